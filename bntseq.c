@@ -272,18 +272,51 @@ void bns_destroy(bntseq_t *bns) {
 #define _set_pac(pac, l, c) ((pac)[(l)>>2] |= (c)<<((~(l)&3)<<1))
 #define _get_pac(pac, l) ((pac)[(l)>>2]>>((~(l)&3)<<1)&3)
 
+#define BNS_PAC_BUF 0x1000000 // characters of the .pac kept in memory by bns_fasta2bntseq(); a multiple of 4
+
+// the .pac being written; characters before off are already in the file
+typedef struct {
+    FILE *fp;
+    int64_t off;
+    uint8_t *buf; // characters [off, off+BNS_PAC_BUF)
+} bns_pacw_t;
+
+static inline void bns_pacw_push(bns_pacw_t *w, int64_t l, int c) {
+    if (l == w->off + BNS_PAC_BUF) { // spill the full buffer
+        err_fwrite(w->buf, 1, BNS_PAC_BUF / 4, w->fp);
+        memset(w->buf, 0, BNS_PAC_BUF / 4);
+        w->off = l;
+    }
+    _set_pac(w->buf, l - w->off, c);
+}
+
+// finalize the .pac file
+static void bns_pacw_close(bns_pacw_t *w, int64_t l_pac) {
+    ubyte_t ct;
+    int64_t l = l_pac - w->off;
+    err_fwrite(w->buf, 1, (l >> 2) + ((l & 3) == 0 ? 0 : 1), w->fp);
+    // the following codes make the pac file size always (l_pac/4+1+1)
+    if (l_pac % 4 == 0) {
+        ct = 0;
+        err_fwrite(&ct, 1, 1, w->fp);
+    }
+    ct = l_pac % 4;
+    err_fwrite(&ct, 1, 1, w->fp);
+    // close .pac file
+    err_fflush(w->fp);
+    err_fclose(w->fp);
+}
+
 /**
  * 将reference中的每个碱基编码并加入到pac的数据指针中
  * @param seq reference的序列数据
  * @param bns bns数据指针
- * @param pac pac数据的指针
- * @param m_pac pac数据的长度，一般用于控制pac数据内存的分配
+ * @param w 正在写入的pac文件
  * @param m_seqs ann数据seq的长度
  * @param m_holes 用于控制bns->m_holes数据的内存分配
  * @param q amb信息
- * @return pac数据
  */
-static uint8_t *add1(const kseq_t *seq, bntseq_t *bns, uint8_t *pac, int64_t *m_pac, int *m_seqs, int *m_holes, bntamb1_t **q) {
+static void add1(const kseq_t *seq, bntseq_t *bns, bns_pacw_t *w, int *m_seqs, int *m_holes, bntamb1_t **q) {
     bntann1_t *p;
     int i, lasts;  //i为序列中字符的位置，从0开始计数；lasts为i的前一个碱基字符
     if (bns->n_seqs == *m_seqs) {
@@ -320,18 +353,11 @@ static uint8_t *add1(const kseq_t *seq, bntseq_t *bns, uint8_t *pac, int64_t *m_
             if (c >= 4) {
                 c = lrand48() & 3;
             }
-            if (bns->l_pac == *m_pac) { // double the pac size
-                *m_pac <<= 1; //(n*65536)*2，其中 n 为进入该if分支的次数
-                //下面两行有点难理解，pac初始分配为(n*65536)/4，realloc后的空间为(n*65536)/2，相当于增加了(n*65536)/4的空间，空间加倍了
-                pac = realloc(pac, *m_pac / 4); //分配内存空间长度为(n*65536*2)/4，在最初长度的基础上增加了一倍
-                memset(pac + bns->l_pac / 4, 0, (*m_pac - bns->l_pac) / 4); //仅对追加分配的(n*65536)/4内存初始化
-            }
-            _set_pac(pac, bns->l_pac, c);
+            bns_pacw_push(w, bns->l_pac, c);
             ++bns->l_pac;
         }
     }
     ++bns->n_seqs;
-    return pac;
 }
 
 /**
@@ -346,11 +372,10 @@ int64_t bns_fasta2bntseq(gzFile fp_fa, const char *prefix, int for_only) {
     kseq_t *seq; //输入参数fp_fa文件内容，映射出来的结构化数据对象
     char name[1024]; //输出的文件名
     bntseq_t *bns;
-    uint8_t *pac = 0; //指针可以当作数组使用
+    bns_pacw_t w; //pac只在内存中保留最后BNS_PAC_BUF个碱基，之前的已写入文件
     int32_t m_seqs, m_holes;
-    int64_t ret = -1, m_pac, l;
+    int64_t ret = -1, l;
     bntamb1_t *q;
-    FILE *fp;
 
     // initialization，初始化前面声明的变量
     seq = kseq_init(fp_fa);
@@ -358,51 +383,111 @@ int64_t bns_fasta2bntseq(gzFile fp_fa, const char *prefix, int for_only) {
     bns->seed = 11; // fixed seed for random generator
     srand48(bns->seed);
     m_seqs = m_holes = 8;
-    m_pac = 0x10000; //65536
     bns->anns = (bntann1_t *)calloc(m_seqs, sizeof(bntann1_t));
     bns->ambs = (bntamb1_t *)calloc(m_holes, sizeof(bntamb1_t));
-    pac = calloc(m_pac / 4, 1); // pac的初始化空间为 65536/4 字节，并初始化为0
+    w.off = 0;
+    w.buf = calloc(BNS_PAC_BUF / 4, 1);
     q = bns->ambs;
     strcpy(name, prefix);
     strcat(name, ".pac");
-    fp = xopen(name, "wb"); //打开输出文件
+    w.fp = xopen(name, "w+b"); //打开输出文件；反向互补序列需要读回正向序列
     // read sequences，循环读取fasta文件中的基因组数据并编码
     while (kseq_read(seq) >= 0) {
-        pac = add1(seq, bns, pac, &m_pac, &m_seqs, &m_holes, &q);
+        add1(seq, bns, &w, &m_seqs, &m_holes, &q);
     }
     // for_only 反向序列标记：0-需要反向序列，1-不需要反向序列
     if (!for_only) { // add the reverse complemented sequence
-        //增加反向互补序列的长度空间，预留 3 个字节的空间
-        int64_t ll_pac = (bns->l_pac * 2 + 3) / 4 * 4;
-        if (ll_pac > m_pac) {
-            pac = realloc(pac, ll_pac / 4);
-        }
-        memset(pac + (bns->l_pac + 3) / 4, 0, (ll_pac - (bns->l_pac + 3) / 4 * 4) / 4);
+        // src keeps forward characters [s_off, s_off+BNS_PAC_BUF); earlier blocks are read back from the file
+        int64_t s_off = w.off;
+        uint8_t *src = malloc(BNS_PAC_BUF / 4);
+        memcpy(src, w.buf, BNS_PAC_BUF / 4);
         //对反向互补序列赋值
         for (l = bns->l_pac - 1; l >= 0; --l, ++bns->l_pac) {
+            if (l < s_off) {
+                s_off -= BNS_PAC_BUF;
+                err_fseek(w.fp, s_off / 4, SEEK_SET);
+                err_fread_noeof(src, 1, BNS_PAC_BUF / 4, w.fp);
+                err_fseek(w.fp, 0, SEEK_END);
+            }
             //根据 nst_nt4_table 映射表的数据，实现 A <=> T，C <=> G 的互转
-            _set_pac(pac, bns->l_pac, 3 - _get_pac(pac, l));
+            bns_pacw_push(&w, bns->l_pac, 3 - _get_pac(src, l - s_off));
         }
+        free(src);
     }
     ret = bns->l_pac;
-    { // finalize .pac file
-        ubyte_t ct;
-        err_fwrite(pac, 1, (bns->l_pac >> 2) + ((bns->l_pac & 3) == 0 ? 0 : 1), fp);
-        // the following codes make the pac file size always (l_pac/4+1+1)
-        if (bns->l_pac % 4 == 0) {
-            ct = 0;
-            err_fwrite(&ct, 1, 1, fp);
+    bns_pacw_close(&w, bns->l_pac);
+    bns_dump(bns, prefix);
+    bns_destroy(bns);
+    kseq_destroy(seq);
+    free(w.buf);
+    return ret;
+}
+
+/**
+ * 将fasta中的序列追加到已有的bns数据之后，输出正向序列的pac/ann/amb
+ * 随机数生成器先跳过已有序列的模糊碱基所用掉的随机数，结果与对合并后的fasta重新构建相同
+ * @param fp_fa 追加的reference文件
+ * @param prefix 已有索引的文件名前缀
+ * @param prefix_out 输出文件名前缀，可以与prefix相同
+ * @return 追加后pac的长度
+ */
+int64_t bns_fasta2bntseq_append(gzFile fp_fa, const char *prefix, const char *prefix_out) {
+    kseq_t *seq;
+    char ann_filename[1024], amb_filename[1024], pac_filename[1024];
+    bntseq_t *bns;
+    bns_pacw_t w;
+    int32_t m_seqs, m_holes, i;
+    int64_t ret, l;
+    bntamb1_t *q;
+
+    strcat(strcpy(ann_filename, prefix), ".ann");
+    strcat(strcpy(amb_filename, prefix), ".amb");
+    strcat(strcpy(pac_filename, prefix), ".pac");
+    bns = bns_restore_core(ann_filename, amb_filename, pac_filename);
+    srand48(bns->seed);
+    for (i = 0; i < bns->n_holes; ++i) { // replay the random bases of the existing ambiguous bases
+        for (l = 0; l < bns->ambs[i].len; ++l) {
+            lrand48();
         }
-        ct = bns->l_pac % 4;
-        err_fwrite(&ct, 1, 1, fp);
-        // close .pac file
-        err_fflush(fp);
-        err_fclose(fp);
     }
-    bns_dump(bns, prefix);
+    for (i = 0; i < bns->n_seqs; ++i) { // bns_restore() drops the placeholder written for an empty comment
+        if (bns->anns[i].anno[0] == 0) {
+            free(bns->anns[i].anno);
+            bns->anns[i].anno = strdup("(null)");
+        }
+    }
+    m_seqs = bns->n_seqs > 8 ? bns->n_seqs : 8;
+    m_holes = bns->n_holes > 8 ? bns->n_holes : 8;
+    bns->anns = (bntann1_t *)realloc(bns->anns, m_seqs * sizeof(bntann1_t));
+    bns->ambs = (bntamb1_t *)realloc(bns->ambs, m_holes * sizeof(bntamb1_t));
+    q = bns->ambs;
+
+    // copy the complete bytes of the existing .pac and keep the last partial one in the buffer
+    w.off = bns->l_pac & ~3LL;
+    w.buf = calloc(BNS_PAC_BUF / 4, 1);
+    strcat(strcpy(pac_filename, prefix_out), ".pac");
+    w.fp = xopen(pac_filename, "wb");
+    err_fseek(bns->fp_pac, 0, SEEK_SET);
+    for (l = 0; l < w.off >> 2; l += BNS_PAC_BUF / 4) {
+        int64_t n = (w.off >> 2) - l < BNS_PAC_BUF / 4 ? (w.off >> 2) - l : BNS_PAC_BUF / 4;
+        err_fread_noeof(w.buf, 1, n, bns->fp_pac);
+        err_fwrite(w.buf, 1, n, w.fp);
+    }
+    memset(w.buf, 0, BNS_PAC_BUF / 4);
+    if (bns->l_pac & 3) {
+        err_fread_noeof(w.buf, 1, 1, bns->fp_pac);
+    }
+
+    seq = kseq_init(fp_fa);
+    while (kseq_read(seq) >= 0) {
+        add1(seq, bns, &w, &m_seqs, &m_holes, &q);
+    }
+    ret = bns->l_pac;
+    bns_pacw_close(&w, bns->l_pac);
+    bns_dump(bns, prefix_out);
     bns_destroy(bns);
     kseq_destroy(seq);
-    free(pac);
+    free(w.buf);
     return ret;
 }
 
@@ -79,6 +79,14 @@ void bns_destroy(bntseq_t *bns);
 
 int64_t bns_fasta2bntseq(gzFile fp_fa, const char *prefix, int for_only);
 
+/**
+ * Append the sequences in $fp_fa to the forward-only .pac/.ann/.amb of $prefix and write the result to
+ * $prefix_out; the output is the same as packing the concatenated FASTA with bns_fasta2bntseq(fp, prefix, 1)
+ *
+ * @return  the length of the new forward strand
+ */
+int64_t bns_fasta2bntseq_append(gzFile fp_fa, const char *prefix, const char *prefix_out);
+
 int bns_pos2rid(const bntseq_t *bns, int64_t pos_f);
 
 int bns_cnt_ambi(const bntseq_t *bns, int64_t pos_f, int len, int *ref_id);
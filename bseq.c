@@ -0,0 +1,555 @@
+/* The MIT License
+
+   Copyright (c) 2018-     Dana-Farber Cancer Institute
+                 2009-2018 Broad Institute, Inc.
+                 2008-2009 Genome Research Ltd. (GRL)
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   "Software"), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <zlib.h>
+#include "bwa.h"
+#include "utils.h"
+#include "kvec.h"
+
+#ifdef USE_MALLOC_WRAPPERS
+
+#  include "malloc_wrap.h"
+
+#endif
+
+/*******************************************************************
+ * FASTA/Q reader with a decompression thread and per-chunk arenas *
+ *******************************************************************/
+
+#define BSEQ_BUF   0x400000 // bytes read from the file at a time; holds at least 64 BGZF blocks
+#define BSEQ_N_BLK 4        // decompressed blocks queued ahead of the parser
+#define BSEQ_MORE  (-3)     // bseq_parse1(): the record is not complete in the arena
+
+typedef struct {
+    char *s;
+    int64_t l;
+} bseq_blk_t;
+
+typedef struct {
+    const uint8_t *cdata;
+    int l_cdata, l_out;
+    uint32_t crc;
+    char *out;
+} bseq_bgzf_t;
+
+struct bseq_file_s {
+    int fd, n_threads;
+    // raw input; only touched by the reader thread
+    uint8_t *in;
+    int in_beg, in_end, in_eof;
+    // decompressed blocks handed over to the parser
+    pthread_t tid;
+    pthread_mutex_t lock;
+    pthread_cond_t cv;
+    bseq_blk_t q[BSEQ_N_BLK];
+    int q_beg, q_n, q_eof, stop;
+    // arena of the current chunk: records are parsed up to beg and data is available up to end
+    char *s;
+    int64_t beg, end, m;
+    int is_eof;
+};
+
+// the fields of a record as offsets into the arena
+typedef struct {
+    int64_t name, comment, seq, qual;
+    int l_name, l_comment, l_seq, l_qual;
+} bseq_rec_t;
+
+/*** reader thread ***/
+
+// make n bytes available in fp->in unless the file ends first; return the number of bytes available
+static int bseq_in_fill(bseq_file_t *fp, int n) {
+    if (fp->in_end - fp->in_beg >= n || fp->in_eof) {
+        return fp->in_end - fp->in_beg;
+    }
+    memmove(fp->in, fp->in + fp->in_beg, fp->in_end - fp->in_beg);
+    fp->in_end -= fp->in_beg, fp->in_beg = 0;
+    while (fp->in_end < n) {
+        ssize_t l = read(fp->fd, fp->in + fp->in_end, BSEQ_BUF - fp->in_end);
+        if (l < 0 && errno == EINTR) {
+            continue;
+        } else if (l < 0) {
+            err_fatal(__func__, "fail to read the input: %s", strerror(errno));
+        } else if (l == 0) {
+            fp->in_eof = 1;
+            break;
+        }
+        fp->in_end += l;
+    }
+    return fp->in_end - fp->in_beg;
+}
+
+// hand a decompressed block over to the parser; return 0 if the reader is being closed
+static int bseq_push(bseq_file_t *fp, char *s, int64_t l) {
+    if (l == 0) {
+        free(s);
+        return 1;
+    }
+    pthread_mutex_lock(&fp->lock);
+    while (fp->q_n == BSEQ_N_BLK && !fp->stop) {
+        pthread_cond_wait(&fp->cv, &fp->lock);
+    }
+    if (fp->stop) {
+        pthread_mutex_unlock(&fp->lock);
+        free(s);
+        return 0;
+    }
+    fp->q[(fp->q_beg + fp->q_n) % BSEQ_N_BLK].s = s;
+    fp->q[(fp->q_beg + fp->q_n) % BSEQ_N_BLK].l = l;
+    ++fp->q_n;
+    pthread_cond_broadcast(&fp->cv);
+    pthread_mutex_unlock(&fp->lock);
+    return 1;
+}
+
+// size of the BGZF block at p, or 0 if p[0, n) does not start with a complete BGZF block
+static int bseq_bgzf_len(const uint8_t *p, int n, int *xlen) {
+    int i, len = 0;
+    if (n < 18 || p[0] != 31 || p[1] != 139 || p[2] != 8 || p[3] != 4) {
+        return 0;
+    }
+    *xlen = p[10] | p[11] << 8;
+    for (i = 12; i + 6 <= 12 + *xlen && i + 6 <= n; i += 4 + (p[i + 2] | p[i + 3] << 8)) {
+        if (p[i] == 'B' && p[i + 1] == 'C' && (p[i + 2] | p[i + 3] << 8) == 2) {
+            len = (p[i + 4] | p[i + 5] << 8) + 1;
+            break;
+        }
+    }
+    return len > 12 + *xlen + 8 && len <= n ? len : 0;
+}
+
+static void bseq_bgzf_worker(void *data, long i, int tid) {
+    bseq_bgzf_t *b = (bseq_bgzf_t *)data + i;
+    z_stream zs;
+    int ret;
+    memset(&zs, 0, sizeof(z_stream));
+    inflateInit2(&zs, -15);
+    zs.next_in = (Bytef *)b->cdata, zs.avail_in = b->l_cdata;
+    zs.next_out = (Bytef *)b->out, zs.avail_out = b->l_out;
+    ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || zs.avail_out != 0 || crc32(0, (Bytef *)b->out, b->l_out) != b->crc) {
+        err_fatal(__func__, "corrupted BGZF block");
+    }
+}
+
+// inflate the BGZF blocks at the front of fp->in, several batches in parallel; return 0 if the input does not continue with BGZF
+static int bseq_read_bgzf(bseq_file_t *fp) {
+    extern void *kt_forpool_init(int n_threads, int pin);
+    extern void kt_forpool_destroy(void *_fp);
+    extern void kt_forpool(void *_fp, void (*func)(void *, long, int), void *data, long n);
+    kvec_t(bseq_bgzf_t) b = {0, 0, 0};
+    void *pool = 0; // inflate threads; started once for the whole input
+    int n, off, len, xlen, ret = 1;
+    int64_t l;
+    for (;;) {
+        const uint8_t *p;
+        char *s;
+        if ((n = bseq_in_fill(fp, BSEQ_BUF)) == 0) {
+            break;
+        }
+        p = fp->in + fp->in_beg;
+        for (off = 0, l = 0, b.n = 0; (len = bseq_bgzf_len(p + off, n - off, &xlen)) > 0; off += len) {
+            bseq_bgzf_t *q = kv_pushp(bseq_bgzf_t, b);
+            q->cdata = p + off + 12 + xlen, q->l_cdata = len - 12 - xlen - 8;
+            q->crc = p[off + len - 8] | p[off + len - 7] << 8 | p[off + len - 6] << 16 | (uint32_t)p[off + len - 5] << 24;
+            q->l_out = p[off + len - 4] | p[off + len - 3] << 8 | p[off + len - 2] << 16 | (uint32_t)p[off + len - 1] << 24;
+            l += q->l_out;
+        }
+        if (b.n == 0) { // not BGZF, or truncated
+            ret = 0;
+            break;
+        }
+        s = malloc(l);
+        for (l = 0, n = 0; n < b.n; ++n) {
+            b.a[n].out = s + l, l += b.a[n].l_out;
+        }
+        if (pool == 0 && fp->n_threads > 1) {
+            pool = kt_forpool_init(fp->n_threads, 0);
+        }
+        if (pool) {
+            kt_forpool(pool, bseq_bgzf_worker, b.a, b.n);
+        } else {
+            for (n = 0; n < b.n; ++n) {
+                bseq_bgzf_worker(b.a, n, 0);
+            }
+        }
+        fp->in_beg += off;
+        if (!bseq_push(fp, s, l)) {
+            break;
+        }
+    }
+    kt_forpool_destroy(pool);
+    kv_destroy(b);
+    return ret;
+}
+
+// inflate ordinary gzip, possibly of several members
+static void bseq_read_gzip(bseq_file_t *fp) {
+    z_stream zs;
+    int ret = Z_OK, done = 0;
+    memset(&zs, 0, sizeof(z_stream));
+    inflateInit2(&zs, 16 + MAX_WBITS);
+    while (!done) {
+        char *s = malloc(BSEQ_BUF);
+        zs.next_out = (Bytef *)s, zs.avail_out = BSEQ_BUF;
+        while (zs.avail_out > 0) {
+            if (fp->in_beg == fp->in_end && bseq_in_fill(fp, 1) == 0) {
+                if (ret != Z_STREAM_END) {
+                    err_fatal(__func__, "truncated gzip input");
+                }
+                done = 1;
+                break;
+            }
+            zs.next_in = fp->in + fp->in_beg, zs.avail_in = fp->in_end - fp->in_beg;
+            ret = inflate(&zs, Z_NO_FLUSH);
+            fp->in_beg = fp->in_end - zs.avail_in;
+            if (ret == Z_STREAM_END) { // like gzread(), go on if another member follows and ignore anything else
+                if (bseq_in_fill(fp, 2) < 2 || fp->in[fp->in_beg] != 31 || fp->in[fp->in_beg + 1] != 139) {
+                    done = 1;
+                    break;
+                }
+                inflateReset(&zs);
+            } else if (ret != Z_OK) {
+                err_fatal(__func__, "corrupted gzip input: %s", zs.msg ? zs.msg : "inflate failed");
+            }
+        }
+        if (!bseq_push(fp, s, BSEQ_BUF - zs.avail_out)) {
+            break;
+        }
+    }
+    inflateEnd(&zs);
+}
+
+static void *bseq_reader(void *data) {
+    bseq_file_t *fp = (bseq_file_t *)data;
+    int n = bseq_in_fill(fp, 2);
+    if (n >= 2 && fp->in[fp->in_beg] == 31 && fp->in[fp->in_beg + 1] == 139) {
+        if (!bseq_read_bgzf(fp) && fp->in_end > fp->in_beg) {
+            bseq_read_gzip(fp);
+        }
+    } else { // uncompressed
+        while ((n = bseq_in_fill(fp, BSEQ_BUF)) > 0) {
+            char *s = malloc(n);
+            memcpy(s, fp->in + fp->in_beg, n);
+            fp->in_beg += n;
+            if (!bseq_push(fp, s, n)) {
+                break;
+            }
+        }
+    }
+    pthread_mutex_lock(&fp->lock);
+    fp->q_eof = 1;
+    pthread_cond_broadcast(&fp->cv);
+    pthread_mutex_unlock(&fp->lock);
+    return 0;
+}
+
+bseq_file_t *bseq_open(int fd, int n_threads) {
+    bseq_file_t *fp;
+    fp = (bseq_file_t *)calloc(1, sizeof(bseq_file_t));
+    fp->fd = fd, fp->n_threads = n_threads > 1 ? n_threads : 1;
+    fp->in = (uint8_t *)malloc(BSEQ_BUF);
+    fp->m = BSEQ_BUF + 1;
+    fp->s = (char *)malloc(fp->m);
+    pthread_mutex_init(&fp->lock, 0);
+    pthread_cond_init(&fp->cv, 0);
+    pthread_create(&fp->tid, 0, bseq_reader, fp);
+    return fp;
+}
+
+void bseq_close(bseq_file_t *fp) {
+    int i;
+    if (fp == 0) {
+        return;
+    }
+    pthread_mutex_lock(&fp->lock);
+    fp->stop = 1;
+    pthread_cond_broadcast(&fp->cv);
+    pthread_mutex_unlock(&fp->lock);
+    pthread_join(fp->tid, 0);
+    for (i = 0; i < fp->q_n; ++i) {
+        free(fp->q[(fp->q_beg + i) % BSEQ_N_BLK].s);
+    }
+    pthread_cond_destroy(&fp->cv);
+    pthread_mutex_destroy(&fp->lock);
+    close(fp->fd);
+    free(fp->in);
+    free(fp->s);
+    free(fp);
+}
+
+/*** parser ***/
+
+// append the next decompressed block to the arena; return 0 at the end of the input
+static int bseq_fill(bseq_file_t *fp) {
+    bseq_blk_t b;
+    pthread_mutex_lock(&fp->lock);
+    while (fp->q_n == 0 && !fp->q_eof) {
+        pthread_cond_wait(&fp->cv, &fp->lock);
+    }
+    if (fp->q_n == 0) {
+        pthread_mutex_unlock(&fp->lock);
+        fp->is_eof = 1;
+        return 0;
+    }
+    b = fp->q[fp->q_beg];
+    fp->q_beg = (fp->q_beg + 1) % BSEQ_N_BLK, --fp->q_n;
+    pthread_cond_broadcast(&fp->cv);
+    pthread_mutex_unlock(&fp->lock);
+    if (fp->end + b.l + 1 > fp->m) { // one more byte for the NUL after a record at the end of the file
+        fp->m = fp->end + b.l + 1;
+        fp->m += fp->m >> 1;
+        fp->s = (char *)realloc(fp->s, fp->m);
+    }
+    memcpy(fp->s + fp->end, b.s, b.l);
+    fp->end += b.l;
+    free(b.s);
+    return 1;
+}
+
+/* The same as kseq_read() on fp->s[fp->beg, fp->end), including the
+ * handling of empty lines and '\r', but the fields are located in place.
+ * Nothing is written unless $wet is set, in which case multi-line
+ * sequences and qualities are moved together. Return 1 for a record, -1 at
+ * the end of the input, -2 for a truncated record or BSEQ_MORE if more
+ * data is needed. */
+static int bseq_parse1(bseq_file_t *fp, int wet, bseq_rec_t *r) {
+    char *s = fp->s;
+    int64_t i = fp->beg, e = fp->end, b, l;
+    int c, last, strip;
+#define BSEQ_GETC(c) do { \
+        if (i < e) (c) = (uint8_t)s[i++]; \
+        else if (fp->is_eof) (c) = -1; \
+        else return BSEQ_MORE; \
+    } while (0)
+#define BSEQ_EOL() do { /* move i to the end of the line */ \
+        for (; i < e && s[i] != '\n'; ++i); \
+        if (i == e && !fp->is_eof) return BSEQ_MORE; \
+    } while (0)
+
+    do { // jump to the next header line
+        BSEQ_GETC(c);
+    } while (c != -1 && c != '>' && c != '@');
+    if (c == -1) {
+        return -1;
+    }
+    r->name = i;
+    for (; i < e && !isspace((uint8_t)s[i]); ++i);
+    if (i == e && !fp->is_eof) {
+        return BSEQ_MORE;
+    }
+    r->l_name = i - r->name;
+    if (i == e && r->l_name == 0) {
+        return -1;
+    }
+    c = i < e ? (uint8_t)s[i++] : 0;
+    r->comment = i, r->l_comment = 0;
+    if (c != '\n') { // comment
+        BSEQ_EOL();
+        r->l_comment = i - r->comment;
+        if (r->l_comment > 1 && s[i - 1] == '\r') {
+            --r->l_comment;
+        }
+        i += i < e;
+    }
+    for (r->seq = i, l = 0;;) { // sequence lines
+        BSEQ_GETC(c);
+        if (c == -1 || c == '>' || c == '+' || c == '@') {
+            break;
+        } else if (c == '\n') {
+            continue;
+        }
+        b = i - 1;
+        BSEQ_EOL();
+        last = s[i - 1];
+        if (wet && r->seq + l != b) {
+            memmove(s + r->seq + l, s + b, i - b);
+        }
+        l += i - b;
+        if ((i - b > 1 || i < e) && l > 1 && last == '\r') {
+            --l;
+        }
+        i += i < e;
+    }
+    r->l_seq = l;
+    r->qual = -1, r->l_qual = 0;
+    if (c == '>' || c == '@') { // leave the header of the next record in place
+        --i;
+    }
+    if (c == '+') {
+        do { // skip the rest of the '+' line
+            BSEQ_GETC(c);
+        } while (c != -1 && c != '\n');
+        if (c == -1) {
+            fp->beg = i;
+            return -2;
+        }
+        r->qual = i, l = 0, last = 0;
+        do { // quality lines until there are as many as bases
+            if (i == e) {
+                if (!fp->is_eof) {
+                    return BSEQ_MORE;
+                }
+                break;
+            }
+            b = i;
+            BSEQ_EOL();
+            c = i > b ? s[i - 1] : last; // the last character of the quality so far
+            strip = l + (i - b) > 1 && c == '\r';
+            last = !strip ? c : i - b > 1 ? s[i - 2] : i > b ? last : 0;
+            if (wet && r->qual + l != b) {
+                memmove(s + r->qual + l, s + b, i - b);
+            }
+            l += i - b - strip;
+            i += i < e;
+        } while (l < r->l_seq);
+        r->l_qual = l;
+        if (r->l_qual != r->l_seq) {
+            fp->beg = i;
+            return -2;
+        }
+    }
+    fp->beg = i;
+    return 1;
+#undef BSEQ_EOL
+#undef BSEQ_GETC
+}
+
+// parse the next record into the arena; fields are stored as offset+1 so that NULL stays 0
+static int bseq_next(bseq_file_t *fp, int copy_comment, bseq1_t *q) {
+    bseq_rec_t r;
+    int ret;
+    int64_t beg = fp->beg;
+    while ((ret = bseq_parse1(fp, 0, &r)) == BSEQ_MORE) {
+        fp->beg = beg;
+        if (!bseq_fill(fp)) {
+            fp->is_eof = 1;
+        }
+    }
+    if (ret != 1) {
+        return ret;
+    }
+    fp->beg = beg;
+    bseq_parse1(fp, 1, &r);
+    if (r.l_name > 2 && fp->s[r.name + r.l_name - 2] == '/' && isdigit((uint8_t)fp->s[r.name + r.l_name - 1])) {
+        r.l_name -= 2; // trim_readno()
+    }
+    fp->s[r.name + r.l_name] = 0;
+    q->name = (char *)(intptr_t)(r.name + 1);
+    q->comment = 0;
+    if (copy_comment && r.l_comment > 0) {
+        fp->s[r.comment + r.l_comment] = 0;
+        q->comment = (char *)(intptr_t)(r.comment + 1);
+    }
+    if (r.l_seq > 0) {
+        fp->s[r.seq + r.l_seq] = 0;
+        q->seq = (char *)(intptr_t)(r.seq + 1);
+    } else { // the NUL after the name
+        q->seq = (char *)(intptr_t)(r.name + r.l_name + 1);
+    }
+    q->qual = 0;
+    if (r.l_qual > 0) {
+        fp->s[r.qual + r.l_qual] = 0;
+        q->qual = (char *)(intptr_t)(r.qual + 1);
+    }
+    q->l_seq = r.l_seq;
+    q->sam = 0;
+    return 1;
+}
+
+// hand the arena with the parsed records to the caller and start a new one with the rest
+static char *bseq_detach(bseq_file_t *fp, bseq1_t *seqs, int n, int step) {
+    char *s = fp->s;
+    int64_t l = fp->end - fp->beg;
+    int i;
+    for (i = 0; i < n; i += step) {
+        bseq1_t *q = &seqs[i];
+        q->name = q->name ? s + ((intptr_t)q->name - 1) : 0;
+        q->comment = q->comment ? s + ((intptr_t)q->comment - 1) : 0;
+        q->seq = q->seq ? s + ((intptr_t)q->seq - 1) : 0;
+        q->qual = q->qual ? s + ((intptr_t)q->qual - 1) : 0;
+    }
+    fp->m = l + BSEQ_BUF + 1;
+    fp->s = (char *)malloc(fp->m);
+    memcpy(fp->s, s + fp->beg, l);
+    fp->beg = 0, fp->end = l;
+    return s;
+}
+
+bseq1_t *bseq_read3(int chunk_size, int *n_, bseq_file_t *fp1, bseq_file_t *fp2, int copy_comment, char *mem[2]) {
+    int size = 0, m, n;
+    bseq1_t *seqs;
+    m = n = 0;
+    seqs = 0;
+    mem[0] = mem[1] = 0;
+    for (;;) {
+        if (n + 2 > m) {
+            m = m ? m << 1 : 256;
+            seqs = realloc(seqs, m * sizeof(bseq1_t));
+        }
+        if (bseq_next(fp1, copy_comment, &seqs[n]) != 1) {
+            break;
+        }
+        if (fp2 && bseq_next(fp2, copy_comment, &seqs[n + 1]) != 1) { // the 2nd file has fewer reads
+            fprintf(stderr, "[W::%s] the 2nd file has fewer sequences.\n", __func__);
+            break;
+        }
+        seqs[n].id = n;
+        size += seqs[n++].l_seq;
+        if (fp2) {
+            seqs[n].id = n;
+            size += seqs[n++].l_seq;
+        }
+        if (size >= chunk_size && (n & 1) == 0) {
+            break;
+        }
+    }
+    if (size == 0) { // test if the 2nd file is finished
+        bseq1_t tmp;
+        if (fp2 && bseq_next(fp2, 0, &tmp) == 1) {
+            fprintf(stderr, "[W::%s] the 1st file has fewer sequences.\n", __func__);
+        }
+    }
+    *n_ = n;
+    if (n == 0) {
+        free(seqs);
+        return 0;
+    }
+    mem[0] = bseq_detach(fp1, seqs, n, fp2 ? 2 : 1);
+    if (fp2) {
+        mem[1] = bseq_detach(fp2, seqs + 1, n - 1, 2);
+    }
+    return seqs;
+}
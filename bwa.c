@@ -28,6 +28,10 @@
 #include <stdio.h>
 #include <zlib.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "bntseq.h"
 #include "bwa.h"
 #include "ksw.h"
@@ -383,9 +387,44 @@ bwt_t *bwa_idx_load_bwt(const char *hint) {
     bwt_restore_sa(tmp, bwt);
     free(tmp);
     free(prefix);
+    bwa_idx_load_kmer(hint, bwt);
     return bwt;
 }
 
+int bwa_idx_load_kmer(const char *hint, bwt_t *bwt) {
+    char *prefix = bwa_idx_infer_prefix(hint);
+    if (prefix == 0) {
+        return -1;
+    }
+    char *tmp = calloc(strlen(prefix) + 6, 1);
+    strcat(strcpy(tmp, prefix), ".kmer"); // k-mer lookup table; optional
+    int ret = bwt_restore_kmer(tmp, bwt);
+    if (ret == -2 && bwa_verbose >= 2) {
+        fprintf(stderr, "[W::%s] %s does not match the BWT and is ignored\n", __func__, tmp);
+    } else if (ret == 0 && bwa_verbose >= 3) {
+        fprintf(stderr, "[M::%s] mapped the %d-mer lookup table\n", __func__, bwt->kmer_k);
+    }
+    free(tmp);
+    free(prefix);
+    return ret;
+}
+
+// size and mtime of <prefix>.bwt and <prefix>.pac; 0 for an absent file
+static void bwa_idx_src_stat(const char *prefix, int64_t src[4]) {
+    static const char *ext[2] = {".bwt", ".pac"};
+    char *tmp = calloc(strlen(prefix) + 5, 1);
+    for (int i = 0; i < 2; ++i) {
+        struct stat st;
+        strcat(strcpy(tmp, prefix), ext[i]);
+        if (stat(tmp, &st) == 0) {
+            src[i << 1] = st.st_size, src[i << 1 | 1] = st.st_mtime;
+        } else {
+            src[i << 1] = src[i << 1 | 1] = 0;
+        }
+    }
+    free(tmp);
+}
+
 /**
  * 从磁盘文件加载FM-Index相关数据
  * @param hint reference文件名称
@@ -401,6 +440,7 @@ bwaidx_t *bwa_idx_load_from_disk(const char *hint, int which) {
         return 0;
     }
     bwaidx_t *idx = calloc(1, sizeof(bwaidx_t));
+    bwa_idx_src_stat(prefix, idx->src);
     if (which & BWA_IDX_BWT) {
         idx->bwt = bwa_idx_load_bwt(hint);
     }
@@ -435,9 +475,118 @@ bwaidx_t *bwa_idx_load_from_disk(const char *hint, int which) {
  * @return index数据
  */
 bwaidx_t *bwa_idx_load(const char *hint, int which) {
+    if ((which & BWA_IDX_ALL) == BWA_IDX_ALL) { // prefer the image, which holds everything
+        char *prefix = bwa_idx_infer_prefix(hint);
+        if (prefix) {
+            bwaidx_t *idx = bwa_idx_load_img(prefix, BWA_MMAP_POPULATE | BWA_MMAP_HUGEPAGE);
+            free(prefix);
+            if (idx) {
+                if (bwa_verbose >= 3) {
+                    fprintf(stderr, "[M::%s] memory-mapped the index image\n", __func__);
+                }
+                if (idx->bwt->kmer == 0) {
+                    bwa_idx_load_kmer(hint, idx->bwt);
+                }
+                return idx;
+            }
+        }
+    }
     return bwa_idx_load_from_disk(hint, which);
 }
 
+bwaidx_t *bwa_idx_load_img(const char *prefix, int flags) {
+    int64_t src[4];
+    bwtint_t hdr[5]; // primary and L2[1..4] at the start of .bwt
+    int stale = 0;
+    char *tmp = calloc(strlen(prefix) + 5, 1);
+    strcat(strcpy(tmp, prefix), ".img");
+    bwaidx_t *idx = bwa_idx_load_mmap(tmp, flags);
+    if (idx == 0) {
+        free(tmp);
+        return 0;
+    }
+    bwa_idx_src_stat(prefix, src);
+    for (int i = 0; i < 4; i += 2) { // the image alone is enough; only compare with the files present
+        if (src[i] > 0 && (src[i] != idx->src[i] || src[i + 1] != idx->src[i + 1])) {
+            stale = 1;
+        }
+    }
+    if (src[0] > 0) {
+        FILE *fp = fopen(strcat(strcpy(tmp, prefix), ".bwt"), "rb");
+        if (fp == 0 || fread(hdr, sizeof(bwtint_t), 5, fp) != 5 || hdr[0] != idx->bwt->primary || hdr[4] != idx->bwt->seq_len) {
+            stale = 1;
+        }
+        if (fp) {
+            fclose(fp);
+        }
+    }
+    if (stale) {
+        if (bwa_verbose >= 2) {
+            fprintf(stderr, "[W::%s] %s.img does not match %s.bwt or %s.pac and is ignored; run `bwa idx2img' to rebuild it\n", __func__, prefix, prefix, prefix);
+        }
+        bwa_idx_destroy(idx);
+        idx = 0;
+    }
+    free(tmp);
+    return idx;
+}
+
+bwaidx_t *bwa_idx_load_mmap(const char *fn, int flags) {
+    struct stat st;
+    uint8_t *map;
+    int fd;
+
+    if ((fd = open(fn, O_RDONLY)) < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size <= BWA_IMG_ALIGN) {
+        close(fd);
+        return 0;
+    }
+#ifdef MAP_POPULATE
+    map = mmap(0, st.st_size, PROT_READ, MAP_SHARED | ((flags & BWA_MMAP_POPULATE) ? MAP_POPULATE : 0), fd, 0);
+#else
+    map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+#endif
+    close(fd);
+    if (map == MAP_FAILED) {
+        if (bwa_verbose >= 2) {
+            fprintf(stderr, "[W::%s] failed to map %s\n", __func__, fn);
+        }
+        return 0;
+    }
+#ifdef MADV_HUGEPAGE
+    if (flags & BWA_MMAP_HUGEPAGE) {
+        madvise(map, st.st_size, MADV_HUGEPAGE); // only a hint; fails harmlessly without THP support for files
+    }
+#endif
+    bwaidx_t *idx = calloc(1, sizeof(bwaidx_t));
+    if (bwa_idx_check_mem(st.st_size, map, flags & BWA_MMAP_VERIFY) < 0 || bwa_mem2idx(st.st_size, map, idx) < 0) {
+        if (bwa_verbose >= 2) {
+            fprintf(stderr, "[W::%s] %s is not a valid index image or is corrupted\n", __func__, fn);
+        }
+        munmap(map, st.st_size);
+        free(idx);
+        return 0;
+    }
+    idx->is_mmap = 1;
+    return idx;
+}
+
+int bwa_idx_dump_img(const char *fn, bwaidx_t *idx) {
+    FILE *fp;
+    if (idx->mem == 0) {
+        bwa_idx2mem(idx);
+    }
+    fp = xopen(fn, "wb");
+    for (int64_t k = 0; k < idx->l_mem; k += 0x1000000) { // in 16MB chunks
+        err_fwrite(idx->mem + k, 1, idx->l_mem - k < 0x1000000 ? idx->l_mem - k : 0x1000000, fp);
+    }
+    err_fflush(fp);
+    err_fclose(fp);
+    return 0;
+}
+
 void bwa_idx_destroy(bwaidx_t *idx) {
     if (idx == 0) {
         return;
@@ -453,119 +602,249 @@ void bwa_idx_destroy(bwaidx_t *idx) {
             free(idx->pac);
         }
     } else {
-        free(idx->bwt);
+        idx->bwt->bwt = 0, idx->bwt->sa = 0; // in idx->mem
+        if ((uint8_t *)idx->bwt->kmer >= idx->mem && (uint8_t *)idx->bwt->kmer < idx->mem + idx->l_mem) {
+            idx->bwt->kmer = 0;
+        }
+        bwt_destroy(idx->bwt);
         free(idx->bns->anns);
         free(idx->bns);
-        if (!idx->is_shm) {
+        if (idx->is_mmap) {
+            munmap(idx->mem, idx->l_mem);
+        } else if (!idx->is_shm) {
             free(idx->mem);
         }
     }
     free(idx);
 }
 
+/***************
+ * Index image *
+ ***************/
+/* The flattened index starts with a BWA_IMG_ALIGN-byte header holding the
+ * table of contents. Each section starts at a multiple of BWA_IMG_ALIGN from
+ * the start of the image and carries its own CRC32. Sections not known to
+ * this version are ignored; a change to bwt_t or bntseq_t requires bumping
+ * BWA_IMG_VERSION. */
+
+enum {
+    BWA_SEC_BWT = 1, // BWT with occurrence counts; placed first so that bwa_idx2mem() may grow it in place
+    BWA_SEC_BWT_HDR, // bwt_t
+    BWA_SEC_SA,      // sampled suffix array
+    BWA_SEC_BNS_HDR, // bntseq_t
+    BWA_SEC_AMB,     // bntamb1_t[n_holes]
+    BWA_SEC_ANN,     // bntann1_t[n_seqs]
+    BWA_SEC_NAME,    // names and comments of the reference sequences, each NULL terminated
+    BWA_SEC_PAC,     // 2-bit encoded reference
+    BWA_SEC_KMER,    // optional k-mer lookup table
+    BWA_SEC_MAX
+};
+
+typedef struct {
+    uint32_t id, crc; // BWA_SEC_* and CRC32 of the section
+    int64_t off, len; // offset from the start of the image and length in bytes
+} bwa_imgsec_t;
+
+typedef struct {
+    char magic[8];
+    uint32_t version, n_sec;
+    int64_t l_mem;     // size of the entire image
+    uint32_t hdr_crc;  // CRC32 of the header with hdr_crc set to 0
+    uint32_t dummy;
+    int64_t src[4];    // bwaidx_t::src of the index the image was made from
+    bwa_imgsec_t sec[];
+} bwa_imghdr_t;
+
+#define BWA_IMG_MAX_SEC ((BWA_IMG_ALIGN - (int)sizeof(bwa_imghdr_t)) / (int)sizeof(bwa_imgsec_t))
+
+static uint32_t bwa_crc32(uint32_t crc, const uint8_t *p, int64_t l) {
+    for (int64_t k = 0; k < l; k += 0x40000000) { // crc32() takes 32-bit lengths
+        crc = crc32(crc, p + k, l - k < 0x40000000 ? l - k : 0x40000000);
+    }
+    return crc;
+}
+
+static uint32_t bwa_img_hdr_crc(const uint8_t *mem) {
+    uint32_t crc = bwa_crc32(0, mem, offsetof(bwa_imghdr_t, hdr_crc));
+    return bwa_crc32(crc, mem + offsetof(bwa_imghdr_t, dummy), BWA_IMG_ALIGN - offsetof(bwa_imghdr_t, dummy));
+}
+
+int bwa_idx_check_mem(int64_t l_mem, const uint8_t *mem, int verify) {
+    const bwa_imghdr_t *h = (const bwa_imghdr_t *)mem;
+    if (l_mem < BWA_IMG_ALIGN || memcmp(h->magic, BWA_IMG_MAGIC, 8) != 0) {
+        return -1;
+    }
+    if (h->version != BWA_IMG_VERSION || h->l_mem != l_mem || h->n_sec > BWA_IMG_MAX_SEC) {
+        return -1;
+    }
+    if (h->hdr_crc != bwa_img_hdr_crc(mem)) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < h->n_sec; ++i) {
+        const bwa_imgsec_t *s = &h->sec[i];
+        if (s->off < BWA_IMG_ALIGN || s->off % BWA_IMG_ALIGN != 0 || s->len < 0 || s->off + s->len > l_mem) {
+            return -1;
+        }
+        if (verify && s->crc != bwa_crc32(0, mem + s->off, s->len)) {
+            if (bwa_verbose >= 1) {
+                fprintf(stderr, "[E::%s] checksum mismatch in section %d\n", __func__, s->id);
+            }
+            return -2;
+        }
+    }
+    return 0;
+}
+
 int bwa_mem2idx(int64_t l_mem, uint8_t *mem, bwaidx_t *idx) {
-    int64_t k = 0, x;
+    const bwa_imghdr_t *h = (const bwa_imghdr_t *)mem;
+    const bwa_imgsec_t *sec[BWA_SEC_MAX];
+    int64_t k;
+
+    if (bwa_idx_check_mem(l_mem, mem, 0) < 0) {
+        return -1;
+    }
+    memset(sec, 0, sizeof(sec));
+    for (uint32_t i = 0; i < h->n_sec; ++i) {
+        if (h->sec[i].id < BWA_SEC_MAX) {
+            sec[h->sec[i].id] = &h->sec[i];
+        }
+    }
+    for (int i = 1; i < BWA_SEC_KMER; ++i) { // all but the k-mer table are required
+        if (sec[i] == 0) {
+            return -1;
+        }
+    }
+    if (sec[BWA_SEC_BWT_HDR]->len != sizeof(bwt_t) || sec[BWA_SEC_BNS_HDR]->len != sizeof(bntseq_t)) {
+        return -1;
+    }
+
     // generate idx->bwt
-    x = sizeof(bwt_t);
-    idx->bwt = malloc(x);
-    memcpy(idx->bwt, mem + k, x);
-    k += x;
-    x = idx->bwt->bwt_size * 4;
-    idx->bwt->bwt = (uint32_t *)(mem + k);
-    k += x;
-    x = idx->bwt->n_sa * sizeof(bwtint_t);
-    idx->bwt->sa = (bwtint_t *)(mem + k);
-    k += x;
+    idx->bwt = malloc(sizeof(bwt_t));
+    memcpy(idx->bwt, mem + sec[BWA_SEC_BWT_HDR]->off, sizeof(bwt_t));
+    idx->bwt->bwt = (uint32_t *)(mem + sec[BWA_SEC_BWT]->off);
+    idx->bwt->sa = (bwtint_t *)(mem + sec[BWA_SEC_SA]->off);
+    if (sec[BWA_SEC_KMER] && sec[BWA_SEC_KMER]->len > 0) { // kmer_k is kept in bwt_t
+        idx->bwt->kmer = (bwtint_t *)(mem + sec[BWA_SEC_KMER]->off);
+    } else {
+        idx->bwt->kmer_k = 0, idx->bwt->kmer = 0;
+    }
+    idx->bwt->kmer_mmap = 0;
 
     // generate idx->bns and idx->pac
-    x = sizeof(bntseq_t);
-    idx->bns = malloc(x); //malloc仅分配内存，不会对内存初始化
-    memcpy(idx->bns, mem + k, x);
-    k += x;
-    x = idx->bns->n_holes * sizeof(bntamb1_t);
-    idx->bns->ambs = (bntamb1_t *)(mem + k);
-    k += x;
-    x = idx->bns->n_seqs * sizeof(bntann1_t);
-    idx->bns->anns = malloc(x);
-    memcpy(idx->bns->anns, mem + k, x);
-    k += x;
+    idx->bns = malloc(sizeof(bntseq_t)); //malloc仅分配内存，不会对内存初始化
+    memcpy(idx->bns, mem + sec[BWA_SEC_BNS_HDR]->off, sizeof(bntseq_t));
+    idx->bns->fp_pac = 0;
+    idx->bns->ambs = (bntamb1_t *)(mem + sec[BWA_SEC_AMB]->off);
+    idx->bns->anns = malloc(sec[BWA_SEC_ANN]->len);
+    memcpy(idx->bns->anns, mem + sec[BWA_SEC_ANN]->off, sec[BWA_SEC_ANN]->len);
+    k = sec[BWA_SEC_NAME]->off;
     for (int i = 0; i < idx->bns->n_seqs; ++i) {
         idx->bns->anns[i].name = (char *)(mem + k);
         k += strlen(idx->bns->anns[i].name) + 1;
         idx->bns->anns[i].anno = (char *)(mem + k);
         k += strlen(idx->bns->anns[i].anno) + 1;
     }
-    idx->pac = (uint8_t *)(mem + k);
-    k += idx->bns->l_pac / 4 + 1;
-    assert(k == l_mem);
+    assert(k == sec[BWA_SEC_NAME]->off + sec[BWA_SEC_NAME]->len);
+    idx->pac = (uint8_t *)(mem + sec[BWA_SEC_PAC]->off);
 
-    idx->l_mem = k;
+    memcpy(idx->src, h->src, sizeof(idx->src));
+    idx->l_mem = l_mem;
     idx->mem = mem;
     return 0;
 }
 
 int bwa_idx2mem(bwaidx_t *idx) {
+    bwt_t *bwt = idx->bwt;
+    bntseq_t *bns = idx->bns;
+    bwa_imghdr_t *h;
+    int64_t len[BWA_SEC_MAX], off[BWA_SEC_MAX], k;
+    uint8_t *mem;
+
+    // lay out the sections
+    memset(len, 0, sizeof(len));
+    len[BWA_SEC_BWT] = bwt->bwt_size * 4;
+    len[BWA_SEC_BWT_HDR] = sizeof(bwt_t);
+    len[BWA_SEC_SA] = bwt_sa_bytes(bwt);
+    len[BWA_SEC_BNS_HDR] = sizeof(bntseq_t);
+    len[BWA_SEC_AMB] = bns->n_holes * sizeof(bntamb1_t);
+    len[BWA_SEC_ANN] = bns->n_seqs * sizeof(bntann1_t);
+    for (int i = 0; i < bns->n_seqs; ++i) {
+        len[BWA_SEC_NAME] += strlen(bns->anns[i].name) + strlen(bns->anns[i].anno) + 2;
+    }
+    len[BWA_SEC_PAC] = bns->l_pac / 4 + 1;
+    len[BWA_SEC_KMER] = bwt->kmer ? bwt_kmer_off(bwt->kmer_k + 1) * sizeof(bwtint_t) : 0;
+    k = BWA_IMG_ALIGN;
+    for (int i = 1; i < BWA_SEC_MAX; ++i) {
+        off[i] = k;
+        k += (len[i] + BWA_IMG_ALIGN - 1) / BWA_IMG_ALIGN * BWA_IMG_ALIGN;
+    }
+    k = off[BWA_SEC_MAX - 1] + len[BWA_SEC_MAX - 1];
+
+    // move the BWT in place to avoid holding two copies of it
+    mem = realloc(bwt->bwt, k);
+    memmove(mem + off[BWA_SEC_BWT], mem, len[BWA_SEC_BWT]);
+    memset(mem, 0, off[BWA_SEC_BWT]);
+    bwt->bwt = 0;
+    for (int i = BWA_SEC_BWT + 1; i < BWA_SEC_MAX; ++i) { // zero the padding
+        memset(mem + off[i - 1] + len[i - 1], 0, off[i] - off[i - 1] - len[i - 1]);
+    }
+
     // copy idx->bwt
-    int64_t x = idx->bwt->bwt_size * 4;
-    uint8_t *mem = realloc(idx->bwt->bwt, sizeof(bwt_t) + x);
-    idx->bwt->bwt = 0;
-    memmove(mem + sizeof(bwt_t), mem, x);
-    memcpy(mem, idx->bwt, sizeof(bwt_t));
-    int64_t k = sizeof(bwt_t) + x;
-    x = idx->bwt->n_sa * sizeof(bwtint_t);
-    mem = realloc(mem, k + x);
-    memcpy(mem + k, idx->bwt->sa, x);
-    k += x;
-    free(idx->bwt->sa);
-    free(idx->bwt);
+    memcpy(mem + off[BWA_SEC_SA], bwt->sa, len[BWA_SEC_SA]);
+    if (bwt->kmer) {
+        memcpy(mem + off[BWA_SEC_KMER], bwt->kmer, len[BWA_SEC_KMER]);
+    }
+    memcpy(mem + off[BWA_SEC_BWT_HDR], bwt, sizeof(bwt_t));
+    ((bwt_t *)(mem + off[BWA_SEC_BWT_HDR]))->kmer_mmap = 0; // pointers are not meaningful in the image
+    ((bwt_t *)(mem + off[BWA_SEC_BWT_HDR]))->bwt = 0;
+    ((bwt_t *)(mem + off[BWA_SEC_BWT_HDR]))->sa = 0;
+    ((bwt_t *)(mem + off[BWA_SEC_BWT_HDR]))->kmer = 0;
+    bwt_destroy(bwt);
     idx->bwt = 0;
 
     // copy idx->bns
-    int64_t tmp = idx->bns->n_seqs * sizeof(bntann1_t) + idx->bns->n_holes * sizeof(bntamb1_t);
-    for (int i = 0; i < idx->bns->n_seqs; ++i) { // compute the size of heap-allocated memory
-        tmp += strlen(idx->bns->anns[i].name) + strlen(idx->bns->anns[i].anno) + 2;
-    }
-    mem = realloc(mem, k + sizeof(bntseq_t) + tmp);
-    x = sizeof(bntseq_t);
-    memcpy(mem + k, idx->bns, x);
-    k += x;
-    x = idx->bns->n_holes * sizeof(bntamb1_t);
-    memcpy(mem + k, idx->bns->ambs, x);
-    k += x;
-    free(idx->bns->ambs);
-    x = idx->bns->n_seqs * sizeof(bntann1_t);
-    memcpy(mem + k, idx->bns->anns, x);
-    k += x;
-    for (int i = 0; i < idx->bns->n_seqs; ++i) {
-        x = strlen(idx->bns->anns[i].name) + 1;
-        memcpy(mem + k, idx->bns->anns[i].name, x);
+    memcpy(mem + off[BWA_SEC_BNS_HDR], bns, sizeof(bntseq_t));
+    memcpy(mem + off[BWA_SEC_AMB], bns->ambs, len[BWA_SEC_AMB]);
+    memcpy(mem + off[BWA_SEC_ANN], bns->anns, len[BWA_SEC_ANN]);
+    k = off[BWA_SEC_NAME];
+    for (int i = 0; i < bns->n_seqs; ++i) {
+        int64_t x = strlen(bns->anns[i].name) + 1;
+        memcpy(mem + k, bns->anns[i].name, x);
         k += x;
-        x = strlen(idx->bns->anns[i].anno) + 1;
-        memcpy(mem + k, idx->bns->anns[i].anno, x);
+        x = strlen(bns->anns[i].anno) + 1;
+        memcpy(mem + k, bns->anns[i].anno, x);
         k += x;
-        free(idx->bns->anns[i].name);
-        free(idx->bns->anns[i].anno);
     }
-    free(idx->bns->anns);
+    bns_destroy(bns);
+    idx->bns = 0;
 
     // copy idx->pac
-    x = idx->bns->l_pac / 4 + 1;
-    mem = realloc(mem, k + x);
-    memcpy(mem + k, idx->pac, x);
-    k += x;
-    free(idx->bns);
-    idx->bns = 0;
+    memcpy(mem + off[BWA_SEC_PAC], idx->pac, len[BWA_SEC_PAC]);
     free(idx->pac);
     idx->pac = 0;
 
-    return bwa_mem2idx(k, mem, idx);
+    // fill the header
+    h = (bwa_imghdr_t *)mem;
+    memcpy(h->magic, BWA_IMG_MAGIC, 8);
+    h->version = BWA_IMG_VERSION;
+    h->n_sec = BWA_SEC_MAX - 1;
+    h->l_mem = off[BWA_SEC_MAX - 1] + len[BWA_SEC_MAX - 1];
+    memcpy(h->src, idx->src, sizeof(h->src));
+    for (int i = 1; i < BWA_SEC_MAX; ++i) {
+        bwa_imgsec_t *s = &h->sec[i - 1];
+        s->id = i, s->off = off[i], s->len = len[i];
+        s->crc = bwa_crc32(0, mem + off[i], len[i]);
+    }
+    h->hdr_crc = bwa_img_hdr_crc(mem);
+    return bwa_mem2idx(h->l_mem, mem, idx);
 }
 
 /***********************
  * SAM header routines *
  ***********************/
 //打印输出比对结果(sam)头部信息
-void bwa_print_sam_hdr(const bntseq_t *bns, const char *hdr_line) {
+char *bwa_format_sam_hdr(const bntseq_t *bns, const char *hdr_line) {
+    kstring_t str = {0, 0, 0};
     int n_SQ = 0;
     extern char *bwa_pg;
     if (hdr_line) {
@@ -579,11 +858,11 @@ void bwa_print_sam_hdr(const bntseq_t *bns, const char *hdr_line) {
     }
     if (n_SQ == 0) {
         for (int i = 0; i < bns->n_seqs; ++i) {
-            err_printf("@SQ\tSN:%s\tLN:%d", bns->anns[i].name, bns->anns[i].len);
+            ksprintf(&str, "@SQ\tSN:%s\tLN:%d", bns->anns[i].name, bns->anns[i].len);
             if (bns->anns[i].is_alt) {
-                err_printf("\tAH:*\n");
+                kputs("\tAH:*\n", &str);
             } else {
-                err_fputc('\n', stdout);
+                kputc('\n', &str);
             }
         }
     } else if (n_SQ != bns->n_seqs && bwa_verbose >= 2) {
@@ -592,11 +871,23 @@ void bwa_print_sam_hdr(const bntseq_t *bns, const char *hdr_line) {
             bns->n_seqs);
     }
     if (hdr_line) {
-        err_printf("%s\n", hdr_line);
+        kputs(hdr_line, &str);
+        kputc('\n', &str);
     }
     if (bwa_pg) {
-        err_printf("%s\n", bwa_pg);
+        kputs(bwa_pg, &str);
+        kputc('\n', &str);
+    }
+    if (str.s == 0) {
+        kputs("", &str);
     }
+    return str.s;
+}
+
+void bwa_print_sam_hdr(const bntseq_t *bns, const char *hdr_line) {
+    char *s = bwa_format_sam_hdr(bns, hdr_line);
+    err_fputs(s, stdout);
+    free(s);
 }
 
 static char *bwa_escape(char *s) {
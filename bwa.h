@@ -38,6 +38,14 @@
 
 #define BWA_CTL_SIZE 0x10000
 
+#define BWA_IMG_MAGIC   "BWAIMG\1" // <prefix>.img: the index flattened by bwa_idx2mem(); see bwa.c for the layout
+#define BWA_IMG_VERSION 3
+#define BWA_IMG_ALIGN   0x1000     // the header and every section are page aligned
+
+#define BWA_MMAP_POPULATE 0x1 // prefault the whole image with MAP_POPULATE
+#define BWA_MMAP_HUGEPAGE 0x2 // madvise(MADV_HUGEPAGE)
+#define BWA_MMAP_VERIFY   0x4 // verify the checksums of all sections
+
 #define BWTALGO_AUTO  0
 #define BWTALGO_RB2   1
 #define BWTALGO_BWTSW 2
@@ -50,9 +58,10 @@ typedef struct {
     bntseq_t *bns; // information on the reference sequences
     uint8_t *pac; // the actual 2-bit encoded reference sequences with 'N' converted to a random base
 
-    int is_shm;
+    int is_shm, is_mmap;
     int64_t l_mem;
     uint8_t *mem;
+    int64_t src[4]; // size and mtime of <prefix>.bwt and <prefix>.pac when the index was read; kept in the image
 } bwaidx_t;
 
 //待比对基因序列的数据结构
@@ -71,6 +80,8 @@ typedef struct {
     char *name, *comment, *seq, *qual, *sam;
 } bseq1_t;
 
+typedef struct bseq_file_s bseq_file_t;
+
 extern int bwa_verbose, bwa_dbg;
 extern char bwa_rg_id[256];
 
@@ -80,6 +91,27 @@ extern "C" {
 
 bseq1_t *bseq_read(int chunk_size, int *n_, void *ks1_, void *ks2_);
 
+/**
+ * 打开FASTA/FASTQ输入，由独立线程读取并解压(gzip/BGZF)
+ * @param fd 文件描述符，由bseq_close()关闭
+ * @param n_threads 并行解压BGZF块的线程数
+ * @return 文件句柄
+ */
+bseq_file_t *bseq_open(int fd, int n_threads);
+
+void bseq_close(bseq_file_t *fp);
+
+/**
+ * 与bseq_read()相同，但不为每条序列单独分配内存
+ *
+ * name/comment/seq/qual指向mem[0](第二个文件为mem[1])中的原位数据。调用者
+ * 只需释放每条序列的sam，然后释放mem[0]、mem[1]和返回的数组。
+ * @param copy_comment 为0时comment总是NULL
+ * @param mem 输出，本批序列的内存块
+ * @return 序列数组；没有序列时返回NULL
+ */
+bseq1_t *bseq_read3(int chunk_size, int *n_, bseq_file_t *fp1, bseq_file_t *fp2, int copy_comment, char *mem[2]);
+
 void bseq_classify(int n, bseq1_t *seqs, int m[2], bseq1_t *sep[2]);
 
 void bwa_fill_scmat(int a, int b, int8_t mat[25]);
@@ -90,22 +122,115 @@ uint32_t *bwa_gen_cigar2(const int8_t mat[25], int o_del, int e_del, int o_ins,
 
 int bwa_idx_build(const char *fa, const char *prefix, int algo_type, int block_size);
 
+// the same as bwa_idx_build() but with the SA sampled every $sa_intv positions instead of 32, using $n_threads threads
+int bwa_idx_build2(const char *fa, const char *prefix, int algo_type, int block_size, int sa_intv, int n_threads);
+
+/**
+ * The same as bwa_idx_build2() but within a memory budget of $max_mem bytes (0 for no limit)
+ *
+ * The bwtsw block size is shrunk to fit, and the SA samples are computed in
+ * several passes over the BWT if they do not fit next to it. The index is
+ * identical to the one built without a budget.
+ */
+int bwa_idx_build3(const char *fa, const char *prefix, int algo_type, int block_size, int sa_intv, int n_threads,
+                   int64_t max_mem);
+
+/**
+ * Insert the sequences in $fa into the existing index $prefix
+ *
+ * The new sequences are placed after the old ones, so the resulting index
+ * is identical to the one built from the concatenated FASTA. Only the
+ * suffixes starting in the new sequences and in a short unique tail of the
+ * old forward strand are sorted; the old BWT is merged with them in a
+ * single pass and the SA is re-sampled with the interval of the old .sa.
+ * The .kmer table is not touched and an outdated .img is removed.
+ */
+int bwa_idx_append(const char *fa, const char *prefix, int n_threads);
+
 char *bwa_idx_infer_prefix(const char *hint);
 
 bwt_t *bwa_idx_load_bwt(const char *hint);
 
+/**
+ * Memory-map the optional k-mer lookup table <prefix>.kmer into $bwt
+ *
+ * @return   0 on success; negative if not loaded (see bwt_restore_kmer())
+ */
+int bwa_idx_load_kmer(const char *hint, bwt_t *bwt);
+
 bwaidx_t *bwa_idx_load_from_shm(const char *hint);
 
 bwaidx_t *bwa_idx_load_from_disk(const char *hint, int which);
 
 bwaidx_t *bwa_idx_load(const char *hint, int which);
 
+/**
+ * Memory-map an index image written by bwa_idx_dump_img()
+ *
+ * No index data are copied; processes mapping the same image share it in
+ * the page cache.
+ *
+ * @param fn     image file name
+ * @param flags  BWA_MMAP_* flags
+ *
+ * @return       the index, or 0 if $fn is absent or not an index image
+ */
+bwaidx_t *bwa_idx_load_mmap(const char *fn, int flags);
+
+/**
+ * Memory-map <prefix>.img if it is up to date
+ *
+ * The image is ignored with a warning if <prefix>.bwt or <prefix>.pac on
+ * disk differs in size or mtime from the files it was made from, or if the
+ * primary or the length of the BWT in <prefix>.bwt differs.
+ *
+ * @return       the index, or 0 if there is no usable image
+ */
+bwaidx_t *bwa_idx_load_img(const char *prefix, int flags);
+
+/**
+ * Write $idx as an image to be loaded by bwa_idx_load_mmap()
+ *
+ * $idx is flattened with bwa_idx2mem() if it is not yet. Copying this single
+ * file is all it takes to stage the index elsewhere.
+ */
+int bwa_idx_dump_img(const char *fn, bwaidx_t *idx);
+
 void bwa_idx_destroy(bwaidx_t *idx);
 
+/**
+ * Flatten $idx into a single image in idx->mem
+ *
+ * The image is self-describing: a versioned header with a table of contents
+ * and a CRC32 per section, followed by page-aligned sections including the
+ * k-mer table if loaded. It is what `bwa shm' stages and what
+ * bwa_idx_dump_img() writes to disk.
+ */
 int bwa_idx2mem(bwaidx_t *idx);
 
+/**
+ * Set up $idx to point into an image made by bwa_idx2mem()
+ *
+ * Only the header is checked; use bwa_idx_check_mem() to verify the sections.
+ *
+ * @return       0 on success; -1 if $mem is not a valid image
+ */
 int bwa_mem2idx(int64_t l_mem, uint8_t *mem, bwaidx_t *idx);
 
+/**
+ * Check the header of an index image
+ *
+ * @param verify  also verify the checksum of every section
+ *
+ * @return        0 if valid; -1 if the header is invalid; -2 on a checksum mismatch
+ */
+int bwa_idx_check_mem(int64_t l_mem, const uint8_t *mem, int verify);
+
+/**
+ * SAM header printed by bwa_print_sam_hdr(), as a string to be freed by the caller
+ */
+char *bwa_format_sam_hdr(const bntseq_t *bns, const char *hdr_line);
+
 void bwa_print_sam_hdr(const bntseq_t *bns, const char *hdr_line);
 
 char *bwa_set_rg(const char *s);
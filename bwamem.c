@@ -25,8 +25,10 @@
    SOFTWARE.
 */
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <assert.h>
 #include <limits.h>
 #include <math.h>
@@ -123,6 +125,24 @@ mem_opt_t *mem_opt_init() {
 
 KSORT_INIT(mem_intv, bwtintv_t, intv_lt)
 
+enum { BS_IDLE = 0, BS_FWD, BS_BWD, BS_SS1 };
+
+// a read in mem_collect_intv_batch()
+typedef struct {
+    int len;
+    const uint8_t *seq;
+    bwtintv_v mem;          // output; the same as smem_aux_t::mem after mem_collect_intv()
+    int pass, x, k, old_n;  // position in mem_collect_intv()
+    // state of bwt_smem1() or bwt_seed_strategy1()
+    int state, sx, min_intv, i, j, c, ret;
+    bwtint_t km; // seq[sx..i) packed, for the k-mer table
+    bwtintv_t ik, m;
+    bwtintv_v mem1, v[2], *prev, *curr;
+    // pending extension
+    int is_back;
+    bwtintv_t e, ok[4];
+} mem_bsmem_t;
+
 //存储smems的结构
 typedef struct {
     /**
@@ -130,6 +150,9 @@ typedef struct {
      * mem1 参与运算的中间参数
      */
     bwtintv_v mem, mem1, *tmpv[2];
+    // for mem_collect_intv_batch()
+    int m_bs, *act;
+    mem_bsmem_t *bs;
 } smem_aux_t;
 
 static smem_aux_t *smem_aux_init() {
@@ -146,6 +169,15 @@ static void smem_aux_destroy(smem_aux_t *a) {
     free(a->tmpv[1]);
     free(a->mem.a);
     free(a->mem1.a);
+    for (int i = 0; i < a->m_bs; ++i) {
+        mem_bsmem_t *bs = &a->bs[i];
+        free(bs->mem.a);
+        free(bs->mem1.a);
+        free(bs->v[0].a);
+        free(bs->v[1].a);
+    }
+    free(a->bs);
+    free(a->act);
     free(a);
 }
 
@@ -214,6 +246,277 @@ static void mem_collect_intv(const mem_opt_t *opt, const bwt_t *bwt, int len, co
     ks_introsort(mem_intv, a->mem.n, a->mem.a);
 }
 
+/* mem_collect_intv_batch() collects the same SMEMs as mem_collect_intv(),
+ * for a block of reads at a time. Each read is a resumable search that stops
+ * whenever it needs bwt_extend(); the pending extensions of all reads are
+ * then performed in turn. The occurrence blocks needed by a read are
+ * prefetched right after it stops, so that by the time we come back to the
+ * read, a full round later, they are likely to be in cache and the DRAM
+ * latency of different reads overlaps. */
+
+static inline int bs_request(mem_bsmem_t *bs, const bwtintv_t *p, int is_back, int state) {
+    bs->e = *p, bs->is_back = is_back, bs->state = state;
+    return 1;
+}
+
+static void bs_reverse_intvs(bwtintv_v *p) {
+    for (int j = 0; j < p->n >> 1; ++j) {
+        bwtintv_t tmp = p->a[p->n - 1 - j];
+        p->a[p->n - 1 - j] = p->a[j];
+        p->a[j] = tmp;
+    }
+}
+
+static inline void bs_bwd_row(mem_bsmem_t *bs) {
+    int i = bs->i;
+    bs->c = i < 0 ? -1 : bs->seq[i] < 4 ? bs->seq[i] : -1; // c==-1 if i<0 or q[i] is an ambiguous base
+    bs->j = 0, bs->curr->n = 0;
+}
+
+// backward search in bwt_smem1(); $has_ok is true if bs->ok holds the extension of bs->prev->a[bs->j]
+static int bs_smem1_bwd(mem_bsmem_t *bs, int has_ok) {
+    for (;;) {
+        if (bs->j < bs->prev->n) {
+            bwtintv_t *p = &bs->prev->a[bs->j], *ok = bs->ok;
+            int c = bs->c;
+            if (c >= 0 && !has_ok) {
+                return bs_request(bs, p, 1, BS_BWD);
+            }
+            has_ok = 0;
+            if (c < 0 || ok[c].x[2] < bs->min_intv) { // keep the hit if reaching the beginning or an ambiguous base or the intv is small enough
+                if (bs->curr->n == 0) { // test curr->n>0 to make sure there are no longer matches
+                    if (bs->mem1.n == 0 || bs->i + 1 < bs->mem1.a[bs->mem1.n - 1].info >> 32) { // skip contained matches
+                        bwtintv_t ik = *p;
+                        ik.info |= (uint64_t)(bs->i + 1) << 32;
+                        kv_push(bwtintv_t, bs->mem1, ik);
+                    }
+                } // otherwise the match is contained in another longer match
+            } else if (bs->curr->n == 0 || ok[c].x[2] != bs->curr->a[bs->curr->n - 1].x[2]) {
+                ok[c].info = p->info;
+                kv_push(bwtintv_t, *bs->curr, ok[c]);
+            }
+            ++bs->j;
+            continue;
+        }
+        if (bs->curr->n == 0 || bs->i == -1) {
+            break;
+        }
+        bwtintv_v *swap = bs->curr;
+        bs->curr = bs->prev, bs->prev = swap;
+        --bs->i;
+        bs_bwd_row(bs);
+    }
+    bs_reverse_intvs(&bs->mem1); // s.t. sorted by the start coordinate
+    return 0;
+}
+
+// forward search in bwt_smem1(); $has_ok is true if bs->ok holds the extension of bs->ik
+static int bs_smem1_fwd(const bwt_t *bwt, mem_bsmem_t *bs, int has_ok) {
+    const uint8_t *q = bs->seq;
+    for (; bs->i < bs->len; ++bs->i) {
+        if (q[bs->i] < 4) { // an A/C/G/T base
+            int c = 3 - q[bs->i]; // complement of q[i]
+            if (!has_ok && bs->i - bs->sx < bwt->kmer_k) { // q[sx..i] is in the k-mer table, prefetched by bs_start()
+                bs->km = bs->km << 2 | q[bs->i];
+                bwt_kmer_intv(bwt, bs->i - bs->sx + 1, bs->km, bs->ok[c]);
+                has_ok = 1;
+            }
+            if (!has_ok) {
+                return bs_request(bs, &bs->ik, 0, BS_FWD);
+            }
+            has_ok = 0;
+            if (bs->ok[c].x[2] != bs->ik.x[2]) { // change of the interval size
+                kv_push(bwtintv_t, *bs->curr, bs->ik);
+                if (bs->ok[c].x[2] < bs->min_intv) {
+                    break;
+                } // the interval size is too small to be extended further
+            }
+            bs->ik = bs->ok[c];
+            bs->ik.info = bs->i + 1;
+        } else { // an ambiguous base
+            kv_push(bwtintv_t, *bs->curr, bs->ik);
+            break;
+        }
+    }
+    if (bs->i == bs->len) {
+        kv_push(bwtintv_t, *bs->curr, bs->ik);
+    } // push the last interval if we reach the end
+    bs_reverse_intvs(bs->curr); // s.t. smaller intervals (i.e. longer matches) visited first
+    bs->ret = bs->curr->a[0].info;
+    bwtintv_v *swap = bs->curr;
+    bs->curr = bs->prev, bs->prev = swap;
+    bs->i = bs->sx - 1;
+    bs_bwd_row(bs);
+    return bs_smem1_bwd(bs, 0);
+}
+
+// bwt_seed_strategy1()
+static int bs_ss1(const mem_opt_t *opt, const bwt_t *bwt, mem_bsmem_t *bs, int has_ok) {
+    const uint8_t *q = bs->seq;
+    int max_intv = opt->max_mem_intv;
+    for (; bs->i < bs->len; ++bs->i) {
+        if (q[bs->i] < 4) {
+            int c = 3 - q[bs->i];
+            if (!has_ok && bs->i - bs->sx < bwt->kmer_k) {
+                bs->km = bs->km << 2 | q[bs->i];
+                bwt_kmer_intv(bwt, bs->i - bs->sx + 1, bs->km, bs->ok[c]);
+                has_ok = 1;
+            }
+            if (!has_ok) {
+                return bs_request(bs, &bs->ik, 0, BS_SS1);
+            }
+            has_ok = 0;
+            if (bs->ok[c].x[2] < max_intv && bs->i - bs->sx >= opt->min_seed_len) {
+                bs->m = bs->ok[c];
+                bs->m.info = (uint64_t)bs->sx << 32 | (bs->i + 1);
+                bs->ret = bs->i + 1;
+                return 0;
+            }
+            bs->ik = bs->ok[c];
+        } else {
+            bs->ret = bs->i + 1;
+            return 0;
+        }
+    }
+    bs->ret = bs->len;
+    return 0;
+}
+
+static void bs_start(const bwt_t *bwt, mem_bsmem_t *bs, int state, int x, int min_intv) {
+    bs->state = state;
+    bs->sx = x, bs->i = x + 1;
+    bs->min_intv = min_intv > 1 ? min_intv : 1;
+    bwt_set_intv(bwt, bs->seq[x], bs->ik); // the initial interval of a single base
+    bs->km = bs->seq[x];
+    if (bwt->kmer_k > 1) {
+        bwt_kmer_prefetch(bwt, bs->len - x, bs->seq + x);
+    }
+    if (state == BS_FWD) {
+        bs->ik.info = x + 1;
+        bs->mem1.n = 0;
+        bs->prev = &bs->v[0], bs->curr = &bs->v[1];
+        bs->curr->n = 0;
+    } else {
+        memset(&bs->m, 0, sizeof(bwtintv_t));
+    }
+}
+
+/**
+ * 推进一条read的SMEM查找，直到需要下一次bwt_extend()
+ * @param has_ok bs->ok holds the extension requested by the previous call
+ * @return 1 if bs->e needs to be extended; 0 if all SMEMs of the read have been collected
+ */
+static int bs_next(const mem_opt_t *opt, const bwt_t *bwt, mem_bsmem_t *bs, int has_ok) {
+    int split_len = (int)(opt->min_seed_len * opt->split_factor + .499);
+    for (;;) {
+        if (bs->state != BS_IDLE) { // resume the current search
+            int ret = bs->state == BS_FWD ? bs_smem1_fwd(bwt, bs, has_ok) : bs->state == BS_BWD ? bs_smem1_bwd(bs, has_ok) : bs_ss1(opt, bwt, bs, has_ok);
+            if (ret) {
+                return 1;
+            }
+            bs->state = BS_IDLE;
+            if (bs->pass == 1) {
+                for (int i = 0; i < bs->mem1.n; ++i) {
+                    bwtintv_t *p = &bs->mem1.a[i];
+                    int slen = (uint32_t)p->info - (p->info >> 32); // seed length
+                    if (slen >= opt->min_seed_len) {
+                        kv_push(bwtintv_t, bs->mem, *p);
+                    }
+                }
+                bs->x = bs->ret;
+            } else if (bs->pass == 2) {
+                for (int i = 0; i < bs->mem1.n; ++i) {
+                    if ((uint32_t)bs->mem1.a[i].info - (bs->mem1.a[i].info >> 32) >= opt->min_seed_len) {
+                        kv_push(bwtintv_t, bs->mem, bs->mem1.a[i]);
+                    }
+                }
+                ++bs->k;
+            } else {
+                if (bs->m.x[2] > 0) {
+                    kv_push(bwtintv_t, bs->mem, bs->m);
+                }
+                bs->x = bs->ret;
+            }
+        }
+        has_ok = 0;
+        // start the next search
+        if (bs->pass == 1) { // first pass: find all SMEMs
+            while (bs->x < bs->len && bs->seq[bs->x] > 3) {
+                ++bs->x;
+            }
+            if (bs->x < bs->len) {
+                bs_start(bwt, bs, BS_FWD, bs->x, 1);
+                continue;
+            }
+            bs->pass = 2, bs->k = 0, bs->old_n = bs->mem.n;
+        }
+        if (bs->pass == 2) { // second pass: find MEMs inside a long SMEM
+            for (; bs->k < bs->old_n; ++bs->k) {
+                bwtintv_t *p = &bs->mem.a[bs->k];
+                int start = p->info >> 32, end = (int32_t)p->info;
+                if (end - start < split_len || p->x[2] > opt->split_width || bs->seq[(start + end) >> 1] > 3) {
+                    continue;
+                }
+                bs_start(bwt, bs, BS_FWD, (start + end) >> 1, p->x[2] + 1);
+                break;
+            }
+            if (bs->k < bs->old_n) {
+                continue;
+            }
+            bs->pass = 3, bs->x = 0;
+        }
+        if (bs->pass == 3 && opt->max_mem_intv > 0) { // third pass: LAST-like
+            while (bs->x < bs->len && bs->seq[bs->x] > 3) {
+                ++bs->x;
+            }
+            if (bs->x < bs->len) {
+                bs_start(bwt, bs, BS_SS1, bs->x, 0);
+                continue;
+            }
+        }
+        break;
+    }
+    ks_introsort(mem_intv, bs->mem.n, bs->mem.a);
+    return 0;
+}
+
+/**
+ * 批量查找多条reads的SMEMs，结果与逐条调用mem_collect_intv()相同
+ * @param n    number of reads
+ * @param seqs reads in the 2-bit encoding
+ * @param a    on return, SMEMs of seqs[i] are in a->bs[i].mem
+ */
+static void mem_collect_intv_batch(const mem_opt_t *opt, const bwt_t *bwt, int n, const bseq1_t *seqs, smem_aux_t *a) {
+    int i, k, n_act;
+    if (n > a->m_bs) {
+        a->bs = realloc(a->bs, n * sizeof(mem_bsmem_t));
+        memset(a->bs + a->m_bs, 0, (n - a->m_bs) * sizeof(mem_bsmem_t));
+        a->m_bs = n;
+    }
+    a->act = realloc(a->act, a->m_bs * sizeof(int));
+    for (i = n_act = 0; i < n; ++i) {
+        mem_bsmem_t *bs = &a->bs[i];
+        bs->len = seqs[i].l_seq, bs->seq = (const uint8_t *)seqs[i].seq;
+        bs->mem.n = 0;
+        bs->pass = 1, bs->x = 0, bs->state = BS_IDLE;
+        if (bs->len >= opt->min_seed_len && bs_next(opt, bwt, bs, 0)) {
+            bwt_extend_prefetch(bwt, &bs->e, bs->is_back);
+            a->act[n_act++] = i;
+        }
+    }
+    while (n_act > 0) {
+        for (i = k = 0; i < n_act; ++i) {
+            mem_bsmem_t *bs = &a->bs[a->act[i]];
+            bwt_extend(bwt, &bs->e, bs->ok, bs->is_back);
+            if (bs_next(opt, bwt, bs, 1)) {
+                bwt_extend_prefetch(bwt, &bs->e, bs->is_back);
+                a->act[k++] = a->act[i];
+            }
+        }
+        n_act = k;
+    }
+}
+
 /************
  * Chaining *
  ************/
@@ -331,20 +634,13 @@ void mem_print_chain(const bntseq_t *bns, mem_chain_v *chn) {
 }
 
 /**
- * 对读取到的待匹配序列在bwt表中进行完全匹配
- * @param opt 执行参数值
- * @param bwt 参考序列bwt数据
- * @param bns 参考序列bns数据
- * @param len 待比对序列长度
- * @param seq 待比对序列转换后的数据
- * @param buf
- * @return 链接过后的chain链
+ * 由SMEMs生成种子链；the same as mem_chain() but with SMEMs already collected
+ * @param mem 由mem_collect_intv()或mem_collect_intv_batch()得到的SMEMs
  */
-mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, int len, const uint8_t *seq, void *buf) {
+static mem_chain_v mem_chain_intv(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, int len, const bwtintv_v *mem) {
     int i, b, e, l_rep; //b开始位置，e结束位置
     int64_t l_pac = bns->l_pac;
     kbtree_t(chn) * tree;
-    smem_aux_t *aux;
 
     mem_chain_v chain;
     kv_init(chain);
@@ -353,11 +649,8 @@ mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bn
     } // if the query is shorter than the seed length, no match
     tree = kb_init(chn, KB_DEFAULT_SIZE);
 
-    aux = buf ? (smem_aux_t *)buf : smem_aux_init();
-    mem_collect_intv(opt, bwt, len, seq, aux);
-
-    for (i = 0, b = e = l_rep = 0; i < aux->mem.n; ++i) { // compute frac_rep
-        bwtintv_t *p = &aux->mem.a[i];
+    for (i = 0, b = e = l_rep = 0; i < mem->n; ++i) { // compute frac_rep
+        bwtintv_t *p = &mem->a[i];
         int sb = (p->info >> 32), se = (uint32_t)p->info;
         if (p->x[2] <= opt->max_occ) {
             continue;
@@ -369,8 +662,27 @@ mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bn
         }
     }
     l_rep += e - b;
-    for (i = 0; i < aux->mem.n; ++i) {
-        bwtintv_t *p = &aux->mem.a[i];
+
+    // look up the reference positions of all seeds in one go such that the SA walks overlap
+    int64_t n_pos = 0, t = 0;
+    bwtint_t *pos;
+    for (i = 0; i < mem->n; ++i) {
+        n_pos += mem->a[i].x[2] < opt->max_occ ? mem->a[i].x[2] : opt->max_occ;
+    }
+    pos = malloc(n_pos * sizeof(bwtint_t));
+    for (i = 0; i < mem->n; ++i) {
+        bwtintv_t *p = &mem->a[i];
+        int step, count;
+        int64_t k;
+        step = p->x[2] > opt->max_occ ? p->x[2] / opt->max_occ : 1;
+        for (k = count = 0; k < p->x[2] && count < opt->max_occ; k += step, ++count) {
+            pos[t++] = p->x[0] + k;
+        }
+    }
+    bwt_sa_batch(bwt, n_pos, pos, pos);
+
+    for (i = 0, t = 0; i < mem->n; ++i) {
+        bwtintv_t *p = &mem->a[i];
         int step, count, slen = (uint32_t)p->info - (p->info >> 32); // seed length
         int64_t k;
         // if (slen < opt->min_seed_len) continue; // ignore if too short or too repetitive
@@ -378,7 +690,7 @@ mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bn
         for (k = count = 0; k < p->x[2] && count < opt->max_occ; k += step, ++count) {
             mem_chain_t tmp, *lower, *upper;
             mem_seed_t s;
-            s.rbeg = tmp.pos = bwt_sa(bwt, p->x[0] + k); // this is the base coordinate in the forward-reverse reference
+            s.rbeg = tmp.pos = pos[t++]; // this is the base coordinate in the forward-reverse reference
             s.qbeg = p->info >> 32;
             s.score = s.len = slen;
             // bridging multiple reference sequences or the forward-reverse boundary; TODO: split the seed; don't discard it!!!
@@ -407,10 +719,7 @@ mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bn
             }
         }
     }
-    if (buf == 0) {
-        smem_aux_destroy(aux);
-    }
-
+    free(pos);
     kv_resize(mem_chain_t, chain, kb_size(tree));
 
 #define traverse_func(p_) (chain.a[chain.n++] = *(p_))
@@ -428,6 +737,33 @@ mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bn
     return chain;
 }
 
+/**
+ * 对读取到的待匹配序列在bwt表中进行完全匹配
+ * @param opt 执行参数值
+ * @param bwt 参考序列bwt数据
+ * @param bns 参考序列bns数据
+ * @param len 待比对序列长度
+ * @param seq 待比对序列转换后的数据
+ * @param buf
+ * @return 链接过后的chain链
+ */
+mem_chain_v mem_chain(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, int len, const uint8_t *seq, void *buf) {
+    smem_aux_t *aux;
+    mem_chain_v chain;
+    kv_init(chain);
+    if (len < opt->min_seed_len) {
+        return chain;
+    } // if the query is shorter than the seed length, no match
+
+    aux = buf ? (smem_aux_t *)buf : smem_aux_init();
+    mem_collect_intv(opt, bwt, len, seq, aux);
+    chain = mem_chain_intv(opt, bwt, bns, len, &aux->mem);
+    if (buf == 0) {
+        smem_aux_destroy(aux);
+    }
+    return chain;
+}
+
 /********************
  * Filtering chains *
  ********************/
@@ -870,36 +1206,51 @@ static inline int cal_max_gap(const mem_opt_t *opt, int qlen) {
 
 #define MAX_BAND_TRY  2
 
-/**
- * 将chain映射到真实的reference区域region
- * @param opt 程序运行参数
- * @param bns reference的bns信息
- * @param pac reference的pac信息
- * @param l_query query的长度
- * @param query query的数组
- * @param c mem_chain数组
- * @param av 该query在reference真实位置的对应信息，返回数据
- */
-void mem_chain2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const uint8_t *query, const mem_chain_t *c, mem_alnreg_v *av) {
-    int max_off[2], aw[2]; // aw: actual bandwidth used in extension
-    int64_t l_pac = bns->l_pac, max = 0;
+/* The extension of a chain is kept as a resumable state machine such that
+ * ksw_extend2() calls from many reads can be collected and run in batches.
+ * mem_ext_next() fills mem_ext_t::job and returns 1 if an extension needs to
+ * be performed; the next call consumes its results. It returns 0 when all
+ * seeds in the chain have been processed. */
+typedef struct {
+    const mem_opt_t *opt;
+    const bntseq_t *bns;
+    int l_query;
+    const uint8_t *query;
+    const mem_chain_t *c;
+    mem_alnreg_v *av;
+    int64_t rmax[2];
+    uint8_t *rseq;
+    uint8_t *qs, *rs;   // reversed query and reference for the left extension
+    uint64_t *srt;      // seeds sorted by score
+    int k;              // the seed being extended is c->seeds[(uint32_t)srt[k]]
+    int state;          // 0: no extension in progress; 1: left extension; 2: right extension
+    int n_try;          // number of bandwidths tried
+    int aw[2];          // actual bandwidth used in extension
+    int prev, sc0, qe, re;
+    size_t ai;          // index of the region being extended in $av
+    ksw_extjob_t job;
+} mem_ext_t;
+
+static void mem_ext_init(mem_ext_t *e, const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const uint8_t *query, const mem_chain_t *c, mem_alnreg_v *av) {
+    int64_t l_pac = bns->l_pac;
+    memset(e, 0, sizeof(mem_ext_t));
+    e->opt = opt, e->bns = bns, e->c = c, e->av = av;
+    e->l_query = l_query, e->query = query;
+    e->k = c->n - 1;
     if (c->n == 0) {
         return;
     }
     // get the max possible span
-    int64_t rmax[2];
+    int64_t *rmax = e->rmax;
     rmax[0] = l_pac << 1;
     rmax[1] = 0;
     for (int i = 0; i < c->n; ++i) {
-        int64_t b, e;
+        int64_t rb, re;
         const mem_seed_t *t = &c->seeds[i];
-        b = t->rbeg - (t->qbeg + cal_max_gap(opt, t->qbeg));
-        e = t->rbeg + t->len + ((l_query - t->qbeg - t->len) + cal_max_gap(opt, l_query - t->qbeg - t->len));
-        rmax[0] = rmax[0] < b ? rmax[0] : b;
-        rmax[1] = rmax[1] > e ? rmax[1] : e;
-        if (t->len > max) {
-            max = t->len;
-        }
+        rb = t->rbeg - (t->qbeg + cal_max_gap(opt, t->qbeg));
+        re = t->rbeg + t->len + ((l_query - t->qbeg - t->len) + cal_max_gap(opt, l_query - t->qbeg - t->len));
+        rmax[0] = rmax[0] < rb ? rmax[0] : rb;
+        rmax[1] = rmax[1] > re ? rmax[1] : re;
     }
     rmax[0] = rmax[0] > 0 ? rmax[0] : 0;
     rmax[1] = rmax[1] < l_pac << 1 ? rmax[1] : l_pac << 1;
@@ -912,208 +1263,276 @@ void mem_chain2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac
     }
     // retrieve the reference sequence
     int rid;
-    uint8_t *rseq = 0;
-    rseq = bns_fetch_seq(bns, pac, &rmax[0], c->seeds[0].rbeg, &rmax[1], &rid);
+    e->rseq = bns_fetch_seq(bns, pac, &rmax[0], c->seeds[0].rbeg, &rmax[1], &rid);
     assert(c->rid == rid);
 
-    uint64_t * srt = malloc(c->n * 8);
+    e->srt = malloc(c->n * 8);
     for (int i = 0; i < c->n; ++i) {
-        srt[i] = (uint64_t)
+        e->srt[i] = (uint64_t)
         c->seeds[i].score << 32 | i;
     }
-    ks_introsort_64(c->n, srt);
+    ks_introsort_64(c->n, e->srt);
+}
 
-    const mem_seed_t *s;
-    for (int k = c->n - 1; k >= 0; --k) {
+/**
+ * 检查seed(k)是否已被之前的比对区域覆盖，从而可以跳过延伸
+ * @return 1 if the extension from the seed can be skipped
+ */
+static int mem_ext_skip(const mem_ext_t *e, int k, const mem_seed_t *s) {
+    const mem_opt_t *opt = e->opt;
+    const mem_chain_t *c = e->c;
+    const mem_alnreg_v *av = e->av;
+    int i;
+    for (i = 0; i < av->n; ++i) { // test whether extension has been made before
+        mem_alnreg_t *p = &av->a[i];
+        int64_t rd;
+        int qd, w, max_gap;
+        if (s->rbeg < p->rb || s->rbeg + s->len > p->re || s->qbeg < p->qb || s->qbeg + s->len > p->qe) {
+            continue;
+        } // not fully contained
+        if (s->len - p->seedlen0 > .1 * e->l_query) {
+            continue;
+        } // this seed may give a better alignment
+        // qd: distance ahead of the seed on query; rd: on reference
+        qd = s->qbeg - p->qb;
+        rd = s->rbeg - p->rb;
+        max_gap = cal_max_gap(opt, qd < rd ? qd : rd); // the maximal gap allowed in regions ahead of the seed
+        w = max_gap < p->w ? max_gap : p->w; // bounded by the band width
+        if (qd - rd < w && rd - qd < w) {
+            break;
+        } // the seed is "around" a previous hit
+        // similar to the previous four lines, but this time we look at the region behind
+        qd = p->qe - (s->qbeg + s->len);
+        rd = p->re - (s->rbeg + s->len);
+        max_gap = cal_max_gap(opt, qd < rd ? qd : rd);
+        w = max_gap < p->w ? max_gap : p->w;
+        if (qd - rd < w && rd - qd < w) {
+            break;
+        }
+    }
+    if (i == av->n) {
+        return 0;
+    }
+    // the seed is (almost) contained in an existing alignment; further testing is needed to confirm it is not leading to a different aln
+    if (bwa_verbose >= 4) {
+        printf("** Seed(%d) [%ld;%ld,%ld] is almost contained in an existing alignment [%d,%d) <=> [%ld,%ld)\n",
+            k, (long)s->len, (long)s->qbeg, (long)s->rbeg, av->a[i].qb, av->a[i].qe, (long)av->a[i].rb,
+            (long)av->a[i].re);
+    }
+    for (i = k + 1; i < c->n; ++i) { // check overlapping seeds in the same chain
+        const mem_seed_t *t;
+        if (e->srt[i] == 0) {
+            continue;
+        }
+        t = &c->seeds[(uint32_t)e->srt[i]];
+        if (t->len < s->len * .95) {
+            continue;
+        } // only check overlapping if t is long enough; TODO: more efficient by early stopping
+        if (s->qbeg <= t->qbeg && s->qbeg + s->len - t->qbeg >= s->len >> 2 && t->qbeg - s->qbeg != t->rbeg - s->rbeg) {
+            break;
+        }
+        if (t->qbeg <= s->qbeg && t->qbeg + t->len - s->qbeg >= s->len >> 2 && s->qbeg - t->qbeg != s->rbeg - t->rbeg) {
+            break;
+        }
+    }
+    if (i == c->n) { // no overlapping seeds; then skip extension
+        return 1;
+    }
+    if (bwa_verbose >= 4) {
+        printf("** Seed(%d) might lead to a different alignment even though it is contained. "
+               "Extension will be performed.\n", k);
+    }
+    return 0;
+}
+
+static void mem_ext_left_job(mem_ext_t *e, const mem_seed_t *s) {
+    const mem_opt_t *opt = e->opt;
+    int tmp = s->rbeg - e->rmax[0];
+    e->prev = e->av->a[e->ai].score;
+    e->aw[0] = opt->w << e->n_try;
+    if (bwa_verbose >= 4) {
+        printf("*** Left ref:   ");
+        for (int j = 0; j < tmp; ++j) {
+            putchar("ACGTN"[(int)e->rs[j]]);
+        }
+        putchar('\n');
+        printf("*** Left query: ");
+        for (int j = 0; j < s->qbeg; ++j) {
+            putchar("ACGTN"[(int)e->qs[j]]);
+        }
+        putchar('\n');
+    }
+    e->job.qlen = s->qbeg, e->job.query = e->qs;
+    e->job.tlen = tmp, e->job.target = e->rs;
+    e->job.w = e->aw[0], e->job.end_bonus = opt->pen_clip5, e->job.h0 = s->len * opt->a;
+}
+
+static void mem_ext_right_job(mem_ext_t *e) {
+    const mem_opt_t *opt = e->opt;
+    e->prev = e->av->a[e->ai].score;
+    e->aw[1] = opt->w << e->n_try;
+    if (bwa_verbose >= 4) {
+        int j;
+        printf("*** Right ref:   ");
+        for (j = 0; j < e->rmax[1] - e->rmax[0] - e->re; ++j) {
+            putchar("ACGTN"[(int)e->rseq[e->re + j]]);
+        }
+        putchar('\n');
+        printf("*** Right query: ");
+        for (j = 0; j < e->l_query - e->qe; ++j) {
+            putchar("ACGTN"[(int)e->query[e->qe + j]]);
+        }
+        putchar('\n');
+    }
+    e->job.qlen = e->l_query - e->qe, e->job.query = e->query + e->qe;
+    e->job.tlen = e->rmax[1] - e->rmax[0] - e->re, e->job.target = e->rseq + e->re;
+    e->job.w = e->aw[1], e->job.end_bonus = opt->pen_clip3, e->job.h0 = e->sc0;
+}
+
+// finish the region extended from seed $s
+static void mem_ext_finish(const mem_ext_t *e, const mem_seed_t *s, mem_alnreg_t *a) {
+    const mem_chain_t *c = e->c;
+    int i;
+    if (bwa_verbose >= 4) {
+        printf("*** Added alignment region: [%d,%d) <=> [%ld,%ld); score=%d; {left,right}_bandwidth={%d,%d}\n",
+            a->qb, a->qe, (long)a->rb, (long)a->re, a->score, e->aw[0], e->aw[1]);
+    }
+
+    // compute seedcov
+    for (i = 0, a->seedcov = 0; i < c->n; ++i) {
+        const mem_seed_t *t = &c->seeds[i];
+        if (t->qbeg >= a->qb && t->qbeg + t->len <= a->qe && t->rbeg >= a->rb && t->rbeg + t->len <= a->re) { // seed fully contained
+            a->seedcov += t->len;
+        } // this is not very accurate, but for approx. mapQ, this is good enough
+    }
+    a->w = e->aw[0] > e->aw[1] ? e->aw[0] : e->aw[1];
+    a->seedlen0 = s->len;
+
+    a->frac_rep = c->frac_rep;
+}
+
+static int mem_ext_next(mem_ext_t *e) {
+    const mem_opt_t *opt = e->opt;
+    const mem_chain_t *c = e->c;
+    const ksw_extjob_t *p = &e->job;
+    while (e->k >= 0) {
+        const mem_seed_t *s = &c->seeds[(uint32_t)e->srt[e->k]];
         mem_alnreg_t *a;
-        s = &c->seeds[(uint32_t)srt[k]];
-
-        int i;
-        for (i = 0; i < av->n; ++i) { // test whether extension has been made before
-            mem_alnreg_t *p = &av->a[i];
-            int64_t rd;
-            int qd, w, max_gap;
-            if (s->rbeg < p->rb || s->rbeg + s->len > p->re || s->qbeg < p->qb || s->qbeg + s->len > p->qe) {
+        if (e->state == 0) { // start from a new seed
+            if (mem_ext_skip(e, e->k, s)) {
+                e->srt[e->k--] = 0; // mark that seed extension has not been performed
                 continue;
-            } // not fully contained
-            if (s->len - p->seedlen0 > .1 * l_query) {
-                continue;
-            } // this seed may give a better alignment
-            // qd: distance ahead of the seed on query; rd: on reference
-            qd = s->qbeg - p->qb;
-            rd = s->rbeg - p->rb;
-            max_gap = cal_max_gap(opt, qd < rd ? qd : rd); // the maximal gap allowed in regions ahead of the seed
-            w = max_gap < p->w ? max_gap : p->w; // bounded by the band width
-            if (qd - rd < w && rd - qd < w) {
-                break;
-            } // the seed is "around" a previous hit
-            // similar to the previous four lines, but this time we look at the region behind
-            qd = p->qe - (s->qbeg + s->len);
-            rd = p->re - (s->rbeg + s->len);
-            max_gap = cal_max_gap(opt, qd < rd ? qd : rd);
-            w = max_gap < p->w ? max_gap : p->w;
-            if (qd - rd < w && rd - qd < w) {
-                break;
             }
-        }
-        if (i < av->n) { // the seed is (almost) contained in an existing alignment; further testing is needed to confirm it is not leading to a different aln
+            a = kv_pushp(mem_alnreg_t, *e->av);
+            e->ai = a - e->av->a;
+            memset(a, 0, sizeof(mem_alnreg_t));
+            a->w = e->aw[0] = e->aw[1] = opt->w;
+            a->score = a->truesc = -1;
+            a->rid = c->rid;
+
             if (bwa_verbose >= 4) {
-                printf("** Seed(%d) [%ld;%ld,%ld] is almost contained in an existing alignment [%d,%d) <=> [%ld,%ld)\n",
-                    k, (long)s->len, (long)s->qbeg, (long)s->rbeg, av->a[i].qb, av->a[i].qe, (long)av->a[i].rb,
-                    (long)av->a[i].re);
+                err_printf("** ---> Extending from seed(%d) [%ld;%ld,%ld] @ %s <---\n",
+                    e->k, (long)s->len, (long)s->qbeg, (long)s->rbeg, e->bns->anns[c->rid].name);
             }
-            for (i = k + 1; i < c->n; ++i) { // check overlapping seeds in the same chain
-                const mem_seed_t *t;
-                if (srt[i] == 0) {
-                    continue;
+            if (s->qbeg) { // left extension
+                int i, tmp = s->rbeg - e->rmax[0];
+                e->qs = malloc(s->qbeg);
+                for (i = 0; i < s->qbeg; ++i) {
+                    e->qs[i] = e->query[s->qbeg - 1 - i];
                 }
-                t = &c->seeds[(uint32_t)srt[i]];
-                if (t->len < s->len * .95) {
-                    continue;
-                } // only check overlapping if t is long enough; TODO: more efficient by early stopping
-                if (s->qbeg <= t->qbeg && s->qbeg + s->len - t->qbeg >= s->len >> 2 && t->qbeg - s->qbeg != t->rbeg - s->rbeg) {
-                    break;
-                }
-                if (t->qbeg <= s->qbeg && t->qbeg + t->len - s->qbeg >= s->len >> 2 && s->qbeg - t->qbeg != s->rbeg - t->rbeg) {
-                    break;
+                e->rs = malloc(tmp);
+                for (i = 0; i < tmp; ++i) {
+                    e->rs[i] = e->rseq[tmp - 1 - i];
                 }
+                e->state = 1, e->n_try = 0;
+                mem_ext_left_job(e, s);
+                return 1;
             }
-            if (i == c->n) { // no overlapping seeds; then skip extension
-                srt[k] = 0; // mark that seed extension has not been performed
-                continue;
-            }
+            a->score = a->truesc = s->len * opt->a, a->qb = 0, a->rb = s->rbeg;
+        } else if (e->state == 1) { // the left extension has been performed
+            a = &e->av->a[e->ai];
+            a->score = p->score;
             if (bwa_verbose >= 4) {
-                printf("** Seed(%d) might lead to a different alignment even though it is contained. "
-                       "Extension will be performed.\n", k);
-            }
-        }
-
-        a = kv_pushp(mem_alnreg_t, *av);
-        memset(a, 0, sizeof(mem_alnreg_t));
-        a->w = aw[0] = aw[1] = opt->w;
-        a->score = a->truesc = -1;
-        a->rid = c->rid;
-
-        if (bwa_verbose >= 4) {
-            err_printf("** ---> Extending from seed(%d) [%ld;%ld,%ld] @ %s <---\n",
-                k, (long)s->len, (long)s->qbeg, (long)s->rbeg, bns->anns[c->rid].name);
-        }
-        if (s->qbeg) { // left extension
-            uint8_t *rs, *qs;
-            int qle, tle, gtle, gscore;
-            qs = malloc(s->qbeg);
-            for (i = 0; i < s->qbeg; ++i) {
-                qs[i] = query[s->qbeg - 1 - i];
+                printf("*** Left extension: prev_score=%d; score=%d; bandwidth=%d; max_off_diagonal_dist=%d\n",
+                    e->prev, a->score, e->aw[0], p->max_off);
+                fflush(stdout);
             }
-            int tmp = s->rbeg - rmax[0];
-            rs = malloc(tmp);
-            for (i = 0; i < tmp; ++i) {
-                rs[i] = rseq[tmp - 1 - i];
-            }
-            for (i = 0; i < MAX_BAND_TRY; ++i) {
-                int prev = a->score;
-                aw[0] = opt->w << i;
-                if (bwa_verbose >= 4) {
-                    printf("*** Left ref:   ");
-                    for (int j = 0; j < tmp; ++j) {
-                        putchar("ACGTN"[(int)rs[j]]);
-                    }
-                    putchar('\n');
-                    printf("*** Left query: ");
-                    for (int j = 0; j < s->qbeg; ++j) {
-                        putchar("ACGTN"[(int)qs[j]]);
-                    }
-                    putchar('\n');
-                }
-                a->score = ksw_extend2(s->qbeg, qs, tmp, rs, 5, opt->mat, opt->o_del, opt->e_del, opt->o_ins,
-                    opt->e_ins, aw[0], opt->pen_clip5, opt->zdrop, s->len * opt->a,
-                    &qle, &tle, &gtle, &gscore, &max_off[0]);
-                if (bwa_verbose >= 4) {
-                    printf("*** Left extension: prev_score=%d; score=%d; bandwidth=%d; max_off_diagonal_dist=%d\n",
-                        prev, a->score, aw[0], max_off[0]);
-                    fflush(stdout);
-                }
-                if (a->score == prev || max_off[0] < (aw[0] >> 1) + (aw[0] >> 2)) {
-                    break;
-                }
+            if (a->score != e->prev && p->max_off >= (e->aw[0] >> 1) + (e->aw[0] >> 2) && ++e->n_try < MAX_BAND_TRY) {
+                mem_ext_left_job(e, s);
+                return 1;
             }
             // check whether we prefer to reach the end of the query
-            if (gscore <= 0 || gscore <= a->score - opt->pen_clip5) { // local extension
-                a->qb = s->qbeg - qle, a->rb = s->rbeg - tle;
+            if (p->gscore <= 0 || p->gscore <= a->score - opt->pen_clip5) { // local extension
+                a->qb = s->qbeg - p->qle, a->rb = s->rbeg - p->tle;
                 a->truesc = a->score;
             } else { // to-end extension
-                a->qb = 0, a->rb = s->rbeg - gtle;
-                a->truesc = gscore;
+                a->qb = 0, a->rb = s->rbeg - p->gtle;
+                a->truesc = p->gscore;
             }
-            free(qs);
-            free(rs);
-        } else {
-            a->score = a->truesc = s->len * opt->a, a->qb = 0, a->rb = s->rbeg;
-        }
-
-        if (s->qbeg + s->len != l_query) { // right extension
-            int qle, tle, qe, re, gtle, gscore, sc0 = a->score;
-            qe = s->qbeg + s->len;
-            re = s->rbeg + s->len - rmax[0];
-            assert(re >= 0);
-            for (i = 0; i < MAX_BAND_TRY; ++i) {
-                int prev = a->score;
-                aw[1] = opt->w << i;
-                if (bwa_verbose >= 4) {
-                    int j;
-                    printf("*** Right ref:   ");
-                    for (j = 0; j < rmax[1] - rmax[0] - re; ++j) {
-                        putchar("ACGTN"[(int)rseq[re + j]]);
-                    }
-                    putchar('\n');
-                    printf("*** Right query: ");
-                    for (j = 0; j < l_query - qe; ++j) {
-                        putchar("ACGTN"[(int)query[qe + j]]);
-                    }
-                    putchar('\n');
-                }
-                a->score = ksw_extend2(l_query - qe, query + qe, rmax[1] - rmax[0] - re, rseq + re, 5,
-                    opt->mat, opt->o_del, opt->e_del, opt->o_ins, opt->e_ins, aw[1], opt->pen_clip3, opt->zdrop,
-                    sc0, &qle, &tle, &gtle, &gscore, &max_off[1]);
-                if (bwa_verbose >= 4) {
-                    printf("*** Right extension: prev_score=%d; score=%d; bandwidth=%d; max_off_diagonal_dist=%d\n",
-                        prev, a->score, aw[1], max_off[1]);
-                    fflush(stdout);
-                }
-                if (a->score == prev || max_off[1] < (aw[1] >> 1) + (aw[1] >> 2)) {
-                    break;
-                }
+            free(e->qs);
+            free(e->rs);
+            e->qs = e->rs = 0;
+        } else { // the right extension has been performed
+            a = &e->av->a[e->ai];
+            a->score = p->score;
+            if (bwa_verbose >= 4) {
+                printf("*** Right extension: prev_score=%d; score=%d; bandwidth=%d; max_off_diagonal_dist=%d\n",
+                    e->prev, a->score, e->aw[1], p->max_off);
+                fflush(stdout);
+            }
+            if (a->score != e->prev && p->max_off >= (e->aw[1] >> 1) + (e->aw[1] >> 2) && ++e->n_try < MAX_BAND_TRY) {
+                mem_ext_right_job(e);
+                return 1;
             }
             // similar to the above
-            if (gscore <= 0 || gscore <= a->score - opt->pen_clip3) { // local extension
-                a->qe = qe + qle, a->re = rmax[0] + re + tle;
-                a->truesc += a->score - sc0;
+            if (p->gscore <= 0 || p->gscore <= a->score - opt->pen_clip3) { // local extension
+                a->qe = e->qe + p->qle, a->re = e->rmax[0] + e->re + p->tle;
+                a->truesc += a->score - e->sc0;
             } else { // to-end extension
-                a->qe = l_query, a->re = rmax[0] + re + gtle;
-                a->truesc += gscore - sc0;
+                a->qe = e->l_query, a->re = e->rmax[0] + e->re + p->gtle;
+                a->truesc += p->gscore - e->sc0;
             }
-        } else {
-            a->qe = l_query, a->re = s->rbeg + s->len;
-        }
-        if (bwa_verbose >= 4) {
-            printf("*** Added alignment region: [%d,%d) <=> [%ld,%ld); score=%d; {left,right}_bandwidth={%d,%d}\n",
-                a->qb, a->qe, (long)a->rb, (long)a->re, a->score, aw[0], aw[1]);
-        }
-
-        // compute seedcov
-        for (i = 0, a->seedcov = 0; i < c->n; ++i) {
-            const mem_seed_t *t = &c->seeds[i];
-            if (t->qbeg >= a->qb && t->qbeg + t->len <= a->qe && t->rbeg >= a->rb && t->rbeg + t->len <= a->re) { // seed fully contained
-                a->seedcov += t->len;
-            } // this is not very accurate, but for approx. mapQ, this is good enough
+            mem_ext_finish(e, s, a);
+            e->state = 0, --e->k;
+            continue;
         }
-        a->w = aw[0] > aw[1] ? aw[0] : aw[1];
-        a->seedlen0 = s->len;
+        if (s->qbeg + s->len != e->l_query) { // right extension
+            e->qe = s->qbeg + s->len;
+            e->re = s->rbeg + s->len - e->rmax[0];
+            assert(e->re >= 0);
+            e->sc0 = a->score;
+            e->state = 2, e->n_try = 0;
+            mem_ext_right_job(e);
+            return 1;
+        }
+        a->qe = e->l_query, a->re = s->rbeg + s->len;
+        mem_ext_finish(e, s, a);
+        e->state = 0, --e->k;
+    }
+    free(e->srt);
+    free(e->rseq);
+    e->srt = 0, e->rseq = 0;
+    return 0;
+}
 
-        a->frac_rep = c->frac_rep;
+/**
+ * 将chain映射到真实的reference区域region
+ * @param opt 程序运行参数
+ * @param bns reference的bns信息
+ * @param pac reference的pac信息
+ * @param l_query query的长度
+ * @param query query的数组
+ * @param c mem_chain数组
+ * @param av 该query在reference真实位置的对应信息，返回数据
+ */
+void mem_chain2aln(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, int l_query, const uint8_t *query, const mem_chain_t *c, mem_alnreg_v *av) {
+    mem_ext_t e;
+    mem_ext_init(&e, opt, bns, pac, l_query, query, c, av);
+    while (mem_ext_next(&e)) {
+        ksw_extjob_t *p = &e.job;
+        p->score = ksw_extend2(p->qlen, p->query, p->tlen, p->target, 5, opt->mat, opt->o_del, opt->e_del, opt->o_ins,
+            opt->e_ins, p->w, p->end_bonus, opt->zdrop, p->h0, &p->qle, &p->tle, &p->gtle, &p->gscore, &p->max_off);
     }
-    free(srt);
-    free(rseq);
 }
 
 /*****************************
@@ -1157,12 +1576,8 @@ static inline void add_cigar(const mem_opt_t *opt, mem_aln_t *p, kstring_t *str,
     } // having a coordinate but unaligned (e.g. when copy_mate is true)
 }
 
-void mem_aln2sam(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str, bseq1_t *s, int n, const mem_aln_t *list, int which, const mem_aln_t *m_) {
-    mem_aln_t ptmp = list[which], *p = &ptmp, mtmp, *m = 0; // make a copy of the alignment to convert
-    if (m_) {
-        mtmp = *m_, m = &mtmp;
-    }
-    // set flag
+// set the flag of $p and place an unmapped read or mate next to its mapped partner
+static void mem_aln_pair_flag(mem_aln_t *p, mem_aln_t *m) {
     p->flag |= m ? 0x1 : 0; // is paired in sequencing
     p->flag |= p->rid < 0 ? 0x4 : 0; // is mapped
     p->flag |= m && m->rid < 0 ? 0x8 : 0; // is mate mapped
@@ -1174,6 +1589,66 @@ void mem_aln2sam(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str, bseq
     }
     p->flag |= p->is_rev ? 0x10 : 0; // is on the reverse strand
     p->flag |= m && m->is_rev ? 0x20 : 0; // is mate on the reverse strand
+}
+
+// TLEN of $p with mate $m on the same reference
+static inline int64_t mem_aln_tlen(const mem_aln_t *p, const mem_aln_t *m) {
+    int64_t p0 = p->pos + (p->is_rev ? get_rlen(p->n_cigar, p->cigar) - 1 : 0);
+    int64_t p1 = m->pos + (m->is_rev ? get_rlen(m->n_cigar, m->cigar) - 1 : 0);
+    if (m->n_cigar == 0 || p->n_cigar == 0) {
+        return 0;
+    }
+    return -(p0 - p1 + (p0 > p1 ? 1 : p0 < p1 ? -1 : 0));
+}
+
+// the value of the SA tag, if there are other primary hits
+static int mem_aln_sa(const bntseq_t *bns, int n, const mem_aln_t *list, int which, kstring_t *str) {
+    int i;
+    for (i = 0; i < n; ++i) {
+        if (i != which && !(list[i].flag & 0x100)) {
+            break;
+        }
+    }
+    if (i == n) {
+        return 0;
+    }
+    for (i = 0; i < n; ++i) {
+        const mem_aln_t *r = &list[i];
+        if (i == which || (r->flag & 0x100)) {
+            continue;
+        } // proceed if: 1) different from the current; 2) not shadowed multi hit
+        kputs(bns->anns[r->rid].name, str);
+        kputc(',', str);
+        kputl(r->pos + 1, str);
+        kputc(',', str);
+        kputc("+-"[r->is_rev], str);
+        kputc(',', str);
+        for (int k = 0; k < r->n_cigar; ++k) {
+            kputw(r->cigar[k] >> 4, str);
+            kputc("MIDSH"[r->cigar[k] & 0xf], str);
+        }
+        kputc(',', str);
+        kputw(r->mapq, str);
+        kputc(',', str);
+        kputw(r->NM, str);
+        kputc(';', str);
+    }
+    return 1;
+}
+
+static void mem_aln2bam(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str, bseq1_t *s, int n, const mem_aln_t *list, int which, const mem_aln_t *m_);
+
+void mem_aln2sam(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str, bseq1_t *s, int n, const mem_aln_t *list, int which, const mem_aln_t *m_) {
+    if (opt->flag & MEM_F_BAM) {
+        mem_aln2bam(opt, bns, str, s, n, list, which, m_);
+        return;
+    }
+    mem_aln_t ptmp = list[which], *p = &ptmp, mtmp, *m = 0; // make a copy of the alignment to convert
+    if (m_) {
+        mtmp = *m_, m = &mtmp;
+    }
+    // set flag
+    mem_aln_pair_flag(p, m);
 
     // print up to CIGAR
     int l_name = strlen(s->name);
@@ -1206,13 +1681,7 @@ void mem_aln2sam(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str, bseq
         kputl(m->pos + 1, str);
         kputc('\t', str);
         if (p->rid == m->rid) {
-            int64_t p0 = p->pos + (p->is_rev ? get_rlen(p->n_cigar, p->cigar) - 1 : 0);
-            int64_t p1 = m->pos + (m->is_rev ? get_rlen(m->n_cigar, m->cigar) - 1 : 0);
-            if (m->n_cigar == 0 || p->n_cigar == 0) {
-                kputc('0', str);
-            } else {
-                kputl(-(p0 - p1 + (p0 > p1 ? 1 : p0 < p1 ? -1 : 0)), str);
-            }
+            kputl(mem_aln_tlen(p, m), str);
         } else {
             kputc('0', str);
         }
@@ -1298,35 +1767,10 @@ void mem_aln2sam(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str, bseq
         kputs(bwa_rg_id, str);
     }
     if (!(p->flag & 0x100)) { // not multi-hit
-        int i;
-        for (i = 0; i < n; ++i) {
-            if (i != which && !(list[i].flag & 0x100)) {
-                break;
-            }
-        }
-        if (i < n) { // there are other primary hits; output them
-            kputsn("\tSA:Z:", 6, str);
-            for (i = 0; i < n; ++i) {
-                const mem_aln_t *r = &list[i];
-                if (i == which || (r->flag & 0x100)) {
-                    continue;
-                } // proceed if: 1) different from the current; 2) not shadowed multi hit
-                kputs(bns->anns[r->rid].name, str);
-                kputc(',', str);
-                kputl(r->pos + 1, str);
-                kputc(',', str);
-                kputc("+-"[r->is_rev], str);
-                kputc(',', str);
-                for (int k = 0; k < r->n_cigar; ++k) {
-                    kputw(r->cigar[k] >> 4, str);
-                    kputc("MIDSH"[r->cigar[k] & 0xf], str);
-                }
-                kputc(',', str);
-                kputw(r->mapq, str);
-                kputc(',', str);
-                kputw(r->NM, str);
-                kputc(';', str);
-            }
+        size_t l = str->l;
+        kputsn("\tSA:Z:", 6, str);
+        if (!mem_aln_sa(bns, n, list, which, str)) { // no other primary hits
+            str->l = l, str->s[l] = 0;
         }
         if (p->alt_sc > 0) {
             ksprintf(str, "\tpa:f:%.3f", (double)p->score / p->alt_sc);
@@ -1354,6 +1798,257 @@ void mem_aln2sam(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str, bseq
     kputc('\n', str);
 }
 
+/**************
+ * BAM output *
+ **************/
+
+static inline void bam_put16(kstring_t *s, uint16_t x) {
+    char b[2] = {(char)x, (char)(x >> 8)};
+    kputsn(b, 2, s);
+}
+
+static inline void bam_put32(kstring_t *s, uint32_t x) {
+    char b[4] = {(char)x, (char)(x >> 8), (char)(x >> 16), (char)(x >> 24)};
+    kputsn(b, 4, s);
+}
+
+// bin of [beg,end) in the BAM index (SAM spec, section 5.3)
+static inline int bam_reg2bin(int64_t beg, int64_t end) {
+    --end;
+    if (beg >> 14 == end >> 14) {
+        return ((1 << 15) - 1) / 7 + (beg >> 14);
+    }
+    if (beg >> 17 == end >> 17) {
+        return ((1 << 12) - 1) / 7 + (beg >> 17);
+    }
+    if (beg >> 20 == end >> 20) {
+        return ((1 << 9) - 1) / 7 + (beg >> 20);
+    }
+    if (beg >> 23 == end >> 23) {
+        return ((1 << 6) - 1) / 7 + (beg >> 23);
+    }
+    if (beg >> 26 == end >> 26) {
+        return ((1 << 3) - 1) / 7 + (beg >> 26);
+    }
+    return 0;
+}
+
+// integer tag in the smallest type that holds the value, the same as samtools does
+static void bam_put_int_tag(kstring_t *s, const char *tag, int64_t v) {
+    kputsn(tag, 2, s);
+    if (v < 0) {
+        if (v >= INT8_MIN) {
+            kputc('c', s), kputc((char)v, s);
+        } else if (v >= INT16_MIN) {
+            kputc('s', s), bam_put16(s, (uint16_t)v);
+        } else {
+            kputc('i', s), bam_put32(s, (uint32_t)v);
+        }
+    } else {
+        if (v <= UINT8_MAX) {
+            kputc('C', s), kputc((char)v, s);
+        } else if (v <= UINT16_MAX) {
+            kputc('S', s), bam_put16(s, (uint16_t)v);
+        } else {
+            kputc('I', s), bam_put32(s, (uint32_t)v);
+        }
+    }
+}
+
+static void bam_put_str_tag(kstring_t *s, const char *tag, char type, const char *v, int l) {
+    kputsn(tag, 2, s);
+    kputc(type, s);
+    kputsn(v, l, s);
+    kputc(0, s);
+}
+
+static void bam_put_float_tag(kstring_t *s, const char *tag, float f) {
+    union {
+        float f;
+        uint32_t i;
+    } u;
+    u.f = f;
+    kputsn(tag, 2, s);
+    kputc('f', s);
+    bam_put32(s, u.i);
+}
+
+// SAM text tags like "BC:Z:ACGT\tXY:i:1", as appended with -C; fields that are not valid SAM tags are dropped
+static void bam_put_text_tags(kstring_t *s, const char *p) {
+    while (*p) {
+        const char *q, *e = strchr(p, '\t');
+        e = e ? e : p + strlen(p);
+        if (e - p >= 5 && p[2] == ':' && p[4] == ':' && isalpha((uint8_t)p[0]) && isalnum((uint8_t)p[1])) {
+            q = p + 5;
+            if (p[3] == 'Z' || p[3] == 'H') {
+                bam_put_str_tag(s, p, p[3], q, e - q);
+            } else if (p[3] == 'A' && e - q == 1) {
+                kputsn(p, 2, s), kputc('A', s), kputc(*q, s);
+            } else if (p[3] == 'i') {
+                bam_put_int_tag(s, p, strtoll(q, 0, 10));
+            } else if (p[3] == 'f') {
+                bam_put_float_tag(s, p, strtof(q, 0));
+            } else if (p[3] == 'B' && e - q >= 1 && strchr("cCsSiIf", *q)) {
+                size_t l_cnt;
+                uint32_t cnt = 0;
+                char type = *q++;
+                kputsn(p, 2, s), kputc('B', s), kputc(type, s);
+                l_cnt = s->l;
+                bam_put32(s, 0);
+                while (q < e && *q == ',') {
+                    char *r;
+                    if (type == 'f') {
+                        union {
+                            float f;
+                            uint32_t i;
+                        } u;
+                        u.f = strtof(q + 1, &r);
+                        bam_put32(s, u.i);
+                    } else {
+                        int64_t v = strtoll(q + 1, &r, 10);
+                        if (type == 'c' || type == 'C') {
+                            kputc((char)v, s);
+                        } else if (type == 's' || type == 'S') {
+                            bam_put16(s, (uint16_t)v);
+                        } else {
+                            bam_put32(s, (uint32_t)v);
+                        }
+                    }
+                    q = r, ++cnt;
+                }
+                s->s[l_cnt] = cnt, s->s[l_cnt + 1] = cnt >> 8, s->s[l_cnt + 2] = cnt >> 16, s->s[l_cnt + 3] = cnt >> 24;
+            }
+        }
+        p = *e ? e + 1 : e;
+    }
+}
+
+// CIGAR in the BAM encoding, with the same clipping as add_cigar()
+static void bam_put_cigar(const mem_opt_t *opt, const mem_aln_t *p, kstring_t *str, int which) {
+    static const uint8_t op2bam[5] = {0, 1, 2, 4, 5}; // MIDSH
+    for (int i = 0; i < p->n_cigar; ++i) {
+        int c = p->cigar[i] & 0xf;
+        if (!(opt->flag & MEM_F_SOFTCLIP) && !p->is_alt && (c == 3 || c == 4)) {
+            c = which ? 4 : 3;
+        } // use hard clipping for supplementary alignments
+        bam_put32(str, (p->cigar[i] >> 4) << 4 | op2bam[c]);
+    }
+}
+
+/* The same record as mem_aln2sam() writes, but in BAM. The record starts
+ * with its block_size, so the records of one read can be concatenated. */
+static void mem_aln2bam(const mem_opt_t *opt, const bntseq_t *bns, kstring_t *str, bseq1_t *s, int n, const mem_aln_t *list, int which, const mem_aln_t *m_) {
+    static const uint8_t nt2bam[5] = {1, 2, 4, 8, 15}; // ACGTN
+    mem_aln_t ptmp = list[which], *p = &ptmp, mtmp, *m = 0;
+    size_t st = str->l;
+    int l_name = strlen(s->name), flag, qb = 0, qe = s->l_seq, l_seq;
+    kstring_t tmp = {0, 0, 0};
+    if (m_) {
+        mtmp = *m_, m = &mtmp;
+    }
+    mem_aln_pair_flag(p, m);
+    flag = (p->flag & 0xffff) | (p->flag & 0x10000 ? 0x100 : 0);
+    if (p->rid < 0) {
+        p->n_cigar = 0;
+    }
+    if (p->flag & 0x100) { // for secondary alignments, don't write SEQ and QUAL
+        qb = qe = 0;
+    } else if (p->n_cigar && which && !(opt->flag & MEM_F_SOFTCLIP) && !p->is_alt) { // hard clipped
+        int c0 = p->cigar[0] & 0xf, c1 = p->cigar[p->n_cigar - 1] & 0xf;
+        int l0 = c0 == 3 || c0 == 4 ? p->cigar[0] >> 4 : 0, l1 = c1 == 3 || c1 == 4 ? p->cigar[p->n_cigar - 1] >> 4 : 0;
+        qb += p->is_rev ? l1 : l0;
+        qe -= p->is_rev ? l0 : l1;
+    }
+    l_seq = qe - qb;
+
+    bam_put32(str, 0); // block_size; filled in at the end
+    bam_put32(str, p->rid);
+    bam_put32(str, p->rid >= 0 ? p->pos : -1);
+    kputc(l_name + 1, str);
+    kputc(p->rid >= 0 ? p->mapq : 0, str);
+    if (p->rid >= 0) {
+        int rlen = p->n_cigar ? get_rlen(p->n_cigar, p->cigar) : 0;
+        bam_put16(str, bam_reg2bin(p->pos, p->pos + (rlen > 0 ? rlen : 1)));
+    } else {
+        bam_put16(str, 4680); // bam_reg2bin(-1, 0)
+    }
+    bam_put16(str, p->n_cigar);
+    bam_put16(str, flag);
+    bam_put32(str, l_seq);
+    if (m && m->rid >= 0) {
+        bam_put32(str, m->rid);
+        bam_put32(str, m->pos);
+        bam_put32(str, p->rid == m->rid ? mem_aln_tlen(p, m) : 0);
+    } else {
+        bam_put32(str, -1);
+        bam_put32(str, -1);
+        bam_put32(str, 0);
+    }
+    kputsn(s->name, l_name + 1, str);
+    bam_put_cigar(opt, p, str, which);
+    ks_resize(str, str->l + l_seq + ((l_seq + 1) >> 1) + 1);
+    for (int i = 0; i < l_seq; i += 2) {
+        int c0 = p->is_rev ? s->seq[qe - 1 - i] : s->seq[qb + i], c1 = 0;
+        c0 = p->is_rev && c0 < 4 ? 3 - c0 : c0;
+        if (i + 1 < l_seq) {
+            c1 = p->is_rev ? s->seq[qe - 2 - i] : s->seq[qb + i + 1];
+            c1 = nt2bam[p->is_rev && c1 < 4 ? 3 - c1 : c1];
+        }
+        str->s[str->l++] = nt2bam[c0] << 4 | c1;
+    }
+    for (int i = 0; i < l_seq; ++i) {
+        str->s[str->l++] = s->qual ? (p->is_rev ? s->qual[qe - 1 - i] : s->qual[qb + i]) - 33 : 0xff;
+    }
+
+    // optional tags, in the same order as in SAM
+    if (p->n_cigar) {
+        bam_put_int_tag(str, "NM", p->NM);
+        bam_put_str_tag(str, "MD", 'Z', (char *)(p->cigar + p->n_cigar), strlen((char *)(p->cigar + p->n_cigar)));
+    }
+    if (m && m->n_cigar) {
+        add_cigar(opt, m, &tmp, which);
+        bam_put_str_tag(str, "MC", 'Z', tmp.s, tmp.l);
+    }
+    if (p->score >= 0) {
+        bam_put_int_tag(str, "AS", p->score);
+    }
+    if (p->sub >= 0) {
+        bam_put_int_tag(str, "XS", p->sub);
+    }
+    if (bwa_rg_id[0]) {
+        bam_put_str_tag(str, "RG", 'Z', bwa_rg_id, strlen(bwa_rg_id));
+    }
+    if (!(p->flag & 0x100)) { // not multi-hit
+        tmp.l = 0;
+        if (mem_aln_sa(bns, n, list, which, &tmp)) {
+            bam_put_str_tag(str, "SA", 'Z', tmp.s, tmp.l);
+        }
+        if (p->alt_sc > 0) {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%.3f", (double)p->score / p->alt_sc); // rounded as in SAM
+            bam_put_float_tag(str, "pa", strtof(buf, 0));
+        }
+    }
+    if (p->XA) {
+        bam_put_str_tag(str, (opt->flag & MEM_F_XB) ? "XB" : "XA", 'Z', p->XA, strlen(p->XA));
+    }
+    if (s->comment) {
+        bam_put_text_tags(str, s->comment);
+    }
+    if ((opt->flag & MEM_F_REF_HDR) && p->rid >= 0 && bns->anns[p->rid].anno != 0 && bns->anns[p->rid].anno[0] != 0) {
+        size_t l = str->l;
+        bam_put_str_tag(str, "XR", 'Z', bns->anns[p->rid].anno, strlen(bns->anns[p->rid].anno));
+        for (size_t i = l + 3; i < str->l; ++i) { // replace TAB in the comment to SPACE
+            if (str->s[i] == '\t') {
+                str->s[i] = ' ';
+            }
+        }
+    }
+    free(tmp.s);
+    l_seq = str->l - st - 4;
+    str->s[st] = l_seq, str->s[st + 1] = l_seq >> 8, str->s[st + 2] = l_seq >> 16, str->s[st + 3] = l_seq >> 24;
+}
+
 /************************
  * Integrated interface *
  ************************/
@@ -1495,6 +2190,9 @@ void mem_reg2sam(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac,
         }
         free(aa.a);
     }
+    if (opt->flag & MEM_F_BAM) { // a zero block_size ends the records of this read
+        kputsn("\0\0\0\0", 4, &str);
+    }
     s->sam = str.s;
     if (XA) {
         for (int k = 0; k < a->n; ++k) {
@@ -1504,6 +2202,39 @@ void mem_reg2sam(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac,
     }
 }
 
+// 种子链的生成及筛选；chaining part of mem_align1_core(). If $intv is not NULL, it holds the SMEMs of $seq
+static mem_chain_v mem_align1_chain(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int l_seq, char *seq, void *buf, const bwtintv_v *intv) {
+    for (int i = 0; i < l_seq; ++i) { // convert to 2-bit encoding if we have not done so
+        seq[i] = seq[i] < 4 ? seq[i] : nst_nt4_table[(int)seq[i]];
+    }
+
+    mem_chain_v chn = intv ? mem_chain_intv(opt, bwt, bns, l_seq, intv) : mem_chain(opt, bwt, bns, l_seq, (uint8_t *)seq, buf);
+    chn.n = mem_chain_flt(opt, chn.n, chn.a);
+    mem_flt_chained_seeds(opt, bns, pac, l_seq, (uint8_t *)seq, chn.n, chn.a);
+    if (bwa_verbose >= 4) {
+        mem_print_chain(bns, &chn);
+    }
+    return chn;
+}
+
+// 去重及标记alt；the part of mem_align1_core() after extension
+static void mem_align1_finish(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, char *seq, mem_alnreg_v *regs) {
+    regs->n = mem_sort_dedup_patch(opt, bns, pac, (uint8_t *)seq, regs->n, regs->a);
+    if (bwa_verbose >= 4) {
+        err_printf("* %ld chains remain after removing duplicated chains\n", regs->n);
+        for (int i = 0; i < regs->n; ++i) {
+            mem_alnreg_t *p = &regs->a[i];
+            printf("** %d, [%d,%d) <=> [%ld,%ld)\n", p->score, p->qb, p->qe, (long)p->rb, (long)p->re);
+        }
+    }
+    for (int i = 0; i < regs->n; ++i) {
+        mem_alnreg_t *p = &regs->a[i];
+        if (p->rid >= 0 && bns->anns[p->rid].is_alt) {
+            p->is_alt = 1;
+        }
+    }
+}
+
 /**
  * ktf_worker worker1的入口函数，确定reads匹配到reference上的位置信息
  * @param opt 程序运行的参数
@@ -1516,16 +2247,7 @@ void mem_reg2sam(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac,
  * @return
  */
 mem_alnreg_v mem_align1_core(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int l_seq, char *seq, void *buf) {
-    for (int i = 0; i < l_seq; ++i) { // convert to 2-bit encoding if we have not done so
-        seq[i] = seq[i] < 4 ? seq[i] : nst_nt4_table[(int)seq[i]];
-    }
-
-    mem_chain_v chn = mem_chain(opt, bwt, bns, l_seq, (uint8_t *)seq, buf);
-    chn.n = mem_chain_flt(opt, chn.n, chn.a);
-    mem_flt_chained_seeds(opt, bns, pac, l_seq, (uint8_t *)seq, chn.n, chn.a);
-    if (bwa_verbose >= 4) {
-        mem_print_chain(bns, &chn);
-    }
+    mem_chain_v chn = mem_align1_chain(opt, bwt, bns, pac, l_seq, seq, buf, 0);
 
     mem_alnreg_v regs;
     kv_init(regs);
@@ -1538,20 +2260,7 @@ mem_alnreg_v mem_align1_core(const mem_opt_t *opt, const bwt_t *bwt, const bntse
         free(chn.a[i].seeds);
     }
     free(chn.a);
-    regs.n = mem_sort_dedup_patch(opt, bns, pac, (uint8_t *)seq, regs.n, regs.a);
-    if (bwa_verbose >= 4) {
-        err_printf("* %ld chains remain after removing duplicated chains\n", regs.n);
-        for (int i = 0; i < regs.n; ++i) {
-            mem_alnreg_t *p = &regs.a[i];
-            printf("** %d, [%d,%d) <=> [%ld,%ld)\n", p->score, p->qb, p->qe, (long)p->rb, (long)p->re);
-        }
-    }
-    for (int i = 0; i < regs.n; ++i) {
-        mem_alnreg_t *p = &regs.a[i];
-        if (p->rid >= 0 && bns->anns[p->rid].is_alt) {
-            p->is_alt = 1;
-        }
-    }
+    mem_align1_finish(opt, bns, pac, seq, &regs);
     return regs;
 }
 
@@ -1660,9 +2369,14 @@ typedef struct {
     const uint8_t *pac;
     const mem_pestat_t *pes;
     smem_aux_t **aux;
+    void *pool;
     bseq1_t *seqs;
     mem_alnreg_v *regs;
     int64_t n_processed;
+    // for MEM_F_BATCHEXT
+    struct mem_rdext_s *rx;
+    ksw_extjob_t *jobs;
+    int n_seqs, *act, n_jobs, slice;
 } worker_t;
 
 /**
@@ -1694,7 +2408,7 @@ static void worker1(void *data, int i, int tid) {
 }
 
 static void worker2(void *data, int i, int tid) {
-    extern int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2]);
+    extern int mem_sam_pe2(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2], int rescued);
     worker_t *w = (worker_t *)data;
     if (!(w->opt->flag & MEM_F_PE)) {
         if (bwa_verbose >= 4) {
@@ -1710,12 +2424,185 @@ static void worker2(void *data, int i, int tid) {
         if (bwa_verbose >= 4) {
             printf("=====> Finalizing read pair '%s' <=====\n", w->seqs[i << 1 | 0].name);
         }
-        mem_sam_pe(w->opt, w->bns, w->pac, w->pes, (w->n_processed >> 1) + i, &w->seqs[i << 1], &w->regs[i << 1]);
+        mem_sam_pe2(w->opt, w->bns, w->pac, w->pes, (w->n_processed >> 1) + i, &w->seqs[i << 1], &w->regs[i << 1], w->opt->flag & MEM_F_BATCHEXT); // see mem_process_seqs2()
         free(w->regs[i << 1 | 0].a);
         free(w->regs[i << 1 | 1].a);
     }
 }
 
+// worker1 followed by worker2, for when nothing has to be learned from the whole batch in between
+static void worker12(void *data, int i, int tid) {
+    worker1(data, i, tid);
+    worker2(data, i, tid);
+}
+
+/*********************************
+ * Batched extension (-z option) *
+ *********************************/
+
+/* With MEM_F_BATCHEXT, worker1 is split into three passes over the batch:
+ * chaining, extension and worker1's final deduplication. In the chaining
+ * pass, the SMEMs of MEM_SMEM_BATCH reads are found together with
+ * mem_collect_intv_batch(). In the extension pass, each read advances its
+ * mem_ext_t to the next ksw_extend2() job; jobs from all reads are then
+ * collected and run by ksw_extend2_batch(). This is repeated until too few
+ * jobs are left for batching to pay off. */
+
+#define MEM_SMEM_BATCH 32 // number of reads searched in lockstep
+#define MEM_BATCH_MIN  64 // per thread
+
+typedef struct mem_rdext_s {
+    mem_chain_v chn;
+    int i;         // the chain being extended
+    mem_ext_t ext;
+} mem_rdext_t;
+
+// advance read $i to its next extension job; return 0 if all chains have been extended
+static int mem_rdext_next(const worker_t *w, int i) {
+    mem_rdext_t *r = &w->rx[i];
+    while (r->i < r->chn.n) {
+        if (mem_ext_next(&r->ext)) {
+            return 1;
+        }
+        free(r->chn.a[r->i].seeds);
+        if (++r->i < r->chn.n) {
+            mem_ext_init(&r->ext, w->opt, w->bns, w->pac, w->seqs[i].l_seq, (uint8_t *)w->seqs[i].seq, &r->chn.a[r->i], &w->regs[i]);
+        }
+    }
+    return 0;
+}
+
+static void worker_chain(void *data, int b, int tid) {
+    worker_t *w = (worker_t *)data;
+    smem_aux_t *aux = w->aux[tid];
+    int i, st = b * MEM_SMEM_BATCH, n = w->n_seqs - st < MEM_SMEM_BATCH ? w->n_seqs - st : MEM_SMEM_BATCH;
+    for (i = st; i < st + n; ++i) { // convert to 2-bit encoding
+        bseq1_t *s = &w->seqs[i];
+        for (int j = 0; j < s->l_seq; ++j) {
+            s->seq[j] = s->seq[j] < 4 ? s->seq[j] : nst_nt4_table[(int)s->seq[j]];
+        }
+    }
+    mem_collect_intv_batch(w->opt, w->bwt, n, &w->seqs[st], aux);
+    for (i = st; i < st + n; ++i) {
+        mem_rdext_t *r = &w->rx[i];
+        r->chn = mem_align1_chain(w->opt, w->bwt, w->bns, w->pac, w->seqs[i].l_seq, w->seqs[i].seq, aux, &aux->bs[i - st].mem);
+        r->i = 0;
+        kv_init(w->regs[i]);
+        if (r->chn.n > 0) {
+            mem_ext_init(&r->ext, w->opt, w->bns, w->pac, w->seqs[i].l_seq, (uint8_t *)w->seqs[i].seq, &r->chn.a[0], &w->regs[i]);
+        }
+    }
+}
+
+static void worker_ext_next(void *data, int j, int tid) {
+    worker_t *w = (worker_t *)data;
+    if (!mem_rdext_next(w, w->act[j])) {
+        w->act[j] = -1;
+    }
+}
+
+static void worker_ext_batch(void *data, int j, int tid) {
+    worker_t *w = (worker_t *)data;
+    const mem_opt_t *opt = w->opt;
+    int st = j * w->slice, n = w->n_jobs - st < w->slice ? w->n_jobs - st : w->slice;
+    ksw_extend2_batch(n, &w->jobs[st], 5, opt->mat, opt->o_del, opt->e_del, opt->o_ins, opt->e_ins, opt->zdrop);
+}
+
+// extend the remaining chains one job at a time
+static void worker_ext_drain(void *data, int j, int tid) {
+    worker_t *w = (worker_t *)data;
+    const mem_opt_t *opt = w->opt;
+    int i = w->act[j];
+    do {
+        ksw_extjob_t *p = &w->rx[i].ext.job;
+        p->score = ksw_extend2(p->qlen, p->query, p->tlen, p->target, 5, opt->mat, opt->o_del, opt->e_del, opt->o_ins,
+            opt->e_ins, p->w, p->end_bonus, opt->zdrop, p->h0, &p->qle, &p->tle, &p->gtle, &p->gscore, &p->max_off);
+    } while (mem_rdext_next(w, i));
+}
+
+static void worker_finish(void *data, int i, int tid) {
+    worker_t *w = (worker_t *)data;
+    free(w->rx[i].chn.a);
+    mem_align1_finish(w->opt, w->bns, w->pac, w->seqs[i].seq, &w->regs[i]);
+}
+
+static void mem_align_batch(worker_t *w, int n) {
+    extern void kt_forpool(void *_fp, void (*func)(void *, int, int), void *data, int n);
+    const mem_opt_t *opt = w->opt;
+    int i, k, n_act, n_slices;
+    w->rx = malloc(n * sizeof(mem_rdext_t));
+    w->act = malloc(n * sizeof(int));
+    w->jobs = malloc(n * sizeof(ksw_extjob_t));
+    w->n_seqs = n;
+    kt_forpool(w->pool, worker_chain, w, (n + MEM_SMEM_BATCH - 1) / MEM_SMEM_BATCH);
+    for (i = 0; i < n; ++i) {
+        w->act[i] = i;
+    }
+    for (n_act = n; n_act > 0;) {
+        kt_forpool(w->pool, worker_ext_next, w, n_act);
+        for (i = k = 0; i < n_act; ++i) { // keep reads with a pending job
+            if (w->act[i] >= 0) {
+                w->act[k++] = w->act[i];
+            }
+        }
+        n_act = k;
+        if (n_act < opt->n_threads * MEM_BATCH_MIN) {
+            kt_forpool(w->pool, worker_ext_drain, w, n_act);
+            break;
+        }
+        for (i = 0; i < n_act; ++i) {
+            w->jobs[i] = w->rx[w->act[i]].ext.job;
+        }
+        w->n_jobs = n_act;
+        n_slices = opt->n_threads > 1 ? opt->n_threads << 2 : 1;
+        w->slice = (n_act + n_slices - 1) / n_slices;
+        kt_forpool(w->pool, worker_ext_batch, w, (n_act + w->slice - 1) / w->slice);
+        for (i = 0; i < n_act; ++i) {
+            w->rx[w->act[i]].ext.job = w->jobs[i];
+        }
+    }
+    kt_forpool(w->pool, worker_finish, w, n);
+    free(w->rx);
+    free(w->act);
+    free(w->jobs);
+}
+
+struct mem_tpool_s {
+    void *pool;
+    int n_threads;
+    smem_aux_t **aux; // one per thread, kept across batches
+};
+
+mem_tpool_t *mem_tpool_init(int n_threads, int pin) {
+    extern void *kt_forpool_init(int n_threads, int pin);
+    mem_tpool_t *tp = calloc(1, sizeof(mem_tpool_t));
+    tp->n_threads = n_threads > 1 ? n_threads : 1;
+    tp->pool = kt_forpool_init(tp->n_threads, pin);
+    tp->aux = malloc(tp->n_threads * sizeof(smem_aux_t *));
+    for (int i = 0; i < tp->n_threads; ++i) {
+        tp->aux[i] = smem_aux_init();
+    }
+    return tp;
+}
+
+void mem_tpool_destroy(mem_tpool_t *tp) {
+    extern void kt_forpool_destroy(void *_fp);
+    if (tp == 0) {
+        return;
+    }
+    kt_forpool_destroy(tp->pool);
+    for (int i = 0; i < tp->n_threads; ++i) {
+        smem_aux_destroy(tp->aux[i]);
+    }
+    free(tp->aux);
+    free(tp);
+}
+
+void mem_tpool_for(mem_tpool_t *tp, void (*func)(void *, int, int), void *data, int n) {
+    extern void kt_forpool(void *_fp, void (*func)(void *, int, int), void *data, int n);
+    kt_forpool(tp->pool, func, data, n);
+}
+
 //mem处理seqs的比对执行过程
 /**
  * 执行mem比对算法执行的逻辑控制函数
@@ -1727,9 +2614,12 @@ static void worker2(void *data, int i, int tid) {
  * @param n n_seqs的索引
  * @param seqs n_seqs中对于n位置的query指针
  * @param pes0
+ * @param pes_out 不为NULL时，输出本批使用的插入片段分布(仅PE模式)
+ * @param tp 线程池，线程数应为opt->n_threads；可由同时进行的多个调用共享
  */
-void mem_process_seqs(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int64_t n_processed, int n, bseq1_t *seqs, const mem_pestat_t *pes0) {
-    extern void kt_for(int n_threads, void (*func)(void *, int, int), void *data, int n);
+void mem_process_seqs2(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int64_t n_processed, int n, bseq1_t *seqs, const mem_pestat_t *pes0, mem_pestat_t *pes_out, mem_tpool_t *tp) {
+    extern void kt_forpool(void *_fp, void (*func)(void *, int, int), void *data, int n);
+    extern void mem_matesw_batch(void *pool, const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], int n, bseq1_t *seqs, mem_alnreg_v *regs);
     double ctime = cputime();
     double rtime = realtime();
     global_bns = bns;
@@ -1744,26 +2634,40 @@ void mem_process_seqs(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bn
     w.seqs = seqs;
     w.n_processed = n_processed;
     w.pes = &pes[0];
-    w.aux = malloc(opt->n_threads * sizeof(smem_aux_t));
-    for (int i = 0; i < opt->n_threads; ++i) {
-        w.aux[i] = smem_aux_init();
-    }
-    kt_for(opt->n_threads, worker1, &w, (opt->flag & MEM_F_PE) ? n >> 1 : n); // find mapping positions
-    for (int i = 0; i < opt->n_threads; ++i) {
-        smem_aux_destroy(w.aux[i]);
-    }
-    free(w.aux);
-    if (opt->flag & MEM_F_PE) { // infer insert sizes if not provided
-        if (pes0) {
-            memcpy(pes, pes0, 4 * sizeof(mem_pestat_t)); // if pes0 != NULL, set the insert-size distribution as pes0
+    w.aux = tp->aux;
+    w.pool = tp->pool;
+    if ((opt->flag & MEM_F_PE) && pes0) {
+        memcpy(pes, pes0, 4 * sizeof(mem_pestat_t)); // if pes0 != NULL, set the insert-size distribution as pes0
+    }
+    if (!(opt->flag & MEM_F_BATCHEXT) && (!(opt->flag & MEM_F_PE) || pes0) && bwa_verbose < 4) {
+        // no insert sizes to infer, so each read (pair) is finalized right after it is aligned
+        kt_forpool(w.pool, worker12, &w, (opt->flag & MEM_F_PE) ? n >> 1 : n);
+    } else {
+        if ((opt->flag & MEM_F_BATCHEXT) && bwa_verbose < 4) { // the debugging output would be interleaved across reads
+            mem_align_batch(&w, n);
         } else {
+            kt_forpool(w.pool, worker1, &w, (opt->flag & MEM_F_PE) ? n >> 1 : n); // find mapping positions
+        }
+        if ((opt->flag & MEM_F_PE) && !pes0) { // infer the insert size distribution from data
             mem_pestat(opt, bns->l_pac, n, w.regs, pes);
-        } // otherwise, infer the insert size distribution from data
+        }
+        if ((opt->flag & MEM_F_PE) && (opt->flag & MEM_F_BATCHEXT) && !(opt->flag & MEM_F_NO_RESCUE)) { // mate rescue across pairs; skipped by worker2
+            mem_matesw_batch(w.pool, opt, bns, pac, pes, n >> 1, seqs, w.regs);
+        }
+        kt_forpool(w.pool, worker2, &w, (opt->flag & MEM_F_PE) ? n >> 1 : n); // generate alignment
+    }
+    if ((opt->flag & MEM_F_PE) && pes_out) {
+        memcpy(pes_out, pes, 4 * sizeof(mem_pestat_t));
     }
-    kt_for(opt->n_threads, worker2, &w, (opt->flag & MEM_F_PE) ? n >> 1 : n); // generate alignment
     free(w.regs);
     if (bwa_verbose >= 3) {
         fprintf(stderr, "[M::%s] Processed %d reads in %.3f CPU sec, %.3f real sec\n",
             __func__, n, cputime() - ctime, realtime() - rtime);
     }
 }
+
+void mem_process_seqs(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int64_t n_processed, int n, bseq1_t *seqs, const mem_pestat_t *pes0) {
+    mem_tpool_t *tp = mem_tpool_init(opt->n_threads, 0);
+    mem_process_seqs2(opt, bwt, bns, pac, n_processed, n, seqs, pes0, 0, tp);
+    mem_tpool_destroy(tp);
+}
@@ -37,6 +37,8 @@
 struct __smem_i;
 typedef struct __smem_i smem_i;
 
+typedef struct mem_tpool_s mem_tpool_t;
+
 #define MEM_F_PE        0x2
 #define MEM_F_NOPAIRING 0x4
 #define MEM_F_ALL       0x8
@@ -48,6 +50,8 @@ typedef struct __smem_i smem_i;
 #define MEM_F_PRIMARY5  0x800
 #define MEM_F_KEEP_SUPP_MAPQ 0x1000
 #define MEM_F_XB        0x2000
+#define MEM_F_BATCHEXT  0x4000
+#define MEM_F_BAM       0x8000 // mem_aln2sam() writes BAM records instead of SAM lines
 
 typedef struct {
     // 算法相关参数
@@ -169,6 +173,58 @@ mem_opt_t *mem_opt_init(void);
  */
 void mem_process_seqs(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int64_t n_processed, int n, bseq1_t *seqs, const mem_pestat_t *pes0);
 
+/**
+ * Create worker threads and per-thread buffers to be reused by mem_process_seqs2()
+ *
+ * @param n_threads  number of threads; should be the same as mem_opt_t::n_threads
+ * @param pin        if non-zero, pin the threads to CPUs, filling one NUMA node after another (Linux only)
+ */
+mem_tpool_t *mem_tpool_init(int n_threads, int pin);
+
+void mem_tpool_destroy(mem_tpool_t *tp);
+
+/**
+ * Run func(data, i, tid) for 0 <= i < $n on the threads of $tp
+ */
+void mem_tpool_for(mem_tpool_t *tp, void (*func)(void *, int, int), void *data, int n);
+
+/**
+ * The same as mem_process_seqs(), but run on the threads of $tp instead of
+ * creating new threads for each batch. Concurrent calls may share $tp: their
+ * parallel steps are queued, and a thread that runs out of work in one step
+ * moves on to the next queued step, possibly of another call.
+ *
+ * If $pes_out is not NULL, the insert-size distribution used for the batch
+ * is written to it in the paired-end mode. Passing it as $pes0 to later
+ * batches saves the barrier between finding and pairing the hits.
+ */
+void mem_process_seqs2(const mem_opt_t *opt, const bwt_t *bwt, const bntseq_t *bns, const uint8_t *pac, int64_t n_processed, int n, bseq1_t *seqs, const mem_pestat_t *pes0, mem_pestat_t *pes_out, mem_tpool_t *tp);
+
+typedef struct mem_bamw_s mem_bamw_t;
+
+/**
+ * Open a BGZF-compressed BAM stream and write the BAM header
+ *
+ * @param fp     output stream; not closed by mem_bamw_close()
+ * @param level  zlib compression level; <0 for the default
+ * @param bns    Information of the reference, giving the reference dictionary
+ * @param text   SAM header text, e.g. from bwa_format_sam_hdr()
+ */
+mem_bamw_t *mem_bamw_init(FILE *fp, int level, const bntseq_t *bns, const char *text);
+
+/**
+ * Write the BAM records of a batch, as generated with MEM_F_BAM
+ *
+ * Full BGZF blocks are compressed on the threads of $tp if it is not NULL;
+ * the remainder is kept for the next call.
+ */
+void mem_bamw_write(mem_bamw_t *bw, int n, const bseq1_t *seqs, mem_tpool_t *tp);
+
+/**
+ * Flush the remaining data and write the BGZF EOF marker
+ */
+void mem_bamw_close(mem_bamw_t *bw);
+
 /**
  * Find the aligned regions for one query sequence
  *
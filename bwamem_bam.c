@@ -0,0 +1,160 @@
+/* The MIT License
+
+   Copyright (c) 2018-     Dana-Farber Cancer Institute
+                 2009-2018 Broad Institute, Inc.
+                 2008-2009 Genome Research Ltd. (GRL)
+
+   Permission is hereby granted, free of charge, to any person obtaining
+   a copy of this software and associated documentation files (the
+   "Software"), to deal in the Software without restriction, including
+   without limitation the rights to use, copy, modify, merge, publish,
+   distribute, sublicense, and/or sell copies of the Software, and to
+   permit persons to whom the Software is furnished to do so, subject to
+   the following conditions:
+
+   The above copyright notice and this permission notice shall be
+   included in all copies or substantial portions of the Software.
+
+   THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+   EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+   MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+   NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+   BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+   ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+   CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+   SOFTWARE.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <zlib.h>
+#include "bwamem.h"
+#include "kstring.h"
+#include "utils.h"
+
+#ifdef USE_MALLOC_WRAPPERS
+
+#  include "malloc_wrap.h"
+
+#endif
+
+/*****************************
+ * BGZF-compressed BAM output *
+ *****************************/
+
+#define BAMW_BLOCK 0xff00  // uncompressed bytes per BGZF block, as in htslib
+#define BAMW_MAX   0x10000 // maximum size of a compressed block
+
+struct mem_bamw_s {
+    FILE *fp;
+    int level;
+    kstring_t buf; // data not compressed yet
+};
+
+typedef struct {
+    const uint8_t *in;
+    int l_in, l_out, level;
+    uint8_t out[BAMW_MAX];
+} bamw_block_t;
+
+static inline void bamw_put32(uint8_t *p, uint32_t x) {
+    p[0] = x, p[1] = x >> 8, p[2] = x >> 16, p[3] = x >> 24;
+}
+
+static void bamw_compress(void *data, int i, int tid) {
+    static const uint8_t hdr[18] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 0, 0};
+    bamw_block_t *b = (bamw_block_t *)data + i;
+    z_stream zs;
+    memset(&zs, 0, sizeof(z_stream));
+    if (deflateInit2(&zs, b->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        err_fatal(__func__, "failed to initialize zlib");
+    }
+    zs.next_in = (Bytef *)b->in, zs.avail_in = b->l_in;
+    zs.next_out = b->out + 18, zs.avail_out = BAMW_MAX - 18 - 8;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) { // can't happen for BAMW_BLOCK bytes
+        err_fatal(__func__, "a compressed BGZF block is too large");
+    }
+    b->l_out = 18 + zs.total_out + 8;
+    deflateEnd(&zs);
+    memcpy(b->out, hdr, 18);
+    b->out[16] = (b->l_out - 1) & 0xff, b->out[17] = (b->l_out - 1) >> 8; // BSIZE
+    bamw_put32(b->out + b->l_out - 8, crc32(crc32(0, 0, 0), b->in, b->l_in));
+    bamw_put32(b->out + b->l_out - 4, b->l_in);
+}
+
+// compress and write the full blocks in the buffer, or everything if $all is set
+static void bamw_flush(mem_bamw_t *bw, int all, mem_tpool_t *tp) {
+    int i, n = all ? (bw->buf.l + BAMW_BLOCK - 1) / BAMW_BLOCK : bw->buf.l / BAMW_BLOCK;
+    bamw_block_t *b;
+    if (n == 0) {
+        return;
+    }
+    b = malloc(n * sizeof(bamw_block_t));
+    for (i = 0; i < n; ++i) {
+        b[i].in = (uint8_t *)bw->buf.s + (size_t)i * BAMW_BLOCK;
+        b[i].l_in = bw->buf.l - (size_t)i * BAMW_BLOCK < BAMW_BLOCK ? bw->buf.l - (size_t)i * BAMW_BLOCK : BAMW_BLOCK;
+        b[i].level = bw->level;
+    }
+    if (tp) {
+        mem_tpool_for(tp, bamw_compress, b, n);
+    } else {
+        for (i = 0; i < n; ++i) {
+            bamw_compress(b, i, 0);
+        }
+    }
+    for (i = 0; i < n; ++i) {
+        err_fwrite(b[i].out, 1, b[i].l_out, bw->fp);
+    }
+    if (all) {
+        bw->buf.l = 0;
+    } else {
+        bw->buf.l -= (size_t)n * BAMW_BLOCK;
+        memmove(bw->buf.s, bw->buf.s + (size_t)n * BAMW_BLOCK, bw->buf.l);
+    }
+    free(b);
+}
+
+mem_bamw_t *mem_bamw_init(FILE *fp, int level, const bntseq_t *bns, const char *text) {
+    mem_bamw_t *bw;
+    uint8_t x[4];
+    int i;
+    bw = calloc(1, sizeof(mem_bamw_t));
+    bw->fp = fp;
+    bw->level = level < 0 ? Z_DEFAULT_COMPRESSION : level > 9 ? 9 : level;
+    kputsn("BAM\1", 4, &bw->buf);
+    bamw_put32(x, strlen(text)), kputsn((char *)x, 4, &bw->buf);
+    kputs(text, &bw->buf);
+    bamw_put32(x, bns->n_seqs), kputsn((char *)x, 4, &bw->buf);
+    for (i = 0; i < bns->n_seqs; ++i) {
+        bamw_put32(x, strlen(bns->anns[i].name) + 1), kputsn((char *)x, 4, &bw->buf);
+        kputsn(bns->anns[i].name, strlen(bns->anns[i].name) + 1, &bw->buf);
+        bamw_put32(x, bns->anns[i].len), kputsn((char *)x, 4, &bw->buf);
+    }
+    bamw_flush(bw, 1, 0); // the header in blocks of its own
+    return bw;
+}
+
+void mem_bamw_write(mem_bamw_t *bw, int n, const bseq1_t *seqs, mem_tpool_t *tp) {
+    int i;
+    for (i = 0; i < n; ++i) {
+        const uint8_t *p = (const uint8_t *)seqs[i].sam;
+        uint32_t l;
+        if (p == 0) {
+            continue;
+        }
+        for (; (l = p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24) != 0; p += 4 + l) {
+            kputsn((const char *)p, 4 + l, &bw->buf);
+        }
+    }
+    bamw_flush(bw, 0, tp);
+}
+
+void mem_bamw_close(mem_bamw_t *bw) {
+    static const uint8_t eof[28] = {31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    bamw_flush(bw, 1, 0);
+    err_fwrite(eof, 1, 28, bw->fp);
+    err_fflush(bw->fp);
+    free(bw->buf.s);
+    free(bw);
+}
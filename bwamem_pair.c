@@ -165,10 +165,17 @@ void mem_pestat(const mem_opt_t *opt, int64_t l_pac, int n, const mem_alnreg_v *
     }
 }
 
-int mem_matesw(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], const mem_alnreg_t *a, int l_ms, const uint8_t *ms, mem_alnreg_v *ma) {
-    extern int mem_sort_dedup_patch(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, uint8_t *query, int n, mem_alnreg_t *a);
-    int64_t l_pac = bns->l_pac;
-    int i, r, skip[4], n = 0, rid;
+// the SW of mate rescue in orientation $r
+typedef struct {
+    int r;
+    int64_t rb;        // start of the window on the reference
+    uint8_t *ref;
+    ksw_alnjob_t job;  // job.query==0 if no SW is performed
+} mem_mswjob_t;
+
+// find the orientations in which $ma has no hit consistent with $a; return their number
+static int mem_matesw_skip(int64_t l_pac, const mem_pestat_t pes[4], const mem_alnreg_t *a, const mem_alnreg_v *ma, int skip[4]) {
+    int i, r;
     for (r = 0; r < 4; ++r) {
         skip[r] = pes[r].failed ? 1 : 0;
     }
@@ -179,85 +186,293 @@ int mem_matesw(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, co
             skip[r] = 1;
         }
     }
-    if (skip[0] + skip[1] + skip[2] + skip[3] == 4) {
+    return 4 - (skip[0] + skip[1] + skip[2] + skip[3]);
+}
+
+// fetch the window of orientation $r; $rev is the reverse complement of $ms
+static void mem_matesw_init(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], const mem_alnreg_t *a, int l_ms, const uint8_t *ms, const uint8_t *rev, int r, mem_mswjob_t *p) {
+    int64_t l_pac = bns->l_pac, rb, re;
+    int is_rev = (r >> 1 != (r & 1)); // whether to reverse complement the mate
+    int is_larger = !(r >> 1); // whether the mate has larger coordinate
+    int rid = -1;
+    if (!is_rev) {
+        rb = is_larger ? a->rb + pes[r].low : a->rb - pes[r].high;
+        re = (is_larger ? a->rb + pes[r].high : a->rb - pes[r].low) + l_ms; // if on the same strand, end position should be larger to make room for the seq length
+    } else {
+        rb = (is_larger ? a->rb + pes[r].low : a->rb - pes[r].high) - l_ms; // similarly on opposite strands
+        re = is_larger ? a->rb + pes[r].high : a->rb - pes[r].low;
+    }
+    if (rb < 0) {
+        rb = 0;
+    }
+    if (re > l_pac << 1) {
+        re = l_pac << 1;
+    }
+    p->r = r;
+    p->ref = 0;
+    if (rb < re) {
+        p->ref = bns_fetch_seq(bns, pac, &rb, (rb + re) >> 1, &re, &rid);
+    }
+    p->rb = rb;
+    memset(&p->job, 0, sizeof(ksw_alnjob_t));
+    if (a->rid == rid && re - rb >= opt->min_seed_len) { // no funny things happening
+        p->job.qlen = l_ms, p->job.query = is_rev ? rev : ms;
+        p->job.tlen = re - rb, p->job.target = p->ref;
+        p->job.xtra = KSW_XSUBO | KSW_XSTART | (l_ms * opt->a < 250 ? KSW_XBYTE : 0) | (opt->min_seed_len * opt->a);
+    }
+}
+
+// add the hit found by job $p to $ma, keeping $ma sorted by score
+static void mem_matesw_add(const mem_opt_t *opt, int64_t l_pac, const mem_alnreg_t *a, const mem_mswjob_t *p, mem_alnreg_v *ma) {
+    const kswr_t *aln = &p->job.r;
+    int i, tmp, l_ms = p->job.qlen, is_rev = (p->r >> 1 != (p->r & 1));
+    mem_alnreg_t b;
+    memset(&b, 0, sizeof(mem_alnreg_t));
+    if (aln->score >= opt->min_seed_len && aln->qb >= 0) { // something goes wrong if aln.qb < 0
+        b.rid = a->rid;
+        b.is_alt = a->is_alt;
+        b.qb = is_rev ? l_ms - (aln->qe + 1) : aln->qb;
+        b.qe = is_rev ? l_ms - aln->qb : aln->qe + 1;
+        b.rb = is_rev ? (l_pac << 1) - (p->rb + aln->te + 1) : p->rb + aln->tb;
+        b.re = is_rev ? (l_pac << 1) - (p->rb + aln->tb) : p->rb + aln->te + 1;
+        b.score = aln->score;
+        b.csub = aln->score2;
+        b.secondary = -1;
+        b.seedcov = (b.re - b.rb < b.qe - b.qb ? b.re - b.rb : b.qe - b.qb) >> 1;
+        kv_push(mem_alnreg_t, *ma, b); // make room for a new element
+        // move b s.t. ma is sorted
+        for (i = 0; i < ma->n - 1; ++i) { // find the insertion point
+            if (ma->a[i].score < b.score) {
+                break;
+            }
+        }
+        tmp = i;
+        for (i = ma->n - 1; i > tmp; --i) {
+            ma->a[i] = ma->a[i - 1];
+        }
+        ma->a[i] = b;
+    }
+}
+
+// add the hits of the $n_job orientations tried for anchor $a; return the number of SW performed
+static int mem_matesw_finish(const mem_opt_t *opt, int64_t l_pac, const mem_alnreg_t *a, int n_job, mem_mswjob_t *jobs, mem_alnreg_v *ma) {
+    extern int mem_sort_dedup_patch(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, uint8_t *query, int n, mem_alnreg_t *a);
+    int k, n = 0;
+    for (k = 0; k < n_job; ++k) {
+        if (jobs[k].job.query) {
+            mem_matesw_add(opt, l_pac, a, &jobs[k], ma);
+            ++n;
+        }
+        if (n) {
+            ma->n = mem_sort_dedup_patch(opt, 0, 0, 0, ma->n, ma->a);
+        }
+        free(jobs[k].ref);
+    }
+    return n;
+}
+
+static inline void mem_revcomp(int l, const uint8_t *s, uint8_t *rev) {
+    for (int i = 0; i < l; ++i) {
+        rev[l - 1 - i] = s[i] < 4 ? 3 - s[i] : 4;
+    }
+}
+
+int mem_matesw(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], const mem_alnreg_t *a, int l_ms, const uint8_t *ms, mem_alnreg_v *ma) {
+    mem_mswjob_t jobs[4];
+    uint8_t *rev;
+    int r, skip[4], n_job = 0, n;
+    if (mem_matesw_skip(bns->l_pac, pes, a, ma, skip) == 0) {
         return 0;
     } // consistent pair exist; no need to perform SW
-    for (r = 0; r < 4; ++r) {
-        int is_rev, is_larger;
-        uint8_t *seq, *rev = 0, *ref = 0;
-        int64_t rb, re;
-        if (skip[r]) {
-            continue;
+    rev = malloc(l_ms); // this is the reverse complement of $ms
+    mem_revcomp(l_ms, ms, rev);
+    for (r = 0; r < 4; ++r) { // the windows do not depend on the hits added to $ma
+        if (!skip[r]) {
+            mem_matesw_init(opt, bns, pac, pes, a, l_ms, ms, rev, r, &jobs[n_job++]);
+        }
+    }
+    for (r = 0; r < n_job; ++r) {
+        ksw_alnjob_t *p = &jobs[r].job;
+        if (p->query) {
+            p->r = ksw_align2(p->qlen, (uint8_t *)p->query, p->tlen, (uint8_t *)p->target, 5, opt->mat, opt->o_del, opt->e_del, opt->o_ins, opt->e_ins, p->xtra, 0);
         }
-        is_rev = (r >> 1 != (r & 1)); // whether to reverse complement the mate
-        is_larger = !(r >> 1); // whether the mate has larger coordinate
-        if (is_rev) {
-            rev = malloc(l_ms); // this is the reverse complement of $ms
-            for (i = 0; i < l_ms; ++i) {
-                rev[l_ms - 1 - i] = ms[i] < 4 ? 3 - ms[i] : 4;
+    }
+    n = mem_matesw_finish(opt, bns->l_pac, a, n_job, jobs, ma);
+    free(rev);
+    return n;
+}
+
+/***************************************
+ * Mate rescue across read pairs (-z) *
+ ***************************************/
+
+/* mem_matesw_batch() does the mate rescue of mem_sam_pe() for all pairs of a
+ * batch in rounds. In a round, each pair sets up the SW of its next anchor in
+ * all orientations to be tried, the SW of all pairs are run together by
+ * ksw_align2_batch() and each pair then adds its hits as mem_matesw() does.
+ * Only one anchor per pair is done in a round because whether an orientation
+ * is to be tried depends on the hits added for the previous anchors. When too
+ * few pairs are left to fill the lanes, they are finished one at a time. */
+
+#define MEM_RESCUE_MIN 256 // min number of SW per call to ksw_align2_batch()
+
+typedef struct {
+    mem_alnreg_v b[2];  // anchors, as in mem_sam_pe()
+    int i, j;           // the current anchor is b[i].a[j]
+    uint8_t *rev[2];    // reverse complement of each end, computed once
+    int n_job;
+    mem_mswjob_t jobs[4];
+} mem_rescue_t;
+
+typedef struct {
+    const mem_opt_t *opt;
+    const bntseq_t *bns;
+    const uint8_t *pac;
+    const mem_pestat_t *pes;
+    bseq1_t *seqs;
+    mem_alnreg_v *regs;
+    mem_rescue_t *rs;
+    int *act, n_jobs, slice;
+    ksw_alnjob_t *jobs;
+} mem_rescue_aux_t;
+
+static void mem_rescue_init(const mem_opt_t *opt, const mem_alnreg_v a[2], mem_rescue_t *p) {
+    int i, j;
+    memset(p, 0, sizeof(mem_rescue_t));
+    for (i = 0; i < 2; ++i) {
+        for (j = 0; j < a[i].n; ++j) {
+            if (a[i].a[j].score >= a[i].a[0].score - opt->pen_unpaired) {
+                kv_push(mem_alnreg_t, p->b[i], a[i].a[j]);
             }
-            seq = rev;
-        } else {
-            seq = (uint8_t *) ms;
         }
-        if (!is_rev) {
-            rb = is_larger ? a->rb + pes[r].low : a->rb - pes[r].high;
-            re = (is_larger ? a->rb + pes[r].high : a->rb - pes[r].low) + l_ms; // if on the same strand, end position should be larger to make room for the seq length
-        } else {
-            rb = (is_larger ? a->rb + pes[r].low : a->rb - pes[r].high) - l_ms; // similarly on opposite strands
-            re = is_larger ? a->rb + pes[r].high : a->rb - pes[r].low;
-        }
-        if (rb < 0) {
-            rb = 0;
-        }
-        if (re > l_pac << 1) {
-            re = l_pac << 1;
-        }
-        if (rb < re) {
-            ref = bns_fetch_seq(bns, pac, &rb, (rb + re) >> 1, &re, &rid);
-        }
-        if (a->rid == rid && re - rb >= opt->min_seed_len) { // no funny things happening
-            kswr_t aln;
-            mem_alnreg_t b;
-            int tmp, xtra = KSW_XSUBO | KSW_XSTART | (l_ms * opt->a < 250 ? KSW_XBYTE : 0) | (opt->min_seed_len * opt->a);
-            aln = ksw_align2(l_ms, seq, re - rb, ref, 5, opt->mat, opt->o_del, opt->e_del, opt->o_ins, opt->e_ins, xtra, 0);
-            memset(&b, 0, sizeof(mem_alnreg_t));
-            if (aln.score >= opt->min_seed_len && aln.qb >= 0) { // something goes wrong if aln.qb < 0
-                b.rid = a->rid;
-                b.is_alt = a->is_alt;
-                b.qb = is_rev ? l_ms - (aln.qe + 1) : aln.qb;
-                b.qe = is_rev ? l_ms - aln.qb : aln.qe + 1;
-                b.rb = is_rev ? (l_pac << 1) - (rb + aln.te + 1) : rb + aln.tb;
-                b.re = is_rev ? (l_pac << 1) - (rb + aln.tb) : rb + aln.te + 1;
-                b.score = aln.score;
-                b.csub = aln.score2;
-                b.secondary = -1;
-                b.seedcov = (b.re - b.rb < b.qe - b.qb ? b.re - b.rb : b.qe - b.qb) >> 1;
-//				printf("*** %d, [%lld,%lld], %d:%d, (%lld,%lld), (%lld,%lld) == (%lld,%lld)\n", aln.score, rb, re, is_rev, is_larger, a->rb, a->re, ma->a[0].rb, ma->a[0].re, b.rb, b.re);
-                kv_push(mem_alnreg_t, *ma, b); // make room for a new element
-                // move b s.t. ma is sorted
-                for (i = 0; i < ma->n - 1; ++i) { // find the insertion point
-                    if (ma->a[i].score < b.score) {
-                        break;
-                    }
-                }
-                tmp = i;
-                for (i = ma->n - 1; i > tmp; --i) {
-                    ma->a[i] = ma->a[i - 1];
+    }
+}
+
+// add the hits of the current anchor of pair $k and set up the SW of the next one; return 0 if the pair is done
+static int mem_rescue_next(const mem_rescue_aux_t *w, int k) {
+    const mem_opt_t *opt = w->opt;
+    mem_rescue_t *p = &w->rs[k];
+    bseq1_t *s = &w->seqs[k << 1];
+    mem_alnreg_v *a = &w->regs[k << 1];
+    if (p->n_job) {
+        mem_matesw_finish(opt, w->bns->l_pac, &p->b[p->i].a[p->j], p->n_job, p->jobs, &a[!p->i]);
+        p->n_job = 0;
+        ++p->j;
+    }
+    for (; p->i < 2; ++p->i, p->j = 0) {
+        int i = p->i, l_ms = s[!i].l_seq;
+        const uint8_t *ms = (const uint8_t *)s[!i].seq;
+        for (; p->j < p->b[i].n && p->j < opt->max_matesw; ++p->j) {
+            const mem_alnreg_t *x = &p->b[i].a[p->j];
+            int r, t, skip[4];
+            if (mem_matesw_skip(w->bns->l_pac, w->pes, x, &a[!i], skip) == 0) {
+                continue;
+            }
+            if (p->rev[!i] == 0) {
+                p->rev[!i] = malloc(l_ms);
+                mem_revcomp(l_ms, ms, p->rev[!i]);
+            }
+            for (r = 0; r < 4; ++r) {
+                if (!skip[r]) {
+                    mem_matesw_init(opt, w->bns, w->pac, w->pes, x, l_ms, ms, p->rev[!i], r, &p->jobs[p->n_job++]);
                 }
-                ma->a[i] = b;
             }
-            ++n;
+            for (t = 0; t < p->n_job && p->jobs[t].job.query == 0; ++t) {
+            }
+            if (t < p->n_job) {
+                return 1;
+            }
+            mem_matesw_finish(opt, w->bns->l_pac, x, p->n_job, p->jobs, &a[!i]); // no SW; just free the windows
+            p->n_job = 0;
         }
-        if (n) {
-            ma->n = mem_sort_dedup_patch(opt, 0, 0, 0, ma->n, ma->a);
+    }
+    free(p->b[0].a);
+    free(p->b[1].a);
+    free(p->rev[0]);
+    free(p->rev[1]);
+    return 0;
+}
+
+static void worker_rescue_next(void *data, int j, int tid) {
+    mem_rescue_aux_t *w = (mem_rescue_aux_t *)data;
+    if (!mem_rescue_next(w, w->act[j])) {
+        w->act[j] = -1;
+    }
+}
+
+static void worker_rescue_batch(void *data, int j, int tid) {
+    mem_rescue_aux_t *w = (mem_rescue_aux_t *)data;
+    const mem_opt_t *opt = w->opt;
+    int st = j * w->slice, n = w->n_jobs - st < w->slice ? w->n_jobs - st : w->slice;
+    ksw_align2_batch(n, &w->jobs[st], 5, opt->mat, opt->o_del, opt->e_del, opt->o_ins, opt->e_ins);
+}
+
+// rescue the remaining anchors of a pair one at a time
+static void worker_rescue_drain(void *data, int j, int tid) {
+    mem_rescue_aux_t *w = (mem_rescue_aux_t *)data;
+    const mem_opt_t *opt = w->opt;
+    int k = w->act[j];
+    mem_rescue_t *p = &w->rs[k];
+    do {
+        for (int t = 0; t < p->n_job; ++t) {
+            ksw_alnjob_t *q = &p->jobs[t].job;
+            if (q->query) {
+                q->r = ksw_align2(q->qlen, (uint8_t *)q->query, q->tlen, (uint8_t *)q->target, 5, opt->mat, opt->o_del, opt->e_del, opt->o_ins, opt->e_ins, q->xtra, 0);
+            }
+        }
+    } while (mem_rescue_next(w, k));
+}
+
+void mem_matesw_batch(void *pool, const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], int n, bseq1_t *seqs, mem_alnreg_v *regs) {
+    extern void kt_forpool(void *_fp, void (*func)(void *, int, int), void *data, int n);
+    mem_rescue_aux_t w;
+    int i, k, t, n_act, n_slices;
+    w.opt = opt, w.bns = bns, w.pac = pac, w.pes = pes;
+    w.seqs = seqs, w.regs = regs;
+    w.rs = malloc(n * sizeof(mem_rescue_t));
+    w.act = malloc(n * sizeof(int));
+    w.jobs = malloc(4 * n * sizeof(ksw_alnjob_t));
+    for (i = 0; i < n; ++i) {
+        mem_rescue_init(opt, &regs[i << 1], &w.rs[i]);
+        w.act[i] = i;
+    }
+    for (n_act = n; n_act > 0;) {
+        kt_forpool(pool, worker_rescue_next, &w, n_act);
+        for (i = k = 0; i < n_act; ++i) { // keep pairs with pending SW
+            if (w.act[i] >= 0) {
+                w.act[k++] = w.act[i];
+            }
         }
-        if (rev) {
-            free(rev);
+        n_act = k;
+        if (n_act < MEM_RESCUE_MIN) {
+            kt_forpool(pool, worker_rescue_drain, &w, n_act);
+            break;
+        }
+        for (i = k = 0; i < n_act; ++i) {
+            mem_rescue_t *p = &w.rs[w.act[i]];
+            for (t = 0; t < p->n_job; ++t) {
+                if (p->jobs[t].job.query) {
+                    w.jobs[k++] = p->jobs[t].job;
+                }
+            }
+        }
+        w.n_jobs = k;
+        n_slices = opt->n_threads > 1 ? opt->n_threads << 2 : 1;
+        w.slice = (k + n_slices - 1) / n_slices;
+        w.slice = w.slice > MEM_RESCUE_MIN ? w.slice : MEM_RESCUE_MIN;
+        kt_forpool(pool, worker_rescue_batch, &w, (k + w.slice - 1) / w.slice);
+        for (i = k = 0; i < n_act; ++i) {
+            mem_rescue_t *p = &w.rs[w.act[i]];
+            for (t = 0; t < p->n_job; ++t) {
+                if (p->jobs[t].job.query) {
+                    p->jobs[t].job.r = w.jobs[k++].r;
+                }
+            }
         }
-        free(ref);
     }
-    return n;
+    free(w.rs);
+    free(w.act);
+    free(w.jobs);
 }
 
 int mem_pair(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], bseq1_t s[2], mem_alnreg_v a[2], int id, int *sub, int *n_sub, int z[2], int n_pri[2]) {
@@ -345,7 +560,11 @@ void mem_reorder_primary5(int T, mem_alnreg_v *a);
 
 #define raw_mapq(diff, a) ((int)(6.02 * (diff) / (a) + .499))
 
-int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2]) {
+/**
+ * The same as mem_sam_pe(), but the mate rescue is skipped if $rescued is
+ * non-zero, e.g. when it has been done by mem_matesw_batch()
+ */
+int mem_sam_pe2(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2], int rescued) {
     extern int mem_mark_primary_se(const mem_opt_t *opt, int n, mem_alnreg_t *a, int64_t id);
     extern int mem_approx_mapq_se(const mem_opt_t *opt, const mem_alnreg_t *a);
     extern void mem_reg2sam(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, bseq1_t *s, mem_alnreg_v *a, int extra_flag, const mem_aln_t *m);
@@ -360,7 +579,7 @@ int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, co
     memset(h, 0, sizeof(mem_aln_t) * 2);
     memset(g, 0, sizeof(mem_aln_t) * 2);
     n_aa[0] = n_aa[1] = 0;
-    if (!(opt->flag & MEM_F_NO_RESCUE)) { // then perform SW for the best alignment
+    if (!rescued && !(opt->flag & MEM_F_NO_RESCUE)) { // then perform SW for the best alignment
         mem_alnreg_v b[2];
         kv_init(b[0]);
         kv_init(b[1]);
@@ -480,10 +699,17 @@ int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, co
         for (i = 0; i < n_aa[0]; ++i) {
             mem_aln2sam(opt, bns, &str, &s[0], n_aa[0], aa[0], i, &h[1]);
         } // write read1 hits
-        s[0].sam = strdup(str.s);
+        if (opt->flag & MEM_F_BAM) { // a zero block_size ends the records of a read
+            kputsn("\0\0\0\0", 4, &str);
+        }
+        s[0].sam = malloc(str.l + 1);
+        memcpy(s[0].sam, str.s, str.l + 1);
         str.l = 0;
         for (i = 0; i < n_aa[1]; ++i)
             mem_aln2sam(opt, bns, &str, &s[1], n_aa[1], aa[1], i, &h[0]); // write read2 hits
+        if (opt->flag & MEM_F_BAM) {
+            kputsn("\0\0\0\0", 4, &str);
+        }
         s[1].sam = str.s;
         if (strcmp(s[0].name, s[1].name) != 0)
             err_fatal(__func__, "paired reads have different names: \"%s\", \"%s\"\n", s[0].name, s[1].name);
@@ -535,3 +761,7 @@ int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, co
     free(h[1].cigar);
     return n;
 }
+
+int mem_sam_pe(const mem_opt_t *opt, const bntseq_t *bns, const uint8_t *pac, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2]) {
+    return mem_sam_pe2(opt, bns, pac, pes, id, s, a, 0);
+}
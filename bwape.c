@@ -35,16 +35,19 @@ typedef struct {
 
 KHASH_INIT(b128, pair64_t, poslist_t, 1, b128_hash, b128_eq)
 
-typedef struct {
+typedef struct { // per-thread buffers
     pair64_v arr;
     pair64_v pos[2];
     kvec_t(bwt_aln1_t) aln[2];
+    kvec_t(bwtint_t) sa; // SA coordinates to look up in a batch
+    kh_b128_t *hash;     // SA interval to positions; one per thread so no locking is needed
+    kstring_t str;       // for MD
+    int64_t cnt_chg, n_tot[2], n_mapped[2]; // statistics of the current batch
 } pe_data_t;
 
 #define MIN_HASH_WIDTH 1000
 
 extern int g_log_n[256]; // in bwase.c
-static kh_b128_t *g_hash;
 
 void bwa_aln2seq_core(int n_aln, const bwt_aln1_t *aln, bwa_seq_t *s, int set_main, int n_multi);
 
@@ -52,8 +55,6 @@ void bwa_aln2seq(int n_aln, const bwt_aln1_t *aln, bwa_seq_t *s);
 
 int bwa_approx_mapQ(const bwa_seq_t *p, int mm);
 
-void bwa_print_sam1(const bntseq_t *bns, bwa_seq_t *p, const bwa_seq_t *mate, int mode, int max_top2);
-
 bntseq_t *bwa_open_nt(const char *prefix);
 
 void bwa_print_sam_SQ(const bntseq_t *bns);
@@ -69,6 +70,7 @@ pe_opt_t *bwa_init_pe_opt() {
     po->type = BWA_PET_STD;
     po->is_sw = 1;
     po->ap_prior = 1e-5;
+    po->n_threads = 1;
     return po;
 }
 /*
@@ -308,172 +310,132 @@ typedef struct {
     kvec_t(bwt_aln1_t) aln;
 } aln_buf_t;
 
-int bwa_cal_pac_pos_pe(
-    const bntseq_t *bns, const char *prefix, bwt_t *const _bwt, int n_seqs, bwa_seq_t *seqs[2], FILE *fp_sa[2], isize_info_t *ii,
-    const pe_opt_t *opt, const gap_opt_t *gopt, const isize_info_t *last_ii) {
-    int i, j, cnt_chg = 0;
-    char str[1024];
-    bwt_t *bwt;
-    pe_data_t *d;
+typedef struct {
+    const bntseq_t *bns;
+    const bwt_t *bwt;
+    const ubyte_t *pac;
+    const pe_opt_t *popt;
+    const gap_opt_t *gopt;
+    const isize_info_t *ii;
+    bwa_seq_t *seqs[2];
     aln_buf_t *buf[2];
-
-    d = (pe_data_t *) calloc(1, sizeof(pe_data_t));
-    buf[0] = (aln_buf_t *) calloc(n_seqs, sizeof(aln_buf_t));
-    buf[1] = (aln_buf_t *) calloc(n_seqs, sizeof(aln_buf_t));
-
-    if (_bwt == 0) { // load forward SA
-        strcpy(str, prefix);
-        strcat(str, ".bwt");
-        bwt = bwt_restore_bwt(str);
-        strcpy(str, prefix);
-        strcat(str, ".sa");
-        bwt_restore_sa(str, bwt);
-    } else {
-        bwt = _bwt;
-    }
-
-    // SE
-    for (i = 0; i != n_seqs; ++i) {
-        bwa_seq_t *p[2];
-        for (j = 0; j < 2; ++j) {
-            int n_aln;
-            p[j] = seqs[j] + i;
-            p[j]->n_multi = 0;
-            p[j]->extra_flag |= SAM_FPD | (j == 0 ? SAM_FR1 : SAM_FR2);
-            err_fread_noeof(&n_aln, 4, 1, fp_sa[j]);
-            if (n_aln > kv_max(d->aln[j]))
-                kv_resize(bwt_aln1_t, d->aln[j], n_aln);
-            d->aln[j].n = n_aln;
-            err_fread_noeof(d->aln[j].a, sizeof(bwt_aln1_t), n_aln, fp_sa[j]);
-            kv_copy(bwt_aln1_t, buf[j][i].aln, d->aln[j]); // backup d->aln[j]
-            // generate SE alignment and mapping quality
-            bwa_aln2seq(n_aln, d->aln[j].a, p[j]);
-            if (p[j]->type == BWA_TYPE_UNIQUE || p[j]->type == BWA_TYPE_REPEAT) {
-                int strand;
-                int max_diff = gopt->fnr > 0.0 ? bwa_cal_maxdiff(p[j]->len, BWA_AVG_ERR, gopt->fnr) : gopt->max_diff;
-                p[j]->seQ = p[j]->mapQ = bwa_approx_mapQ(p[j], max_diff);
-                p[j]->pos = bwa_sa2pos(bns, bwt, p[j]->sa, p[j]->len + p[j]->ref_shift, &strand);
-                p[j]->strand = strand;
-                if (p[j]->pos == (bwtint_t) -1) {
-                    p[j]->type = BWA_TYPE_NO_MATCH;
-                }
+    pe_data_t *d; // per-thread buffers
+    kstring_t *sam; // two SAM lines per pair
+} pe_worker_t;
+
+// SE alignment and mapping quality of both ends
+static void pe_se_pos_worker(void *data, long i, int tid) {
+    pe_worker_t *w = (pe_worker_t *) data;
+    int j;
+    for (j = 0; j < 2; ++j) {
+        bwa_seq_t *p = w->seqs[j] + i;
+        if (p->type == BWA_TYPE_UNIQUE || p->type == BWA_TYPE_REPEAT) {
+            int strand;
+            int max_diff = w->gopt->fnr > 0.0 ? bwa_cal_maxdiff(p->len, BWA_AVG_ERR, w->gopt->fnr) : w->gopt->max_diff;
+            p->seQ = p->mapQ = bwa_approx_mapQ(p, max_diff);
+            p->pos = bwa_sa2pos(w->bns, w->bwt, p->sa, p->len + p->ref_shift, &strand);
+            p->strand = strand;
+            if (p->pos == (bwtint_t) -1) {
+                p->type = BWA_TYPE_NO_MATCH;
             }
         }
     }
+}
 
-    // infer isize
-    infer_isize(n_seqs, seqs, ii, opt->ap_prior, bwt->seq_len / 2);
-    if (ii->avg < 0.0 && last_ii->avg > 0.0) {
-        *ii = *last_ii;
-    }
-    if (opt->force_isize) {
-        fprintf(stderr, "[%s] discard insert size estimate as user's request.\n", __func__);
-        ii->low = ii->high = 0;
-        ii->avg = ii->std = -1.0;
+// pair the hits of both ends and find the alternative hits
+static void pe_pairing_worker(void *data, long i, int tid) {
+    pe_worker_t *w = (pe_worker_t *) data;
+    const bntseq_t *bns = w->bns;
+    const bwt_t *bwt = w->bwt;
+    const pe_opt_t *opt = w->popt;
+    pe_data_t *d = &w->d[tid];
+    bwa_seq_t *p[2];
+    int j;
+    for (j = 0; j < 2; ++j) {
+        p[j] = w->seqs[j] + i;
+        kv_copy(bwt_aln1_t, d->aln[j], w->buf[j][i].aln);
     }
-
-    // PE
-    for (i = 0; i != n_seqs; ++i) {
-        bwa_seq_t *p[2];
+    if ((p[0]->type == BWA_TYPE_UNIQUE || p[0]->type == BWA_TYPE_REPEAT)
+        && (p[1]->type == BWA_TYPE_UNIQUE || p[1]->type == BWA_TYPE_REPEAT)) { // only when both ends mapped
+        pair64_t x;
+        int j, k;
+        long long n_occ[2];
         for (j = 0; j < 2; ++j) {
-            p[j] = seqs[j] + i;
-            kv_copy(bwt_aln1_t, d->aln[j], buf[j][i].aln);
-        }
-        if ((p[0]->type == BWA_TYPE_UNIQUE || p[0]->type == BWA_TYPE_REPEAT)
-            && (p[1]->type == BWA_TYPE_UNIQUE || p[1]->type == BWA_TYPE_REPEAT)) { // only when both ends mapped
-            pair64_t x;
-            int j, k;
-            long long n_occ[2];
-            for (j = 0; j < 2; ++j) {
-                n_occ[j] = 0;
-                for (k = 0; k < d->aln[j].n; ++k) {
-                    n_occ[j] += d->aln[j].a[k].l - d->aln[j].a[k].k + 1;
-                }
-            }
-            if (n_occ[0] > opt->max_occ || n_occ[1] > opt->max_occ) {
-                continue;
+            n_occ[j] = 0;
+            for (k = 0; k < d->aln[j].n; ++k) {
+                n_occ[j] += d->aln[j].a[k].l - d->aln[j].a[k].k + 1;
             }
-            d->arr.n = 0;
-            for (j = 0; j < 2; ++j) {
-                for (k = 0; k < d->aln[j].n; ++k) {
-                    bwt_aln1_t *r = d->aln[j].a + k;
-                    bwtint_t l;
-                    if (0 && r->l - r->k + 1 >= MIN_HASH_WIDTH) { // then check hash table
-                        pair64_t key;
-                        int ret;
-                        key.x = r->k;
-                        key.y = r->l;
-                        khint_t iter = kh_put(b128, g_hash, key, &ret);
-                        if (ret) { // not in the hash table; ret must equal 1 as we never remove elements
-                            poslist_t *z = &kh_val(g_hash, iter);
-                            z->n = r->l - r->k + 1;
-                            z->a = (bwtint_t *) malloc(sizeof(bwtint_t) * z->n);
-                            for (l = r->k; l <= r->l; ++l) {
-                                int strand;
-                                z->a[l - r->k] = bwa_sa2pos(bns, bwt, l, p[j]->len + p[j]->ref_shift, &strand) << 1;
-                                z->a[l - r->k] |= strand;
-                            }
-                        }
-                        for (l = 0; l < kh_val(g_hash, iter).n; ++l) {
-                            x.x = kh_val(g_hash, iter).a[l] >> 1;
-                            x.y = k << 2 | (kh_val(g_hash, iter).a[l] & 1) << 1 | j;
-                            kv_push(pair64_t, d->arr, x);
-                        }
-                    } else { // then calculate on the fly
+        }
+        if (n_occ[0] > opt->max_occ || n_occ[1] > opt->max_occ) {
+            return;
+        }
+        d->arr.n = 0;
+        for (j = 0; j < 2; ++j) {
+            for (k = 0; k < d->aln[j].n; ++k) {
+                bwt_aln1_t *r = d->aln[j].a + k;
+                bwtint_t l;
+                if (0 && r->l - r->k + 1 >= MIN_HASH_WIDTH) { // then check hash table
+                    pair64_t key;
+                    int ret;
+                    key.x = r->k;
+                    key.y = r->l;
+                    khint_t iter = kh_put(b128, d->hash, key, &ret);
+                    if (ret) { // not in the hash table; ret must equal 1 as we never remove elements
+                        poslist_t *z = &kh_val(d->hash, iter);
+                        z->n = r->l - r->k + 1;
+                        z->a = (bwtint_t *) malloc(sizeof(bwtint_t) * z->n);
                         for (l = r->k; l <= r->l; ++l) {
                             int strand;
-                            x.x = bwa_sa2pos(bns, bwt, l, p[j]->len + p[j]->ref_shift, &strand);
-                            x.y = k << 2 | strand << 1 | j;
-                            kv_push(pair64_t, d->arr, x);
+                            z->a[l - r->k] = bwa_sa2pos(bns, bwt, l, p[j]->len + p[j]->ref_shift, &strand) << 1;
+                            z->a[l - r->k] |= strand;
                         }
                     }
-                }
-            }
-            cnt_chg += pairing(p, d, opt, gopt->s_mm, ii);
-        }
-
-        if (opt->N_multi || opt->n_multi) {
-            for (j = 0; j < 2; ++j) {
-                if (p[j]->type != BWA_TYPE_NO_MATCH) {
-                    int k, n_multi;
-                    if (!(p[j]->extra_flag & SAM_FPP) && p[1 - j]->type != BWA_TYPE_NO_MATCH) {
-                        bwa_aln2seq_core(d->aln[j].n, d->aln[j].a, p[j], 0,
-                            p[j]->c1 + p[j]->c2 - 1 > opt->N_multi ? opt->n_multi : opt->N_multi);
-                    } else {
-                        bwa_aln2seq_core(d->aln[j].n, d->aln[j].a, p[j], 0, opt->n_multi);
+                    for (l = 0; l < kh_val(d->hash, iter).n; ++l) {
+                        x.x = kh_val(d->hash, iter).a[l] >> 1;
+                        x.y = k << 2 | (kh_val(d->hash, iter).a[l] & 1) << 1 | j;
+                        kv_push(pair64_t, d->arr, x);
+                    }
+                } else { // then calculate on the fly
+                    kv_resize(bwtint_t, d->sa, r->l - r->k + 1);
+                    for (l = r->k, d->sa.n = 0; l <= r->l; ++l) {
+                        d->sa.a[d->sa.n++] = l;
                     }
-                    for (k = 0, n_multi = 0; k < p[j]->n_multi; ++k) {
+                    bwt_sa_batch(bwt, d->sa.n, d->sa.a, d->sa.a);
+                    for (l = 0; l < d->sa.n; ++l) {
                         int strand;
-                        bwt_multi1_t *q = p[j]->multi + k;
-                        q->pos = bwa_sa2pos(bns, bwt, q->pos, p[j]->len + q->ref_shift, &strand);
-                        q->strand = strand;
-                        if (q->pos != p[j]->pos && q->pos != (bwtint_t) -1) {
-                            p[j]->multi[n_multi++] = *q;
-                        }
+                        x.x = bwa_fr2pos(bns, d->sa.a[l], p[j]->len + p[j]->ref_shift, &strand);
+                        x.y = k << 2 | strand << 1 | j;
+                        kv_push(pair64_t, d->arr, x);
                     }
-                    p[j]->n_multi = n_multi;
                 }
             }
         }
+        d->cnt_chg += pairing(p, d, opt, w->gopt->s_mm, w->ii);
     }
 
-    // free
-    for (i = 0; i < n_seqs; ++i) {
-        kv_destroy(buf[0][i].aln);
-        kv_destroy(buf[1][i].aln);
-    }
-    free(buf[0]);
-    free(buf[1]);
-    if (_bwt == 0) {
-        bwt_destroy(bwt);
+    if (opt->N_multi || opt->n_multi) {
+        for (j = 0; j < 2; ++j) {
+            if (p[j]->type != BWA_TYPE_NO_MATCH) {
+                int k, n_multi;
+                if (!(p[j]->extra_flag & SAM_FPP) && p[1 - j]->type != BWA_TYPE_NO_MATCH) {
+                    bwa_aln2seq_core(d->aln[j].n, d->aln[j].a, p[j], 0,
+                        p[j]->c1 + p[j]->c2 - 1 > opt->N_multi ? opt->n_multi : opt->N_multi);
+                } else {
+                    bwa_aln2seq_core(d->aln[j].n, d->aln[j].a, p[j], 0, opt->n_multi);
+                }
+                for (k = 0, n_multi = 0; k < p[j]->n_multi; ++k) {
+                    int strand;
+                    bwt_multi1_t *q = p[j]->multi + k;
+                    q->pos = bwa_sa2pos(bns, bwt, q->pos, p[j]->len + q->ref_shift, &strand);
+                    q->strand = strand;
+                    if (q->pos != p[j]->pos && q->pos != (bwtint_t) -1) {
+                        p[j]->multi[n_multi++] = *q;
+                    }
+                }
+                p[j]->n_multi = n_multi;
+            }
+        }
     }
-    kv_destroy(d->arr);
-    kv_destroy(d->pos[0]);
-    kv_destroy(d->pos[1]);
-    kv_destroy(d->aln[0]);
-    kv_destroy(d->aln[1]);
-    free(d);
-    return cnt_chg;
 }
 
 #define SW_MIN_MATCH_LEN 20
@@ -586,290 +548,455 @@ bwa_cigar_t *bwa_sw_core(bwtint_t l_pac, const ubyte_t *pacseq, int len, const u
     return cigar;
 }
 
-ubyte_t *bwa_paired_sw(const bntseq_t *bns, const ubyte_t *_pacseq, int n_seqs, bwa_seq_t *seqs[2], const pe_opt_t *popt, const isize_info_t *ii) {
-    ubyte_t *pacseq;
-    int i;
-    uint64_t n_tot[2], n_mapped[2];
-
-    // load reference sequence
-    if (_pacseq == 0) {
-        pacseq = (ubyte_t *) calloc(bns->l_pac / 4 + 1, 1);
-        err_rewind(bns->fp_pac);
-        err_fread_noeof(pacseq, 1, bns->l_pac / 4 + 1, bns->fp_pac);
-    } else {
-        pacseq = (ubyte_t *) _pacseq;
-    }
-    if (!popt->is_sw || ii->avg < 0.0) {
-        return pacseq;
+/**
+ * Align the unmapped or discordant mate of one pair with Smith-Waterman
+ *
+ * @return -1 if the pair is not attempted; otherwise is_singleton | is_mated<<1
+ */
+static int bwa_paired_sw1(const bntseq_t *bns, const ubyte_t *pacseq, bwa_seq_t *p[2], const pe_opt_t *popt, const isize_info_t *ii) {
+    if ((p[0]->mapQ < SW_MIN_MAPQ && p[1]->mapQ < SW_MIN_MAPQ) || (p[0]->extra_flag & SAM_FPP)) { // paired or both with low mapQ
+        return -1;
     }
+    int k, n_cigar[2], is_singleton, is_mated = 0, mapQ = 0, mq_adjust[2];
+    int64_t beg[2], end[2];
+    bwa_cigar_t *cigar[2];
+    uint32_t cnt[2];
 
-    // perform mate alignment
-    n_tot[0] = n_tot[1] = n_mapped[0] = n_mapped[1] = 0;
-    for (i = 0; i != n_seqs; ++i) {
-        bwa_seq_t *p[2];
-        p[0] = seqs[0] + i;
-        p[1] = seqs[1] + i;
-        if ((p[0]->mapQ >= SW_MIN_MAPQ || p[1]->mapQ >= SW_MIN_MAPQ) && (p[0]->extra_flag & SAM_FPP) == 0) { // unpaired and one read has high mapQ
-            int k, n_cigar[2], is_singleton, mapQ = 0, mq_adjust[2];
-            int64_t beg[2], end[2];
-            bwa_cigar_t *cigar[2];
-            uint32_t cnt[2];
-
-            /* In the following, _pref points to the reference read
-             * which must be aligned; _pmate points to its mate which is
-             * considered to be modified. */
+    /* In the following, _pref points to the reference read
+     * which must be aligned; _pmate points to its mate which is
+     * considered to be modified. */
 
 #define __set_rght_coor(_a, _b, _pref, _pmate) do {                        \
-                (_a) = (int64_t)_pref->pos + ii->avg - 3 * ii->std - _pmate->len * 1.5; \
-                (_b) = (_a) + 6 * ii->std + 2 * _pmate->len;            \
-                if ((_a) < (int64_t)_pref->pos + _pref->len) (_a) = _pref->pos + _pref->len; \
-                if ((_b) > bns->l_pac) (_b) = bns->l_pac;                \
-            } while (0)
+        (_a) = (int64_t)_pref->pos + ii->avg - 3 * ii->std - _pmate->len * 1.5; \
+        (_b) = (_a) + 6 * ii->std + 2 * _pmate->len;            \
+        if ((_a) < (int64_t)_pref->pos + _pref->len) (_a) = _pref->pos + _pref->len; \
+        if ((_b) > bns->l_pac) (_b) = bns->l_pac;                \
+    } while (0)
 
 #define __set_left_coor(_a, _b, _pref, _pmate) do {                        \
-                (_a) = (int64_t)_pref->pos + _pref->len - ii->avg - 3 * ii->std - _pmate->len * 0.5; \
-                (_b) = (_a) + 6 * ii->std + 2 * _pmate->len;            \
-                if ((_a) < 0) (_a) = 0;                                    \
-                if ((_b) > _pref->pos) (_b) = _pref->pos;                \
-            } while (0)
+        (_a) = (int64_t)_pref->pos + _pref->len - ii->avg - 3 * ii->std - _pmate->len * 0.5; \
+        (_b) = (_a) + 6 * ii->std + 2 * _pmate->len;            \
+        if ((_a) < 0) (_a) = 0;                                    \
+        if ((_b) > _pref->pos) (_b) = _pref->pos;                \
+    } while (0)
 
 #define __set_fixed(_pref, _pmate, _beg, _cnt) do {                        \
-                _pmate->type = BWA_TYPE_MATESW;                            \
-                _pmate->pos = _beg;                                        \
-                _pmate->seQ = _pref->seQ;                                \
-                _pmate->strand = (popt->type == BWA_PET_STD)? 1 - _pref->strand : _pref->strand; \
-                _pmate->n_mm = _cnt>>16; _pmate->n_gapo = _cnt>>8&0xff; _pmate->n_gape = _cnt&0xff; \
-                _pmate->extra_flag |= SAM_FPP;                            \
-                _pref->extra_flag |= SAM_FPP;                            \
-            } while (0)
-
-            mq_adjust[0] = mq_adjust[1] = 255; // not effective
-            is_singleton = (p[0]->type == BWA_TYPE_NO_MATCH || p[1]->type == BWA_TYPE_NO_MATCH) ? 1 : 0;
-
-            ++n_tot[is_singleton];
-            cigar[0] = cigar[1] = 0;
-            n_cigar[0] = n_cigar[1] = 0;
-            if (popt->type != BWA_PET_STD) {
-                continue;
-            } // other types of pairing is not considered
-            for (k = 0; k < 2; ++k) { // p[1-k] is the reference read and p[k] is the read considered to be modified
-                ubyte_t *seq;
-                if (p[1 - k]->type == BWA_TYPE_NO_MATCH) {
-                    continue;
-                } // if p[1-k] is unmapped, skip
-                { // note that popt->type == BWA_PET_STD always true; in older versions, there was a branch for color-space FF/RR reads
-                    if (p[1 - k]->strand == 0) { // then the mate is on the reverse strand and has larger coordinate
-                        __set_rght_coor(beg[k], end[k], p[1 - k], p[k]);
-                        seq = p[k]->rseq;
-                    } else { // then the mate is on forward stand and has smaller coordinate
-                        __set_left_coor(beg[k], end[k], p[1 - k], p[k]);
-                        seq = p[k]->seq;
-                        seq_reverse(p[k]->len, seq, 0); // because ->seq is reversed; this will reversed back shortly
-                    }
-                }
-                // perform SW alignment
-                cigar[k] = bwa_sw_core(bns->l_pac, pacseq, p[k]->len, seq, &beg[k], end[k] - beg[k], &n_cigar[k], &cnt[k]);
-                if (cigar[k] && p[k]->type != BWA_TYPE_NO_MATCH) { // re-evaluate cigar[k]
-                    int s_old, clip = 0, s_new;
-                    if (__cigar_op(cigar[k][0]) == 3)
-                        clip += __cigar_len(cigar[k][0]);
-                    if (__cigar_op(cigar[k][n_cigar[k] - 1]) == 3)
-                        clip += __cigar_len(cigar[k][n_cigar[k] - 1]);
-                    s_old = (int) ((p[k]->n_mm * 9 + p[k]->n_gapo * 13 + p[k]->n_gape * 2) / 3. * 8. + .499);
-                    s_new = (int) (((cnt[k] >> 16) * 9 + (cnt[k] >> 8 & 0xff) * 13 + (cnt[k] & 0xff) * 2 + clip * 3) / 3. * 8. + .499);
-                    s_old += -4.343 * log(ii->ap_prior / bns->l_pac);
-                    s_new += (int) (-4.343 * log(.5 * erfc(M_SQRT1_2 * 1.5) + .499)); // assume the mapped isize is 1.5\sigma
-                    if (s_old < s_new) { // reject SW alignment
-                        mq_adjust[k] = s_new - s_old;
-                        free(cigar[k]);
-                        cigar[k] = 0;
-                        n_cigar[k] = 0;
-                    } else
-                        mq_adjust[k] = s_old - s_new;
-                }
-                // now revserse sequence back such that p[*]->seq looks untouched
-                if (popt->type == BWA_PET_STD) {
-                    if (p[1 - k]->strand == 1)
-                        seq_reverse(p[k]->len, seq, 0);
-                } else {
-                    if (p[1 - k]->strand == 0)
-                        seq_reverse(p[k]->len, seq, 0);
-                }
-            }
-            k = -1; // no read to be changed
-            if (cigar[0] && cigar[1]) {
-                k = p[0]->mapQ < p[1]->mapQ ? 0 : 1; // p[k] to be fixed
-                mapQ = abs(p[1]->mapQ - p[0]->mapQ);
-            } else if (cigar[0]) {
-                k = 0, mapQ = p[1]->mapQ;
-            } else if (cigar[1]) {
-                k = 1, mapQ = p[0]->mapQ;
+        _pmate->type = BWA_TYPE_MATESW;                            \
+        _pmate->pos = _beg;                                        \
+        _pmate->seQ = _pref->seQ;                                \
+        _pmate->strand = (popt->type == BWA_PET_STD)? 1 - _pref->strand : _pref->strand; \
+        _pmate->n_mm = _cnt>>16; _pmate->n_gapo = _cnt>>8&0xff; _pmate->n_gape = _cnt&0xff; \
+        _pmate->extra_flag |= SAM_FPP;                            \
+        _pref->extra_flag |= SAM_FPP;                            \
+    } while (0)
+
+    mq_adjust[0] = mq_adjust[1] = 255; // not effective
+    is_singleton = (p[0]->type == BWA_TYPE_NO_MATCH || p[1]->type == BWA_TYPE_NO_MATCH) ? 1 : 0;
+
+    cigar[0] = cigar[1] = 0;
+    n_cigar[0] = n_cigar[1] = 0;
+    if (popt->type != BWA_PET_STD) {
+        return is_singleton;
+    } // other types of pairing is not considered
+    for (k = 0; k < 2; ++k) { // p[1-k] is the reference read and p[k] is the read considered to be modified
+        ubyte_t *seq;
+        if (p[1 - k]->type == BWA_TYPE_NO_MATCH) {
+            continue;
+        } // if p[1-k] is unmapped, skip
+        { // note that popt->type == BWA_PET_STD always true; in older versions, there was a branch for color-space FF/RR reads
+            if (p[1 - k]->strand == 0) { // then the mate is on the reverse strand and has larger coordinate
+                __set_rght_coor(beg[k], end[k], p[1 - k], p[k]);
+                seq = p[k]->rseq;
+            } else { // then the mate is on forward stand and has smaller coordinate
+                __set_left_coor(beg[k], end[k], p[1 - k], p[k]);
+                seq = p[k]->seq;
+                seq_reverse(p[k]->len, seq, 0); // because ->seq is reversed; this will reversed back shortly
             }
-            if (k >= 0 && p[k]->pos != beg[k]) {
-                ++n_mapped[is_singleton];
-                { // recalculate mapping quality
-                    int tmp = (int) p[1 - k]->mapQ - p[k]->mapQ / 2 - 8;
-                    if (tmp <= 0) {
-                        tmp = 1;
-                    }
-                    if (mapQ > tmp) {
-                        mapQ = tmp;
-                    }
-                    p[k]->mapQ = p[1 - k]->mapQ = mapQ;
-                    p[k]->seQ = p[1 - k]->seQ = p[1 - k]->seQ < mapQ ? p[1 - k]->seQ : mapQ;
-                    if (p[k]->mapQ > mq_adjust[k]) {
-                        p[k]->mapQ = mq_adjust[k];
-                    }
-                    if (p[k]->seQ > mq_adjust[k]) {
-                        p[k]->seQ = mq_adjust[k];
-                    }
-                }
-                // update CIGAR
-                free(p[k]->cigar);
-                p[k]->cigar = cigar[k];
+        }
+        // perform SW alignment
+        cigar[k] = bwa_sw_core(bns->l_pac, pacseq, p[k]->len, seq, &beg[k], end[k] - beg[k], &n_cigar[k], &cnt[k]);
+        if (cigar[k] && p[k]->type != BWA_TYPE_NO_MATCH) { // re-evaluate cigar[k]
+            int s_old, clip = 0, s_new;
+            if (__cigar_op(cigar[k][0]) == 3)
+                clip += __cigar_len(cigar[k][0]);
+            if (__cigar_op(cigar[k][n_cigar[k] - 1]) == 3)
+                clip += __cigar_len(cigar[k][n_cigar[k] - 1]);
+            s_old = (int) ((p[k]->n_mm * 9 + p[k]->n_gapo * 13 + p[k]->n_gape * 2) / 3. * 8. + .499);
+            s_new = (int) (((cnt[k] >> 16) * 9 + (cnt[k] >> 8 & 0xff) * 13 + (cnt[k] & 0xff) * 2 + clip * 3) / 3. * 8. + .499);
+            s_old += -4.343 * log(ii->ap_prior / bns->l_pac);
+            s_new += (int) (-4.343 * log(.5 * erfc(M_SQRT1_2 * 1.5) + .499)); // assume the mapped isize is 1.5\sigma
+            if (s_old < s_new) { // reject SW alignment
+                mq_adjust[k] = s_new - s_old;
+                free(cigar[k]);
                 cigar[k] = 0;
-                p[k]->n_cigar = n_cigar[k];
-                // update the rest of information
-                __set_fixed(p[1 - k], p[k], beg[k], cnt[k]);
+                n_cigar[k] = 0;
+            } else
+                mq_adjust[k] = s_old - s_new;
+        }
+        // now revserse sequence back such that p[*]->seq looks untouched
+        if (popt->type == BWA_PET_STD) {
+            if (p[1 - k]->strand == 1)
+                seq_reverse(p[k]->len, seq, 0);
+        } else {
+            if (p[1 - k]->strand == 0)
+                seq_reverse(p[k]->len, seq, 0);
+        }
+    }
+    k = -1; // no read to be changed
+    if (cigar[0] && cigar[1]) {
+        k = p[0]->mapQ < p[1]->mapQ ? 0 : 1; // p[k] to be fixed
+        mapQ = abs(p[1]->mapQ - p[0]->mapQ);
+    } else if (cigar[0]) {
+        k = 0, mapQ = p[1]->mapQ;
+    } else if (cigar[1]) {
+        k = 1, mapQ = p[0]->mapQ;
+    }
+    if (k >= 0 && p[k]->pos != beg[k]) {
+        is_mated = 1;
+        { // recalculate mapping quality
+            int tmp = (int) p[1 - k]->mapQ - p[k]->mapQ / 2 - 8;
+            if (tmp <= 0) {
+                tmp = 1;
+            }
+            if (mapQ > tmp) {
+                mapQ = tmp;
+            }
+            p[k]->mapQ = p[1 - k]->mapQ = mapQ;
+            p[k]->seQ = p[1 - k]->seQ = p[1 - k]->seQ < mapQ ? p[1 - k]->seQ : mapQ;
+            if (p[k]->mapQ > mq_adjust[k]) {
+                p[k]->mapQ = mq_adjust[k];
+            }
+            if (p[k]->seQ > mq_adjust[k]) {
+                p[k]->seQ = mq_adjust[k];
             }
-            free(cigar[0]);
-            free(cigar[1]);
         }
+        // update CIGAR
+        free(p[k]->cigar);
+        p[k]->cigar = cigar[k];
+        cigar[k] = 0;
+        p[k]->n_cigar = n_cigar[k];
+        // update the rest of information
+        __set_fixed(p[1 - k], p[k], beg[k], cnt[k]);
     }
-    fprintf(stderr, "[bwa_paired_sw] %lld out of %lld Q%d singletons are mated.\n",
-        (long long) n_mapped[1], (long long) n_tot[1], SW_MIN_MAPQ);
-    fprintf(stderr, "[bwa_paired_sw] %lld out of %lld Q%d discordant pairs are fixed.\n",
-        (long long) n_mapped[0], (long long) n_tot[0], SW_MIN_MAPQ);
-    return pacseq;
+    free(cigar[0]);
+    free(cigar[1]);
+    return is_singleton | is_mated << 1;
 }
 
-void bwa_sai2sam_pe_core(const char *prefix, char *const fn_sa[2], char *const fn_fa[2], pe_opt_t *popt, const char *rg_line) {
-    extern bwa_seqio_t *bwa_open_reads(int mode, const char *fn_fa);
-    int i, j, n_seqs;
-    long long tot_seqs = 0;
-    bwa_seq_t *seqs[2];
+// mate SW, gapped alignment and SAM lines of one pair
+static void pe_sam_worker(void *data, long i, int tid) {
+    pe_worker_t *w = (pe_worker_t *) data;
+    pe_data_t *d = &w->d[tid];
+    bwa_seq_t *p[2];
+    int j;
+    p[0] = w->seqs[0] + i;
+    p[1] = w->seqs[1] + i;
+    if (w->popt->is_sw && w->ii->avg >= 0.0) {
+        int ret = bwa_paired_sw1(w->bns, w->pac, p, w->popt, w->ii);
+        if (ret >= 0) {
+            ++d->n_tot[ret & 1];
+            d->n_mapped[ret & 1] += ret >> 1;
+        }
+    }
+    for (j = 0; j < 2; ++j) {
+        bwa_refine_gapped1(w->bns, p[j], (ubyte_t *) w->pac, &d->str);
+    }
+    if (p[0]->bc[0] || p[1]->bc[0]) {
+        strcat(p[0]->bc, p[1]->bc);
+        strcpy(p[1]->bc, p[0]->bc);
+    }
+    bwa_format_sam1(&w->sam[i], w->bns, p[0], p[1], w->gopt->mode, w->gopt->max_top2);
+    bwa_format_sam1(&w->sam[i], w->bns, p[1], p[0], w->gopt->mode, w->gopt->max_top2);
+}
+
+typedef struct {
+    const char *prefix;
+    const bntseq_t *bns;
+    bwt_t *bwt;   // preloaded with -P
+    ubyte_t *pac; // preloaded with -P
     bwa_seqio_t *ks[2];
-    clock_t t;
-    bntseq_t *bns;
-    FILE *fp_sa[2];
+    FILE *fp_sa[2]; // NULL for `bwa alnpe', which aligns the reads itself
     gap_opt_t opt, opt0;
-    khint_t iter;
-    isize_info_t last_ii; // this is for the last batch of reads
-    char str[1024], magic[2][4];
-    bwt_t *bwt;
-    uint8_t *pac;
+    const pe_opt_t *popt;
+    int n_threads;
+    pe_data_t *d;          // per-thread buffers
+    isize_info_t last_ii;  // this is for the last batch of reads
+    long long tot_seqs;
+} pe_aux_t;
 
-    // initialization
-    bwase_initialize(); // initialize g_log_n[] in bwase.c
-    pac = 0;
-    bwt = 0;
-    for (i = 1; i != 256; ++i) {
-        g_log_n[i] = (int) (4.343 * log(i) + 0.5);
-    }
-    bns = bns_restore(prefix);
-    srand48(bns->seed);
-    fp_sa[0] = xopen(fn_sa[0], "r");
-    fp_sa[1] = xopen(fn_sa[1], "r");
-    g_hash = kh_init(b128);
-    last_ii.avg = -1.0;
+typedef struct {
+    int n_seqs;
+    long long tot_seqs; // number of reads up to this batch
+    bwa_seq_t *seqs[2];
+    aln_buf_t *buf[2];
+    kstring_t *sam;
+} pe_batch_t;
+
+/**
+ * sampe的流水线：step 0读入序列和sai，step 1多线程配对、比对mate和生成SAM，step 2按顺序输出。
+ * alnpe没有sai文件，step 1先比对两端
+ */
+static void *pe_process(void *shared, int step, void *_data) {
+    extern void kt_for(int n_threads, void (*func)(void *, long, int), void *data, long n);
+    pe_aux_t *aux = (pe_aux_t *) shared;
+    pe_batch_t *data = (pe_batch_t *) _data;
+    int i, j;
+    if (step == 0) {
+        bwa_seq_t *seqs[2];
+        int n_seqs;
+        if ((seqs[0] = bwa_read_seq(aux->ks[0], 0x40000, &n_seqs, aux->opt0.mode, aux->opt0.trim_qual)) == 0) {
+            return 0;
+        }
+        seqs[1] = bwa_read_seq(aux->ks[1], 0x40000, &n_seqs, aux->opt.mode, aux->opt.trim_qual);
+        data = (pe_batch_t *) calloc(1, sizeof(pe_batch_t));
+        data->n_seqs = n_seqs;
+        data->tot_seqs = aux->tot_seqs += n_seqs;
+        for (j = 0; j < 2; ++j) {
+            data->seqs[j] = seqs[j];
+            data->buf[j] = (aln_buf_t *) calloc(n_seqs, sizeof(aln_buf_t));
+        }
+        // read alignments; bwa_aln2seq() draws random numbers, so this stays in the input order
+        for (i = 0; i != n_seqs; ++i) {
+            for (j = 0; j < 2; ++j) {
+                bwa_seq_t *p = seqs[j] + i;
+                aln_buf_t *b = data->buf[j] + i;
+                int n_aln;
+                p->n_multi = 0;
+                p->extra_flag |= SAM_FPD | (j == 0 ? SAM_FR1 : SAM_FR2);
+                if (aux->fp_sa[j] == 0) { // alnpe: aligned in step 1
+                    continue;
+                }
+                err_fread_noeof(&n_aln, 4, 1, aux->fp_sa[j]);
+                if (n_aln > kv_max(b->aln)) {
+                    kv_resize(bwt_aln1_t, b->aln, n_aln);
+                }
+                b->aln.n = n_aln;
+                err_fread_noeof(b->aln.a, sizeof(bwt_aln1_t), n_aln, aux->fp_sa[j]);
+                bwa_aln2seq(n_aln, b->aln.a, p);
+            }
+        }
+        return data;
+    } else if (step == 1) {
+        const bntseq_t *bns = aux->bns;
+        pe_worker_t w;
+        isize_info_t ii;
+        int64_t cnt_chg = 0, n_tot[2] = {0, 0}, n_mapped[2] = {0, 0};
+        double t = realtime();
+        char str[1024];
+
+        memset(&w, 0, sizeof(pe_worker_t));
+        w.bns = bns, w.popt = aux->popt, w.gopt = &aux->opt, w.ii = &ii, w.d = aux->d;
+        w.seqs[0] = data->seqs[0], w.seqs[1] = data->seqs[1];
+        w.buf[0] = data->buf[0], w.buf[1] = data->buf[1];
+        for (i = 0; i < aux->n_threads; ++i) {
+            aux->d[i].cnt_chg = 0;
+            aux->d[i].n_tot[0] = aux->d[i].n_tot[1] = aux->d[i].n_mapped[0] = aux->d[i].n_mapped[1] = 0;
+        }
 
-    err_fread_noeof(magic[0], 1, 4, fp_sa[0]);
-    err_fread_noeof(magic[1], 1, 4, fp_sa[1]);
-    if (strncmp(magic[0], SAI_MAGIC, 4) != 0 || strncmp(magic[1], SAI_MAGIC, 4) != 0) {
-        fprintf(stderr, "[E::%s] Unmatched SAI magic. Please re-run `aln' with the same version of bwa.\n", __func__);
-        exit(1);
-    }
-    err_fread_noeof(&opt, sizeof(gap_opt_t), 1, fp_sa[0]);
-    ks[0] = bwa_open_reads(opt.mode, fn_fa[0]);
-    opt0 = opt;
-    err_fread_noeof(&opt, sizeof(gap_opt_t), 1, fp_sa[1]); // overwritten!
-    ks[1] = bwa_open_reads(opt.mode, fn_fa[1]);
-    { // for Illumina alignment only
-        if (popt->is_preload) {
-            strcpy(str, prefix);
+        if (aux->fp_sa[0] == 0) {
+            fprintf(stderr, "[bwa_sai2sam_pe_core] calculate SA coordinate... ");
+            bwa_cal_sa_batch(aux->bwt, data->n_seqs, data->seqs[0], &aux->opt0, 1);
+            bwa_cal_sa_batch(aux->bwt, data->n_seqs, data->seqs[1], &aux->opt, 1);
+            // take over the alignments in the same order as they are read from the .sai files in step 0
+            for (i = 0; i != data->n_seqs; ++i) {
+                for (j = 0; j < 2; ++j) {
+                    bwa_seq_t *p = data->seqs[j] + i;
+                    aln_buf_t *b = data->buf[j] + i;
+                    b->aln.a = p->aln, b->aln.n = b->aln.m = p->n_aln;
+                    p->aln = 0;
+                    bwa_aln2seq(b->aln.n, b->aln.a, p);
+                }
+            }
+            fprintf(stderr, "%.2f sec\n", realtime() - t);
+            t = realtime();
+        }
+
+        fprintf(stderr, "[bwa_sai2sam_pe_core] convert to sequence coordinate... \n");
+        if (aux->bwt == 0) { // load forward SA
+            bwt_t *bwt;
+            strcpy(str, aux->prefix);
             strcat(str, ".bwt");
             bwt = bwt_restore_bwt(str);
-            strcpy(str, prefix);
+            strcpy(str, aux->prefix);
             strcat(str, ".sa");
             bwt_restore_sa(str, bwt);
-            pac = (ubyte_t *) calloc(bns->l_pac / 4 + 1, 1);
+            w.bwt = bwt;
+        } else {
+            w.bwt = aux->bwt;
+        }
+        kt_for(aux->n_threads, pe_se_pos_worker, &w, data->n_seqs);
+        // infer isize
+        infer_isize(data->n_seqs, data->seqs, &ii, aux->popt->ap_prior, w.bwt->seq_len / 2);
+        if (ii.avg < 0.0 && aux->last_ii.avg > 0.0) {
+            ii = aux->last_ii;
+        }
+        if (aux->popt->force_isize) {
+            fprintf(stderr, "[%s] discard insert size estimate as user's request.\n", __func__);
+            ii.low = ii.high = 0;
+            ii.avg = ii.std = -1.0;
+        }
+        kt_for(aux->n_threads, pe_pairing_worker, &w, data->n_seqs);
+        if (aux->bwt == 0) {
+            bwt_destroy((bwt_t *) w.bwt);
+        }
+        for (i = 0; i < aux->n_threads; ++i) {
+            cnt_chg += aux->d[i].cnt_chg;
+        }
+        fprintf(stderr, "[bwa_sai2sam_pe_core] time elapses: %.2f sec\n", realtime() - t);
+        fprintf(stderr, "[bwa_sai2sam_pe_core] changing coordinates of %ld alignments.\n", (long) cnt_chg);
+        t = realtime();
+
+        fprintf(stderr, "[bwa_sai2sam_pe_core] align unmapped mate, refine gapped alignments and generate SAM...\n");
+        if (aux->pac == 0) {
+            ubyte_t *pac = (ubyte_t *) calloc(bns->l_pac / 4 + 1, 1);
             err_rewind(bns->fp_pac);
             err_fread_noeof(pac, 1, bns->l_pac / 4 + 1, bns->fp_pac);
+            w.pac = pac;
+        } else {
+            w.pac = aux->pac;
         }
-    }
-
-    // core loop
-    bwa_print_sam_hdr(bns, rg_line);
-    while ((seqs[0] = bwa_read_seq(ks[0], 0x40000, &n_seqs, opt0.mode, opt0.trim_qual)) != 0) {
-        int cnt_chg;
-        isize_info_t ii;
-        ubyte_t *pacseq;
-
-        seqs[1] = bwa_read_seq(ks[1], 0x40000, &n_seqs, opt.mode, opt.trim_qual);
-        tot_seqs += n_seqs;
-        t = clock();
-
-        fprintf(stderr, "[bwa_sai2sam_pe_core] convert to sequence coordinate... \n");
-        cnt_chg = bwa_cal_pac_pos_pe(bns, prefix, bwt, n_seqs, seqs, fp_sa, &ii, popt, &opt, &last_ii);
-        fprintf(stderr, "[bwa_sai2sam_pe_core] time elapses: %.2f sec\n", (float) (clock() - t) / CLOCKS_PER_SEC);
-        t = clock();
-        fprintf(stderr, "[bwa_sai2sam_pe_core] changing coordinates of %d alignments.\n", cnt_chg);
-
-        fprintf(stderr, "[bwa_sai2sam_pe_core] align unmapped mate...\n");
-        pacseq = bwa_paired_sw(bns, pac, n_seqs, seqs, popt, &ii);
-        fprintf(stderr, "[bwa_sai2sam_pe_core] time elapses: %.2f sec\n", (float) (clock() - t) / CLOCKS_PER_SEC);
-        t = clock();
-
-        fprintf(stderr, "[bwa_sai2sam_pe_core] refine gapped alignments... ");
-        for (j = 0; j < 2; ++j) {
-            bwa_refine_gapped(bns, n_seqs, seqs[j], pacseq);
+        w.sam = data->sam = (kstring_t *) calloc(data->n_seqs, sizeof(kstring_t));
+        kt_for(aux->n_threads, pe_sam_worker, &w, data->n_seqs);
+        if (aux->pac == 0) {
+            free((ubyte_t *) w.pac);
         }
-        fprintf(stderr, "%.2f sec\n", (float) (clock() - t) / CLOCKS_PER_SEC);
-        t = clock();
-        if (pac == 0) {
-            free(pacseq);
+        if (aux->popt->is_sw && ii.avg >= 0.0) {
+            for (i = 0; i < aux->n_threads; ++i) {
+                for (j = 0; j < 2; ++j) {
+                    n_tot[j] += aux->d[i].n_tot[j], n_mapped[j] += aux->d[i].n_mapped[j];
+                }
+            }
+            fprintf(stderr, "[bwa_paired_sw] %lld out of %lld Q%d singletons are mated.\n",
+                (long long) n_mapped[1], (long long) n_tot[1], SW_MIN_MAPQ);
+            fprintf(stderr, "[bwa_paired_sw] %lld out of %lld Q%d discordant pairs are fixed.\n",
+                (long long) n_mapped[0], (long long) n_tot[0], SW_MIN_MAPQ);
         }
-
-        fprintf(stderr, "[bwa_sai2sam_pe_core] print alignments... ");
-        for (i = 0; i < n_seqs; ++i) {
+        fprintf(stderr, "[bwa_sai2sam_pe_core] time elapses: %.2f sec\n", realtime() - t);
+        aux->last_ii = ii;
+        return data;
+    } else if (step == 2) {
+        for (i = 0; i < data->n_seqs; ++i) {
             bwa_seq_t *p[2];
-            p[0] = seqs[0] + i;
-            p[1] = seqs[1] + i;
-            if (p[0]->bc[0] || p[1]->bc[0]) {
-                strcat(p[0]->bc, p[1]->bc);
-                strcpy(p[1]->bc, p[0]->bc);
-            }
-            bwa_print_sam1(bns, p[0], p[1], opt.mode, opt.max_top2);
-            bwa_print_sam1(bns, p[1], p[0], opt.mode, opt.max_top2);
+            p[0] = data->seqs[0] + i;
+            p[1] = data->seqs[1] + i;
+            err_fputs(data->sam[i].s, stdout);
+            free(data->sam[i].s);
             if (strcmp(p[0]->name, p[1]->name) != 0) {
                 err_fatal(__func__, "paired reads have different names: \"%s\", \"%s\"\n", p[0]->name, p[1]->name);
             }
         }
-        fprintf(stderr, "%.2f sec\n", (float) (clock() - t) / CLOCKS_PER_SEC);
-        t = clock();
-
+        free(data->sam);
         for (j = 0; j < 2; ++j) {
-            bwa_free_read_seq(n_seqs, seqs[j]);
+            for (i = 0; i < data->n_seqs; ++i) {
+                kv_destroy(data->buf[j][i].aln);
+            }
+            free(data->buf[j]);
+            bwa_free_read_seq(data->n_seqs, data->seqs[j]);
+        }
+        fprintf(stderr, "[bwa_sai2sam_pe_core] %lld sequences have been processed.\n", data->tot_seqs);
+        free(data);
+        return 0;
+    }
+    return 0;
+}
+
+/**
+ * Run the sampe pipeline with aux->bns, aux->opt0 and aux->opt set. The
+ * index is preloaded with -P or when there are no .sai files.
+ */
+static void bwa_pe_run(pe_aux_t *aux, char *const fn_fa[2], const char *rg_line) {
+    extern bwa_seqio_t *bwa_open_reads(int mode, const char *fn_fa);
+    extern void kt_pipeline(int n_threads, void *(*func)(void *, int, void *), void *shared_data, int n_steps);
+    const bntseq_t *bns = aux->bns;
+    char str[1024];
+    int i;
+
+    aux->n_threads = aux->popt->n_threads > 1 ? aux->popt->n_threads : 1;
+    aux->d = (pe_data_t *) calloc(aux->n_threads, sizeof(pe_data_t));
+    for (i = 0; i < aux->n_threads; ++i) {
+        aux->d[i].hash = kh_init(b128);
+    }
+    aux->last_ii.avg = -1.0;
+    aux->ks[0] = bwa_open_reads(aux->opt0.mode, fn_fa[0]);
+    aux->ks[1] = bwa_open_reads(aux->opt.mode, fn_fa[1]);
+    { // for Illumina alignment only
+        if (aux->popt->is_preload || aux->fp_sa[0] == 0) {
+            strcpy(str, aux->prefix);
+            strcat(str, ".bwt");
+            aux->bwt = bwt_restore_bwt(str);
+            strcpy(str, aux->prefix);
+            strcat(str, ".sa");
+            bwt_restore_sa(str, aux->bwt);
+            aux->pac = (ubyte_t *) calloc(bns->l_pac / 4 + 1, 1);
+            err_rewind(bns->fp_pac);
+            err_fread_noeof(aux->pac, 1, bns->l_pac / 4 + 1, bns->fp_pac);
         }
-        fprintf(stderr, "[bwa_sai2sam_pe_core] %lld sequences have been processed.\n", tot_seqs);
-        last_ii = ii;
     }
 
+    // core loop; with more than one thread, the next batch is read while the current one is being processed
+    bwa_print_sam_hdr(bns, rg_line);
+    kt_pipeline(aux->n_threads > 1 ? 2 : 1, pe_process, aux, 3);
+
     // destroy
-    bns_destroy(bns);
     for (i = 0; i < 2; ++i) {
-        bwa_seq_close(ks[i]);
-        err_fclose(fp_sa[i]);
+        bwa_seq_close(aux->ks[i]);
     }
-    for (iter = kh_begin(g_hash); iter != kh_end(g_hash); ++iter) {
-        if (kh_exist(g_hash, iter)) {
-            free(kh_val(g_hash, iter).a);
+    for (i = 0; i < aux->n_threads; ++i) {
+        pe_data_t *d = &aux->d[i];
+        khint_t iter;
+        for (iter = kh_begin(d->hash); iter != kh_end(d->hash); ++iter) {
+            if (kh_exist(d->hash, iter)) {
+                free(kh_val(d->hash, iter).a);
+            }
         }
+        kh_destroy(b128, d->hash);
+        kv_destroy(d->arr);
+        kv_destroy(d->pos[0]);
+        kv_destroy(d->pos[1]);
+        kv_destroy(d->aln[0]);
+        kv_destroy(d->aln[1]);
+        kv_destroy(d->sa);
+        free(d->str.s);
     }
-    kh_destroy(b128, g_hash);
-    if (pac) {
-        free(pac);
-        bwt_destroy(bwt);
+    free(aux->d);
+    if (aux->pac) {
+        free(aux->pac);
+        bwt_destroy(aux->bwt);
+    }
+}
+
+void bwa_sai2sam_pe_core(const char *prefix, char *const fn_sa[2], char *const fn_fa[2], pe_opt_t *popt, const char *rg_line) {
+    int i;
+    bntseq_t *bns;
+    pe_aux_t aux;
+    char magic[2][4];
+
+    // initialization
+    bwase_initialize(); // initialize g_log_n[] in bwase.c
+    for (i = 1; i != 256; ++i) {
+        g_log_n[i] = (int) (4.343 * log(i) + 0.5);
+    }
+    bns = bns_restore(prefix);
+    srand48(bns->seed);
+    memset(&aux, 0, sizeof(pe_aux_t));
+    aux.prefix = prefix, aux.bns = bns, aux.popt = popt;
+    aux.fp_sa[0] = xopen(fn_sa[0], "r");
+    aux.fp_sa[1] = xopen(fn_sa[1], "r");
+
+    err_fread_noeof(magic[0], 1, 4, aux.fp_sa[0]);
+    err_fread_noeof(magic[1], 1, 4, aux.fp_sa[1]);
+    if (strncmp(magic[0], SAI_MAGIC, 4) != 0 || strncmp(magic[1], SAI_MAGIC, 4) != 0) {
+        fprintf(stderr, "[E::%s] Unmatched SAI magic. Please re-run `aln' with the same version of bwa.\n", __func__);
+        exit(1);
+    }
+    err_fread_noeof(&aux.opt0, sizeof(gap_opt_t), 1, aux.fp_sa[0]);
+    err_fread_noeof(&aux.opt, sizeof(gap_opt_t), 1, aux.fp_sa[1]); // overwritten!
+    bwa_pe_run(&aux, fn_fa, rg_line);
+
+    // destroy
+    bns_destroy(bns);
+    for (i = 0; i < 2; ++i) {
+        err_fclose(aux.fp_sa[i]);
     }
 }
 
@@ -879,7 +1006,7 @@ int bwa_sai2sam_pe(int argc, char *argv[]) {
     char *prefix, *rg_line = 0;
 
     popt = bwa_init_pe_opt();
-    while ((c = getopt(argc, argv, "a:o:sPn:N:c:f:Ar:")) >= 0) {
+    while ((c = getopt(argc, argv, "a:o:sPn:N:c:f:Ar:t:")) >= 0) {
         switch (c) {
             case 'r':
                 if ((rg_line = bwa_set_rg(optarg)) == 0) {
@@ -913,6 +1040,9 @@ int bwa_sai2sam_pe(int argc, char *argv[]) {
             case 'A':
                 popt->force_isize = 1;
                 break;
+            case 't':
+                popt->n_threads = atoi(optarg);
+                break;
             default:
                 return 1;
         }
@@ -926,6 +1056,7 @@ int bwa_sai2sam_pe(int argc, char *argv[]) {
         fprintf(stderr, "         -n INT   maximum hits to output for paired reads [%d]\n", popt->n_multi);
         fprintf(stderr, "         -N INT   maximum hits to output for discordant pairs [%d]\n", popt->N_multi);
         fprintf(stderr, "         -c FLOAT prior of chimeric rate (lower bound) [%.1le]\n", popt->ap_prior);
+        fprintf(stderr, "         -t INT   number of threads [%d]\n", popt->n_threads);
         fprintf(stderr, "         -f FILE  sam file to output results to [stdout]\n");
         fprintf(stderr, "         -r STR   read group header line such as `@RG\\tID:foo\\tSM:bar' [null]\n");
         fprintf(stderr, "         -P       preload index into memory (for base-space reads only)\n");
@@ -946,3 +1077,106 @@ int bwa_sai2sam_pe(int argc, char *argv[]) {
     free(popt);
     return 0;
 }
+
+int bwa_alnpe(int argc, char *argv[]) {
+    int i, c, opte = -1;
+    gap_opt_t *opt;
+    pe_opt_t *popt;
+    char *prefix, *rg_line = 0;
+    bntseq_t *bns;
+    pe_aux_t aux;
+
+    opt = gap_init_opt();
+    popt = bwa_init_pe_opt();
+    while ((c = getopt(argc, argv, BWA_ALN_OPTS "a:j:sx:X:c:Ar:")) >= 0) {
+        switch (c) {
+            case 'r':
+                if ((rg_line = bwa_set_rg(optarg)) == 0) {
+                    return 1;
+                }
+                break;
+            case 'a':
+                popt->max_isize = atoi(optarg);
+                break;
+            case 'j':
+                popt->max_occ = atoi(optarg);
+                break;
+            case 's':
+                popt->is_sw = 0;
+                break;
+            case 'x':
+                popt->n_multi = atoi(optarg);
+                break;
+            case 'X':
+                popt->N_multi = atoi(optarg);
+                break;
+            case 'c':
+                popt->ap_prior = atof(optarg);
+                break;
+            case 'A':
+                popt->force_isize = 1;
+                break;
+            default:
+                if (!bwa_aln_set_opt(opt, c, optarg, &opte)) {
+                    return 1;
+                }
+        }
+    }
+    if (opte > 0) {
+        opt->max_gape = opte;
+        opt->mode &= ~BWA_MODE_GAPE;
+    }
+    popt->n_threads = opt->n_threads;
+
+    if (optind + 3 > argc) {
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Usage:   bwa alnpe [options] <prefix> <in1.fq> <in2.fq>\n\n");
+        bwa_aln_print_opts(opt);
+        fprintf(stderr, "         -a INT    maximum insert size [%d]\n", popt->max_isize);
+        fprintf(stderr, "         -j INT    maximum occurrences for one end (the -o option of sampe) [%d]\n", popt->max_occ);
+        fprintf(stderr, "         -x INT    maximum hits to output for paired reads (the -n option of sampe) [%d]\n", popt->n_multi);
+        fprintf(stderr, "         -X INT    maximum hits to output for discordant pairs (the -N option of sampe) [%d]\n", popt->N_multi);
+        fprintf(stderr, "         -c FLOAT  prior of chimeric rate (lower bound) [%.1le]\n", popt->ap_prior);
+        fprintf(stderr, "         -r STR    read group header line such as `@RG\\tID:foo\\tSM:bar' [null]\n");
+        fprintf(stderr, "         -s        disable Smith-Waterman for the unmapped mate\n");
+        fprintf(stderr, "         -A        disable insert size estimate (force -s)\n\n");
+        fprintf(stderr, "Notes: 1. `bwa alnpe' gives the same output as `bwa aln' on both ends followed by\n");
+        fprintf(stderr, "          `bwa sampe', but keeps the alignments in memory instead of .sai files.\n");
+        fprintf(stderr, "       2. With -b, reads of <in1.bam> and <in2.bam> are taken as if -1 and -2\n");
+        fprintf(stderr, "          were given to `bwa aln'; the two files may be the same.\n");
+        fprintf(stderr, "\n");
+        free(opt);
+        free(popt);
+        return 1;
+    }
+    if ((prefix = bwa_idx_infer_prefix(argv[optind])) == 0) {
+        fprintf(stderr, "[%s] fail to locate the index\n", __func__);
+        free(opt);
+        free(popt);
+        return 1;
+    }
+
+    // initialization
+    bwase_initialize(); // initialize g_log_n[] in bwase.c
+    for (i = 1; i != 256; ++i) {
+        g_log_n[i] = (int) (4.343 * log(i) + 0.5);
+    }
+    bns = bns_restore(prefix);
+    srand48(bns->seed);
+    memset(&aux, 0, sizeof(pe_aux_t));
+    aux.prefix = prefix, aux.bns = bns, aux.popt = popt;
+    aux.opt0 = aux.opt = *opt;
+    if (opt->mode & BWA_MODE_BAM) {
+        int mode = opt->mode & ~(BWA_MODE_BAM_SE | BWA_MODE_BAM_READ1 | BWA_MODE_BAM_READ2);
+        aux.opt0.mode = mode | BWA_MODE_BAM_READ1;
+        aux.opt.mode = mode | BWA_MODE_BAM_READ2;
+    }
+    bwa_pe_run(&aux, argv + optind + 1, rg_line);
+
+    // destroy
+    bns_destroy(bns);
+    free(prefix);
+    free(opt);
+    free(popt);
+    return 0;
+}
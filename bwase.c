@@ -10,6 +10,7 @@
 #include "bntseq.h"
 #include "utils.h"
 #include "kstring.h"
+#include "kvec.h"
 #include "bwa.h"
 #include "ksw.h"
 
@@ -128,10 +129,12 @@ int bwa_approx_mapQ(const bwa_seq_t *p, int mm) {
 }
 
 bwtint_t bwa_sa2pos(const bntseq_t *bns, const bwt_t *bwt, bwtint_t sapos, int ref_len, int *strand) {
-    bwtint_t pos_f;
+    return bwa_fr2pos(bns, bwt_sa(bwt, sapos), ref_len, strand); // position on the forward-reverse coordinate
+}
+
+bwtint_t bwa_fr2pos(const bntseq_t *bns, bwtint_t pos_f, int ref_len, int *strand) {
     int is_rev;
     *strand = 0; // initialise strand to 0 otherwise we could return without setting it
-    pos_f = bwt_sa(bwt, sapos); // position on the forward-reverse coordinate
     if (pos_f < bns->l_pac && bns->l_pac < pos_f + ref_len) {
         return (bwtint_t) -1;
     }
@@ -149,15 +152,13 @@ bwtint_t bwa_sa2pos(const bntseq_t *bns, const bwt_t *bwt, bwtint_t sapos, int r
  * whether indels appear in the read and whether calculations are
  * performed from the start or end of the read.
  */
-void bwa_cal_pac_pos_core(const bntseq_t *bns, const bwt_t *bwt, bwa_seq_t *seq, const int max_mm, const float fnr) {
+// pos_f is the SA value at seq->sa
+static void bwa_cal_pac_pos_core2(const bntseq_t *bns, bwtint_t pos_f, bwa_seq_t *seq, const int max_mm, const float fnr) {
     int max_diff, strand;
-    if (seq->type != BWA_TYPE_UNIQUE && seq->type != BWA_TYPE_REPEAT) {
-        return;
-    }
     max_diff = fnr > 0.0 ? bwa_cal_maxdiff(seq->len, BWA_AVG_ERR, fnr) : max_mm;
     seq->seQ = seq->mapQ = bwa_approx_mapQ(seq, max_diff);
     //fprintf(stderr, "%d\n", seq->ref_shift);
-    seq->pos = bwa_sa2pos(bns, bwt, seq->sa, seq->len + seq->ref_shift, &strand);
+    seq->pos = bwa_fr2pos(bns, pos_f, seq->len + seq->ref_shift, &strand);
     seq->strand = strand;
     seq->seQ = seq->mapQ = bwa_approx_mapQ(seq, max_diff);
     if (seq->pos == (bwtint_t) -1) {
@@ -165,23 +166,50 @@ void bwa_cal_pac_pos_core(const bntseq_t *bns, const bwt_t *bwt, bwa_seq_t *seq,
     }
 }
 
-void bwa_cal_pac_pos(const bntseq_t *bns, const char *prefix, int n_seqs, bwa_seq_t *seqs, int max_mm, float fnr) {
-    int i, j, strand, n_multi;
-    char str[1024];
-    bwt_t *bwt;
-    // load forward SA
-    strcpy(str, prefix);
-    strcat(str, ".bwt");
-    bwt = bwt_restore_bwt(str);
-    strcpy(str, prefix);
-    strcat(str, ".sa");
-    bwt_restore_sa(str, bwt);
-    for (i = 0; i != n_seqs; ++i) {
-        bwa_seq_t *p = &seqs[i];
-        bwa_cal_pac_pos_core(bns, bwt, p, max_mm, fnr);
+void bwa_cal_pac_pos_core(const bntseq_t *bns, const bwt_t *bwt, bwa_seq_t *seq, const int max_mm, const float fnr) {
+    if (seq->type != BWA_TYPE_UNIQUE && seq->type != BWA_TYPE_REPEAT) {
+        return;
+    }
+    bwa_cal_pac_pos_core2(bns, bwt_sa(bwt, seq->sa), seq, max_mm, fnr);
+}
+
+#define BWA_SE_BLOCK 64 // reads per task; SA values of a task are looked up together
+
+typedef struct {
+    const bntseq_t *bns;
+    const bwt_t *bwt;
+    ubyte_t *pac;
+    int n_seqs;
+    bwa_seq_t *seqs;
+    int max_mm, mode, max_top2;
+    float fnr;
+    kstring_t *sam; // one SAM line per read
+} se_worker_t;
+
+static void bwa_cal_pac_pos_worker(void *data, long b, int tid) {
+    se_worker_t *w = (se_worker_t *) data;
+    int i, j, k, strand, n_multi;
+    int beg = b * BWA_SE_BLOCK, end = beg + BWA_SE_BLOCK < w->n_seqs ? beg + BWA_SE_BLOCK : w->n_seqs;
+    // look up the SA for all reads in the block
+    kvec_t(bwtint_t) pos = {0, 0, 0};
+    for (i = beg; i != end; ++i) {
+        bwa_seq_t *p = &w->seqs[i];
+        if (p->type == BWA_TYPE_UNIQUE || p->type == BWA_TYPE_REPEAT) {
+            kv_push(bwtint_t, pos, p->sa);
+        }
+        for (j = 0; j < p->n_multi; ++j) {
+            kv_push(bwtint_t, pos, p->multi[j].pos);
+        }
+    }
+    bwt_sa_batch(w->bwt, pos.n, pos.a, pos.a);
+    for (i = beg, k = 0; i != end; ++i) {
+        bwa_seq_t *p = &w->seqs[i];
+        if (p->type == BWA_TYPE_UNIQUE || p->type == BWA_TYPE_REPEAT) {
+            bwa_cal_pac_pos_core2(w->bns, pos.a[k++], p, w->max_mm, w->fnr);
+        }
         for (j = n_multi = 0; j < p->n_multi; ++j) {
             bwt_multi1_t *q = p->multi + j;
-            q->pos = bwa_sa2pos(bns, bwt, q->pos, p->len + q->ref_shift, &strand);
+            q->pos = bwa_fr2pos(w->bns, pos.a[k++], p->len + q->ref_shift, &strand);
             q->strand = strand;
             if (q->pos != p->pos && q->pos != (bwtint_t) -1) {
                 p->multi[n_multi++] = *q;
@@ -189,6 +217,28 @@ void bwa_cal_pac_pos(const bntseq_t *bns, const char *prefix, int n_seqs, bwa_se
         }
         p->n_multi = n_multi;
     }
+    kv_destroy(pos);
+}
+
+void bwa_cal_pac_pos2(const bntseq_t *bns, const bwt_t *bwt, int n_seqs, bwa_seq_t *seqs, int max_mm, float fnr, int n_threads) {
+    extern void kt_for(int n_threads, void (*func)(void *, long, int), void *data, long n);
+    se_worker_t w;
+    memset(&w, 0, sizeof(se_worker_t));
+    w.bns = bns, w.bwt = bwt, w.n_seqs = n_seqs, w.seqs = seqs, w.max_mm = max_mm, w.fnr = fnr;
+    kt_for(n_threads, bwa_cal_pac_pos_worker, &w, (n_seqs + BWA_SE_BLOCK - 1) / BWA_SE_BLOCK);
+}
+
+void bwa_cal_pac_pos(const bntseq_t *bns, const char *prefix, int n_seqs, bwa_seq_t *seqs, int max_mm, float fnr, int n_threads) {
+    char str[1024];
+    bwt_t *bwt;
+    // load forward SA
+    strcpy(str, prefix);
+    strcat(str, ".bwt");
+    bwt = bwt_restore_bwt(str);
+    strcpy(str, prefix);
+    strcat(str, ".sa");
+    bwt_restore_sa(str, bwt);
+    bwa_cal_pac_pos2(bns, bwt, n_seqs, seqs, max_mm, fnr, n_threads);
     bwt_destroy(bwt);
 }
 
@@ -330,39 +380,25 @@ void bwa_correct_trimmed(bwa_seq_t *s) {
     s->len = s->full_len;
 }
 
-void bwa_refine_gapped(const bntseq_t *bns, int n_seqs, bwa_seq_t *seqs, ubyte_t *_pacseq) {
-    ubyte_t *pacseq;
-    int i, j, k;
-    kstring_t *str;
-
-    if (!_pacseq) {
-        pacseq = (ubyte_t *) calloc(bns->l_pac / 4 + 1, 1);
-        err_rewind(bns->fp_pac);
-        err_fread_noeof(pacseq, 1, bns->l_pac / 4 + 1, bns->fp_pac);
-    } else {
-        pacseq = _pacseq;
-    }
-    for (i = 0; i != n_seqs; ++i) {
-        bwa_seq_t *s = seqs + i;
-        seq_reverse(s->len, s->seq, 0); // IMPORTANT: s->seq is reversed here!!!
-        for (j = k = 0; j < s->n_multi; ++j) {
-            bwt_multi1_t *q = s->multi + j;
-            int n_cigar;
-            if (q->gap) { // gapped alignment
-                q->cigar = bwa_refine_gapped_core(bns->l_pac, pacseq, s->len, q->strand ? s->rseq : s->seq, q->ref_shift, &q->pos,
-                    &n_cigar);
-                q->n_cigar = n_cigar;
-                if (q->cigar) {
-                    s->multi[k++] = *q;
-                }
-            } else {
+void bwa_refine_gapped1(const bntseq_t *bns, bwa_seq_t *s, ubyte_t *pacseq, kstring_t *str) {
+    int j, k;
+    seq_reverse(s->len, s->seq, 0); // IMPORTANT: s->seq is reversed here!!!
+    for (j = k = 0; j < s->n_multi; ++j) {
+        bwt_multi1_t *q = s->multi + j;
+        int n_cigar;
+        if (q->gap) { // gapped alignment
+            q->cigar = bwa_refine_gapped_core(bns->l_pac, pacseq, s->len, q->strand ? s->rseq : s->seq, q->ref_shift, &q->pos,
+                &n_cigar);
+            q->n_cigar = n_cigar;
+            if (q->cigar) {
                 s->multi[k++] = *q;
             }
+        } else {
+            s->multi[k++] = *q;
         }
-        s->n_multi = k; // this squeezes out gapped alignments which failed the CIGAR generation
-        if (s->type == BWA_TYPE_NO_MATCH || s->type == BWA_TYPE_MATESW || s->n_gapo == 0) {
-            continue;
-        }
+    }
+    s->n_multi = k; // this squeezes out gapped alignments which failed the CIGAR generation
+    if (s->type != BWA_TYPE_NO_MATCH && s->type != BWA_TYPE_MATESW && s->n_gapo != 0) {
         s->cigar = bwa_refine_gapped_core(bns->l_pac, pacseq, s->len, s->strand ? s->rseq : s->seq, s->ref_shift, &s->pos,
             &s->n_cigar);
         if (s->cigar == 0) {
@@ -370,23 +406,31 @@ void bwa_refine_gapped(const bntseq_t *bns, int n_seqs, bwa_seq_t *seqs, ubyte_t
         }
     }
     // generate MD tag
-    str = (kstring_t *) calloc(1, sizeof(kstring_t));
-    for (i = 0; i != n_seqs; ++i) {
-        bwa_seq_t *s = seqs + i;
-        if (s->type != BWA_TYPE_NO_MATCH) {
-            int nm;
-            s->md = bwa_cal_md1(s->n_cigar, s->cigar, s->len, s->pos, s->strand ? s->rseq : s->seq, bns->l_pac, pacseq, str, &nm);
-            s->nm = nm;
-        }
+    if (s->type != BWA_TYPE_NO_MATCH) {
+        int nm;
+        s->md = bwa_cal_md1(s->n_cigar, s->cigar, s->len, s->pos, s->strand ? s->rseq : s->seq, bns->l_pac, pacseq, str, &nm);
+        s->nm = nm;
     }
-    free(str->s);
-    free(str);
-
     // correct for trimmed reads
-    for (i = 0; i < n_seqs; ++i) {
-        bwa_correct_trimmed(seqs + i);
-    }
+    bwa_correct_trimmed(s);
+}
+
+void bwa_refine_gapped(const bntseq_t *bns, int n_seqs, bwa_seq_t *seqs, ubyte_t *_pacseq) {
+    ubyte_t *pacseq;
+    int i;
+    kstring_t str = {0, 0, 0};
 
+    if (!_pacseq) {
+        pacseq = (ubyte_t *) calloc(bns->l_pac / 4 + 1, 1);
+        err_rewind(bns->fp_pac);
+        err_fread_noeof(pacseq, 1, bns->l_pac / 4 + 1, bns->fp_pac);
+    } else {
+        pacseq = _pacseq;
+    }
+    for (i = 0; i != n_seqs; ++i) {
+        bwa_refine_gapped1(bns, seqs + i, pacseq, &str);
+    }
+    free(str.s);
     if (!_pacseq) {
         free(pacseq);
     }
@@ -456,7 +500,52 @@ void bwa_print_seq(FILE *stream, bwa_seq_t *seq) {
     }
 }
 
-void bwa_print_sam1(const bntseq_t *bns, bwa_seq_t *p, const bwa_seq_t *mate, int mode, int max_top2) {
+static void bwa_format_seq(kstring_t *str, const bwa_seq_t *seq) {
+    int i;
+    ks_resize(str, str->l + seq->full_len + 1);
+    if (seq->strand == 0) {
+        for (i = 0; i < seq->full_len; ++i) {
+            str->s[str->l++] = "ACGTN"[seq->seq[i]];
+        }
+    } else {
+        for (i = seq->full_len - 1; i >= 0; --i) {
+            str->s[str->l++] = "TGCAN"[seq->seq[i]];
+        }
+    }
+    str->s[str->l] = 0;
+}
+
+// SEQ, QUAL and the tags shared by mapped and unmapped reads
+static void bwa_format_seq_qual(kstring_t *str, bwa_seq_t *p) {
+    bwa_format_seq(str, p);
+    kputc('\t', str);
+    if (p->qual) {
+        if (p->strand) {
+            seq_reverse(p->len, p->qual, 0);
+        } // reverse quality
+        kputs((char *) p->qual, str);
+    } else {
+        kputc('*', str);
+    }
+    if (bwa_rg_id[0]) {
+        kputsn("\tRG:Z:", 6, str), kputs(bwa_rg_id, str);
+    }
+    if (p->bc[0]) {
+        kputsn("\tBC:Z:", 6, str), kputs(p->bc, str);
+    }
+    if (p->clip_len < p->full_len) {
+        kputsn("\tXC:i:", 6, str), kputw(p->clip_len, str);
+    }
+}
+
+static inline void bwa_format_cigar(kstring_t *str, int n_cigar, const bwa_cigar_t *cigar) {
+    int k;
+    for (k = 0; k != n_cigar; ++k) {
+        kputw(__cigar_len(cigar[k]), str), kputc("MIDS"[__cigar_op(cigar[k])], str);
+    }
+}
+
+void bwa_format_sam1(kstring_t *str, const bntseq_t *bns, bwa_seq_t *p, const bwa_seq_t *mate, int mode, int max_top2) {
     int j;
     if (p->type != BWA_TYPE_NO_MATCH || (mate && mate->type != BWA_TYPE_NO_MATCH)) {
         int seqid, nn, am = 0, flag = p->extra_flag;
@@ -490,18 +579,19 @@ void bwa_print_sam1(const bntseq_t *bns, bwa_seq_t *p, const bwa_seq_t *mate, in
                 flag |= SAM_FMU;
             }
         }
-        err_printf("%s\t%d\t%s\t", p->name, flag, bns->anns[seqid].name);
-        err_printf("%d\t%d\t", (int) (p->pos - bns->anns[seqid].offset + 1), p->mapQ);
+        kputs(p->name, str), kputc('\t', str);
+        kputw(flag, str), kputc('\t', str);
+        kputs(bns->anns[seqid].name, str), kputc('\t', str);
+        kputw((int) (p->pos - bns->anns[seqid].offset + 1), str), kputc('\t', str);
+        kputw(p->mapQ, str), kputc('\t', str);
 
         // print CIGAR
         if (p->cigar) {
-            for (j = 0; j != p->n_cigar; ++j) {
-                err_printf("%d%c", __cigar_len(p->cigar[j]), "MIDS"[__cigar_op(p->cigar[j])]);
-            }
+            bwa_format_cigar(str, p->n_cigar, p->cigar);
         } else if (p->type == BWA_TYPE_NO_MATCH) {
-            err_printf("*");
+            kputc('*', str);
         } else {
-            err_printf("%dM", p->len);
+            kputw(p->len, str), kputc('M', str);
         }
 
         // print mate coordinate
@@ -511,39 +601,21 @@ void bwa_print_sam1(const bntseq_t *bns, bwa_seq_t *p, const bwa_seq_t *mate, in
             am = mate->seQ < p->seQ ? mate->seQ : p->seQ; // smaller single-end mapping quality
             // redundant calculation here, but should not matter too much
             bns_cnt_ambi(bns, mate->pos, mate->len, &m_seqid);
-            err_printf("\t%s\t", (seqid == m_seqid) ? "=" : bns->anns[m_seqid].name);
+            kputc('\t', str), kputs((seqid == m_seqid) ? "=" : bns->anns[m_seqid].name, str), kputc('\t', str);
             isize = (seqid == m_seqid) ? pos_5(mate) - pos_5(p) : 0;
             if (p->type == BWA_TYPE_NO_MATCH) {
                 isize = 0;
             }
-            err_printf("%d\t%lld\t", (int) (mate->pos - bns->anns[m_seqid].offset + 1), isize);
+            kputw((int) (mate->pos - bns->anns[m_seqid].offset + 1), str), kputc('\t', str);
+            kputl(isize, str), kputc('\t', str);
         } else if (mate) {
-            err_printf("\t=\t%d\t0\t", (int) (p->pos - bns->anns[seqid].offset + 1));
+            kputsn("\t=\t", 3, str), kputw((int) (p->pos - bns->anns[seqid].offset + 1), str), kputsn("\t0\t", 3, str);
         } else {
-            err_printf("\t*\t0\t0\t");
+            kputsn("\t*\t0\t0\t", 7, str);
         }
 
         // print sequence and quality
-        bwa_print_seq(stdout, p);
-        err_putchar('\t');
-        if (p->qual) {
-            if (p->strand) {
-                seq_reverse(p->len, p->qual, 0);
-            } // reverse quality
-            err_printf("%s", p->qual);
-        } else {
-            err_printf("*");
-        }
-
-        if (bwa_rg_id[0]) {
-            err_printf("\tRG:Z:%s", bwa_rg_id);
-        }
-        if (p->bc[0]) {
-            err_printf("\tBC:Z:%s", p->bc);
-        }
-        if (p->clip_len < p->full_len) {
-            err_printf("\tXC:i:%d", p->clip_len);
-        }
+        bwa_format_seq_qual(str, p);
         if (p->type != BWA_TYPE_NO_MATCH) {
             int i;
             // calculate XT tag
@@ -552,77 +624,65 @@ void bwa_print_sam1(const bntseq_t *bns, bwa_seq_t *p, const bwa_seq_t *mate, in
                 XT = 'N';
             }
             // print tags
-            err_printf("\tXT:A:%c\t%s:i:%d", XT, (mode & BWA_MODE_COMPREAD) ? "NM" : "CM", p->nm);
+            kputsn("\tXT:A:", 6, str), kputc(XT, str);
+            kputs((mode & BWA_MODE_COMPREAD) ? "\tNM:i:" : "\tCM:i:", str), kputw(p->nm, str);
             if (nn) {
-                err_printf("\tXN:i:%d", nn);
+                kputsn("\tXN:i:", 6, str), kputw(nn, str);
             }
             if (mate) {
-                err_printf("\tSM:i:%d\tAM:i:%d", p->seQ, am);
+                kputsn("\tSM:i:", 6, str), kputw(p->seQ, str);
+                kputsn("\tAM:i:", 6, str), kputw(am, str);
             }
             if (p->type != BWA_TYPE_MATESW) { // X0 and X1 are not available for this type of alignment
-                err_printf("\tX0:i:%d", p->c1);
+                kputsn("\tX0:i:", 6, str), kputw(p->c1, str);
                 if (p->c1 <= max_top2) {
-                    err_printf("\tX1:i:%d", p->c2);
+                    kputsn("\tX1:i:", 6, str), kputw(p->c2, str);
                 }
             }
-            err_printf("\tXM:i:%d\tXO:i:%d\tXG:i:%d", p->n_mm, p->n_gapo, p->n_gapo + p->n_gape);
+            kputsn("\tXM:i:", 6, str), kputw(p->n_mm, str);
+            kputsn("\tXO:i:", 6, str), kputw(p->n_gapo, str);
+            kputsn("\tXG:i:", 6, str), kputw(p->n_gapo + p->n_gape, str);
             if (p->md) {
-                err_printf("\tMD:Z:%s", p->md);
+                kputsn("\tMD:Z:", 6, str), kputs(p->md, str);
             }
             // print multiple hits
             if (p->n_multi) {
-                err_printf("\tXA:Z:");
+                kputsn("\tXA:Z:", 6, str);
                 for (i = 0; i < p->n_multi; ++i) {
                     bwt_multi1_t *q = p->multi + i;
-                    int k;
                     j = pos_end_multi(q, p->len) - q->pos;
                     nn = bns_cnt_ambi(bns, q->pos, j, &seqid);
-                    err_printf("%s,%c%d,", bns->anns[seqid].name, q->strand ? '-' : '+',
-                        (int) (q->pos - bns->anns[seqid].offset + 1));
+                    kputs(bns->anns[seqid].name, str), kputc(',', str);
+                    kputc(q->strand ? '-' : '+', str), kputw((int) (q->pos - bns->anns[seqid].offset + 1), str), kputc(',', str);
                     if (q->cigar) {
-                        for (k = 0; k < q->n_cigar; ++k) {
-                            err_printf("%d%c", __cigar_len(q->cigar[k]), "MIDS"[__cigar_op(q->cigar[k])]);
-                        }
+                        bwa_format_cigar(str, q->n_cigar, q->cigar);
                     } else {
-                        err_printf("%dM", p->len);
+                        kputw(p->len, str), kputc('M', str);
                     }
-                    err_printf(",%d;", q->gap + q->mm);
+                    kputc(',', str), kputw(q->gap + q->mm, str), kputc(';', str);
                 }
             }
         }
-        err_putchar('\n');
+        kputc('\n', str);
     } else { // this read has no match
-        //ubyte_t *s = p->strand? p->rseq : p->seq;
         int flag = p->extra_flag | SAM_FSU;
         if (mate && mate->type == BWA_TYPE_NO_MATCH) {
             flag |= SAM_FMU;
         }
-        err_printf("%s\t%d\t*\t0\t0\t*\t*\t0\t0\t", p->name, flag);
-        //Why did this work differently to the version above??
-        //for (j = 0; j != p->len; ++j) putchar("ACGTN"[(int)s[j]]);
-        bwa_print_seq(stdout, p);
-        err_putchar('\t');
-        if (p->qual) {
-            if (p->strand) {
-                seq_reverse(p->len, p->qual, 0);
-            } // reverse quality
-            err_printf("%s", p->qual);
-        } else {
-            err_printf("*");
-        }
-        if (bwa_rg_id[0]) {
-            err_printf("\tRG:Z:%s", bwa_rg_id);
-        }
-        if (p->bc[0]) {
-            err_printf("\tBC:Z:%s", p->bc);
-        }
-        if (p->clip_len < p->full_len) {
-            err_printf("\tXC:i:%d", p->clip_len);
-        }
-        err_putchar('\n');
+        kputs(p->name, str), kputc('\t', str);
+        kputw(flag, str), kputsn("\t*\t0\t0\t*\t*\t0\t0\t", 15, str);
+        bwa_format_seq_qual(str, p);
+        kputc('\n', str);
     }
 }
 
+void bwa_print_sam1(const bntseq_t *bns, bwa_seq_t *p, const bwa_seq_t *mate, int mode, int max_top2) {
+    kstring_t str = {0, 0, 0};
+    bwa_format_sam1(&str, bns, p, mate, mode, max_top2);
+    err_fputs(str.s, stdout);
+    free(str.s);
+}
+
 void bwase_initialize() {
     int i;
     for (i = 1; i != 256; ++i) {
@@ -630,84 +690,158 @@ void bwase_initialize() {
     }
 }
 
-void bwa_sai2sam_se_core(const char *prefix, const char *fn_sa, const char *fn_fa, int n_occ, const char *rg_line) {
-    extern bwa_seqio_t *bwa_open_reads(int mode, const char *fn_fa);
-    int i, n_seqs, m_aln;
-    long long tot_seqs = 0;
-    bwt_aln1_t *aln = 0;
-    bwa_seq_t *seqs;
+static void bwa_se_sam_worker(void *data, long i, int tid) {
+    se_worker_t *w = (se_worker_t *) data;
+    kstring_t *md = &w->sam[i]; // borrowed as the MD buffer until the SAM line is written
+    bwa_refine_gapped1(w->bns, &w->seqs[i], w->pac, md);
+    md->l = 0;
+    bwa_format_sam1(&w->sam[i], w->bns, &w->seqs[i], 0, w->mode, w->max_top2);
+}
+
+typedef struct {
+    const char *prefix;
+    const bntseq_t *bns;
     bwa_seqio_t *ks;
-    clock_t t;
-    bntseq_t *bns;
-    FILE *fp_sa;
+    FILE *fp_sa; // NULL for `bwa alnse', which aligns the reads itself
     gap_opt_t opt;
+    int n_occ, n_threads, m_aln;
+    bwt_aln1_t *aln;
+    bwt_t *bwt; // BWT and SA loaded once for all batches; NULL to load them per batch
+    ubyte_t *pac;
+    long long tot_seqs;
+} se_aux_t;
+
+typedef struct {
+    int n_seqs;
+    long long tot_seqs; // number of reads up to this batch
+    bwa_seq_t *seqs;
+    kstring_t *sam;
+} se_data_t;
+
+/**
+ * samse的流水线：step 0读入序列和sai，step 1多线程计算坐标和生成SAM，step 2按顺序输出。
+ * alnse没有sai文件，step 1先比对再计算坐标
+ */
+static void *se_process(void *shared, int step, void *_data) {
+    extern void kt_for(int n_threads, void (*func)(void *, long, int), void *data, long n);
+    se_aux_t *aux = (se_aux_t *) shared;
+    se_data_t *data = (se_data_t *) _data;
+    int i;
+    if (step == 0) {
+        bwa_seq_t *seqs;
+        int n_seqs;
+        if ((seqs = bwa_read_seq(aux->ks, 0x40000, &n_seqs, aux->opt.mode, aux->opt.trim_qual)) == 0) {
+            return 0;
+        }
+        // read alignment; bwa_aln2seq_core() draws random numbers, so this stays in the input order
+        for (i = 0; aux->fp_sa && i < n_seqs; ++i) {
+            bwa_seq_t *p = seqs + i;
+            int n_aln;
+            err_fread_noeof(&n_aln, 4, 1, aux->fp_sa);
+            if (n_aln > aux->m_aln) {
+                aux->m_aln = n_aln;
+                aux->aln = (bwt_aln1_t *) realloc(aux->aln, sizeof(bwt_aln1_t) * aux->m_aln);
+            }
+            err_fread_noeof(aux->aln, sizeof(bwt_aln1_t), n_aln, aux->fp_sa);
+            bwa_aln2seq_core(n_aln, aux->aln, p, 1, aux->n_occ);
+        }
+        data = (se_data_t *) calloc(1, sizeof(se_data_t));
+        data->n_seqs = n_seqs, data->seqs = seqs;
+        data->tot_seqs = aux->tot_seqs += n_seqs;
+        return data;
+    } else if (step == 1) {
+        se_worker_t w;
+        double t = realtime();
+        if (aux->fp_sa == 0) {
+            bwa_cal_sa_batch(aux->bwt, data->n_seqs, data->seqs, &aux->opt, 1);
+            // step 1 runs on batches in the input order, which keeps the random numbers the same as samse
+            for (i = 0; i < data->n_seqs; ++i) {
+                bwa_seq_t *p = data->seqs + i;
+                bwa_aln2seq_core(p->n_aln, p->aln, p, 1, aux->n_occ);
+            }
+            fprintf(stderr, "[bwa_aln_core] calculate SA coordinate... %.2f sec\n", realtime() - t);
+            t = realtime();
+        }
+        if (aux->bwt) {
+            bwa_cal_pac_pos2(aux->bns, aux->bwt, data->n_seqs, data->seqs, aux->opt.max_diff, aux->opt.fnr, aux->n_threads);
+        } else {
+            bwa_cal_pac_pos(aux->bns, aux->prefix, data->n_seqs, data->seqs, aux->opt.max_diff, aux->opt.fnr, aux->n_threads);
+        }
+        fprintf(stderr, "[bwa_aln_core] convert to sequence coordinate... %.2f sec\n", realtime() - t);
+        t = realtime();
+        memset(&w, 0, sizeof(se_worker_t));
+        w.bns = aux->bns, w.n_seqs = data->n_seqs, w.seqs = data->seqs, w.mode = aux->opt.mode, w.max_top2 = aux->opt.max_top2;
+        if (aux->pac) {
+            w.pac = aux->pac;
+        } else {
+            w.pac = (ubyte_t *) calloc(aux->bns->l_pac / 4 + 1, 1);
+            err_rewind(aux->bns->fp_pac);
+            err_fread_noeof(w.pac, 1, aux->bns->l_pac / 4 + 1, aux->bns->fp_pac);
+        }
+        w.sam = data->sam = (kstring_t *) calloc(data->n_seqs, sizeof(kstring_t));
+        kt_for(aux->n_threads, bwa_se_sam_worker, &w, data->n_seqs);
+        if (w.pac != aux->pac) {
+            free(w.pac);
+        }
+        fprintf(stderr, "[bwa_aln_core] refine gapped alignments and generate SAM... %.2f sec\n", realtime() - t);
+        return data;
+    } else if (step == 2) {
+        for (i = 0; i < data->n_seqs; ++i) {
+            err_fputs(data->sam[i].s, stdout);
+            free(data->sam[i].s);
+        }
+        free(data->sam);
+        bwa_free_read_seq(data->n_seqs, data->seqs);
+        fprintf(stderr, "[bwa_aln_core] %lld sequences have been processed.\n", data->tot_seqs);
+        free(data);
+        return 0;
+    }
+    return 0;
+}
+
+static void bwa_se_run(se_aux_t *aux, const char *fn_fa, const char *rg_line) {
+    extern bwa_seqio_t *bwa_open_reads(int mode, const char *fn_fa);
+    extern void kt_pipeline(int n_threads, void *(*func)(void *, int, void *), void *shared_data, int n_steps);
+    bwa_print_sam_hdr(aux->bns, rg_line);
+    // set ks
+    aux->ks = bwa_open_reads(aux->opt.mode, fn_fa);
+    // core loop; with more than one thread, the next batch is read while the current one is being processed
+    kt_pipeline(aux->n_threads > 1 ? 2 : 1, se_process, aux, 3);
+    bwa_seq_close(aux->ks);
+}
+
+void bwa_sai2sam_se_core(const char *prefix, const char *fn_sa, const char *fn_fa, int n_occ, const char *rg_line, int n_threads) {
+    bntseq_t *bns;
+    se_aux_t aux;
     char magic[4];
 
     // initialization
     bwase_initialize();
     bns = bns_restore(prefix);
     srand48(bns->seed);
-    fp_sa = xopen(fn_sa, "r");
+    memset(&aux, 0, sizeof(se_aux_t));
+    aux.prefix = prefix, aux.bns = bns, aux.n_occ = n_occ;
+    aux.n_threads = n_threads > 1 ? n_threads : 1;
+    aux.fp_sa = xopen(fn_sa, "r");
 
-    m_aln = 0;
-    err_fread_noeof(magic, 1, 4, fp_sa);
+    err_fread_noeof(magic, 1, 4, aux.fp_sa);
     if (strncmp(magic, SAI_MAGIC, 4) != 0) {
         fprintf(stderr, "[E::%s] Unmatched SAI magic. Please re-run `aln' with the same version of bwa.\n", __func__);
         exit(1);
     }
-    err_fread_noeof(&opt, sizeof(gap_opt_t), 1, fp_sa);
-    bwa_print_sam_hdr(bns, rg_line);
-    // set ks
-    ks = bwa_open_reads(opt.mode, fn_fa);
-    // core loop
-    while ((seqs = bwa_read_seq(ks, 0x40000, &n_seqs, opt.mode, opt.trim_qual)) != 0) {
-        tot_seqs += n_seqs;
-        t = clock();
-
-        // read alignment
-        for (i = 0; i < n_seqs; ++i) {
-            bwa_seq_t *p = seqs + i;
-            int n_aln;
-            err_fread_noeof(&n_aln, 4, 1, fp_sa);
-            if (n_aln > m_aln) {
-                m_aln = n_aln;
-                aln = (bwt_aln1_t *) realloc(aln, sizeof(bwt_aln1_t) * m_aln);
-            }
-            err_fread_noeof(aln, sizeof(bwt_aln1_t), n_aln, fp_sa);
-            bwa_aln2seq_core(n_aln, aln, p, 1, n_occ);
-        }
-
-        fprintf(stderr, "[bwa_aln_core] convert to sequence coordinate... ");
-        bwa_cal_pac_pos(bns, prefix, n_seqs, seqs, opt.max_diff, opt.fnr); // forward bwt will be destroyed here
-        fprintf(stderr, "%.2f sec\n", (float) (clock() - t) / CLOCKS_PER_SEC);
-        t = clock();
-
-        fprintf(stderr, "[bwa_aln_core] refine gapped alignments... ");
-        bwa_refine_gapped(bns, n_seqs, seqs, 0);
-        fprintf(stderr, "%.2f sec\n", (float) (clock() - t) / CLOCKS_PER_SEC);
-        t = clock();
-
-        fprintf(stderr, "[bwa_aln_core] print alignments... ");
-        for (i = 0; i < n_seqs; ++i) {
-            bwa_print_sam1(bns, seqs + i, 0, opt.mode, opt.max_top2);
-        }
-        fprintf(stderr, "%.2f sec\n", (float) (clock() - t) / CLOCKS_PER_SEC);
-
-        bwa_free_read_seq(n_seqs, seqs);
-        fprintf(stderr, "[bwa_aln_core] %lld sequences have been processed.\n", tot_seqs);
-    }
+    err_fread_noeof(&aux.opt, sizeof(gap_opt_t), 1, aux.fp_sa);
+    bwa_se_run(&aux, fn_fa, rg_line);
 
     // destroy
-    bwa_seq_close(ks);
     bns_destroy(bns);
-    err_fclose(fp_sa);
-    free(aln);
+    err_fclose(aux.fp_sa);
+    free(aux.aln);
 }
 
 int bwa_sai2sam_se(int argc, char *argv[]) {
-    int c, n_occ = 3;
+    int c, n_occ = 3, n_threads = 1;
     char *prefix, *rg_line = 0;
-    while ((c = getopt(argc, argv, "hn:f:r:")) >= 0) {
+    while ((c = getopt(argc, argv, "hn:f:r:t:")) >= 0) {
         switch (c) {
             case 'h':
                 break;
@@ -719,6 +853,9 @@ int bwa_sai2sam_se(int argc, char *argv[]) {
             case 'n':
                 n_occ = atoi(optarg);
                 break;
+            case 't':
+                n_threads = atoi(optarg);
+                break;
             case 'f':
                 xreopen(optarg, "w", stdout);
                 break;
@@ -728,14 +865,83 @@ int bwa_sai2sam_se(int argc, char *argv[]) {
     }
 
     if (optind + 3 > argc) {
-        fprintf(stderr, "Usage: bwa samse [-n max_occ] [-f out.sam] [-r RG_line] <prefix> <in.sai> <in.fq>\n");
+        fprintf(stderr, "Usage: bwa samse [-n max_occ] [-t nThreads] [-f out.sam] [-r RG_line] <prefix> <in.sai> <in.fq>\n");
         return 1;
     }
     if ((prefix = bwa_idx_infer_prefix(argv[optind])) == 0) {
         fprintf(stderr, "[%s] fail to locate the index\n", __func__);
         return 1;
     }
-    bwa_sai2sam_se_core(prefix, argv[optind + 1], argv[optind + 2], n_occ, rg_line);
+    bwa_sai2sam_se_core(prefix, argv[optind + 1], argv[optind + 2], n_occ, rg_line, n_threads);
+    free(prefix);
+    return 0;
+}
+
+int bwa_alnse(int argc, char *argv[]) {
+    int c, opte = -1, n_occ = 3;
+    char *prefix, *rg_line = 0, str[1024];
+    gap_opt_t *opt;
+    bntseq_t *bns;
+    se_aux_t aux;
+
+    opt = gap_init_opt();
+    while ((c = getopt(argc, argv, BWA_ALN_OPTS "x:r:")) >= 0) {
+        if (c == 'x') {
+            n_occ = atoi(optarg);
+        } else if (c == 'r') {
+            if ((rg_line = bwa_set_rg(optarg)) == 0) {
+                return 1;
+            }
+        } else if (!bwa_aln_set_opt(opt, c, optarg, &opte)) {
+            return 1;
+        }
+    }
+    if (opte > 0) {
+        opt->max_gape = opte;
+        opt->mode &= ~BWA_MODE_GAPE;
+    }
+
+    if (optind + 2 > argc) {
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Usage:   bwa alnse [options] <prefix> <in.fq>\n\n");
+        bwa_aln_print_opts(opt);
+        fprintf(stderr, "         -x INT    maximum hits to output for a read (the -n option of samse) [%d]\n", n_occ);
+        fprintf(stderr, "         -r STR    read group header line such as `@RG\\tID:foo\\tSM:bar' [null]\n");
+        fprintf(stderr, "\n");
+        fprintf(stderr, "Note: `bwa alnse' gives the same output as `bwa aln' followed by `bwa samse', but\n");
+        fprintf(stderr, "      keeps the alignments in memory instead of writing them to a .sai file.\n\n");
+        free(opt);
+        return 1;
+    }
+    if ((prefix = bwa_idx_infer_prefix(argv[optind])) == 0) {
+        fprintf(stderr, "[%s] fail to locate the index\n", __func__);
+        free(opt);
+        return 1;
+    }
+
+    // initialization; unlike samse, the index is loaded only once
+    bwase_initialize();
+    bns = bns_restore(prefix);
+    srand48(bns->seed);
+    memset(&aux, 0, sizeof(se_aux_t));
+    aux.prefix = prefix, aux.bns = bns, aux.n_occ = n_occ, aux.opt = *opt;
+    aux.n_threads = opt->n_threads > 1 ? opt->n_threads : 1;
+    strcpy(str, prefix);
+    strcat(str, ".bwt");
+    aux.bwt = bwt_restore_bwt(str);
+    strcpy(str, prefix);
+    strcat(str, ".sa");
+    bwt_restore_sa(str, aux.bwt);
+    aux.pac = (ubyte_t *) calloc(bns->l_pac / 4 + 1, 1);
+    err_rewind(bns->fp_pac);
+    err_fread_noeof(aux.pac, 1, bns->l_pac / 4 + 1, bns->fp_pac);
+    bwa_se_run(&aux, argv[optind + 1], rg_line);
+
+    // destroy
+    free(aux.pac);
+    bwt_destroy(aux.bwt);
+    bns_destroy(bns);
+    free(opt);
     free(prefix);
     return 0;
 }
@@ -4,6 +4,7 @@
 #include "bntseq.h"
 #include "bwt.h"
 #include "bwtaln.h"
+#include "kstring.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,6 +19,12 @@ void bwa_cal_pac_pos_core(const bntseq_t *bns, const bwt_t *bwt, bwa_seq_t *seq,
 // Refine the approximate position of the sequence to an actual placement for the sequence.
 void bwa_refine_gapped(const bntseq_t *bns, int n_seqs, bwa_seq_t *seqs, ubyte_t *_pacseq);
 
+// The same as bwa_refine_gapped() for one read, with $pacseq loaded and $str as a scratch buffer; safe to call from several threads.
+void bwa_refine_gapped1(const bntseq_t *bns, bwa_seq_t *s, ubyte_t *pacseq, kstring_t *str);
+
+// Append the SAM line of $p to $str; bwa_print_sam1() writes the same line to stdout.
+void bwa_format_sam1(kstring_t *str, const bntseq_t *bns, bwa_seq_t *p, const bwa_seq_t *mate, int mode, int max_top2);
+
 // Backfill certain alignment properties mainly centering around number of matches.
 void bwa_aln2seq(int n_aln, const bwt_aln1_t *aln, bwa_seq_t *s);
 
@@ -27,6 +34,9 @@ int64_t pos_end(const bwa_seq_t *p);
 //
 bwtint_t bwa_sa2pos(const bntseq_t *bns, const bwt_t *bwt, bwtint_t sapos, int len, int *strand);
 
+// The same as bwa_sa2pos() but with the suffix array already looked up, e.g. by bwt_sa_batch().
+bwtint_t bwa_fr2pos(const bntseq_t *bns, bwtint_t pos_f, int len, int *strand);
+
 #ifdef __cplusplus
 }
 #endif
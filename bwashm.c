@@ -1,5 +1,9 @@
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>
@@ -9,7 +13,160 @@
 #include <stdio.h>
 #include "bwa.h"
 
-int bwa_shm_stage(bwaidx_t *idx, const char *hint, const char *_tmpfn) {
+#define BWA_SHM_HUGE_MAGIC "BWAHUGE\1"
+#define BWA_HUGE_ALIGN     0x200000 // 2MB, the most common huge page size
+#define BWA_HUGETLBFS_MAGIC 0x958458f6
+
+/* With `bwa shm -P', the index is placed in a file on hugetlbfs and the POSIX
+ * shm segment /bwaidx-<name> only holds this record of where the file is. */
+typedef struct {
+    char magic[8];  // BWA_SHM_HUGE_MAGIC
+    int64_t len;    // size of the file, a multiple of $pgsize
+    int64_t pgsize; // huge page size
+    char fn[PATH_MAX + 1];
+} bwa_shm_huge_t;
+
+/**
+ * Map $fd at an address aligned to $align
+ *
+ * Huge pages, either transparent or from hugetlbfs, can only be mapped at an
+ * aligned address. An extra $align bytes are reserved and then trimmed.
+ *
+ * @param align  alignment, a multiple of the page size; 0 for a plain mmap()
+ */
+static uint8_t *bwa_shm_map(int fd, int64_t len, int prot, int64_t align) {
+    uint8_t *p, *q;
+    if (align == 0) {
+        return mmap(0, len, prot, MAP_SHARED, fd, 0);
+    }
+    len = (len + 0xfff) & ~(int64_t)0xfff;
+    p = mmap(0, len + align, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        return p;
+    }
+    q = (uint8_t *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+    if (q > p) {
+        munmap(p, q - p);
+    }
+    munmap(q + len, p + align - q);
+    if ((p = mmap(q, len, prot, MAP_SHARED | MAP_FIXED, fd, 0)) == MAP_FAILED) {
+        munmap(q, len);
+        return p;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(p, len, MADV_HUGEPAGE); // for THP on tmpfs; requires shmem_enabled to be "advise" or "always"
+#endif
+    return p;
+}
+
+// return 0 and fill $h if the segment $shmid redirects to hugetlbfs
+static int bwa_shm_read_huge(int shmid, bwa_shm_huge_t *h) {
+    struct stat st;
+    if (fstat(shmid, &st) < 0 || st.st_size != sizeof(bwa_shm_huge_t)) {
+        return -1;
+    }
+    if (pread(shmid, h, sizeof(bwa_shm_huge_t), 0) != sizeof(bwa_shm_huge_t) || memcmp(h->magic, BWA_SHM_HUGE_MAGIC, 8) != 0) {
+        return -1;
+    }
+    h->fn[PATH_MAX] = 0;
+    return 0;
+}
+
+// create the hugetlbfs file in $dir and record it in $shmid
+static uint8_t *bwa_shm_create_huge(const char *dir, const char *name, int64_t l_mem, int shmid) {
+    bwa_shm_huge_t h;
+    uint8_t *p;
+    int fd;
+
+    memset(&h, 0, sizeof(bwa_shm_huge_t));
+    memcpy(h.magic, BWA_SHM_HUGE_MAGIC, 8);
+    if (snprintf(h.fn, PATH_MAX, "%s/bwaidx-%s", dir, name) >= PATH_MAX) {
+        return 0;
+    }
+    if ((fd = open(h.fn, O_CREAT | O_RDWR | O_EXCL, 0644)) < 0) {
+        perror("open()");
+        return 0;
+    }
+    h.pgsize = BWA_HUGE_ALIGN;
+#ifdef __linux__
+    {
+        struct statfs sfs;
+        if (fstatfs(fd, &sfs) == 0) {
+            if ((uint32_t)sfs.f_type == BWA_HUGETLBFS_MAGIC) {
+                h.pgsize = sfs.f_bsize;
+            } else if (bwa_verbose >= 2) {
+                fprintf(stderr, "[W::%s] %s is not on hugetlbfs; huge pages are not guaranteed\n", __func__, dir);
+            }
+        }
+    }
+#endif
+    h.len = (l_mem + h.pgsize - 1) / h.pgsize * h.pgsize;
+    if (ftruncate(fd, h.len) < 0 || (p = bwa_shm_map(fd, h.len, PROT_READ | PROT_WRITE, h.pgsize)) == MAP_FAILED) {
+        fprintf(stderr, "[E::%s] failed to allocate %ld bytes in %s; are there enough huge pages?\n", __func__, (long)h.len, dir);
+        close(fd);
+        unlink(h.fn);
+        return 0;
+    }
+    close(fd);
+    if (ftruncate(shmid, sizeof(bwa_shm_huge_t)) < 0 || pwrite(shmid, &h, sizeof(bwa_shm_huge_t), 0) != sizeof(bwa_shm_huge_t)) {
+        munmap(p, h.len);
+        unlink(h.fn);
+        return 0;
+    }
+    return p;
+}
+
+// kilobytes of the mapping starting at $addr that are backed by huge pages; -1 if unknown
+static int64_t bwa_shm_huge_kb(const void *addr) {
+    char line[1024];
+    int64_t kb = -1, x;
+    int in = 0;
+    FILE *fp;
+    if ((fp = fopen("/proc/self/smaps", "r")) == 0) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long st, en;
+        if (sscanf(line, "%lx-%lx ", &st, &en) == 2) { // the header line of a mapping
+            if (in) {
+                break;
+            }
+            in = ((uintptr_t)addr == st);
+            kb = in ? 0 : -1;
+        } else if (in) {
+            char key[64];
+            if (sscanf(line, "%63s %ld", key, &x) == 2
+                && (strcmp(key, "ShmemPmdMapped:") == 0 || strcmp(key, "FilePmdMapped:") == 0
+                    || strcmp(key, "Shared_Hugetlb:") == 0 || strcmp(key, "Private_Hugetlb:") == 0)) {
+                kb += x;
+            }
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+static void bwa_shm_release(bwaidx_t *idx) { // release idx->mem, which is then copied to shm
+    free(idx->bwt);
+    free(idx->bns->anns);
+    free(idx->bns);
+    idx->bwt = 0, idx->bns = 0;
+    if (idx->is_mmap) {
+        munmap(idx->mem, idx->l_mem);
+    } else {
+        free(idx->mem);
+    }
+    idx->mem = 0;
+}
+
+/**
+ * Copy $idx to shared memory
+ *
+ * @param _tmpfn    temporary file to reduce peak memory; may be NULL
+ * @param huge_dir  if not NULL, place the index in a file under this hugetlbfs mount
+ * @param thp       ask for transparent huge pages on the POSIX shm segment
+ */
+int bwa_shm_stage(bwaidx_t *idx, const char *hint, const char *_tmpfn, const char *huge_dir, int thp) {
     const char *name;
     uint8_t *shm, *shm_idx;
     uint16_t *cnt;
@@ -51,8 +208,7 @@ int bwa_shm_stage(bwaidx_t *idx, const char *hint, const char *_tmpfn) {
                 rest -= fwrite(&idx->mem[idx->l_mem - rest], 1, l, fp);
             }
             fclose(fp);
-            free(idx->mem);
-            idx->mem = 0;
+            bwa_shm_release(idx);
         } else {
             fprintf(stderr, "[W::%s] fail to create the temporary file. Option '-f' is ignored.\n", __func__);
             tmpfn = 0;
@@ -67,14 +223,25 @@ int bwa_shm_stage(bwaidx_t *idx, const char *hint, const char *_tmpfn) {
     }
     l = 8 + strlen(name) + 1;
     if (cnt[1] + l > BWA_CTL_SIZE) {
+        shm_unlink(path);
         return -1;
     }
+    if (huge_dir) {
+        if ((shm_idx = bwa_shm_create_huge(huge_dir, name, idx->l_mem, shmid)) == 0) {
+            shm_unlink(path);
+            return -1;
+        }
+    } else {
+        ftruncate(shmid, idx->l_mem);
+        if ((shm_idx = bwa_shm_map(shmid, idx->l_mem, PROT_READ | PROT_WRITE, thp ? BWA_HUGE_ALIGN : 0)) == MAP_FAILED) {
+            shm_unlink(path);
+            return -1;
+        }
+    }
     memcpy(shm + cnt[1], &idx->l_mem, 8);
     memcpy(shm + cnt[1] + 8, name, l - 8);
     cnt[1] += l;
     ++cnt[0];
-    ftruncate(shmid, idx->l_mem);
-    shm_idx = mmap(0, idx->l_mem, PROT_READ | PROT_WRITE, MAP_SHARED, shmid, 0);
     if (tmpfn) {
         FILE *fp;
         fp = fopen(tmpfn, "rb");
@@ -87,10 +254,19 @@ int bwa_shm_stage(bwaidx_t *idx, const char *hint, const char *_tmpfn) {
         unlink(tmpfn);
     } else {
         memcpy(shm_idx, idx->mem, idx->l_mem);
-        free(idx->mem);
+        bwa_shm_release(idx);
     }
     bwa_mem2idx(idx->l_mem, shm_idx, idx);
-    idx->is_shm = 1;
+    idx->is_shm = 1, idx->is_mmap = 0;
+    if ((huge_dir || thp) && bwa_verbose >= 3) {
+        int64_t kb = bwa_shm_huge_kb(shm_idx);
+        if (kb > 0) {
+            double r = kb * 1024.0 < idx->l_mem ? kb * 1024.0 / idx->l_mem : 1.0; // hugetlbfs files are rounded up to whole pages
+            fprintf(stderr, "[M::%s] %.1f%% of the index is backed by huge pages\n", __func__, 100.0 * r);
+        } else if (kb == 0) {
+            fprintf(stderr, "[W::%s] no huge pages were used; with -H, /dev/shm needs to be mounted with huge=advise\n", __func__);
+        }
+    }
     return 0;
 }
 
@@ -103,6 +279,7 @@ bwaidx_t *bwa_idx_load_from_shm(const char *hint) {
     int shmid; // 内存映射句柄
     int64_t l_mem;
     bwaidx_t *idx;
+    bwa_shm_huge_t h;
 
     if (hint == 0 || hint[0] == 0) {
         return 0;
@@ -139,10 +316,32 @@ bwaidx_t *bwa_idx_load_from_shm(const char *hint) {
     if ((shmid = shm_open(path, O_RDONLY, 0)) < 0) {
         return 0;
     }
-    shm_idx = mmap(0, l_mem, PROT_READ, MAP_SHARED, shmid, 0);
+    if (bwa_shm_read_huge(shmid, &h) == 0) { // staged on hugetlbfs
+        int fd;
+        close(shmid);
+        if ((fd = open(h.fn, O_RDONLY)) < 0) {
+            return 0;
+        }
+        shm_idx = bwa_shm_map(fd, h.len, PROT_READ, h.pgsize);
+        close(fd);
+    } else {
+        // aligned such that huge pages, if the segment has them, can be mapped as such
+        shm_idx = bwa_shm_map(shmid, l_mem, PROT_READ, BWA_HUGE_ALIGN);
+    }
+    if (shm_idx == MAP_FAILED) {
+        return 0;
+    }
     idx = calloc(1, sizeof(bwaidx_t));
-    bwa_mem2idx(l_mem, shm_idx, idx);
+    if (bwa_mem2idx(l_mem, shm_idx, idx) < 0) {
+        fprintf(stderr, "[E::%s] the index in shared memory is of an incompatible format; please restage it\n", __func__);
+        munmap(shm_idx, l_mem);
+        free(idx);
+        return 0;
+    }
     idx->is_shm = 1;
+    if (idx->bwt->kmer == 0) { // staged without the k-mer table
+        bwa_idx_load_kmer(hint, idx->bwt);
+    }
     return idx;
 }
 
@@ -207,6 +406,13 @@ int bwa_shm_destroy(void) {
         memcpy(&l_mem, p, 8);
         p += 8;
         strcat(strcpy(path, "/bwaidx-"), p);
+        if ((shmid = shm_open(path, O_RDONLY, 0)) >= 0) {
+            bwa_shm_huge_t h;
+            if (bwa_shm_read_huge(shmid, &h) == 0) {
+                unlink(h.fn);
+            }
+            close(shmid);
+        }
         shm_unlink(path);
         p += strlen(p) + 1;
     }
@@ -216,22 +422,28 @@ int bwa_shm_destroy(void) {
 }
 
 int main_shm(int argc, char *argv[]) {
-    int c, to_list = 0, to_drop = 0, ret = 0;
-    char *tmpfn = 0;
-    while ((c = getopt(argc, argv, "ldf:")) >= 0) {
+    int c, to_list = 0, to_drop = 0, thp = 0, ret = 0;
+    char *tmpfn = 0, *huge_dir = 0;
+    while ((c = getopt(argc, argv, "ldf:HP:")) >= 0) {
         if (c == 'l') {
             to_list = 1;
         } else if (c == 'd') {
             to_drop = 1;
         } else if (c == 'f') {
             tmpfn = optarg;
+        } else if (c == 'H') {
+            thp = 1;
+        } else if (c == 'P') {
+            huge_dir = optarg;
         }
     }
     if (optind == argc && !to_list && !to_drop) {
-        fprintf(stderr, "\nUsage: bwa shm [-d|-l] [-f tmpFile] [idxbase]\n\n");
+        fprintf(stderr, "\nUsage: bwa shm [-d|-l] [-f tmpFile] [-H] [-P hugeDir] [idxbase]\n\n");
         fprintf(stderr, "Options: -d       destroy all indices in shared memory\n");
         fprintf(stderr, "         -l       list names of indices in shared memory\n");
-        fprintf(stderr, "         -f FILE  temporary file to reduce peak memory\n\n");
+        fprintf(stderr, "         -f FILE  temporary file to reduce peak memory\n");
+        fprintf(stderr, "         -H       back the index with transparent huge pages\n");
+        fprintf(stderr, "         -P DIR   put the index on the hugetlbfs mounted at DIR (e.g. /dev/hugepages)\n\n");
         return 1;
     }
     if (optind < argc && (to_list || to_drop)) {
@@ -240,9 +452,16 @@ int main_shm(int argc, char *argv[]) {
     }
     if (optind < argc) {
         if (bwa_shm_test(argv[optind]) == 0) {
-            bwaidx_t *idx;
-            idx = bwa_idx_load_from_disk(argv[optind], BWA_IDX_ALL);
-            if (bwa_shm_stage(idx, argv[optind], tmpfn) < 0) {
+            bwaidx_t *idx = 0;
+            char *prefix = bwa_idx_infer_prefix(argv[optind]);
+            if (prefix) { // stage the image if there is one
+                idx = bwa_idx_load_img(prefix, BWA_MMAP_VERIFY);
+                free(prefix);
+            }
+            if (idx == 0) {
+                idx = bwa_idx_load_from_disk(argv[optind], BWA_IDX_ALL);
+            }
+            if (bwa_shm_stage(idx, argv[optind], tmpfn, huge_dir, thp) < 0) {
                 fprintf(stderr, "[E::%s] failed to stage the index in shared memory\n", __func__);
                 ret = 1;
             }
@@ -31,6 +31,11 @@
 #include <assert.h>
 #include <stdint.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
 #include "utils.h"
 #include "bwt.h"
 #include "kvec.h"
@@ -53,16 +58,6 @@ void bwt_gen_cnt_table(bwt_t *bwt) {
     }
 }
 
-// compute inverse CSA
-static inline bwtint_t
-
-bwt_invPsi(const bwt_t *bwt, bwtint_t k) {
-    bwtint_t x = k - (k > bwt->primary);
-    x = bwt_B0(bwt, x);
-    x = bwt->L2[x] + bwt_occ(bwt, k, x);
-    return k == bwt->primary ? 0 : x;
-}
-
 // bwt->bwt and bwt->occ must be precalculated
 /**
  * 通过bwt数据计算sa数据
@@ -70,6 +65,75 @@ bwt_invPsi(const bwt_t *bwt, bwtint_t k) {
  * @param intv interval值，默认值32
  */
 void bwt_cal_sa(bwt_t *bwt, int intv) {
+    bwt_cal_sa2(bwt, intv, 1);
+}
+
+#define BWT_SA_WALK_SHIFT 48 // a sample being computed keeps walk_id<<BWT_SA_WALK_SHIFT | steps_from_walk_start
+
+typedef struct {
+    const bwt_t *bwt;
+    bwtint_t stride;  // a walk starts at every stride-th sample
+    bwtint_t lo, hi;  // only samples [lo,hi) are kept
+    bwtint_t *sa;     // sa[i-lo] for sample i
+    bwtint_t *len;    // steps from the start of a walk to the start of the next walk
+    uint32_t *next;   // the walk reached at the end
+} sa_walk_t;
+
+static void sa_walk_worker(void *data, long j, int tid) {
+    sa_walk_t *w = (sa_walk_t *)data;
+    const bwt_t *bwt = w->bwt;
+    bwtint_t k = (bwtint_t)j * w->stride * bwt->sa_intv, d = 0, mask = bwt->sa_intv - 1, i;
+    if (k / bwt->sa_intv >= w->lo && k / bwt->sa_intv < w->hi) {
+        w->sa[k / bwt->sa_intv - w->lo] = (bwtint_t)j << BWT_SA_WALK_SHIFT;
+    }
+    for (;;) {
+        k = bwt_invPsi(bwt, k), ++d;
+        if (k & mask) {
+            continue;
+        }
+        i = k / bwt->sa_intv;
+        if (i % w->stride == 0) { // the start of another walk
+            break;
+        }
+        if (i >= w->lo && i < w->hi) {
+            w->sa[i - w->lo] = (bwtint_t)j << BWT_SA_WALK_SHIFT | d;
+        }
+    }
+    w->len[j] = d, w->next[j] = i / w->stride;
+}
+
+/* The LF-mapping visits all rows in one cycle. Cut the cycle at every
+   stride-th sample and walk the pieces in parallel; the position of each
+   starting row is then resolved by chaining the pieces from row 0, which
+   is the sentinel at seq_len. Samples [lo,hi) are written to sa[]. */
+static void bwt_sa_walk(const bwt_t *bwt, int n_threads, bwtint_t lo, bwtint_t hi, bwtint_t *sa) {
+    extern void kt_for(int n_threads, void (*func)(void *, long, int), void *data, long n);
+    sa_walk_t w;
+    bwtint_t *pos, n_walk, i, isa, p;
+    w.bwt = bwt, w.lo = lo, w.hi = hi, w.sa = sa;
+    n_walk = n_threads * 256 < 0xffff ? n_threads * 256 : 0xffff;
+    w.stride = (bwt->n_sa + n_walk - 1) / n_walk;
+    n_walk = (bwt->n_sa + w.stride - 1) / w.stride;
+    w.len = (bwtint_t *)calloc(n_walk, sizeof(bwtint_t));
+    w.next = (uint32_t *)calloc(n_walk, 4);
+    pos = (bwtint_t *)calloc(n_walk, sizeof(bwtint_t));
+    kt_for(n_threads, sa_walk_worker, &w, n_walk);
+    for (i = 0, isa = 0, p = bwt->seq_len; i < n_walk; ++i) {
+        pos[isa] = p;
+        p -= w.len[isa];
+        isa = w.next[isa];
+    }
+    xassert(isa == 0 && p == (bwtint_t)-1, "the LF-mapping is not a single cycle.");
+    for (i = 0; i < hi - lo; ++i) {
+        bwtint_t x = sa[i];
+        sa[i] = pos[x >> BWT_SA_WALK_SHIFT] - (x & (((bwtint_t)1 << BWT_SA_WALK_SHIFT) - 1));
+    }
+    free(pos);
+    free(w.len);
+    free(w.next);
+}
+
+void bwt_cal_sa2(bwt_t *bwt, int intv, int n_threads) {
     bwtint_t isa, sa, i; // S(isa) = sa
     int intv_round = intv;
 
@@ -82,33 +146,138 @@ void bwt_cal_sa(bwt_t *bwt, int intv) {
         free(bwt->sa);
     }
     bwt->sa_intv = intv;
+    bwt->sa_width = 8;
     bwt->n_sa = (bwt->seq_len + intv) / intv;
     bwt->sa = (bwtint_t *)calloc(bwt->n_sa, sizeof(bwtint_t));
-    // calculate SA value
-    isa = 0;
-    sa = bwt->seq_len;
-    for (i = 0; i < bwt->seq_len; ++i) {
+    if (n_threads > 1 && bwt->seq_len >> BWT_SA_WALK_SHIFT == 0) {
+        bwt_sa_walk(bwt, n_threads, 0, bwt->n_sa, bwt->sa);
+    } else {
+        // calculate SA value
+        isa = 0;
+        sa = bwt->seq_len;
+        for (i = 0; i < bwt->seq_len; ++i) {
+            if (isa % intv == 0) {
+                bwt->sa[isa / intv] = sa;
+            }
+            --sa;
+            isa = bwt_invPsi(bwt, isa);
+        }
         if (isa % intv == 0) {
             bwt->sa[isa / intv] = sa;
         }
-        --sa;
-        isa = bwt_invPsi(bwt, isa);
-    }
-    if (isa % intv == 0) {
-        bwt->sa[isa / intv] = sa;
     }
     bwt->sa[0] = (bwtint_t)-1; // before this line, bwt->sa[0] = bwt->seq_len
 }
 
+void bwt_cal_sa_dump(const char *fn, bwt_t *bwt, int intv, int n_threads, int64_t max_mem) {
+    bwtint_t lo, hi, n_sa = (bwt->seq_len + intv) / intv, step, *buf;
+    FILE *fp;
+    if (max_mem <= 0 || n_sa * sizeof(bwtint_t) <= max_mem || bwt->seq_len >> BWT_SA_WALK_SHIFT) {
+        bwt_cal_sa2(bwt, intv, n_threads);
+        bwt_dump_sa(fn, bwt);
+        return;
+    }
+    xassert(intv > 0 && (intv & (intv - 1)) == 0, "SA sample interval is not a power of 2.");
+    xassert(bwt->bwt, "bwt_t::bwt is not initialized.");
+    bwt->sa_intv = intv;
+    bwt->sa_width = 8;
+    bwt->n_sa = n_sa;
+    step = max_mem / sizeof(bwtint_t) > 1 ? max_mem / sizeof(bwtint_t) : 1;
+    buf = (bwtint_t *)malloc(step * sizeof(bwtint_t));
+    fp = xopen(fn, "wb");
+    err_fwrite(&bwt->primary, sizeof(bwtint_t), 1, fp);
+    err_fwrite(bwt->L2 + 1, sizeof(bwtint_t), 4, fp);
+    err_fwrite(&bwt->sa_intv, sizeof(bwtint_t), 1, fp);
+    err_fwrite(&bwt->seq_len, sizeof(bwtint_t), 1, fp);
+    for (lo = 0; lo < n_sa; lo = hi) { // one pass over the LF-mapping cycle per block of samples
+        hi = lo + step < n_sa ? lo + step : n_sa;
+        bwt_sa_walk(bwt, n_threads, lo, hi, buf);
+        err_fwrite(buf + (lo == 0), sizeof(bwtint_t), hi - lo - (lo == 0), fp); // sa[0] is not stored
+    }
+    err_fflush(fp);
+    err_fclose(fp);
+    free(buf);
+}
+
+// the i-th SA sample, i>0; see bwt_pack_sa()
+static inline bwtint_t bwt_sa_sample(const bwt_t *bwt, bwtint_t i) {
+    uint64_t x;
+    if (bwt->sa_width == 8) {
+        return bwt->sa[i];
+    }
+    memcpy(&x, (const uint8_t *)bwt->sa + i * bwt->sa_width, 8);
+    return x & (((uint64_t)1 << (bwt->sa_width << 3)) - 1);
+}
+
 bwtint_t bwt_sa(const bwt_t *bwt, bwtint_t k) {
     bwtint_t sa = 0, mask = bwt->sa_intv - 1;
     while (k & mask) {
         ++sa;
         k = bwt_invPsi(bwt, k);
     }
-    /* without setting bwt->sa[0] = -1, the following line should be
-       changed to (sa + bwt->sa[k/bwt->sa_intv]) % (bwt->seq_len + 1) */
-    return sa + bwt->sa[k / bwt->sa_intv];
+    /* S(0) is the sentinel, which is taken as -1 such that the result is
+       not (sa + S(k)) % (bwt->seq_len + 1) */
+    return k ? sa + bwt_sa_sample(bwt, k / bwt->sa_intv) : sa - 1;
+}
+
+// prefetch what the next step of the walk at k reads
+static inline void bwt_sa_prefetch(const bwt_t *bwt, bwtint_t k) {
+    if (k & (bwt->sa_intv - 1)) {
+        __builtin_prefetch(bwt_occ_intv(bwt, k));
+    } else {
+        __builtin_prefetch((const uint8_t *)bwt->sa + k / bwt->sa_intv * bwt->sa_width);
+    }
+}
+
+void bwt_sa_batch(const bwt_t *bwt, int n, const bwtint_t *k, bwtint_t *sa) {
+    bwtint_t mask = bwt->sa_intv - 1, x[BWT_SA_LANES], d[BWT_SA_LANES];
+    int j, n_act = 0, next = 0, id[BWT_SA_LANES];
+    // a lane holds one walk; when the walk hits a sample, the lane takes the next position
+    for (; n_act < BWT_SA_LANES && next < n; ++n_act, ++next) {
+        id[n_act] = next, x[n_act] = k[next], d[n_act] = 0;
+        bwt_sa_prefetch(bwt, x[n_act]);
+    }
+    while (n_act > 0) {
+        for (j = 0; j < n_act;) {
+            if (x[j] & mask) {
+                ++d[j];
+                x[j] = bwt_invPsi(bwt, x[j]);
+                bwt_sa_prefetch(bwt, x[j]);
+                ++j;
+                continue;
+            }
+            sa[id[j]] = x[j] ? d[j] + bwt_sa_sample(bwt, x[j] / bwt->sa_intv) : d[j] - 1;
+            if (next < n) {
+                id[j] = next, x[j] = k[next], d[j] = 0;
+                bwt_sa_prefetch(bwt, x[j]);
+                ++next, ++j;
+            } else {
+                --n_act;
+                id[j] = id[n_act], x[j] = x[n_act], d[j] = d[n_act];
+            }
+        }
+    }
+}
+
+void bwt_pack_sa(bwt_t *bwt) {
+    int w = 1;
+    bwtint_t i;
+    uint8_t *p = (uint8_t *)bwt->sa;
+    if (bwt->sa_width != 8) {
+        return;
+    }
+    while (w < 8 && bwt->seq_len >> (w << 3)) {
+        ++w;
+    }
+    if (w == 8) {
+        return;
+    }
+    for (i = 1; i < bwt->n_sa; ++i) { // in place, front to back; sa[0] is not used
+        memmove(p + i * w, &bwt->sa[i], w); // the low bytes on a little-endian machine
+    }
+    bwt->sa_width = w;
+    bwt->sa = (bwtint_t *)realloc(bwt->sa, bwt_sa_bytes(bwt));
+    memset((uint8_t *)bwt->sa + bwt->n_sa * w, 0, 8);
 }
 
 static inline int __occ_aux(uint64_t y, int c) {
@@ -119,162 +288,284 @@ static inline int __occ_aux(uint64_t y, int c) {
     return ((y + (y >> 4)) & 0xf0f0f0f0f0f0f0full) * 0x101010101010101ull >> 56;
 }
 
-/**
- * 通过bwt数据计算Qcc
- * @param bwt
- * @param k
- * @param c
- * @return Qcc的值
- */
-bwtint_t bwt_occ(const bwt_t *bwt, bwtint_t k, ubyte_t c) {
-    bwtint_t n;
-    uint32_t *p, *end;
+#define __occ_aux4(bwt, b)                                            \
+    ((bwt)->cnt_table[(b)&0xff] + (bwt)->cnt_table[(b)>>8&0xff]        \
+     + (bwt)->cnt_table[(b)>>16&0xff] + (bwt)->cnt_table[(b)>>24])
+
+/********************************
+ *** Occurrence count kernels ***
+ ********************************/
+
+/* Bases in an occurrence block are counted by the kernels below. cnt4()
+ * returns the counts of A/C/G/T in the n words at p and cnt4w() those in one
+ * word, packed in 8-bit fields in the format of bwt_t::cnt_table; cnt1()
+ * returns the count of c in 32 bases. The POPCNT based cnt4/cnt4w kernels
+ * leave the A field empty, which fill() derives from the number of words.
+ * Bases zeroed by masking are counted as A and corrected by the callers. The
+ * occ routines are instantiated for each set of kernels with BWT_OCC_INIT()
+ * and selected at runtime by bwt_occ_simd(). */
+
+#ifdef __GNUC__
+#define BWT_OCC_INLINE static inline __attribute__((always_inline))
+#else
+#define BWT_OCC_INLINE static inline
+#endif
 
-    if (k == bwt->seq_len) {
-        return bwt->L2[c + 1] - bwt->L2[c];
+#define __occ_fill_none(x, n) (x)
+
+BWT_OCC_INLINE uint32_t bwt_cnt4w_table(const bwt_t *bwt, uint32_t w) {
+    return __occ_aux4(bwt, w);
+}
+
+BWT_OCC_INLINE uint32_t bwt_cnt4_table(const bwt_t *bwt, const uint32_t *p, int n) {
+    uint32_t x = 0;
+    int i;
+    for (i = 0; i < n; ++i) {
+        x += __occ_aux4(bwt, p[i]);
     }
-    if (k == (bwtint_t)(-1)) {
-        return 0;
+    return x;
+}
+
+BWT_OCC_INLINE int bwt_cnt1_table(uint64_t y, int c) {
+    return __occ_aux(y, c);
+}
+
+#ifdef __GNUC__
+#include <immintrin.h>
+
+// C/G/T counts of 32 bases in bits 8-31; A is derived from the number of bases
+__attribute__((target("popcnt")))
+BWT_OCC_INLINE uint32_t __occ_pop4(uint64_t y) {
+    uint64_t hi = y >> 1 & 0x5555555555555555ull, lo = y & 0x5555555555555555ull;
+    return (uint32_t)__builtin_popcountll(~hi & lo) << 8 | (uint32_t)__builtin_popcountll(hi & ~lo) << 16
+           | (uint32_t)__builtin_popcountll(hi & lo) << 24;
+}
+
+// add the count of A to C/G/T counts of n words
+#define __occ_fill_a(x, n) ((x) | (16 * (n) - (((x) >> 8 & 0xff) + ((x) >> 16 & 0xff) + ((x) >> 24))))
+
+__attribute__((target("popcnt")))
+BWT_OCC_INLINE uint32_t bwt_cnt4w_popcnt(const bwt_t *bwt, uint32_t w) {
+    return __occ_pop4(w);
+}
+
+__attribute__((target("popcnt")))
+BWT_OCC_INLINE int bwt_cnt1_popcnt(uint64_t y, int c) {
+    y = ((c & 2) ? y : ~y) >> 1 & ((c & 1) ? y : ~y) & 0x5555555555555555ull;
+    return __builtin_popcountll(y);
+}
+
+// a block has at most 7 words to count before the one containing k, which fit in one 256-bit vector
+__attribute__((target("popcnt,avx512f,avx512vl,avx512vpopcntdq")))
+BWT_OCC_INLINE uint32_t bwt_cnt4_vpopcnt(const bwt_t *bwt, const uint32_t *p, int n) {
+    __m256i m5 = _mm256_set1_epi64x(0x5555555555555555ll);
+    __m256i y = _mm256_maskz_loadu_epi32((__mmask8)((1U << n) - 1), p);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi64(y, 1), m5), lo = _mm256_and_si256(y, m5);
+    __m256i s = _mm256_slli_epi64(_mm256_popcnt_epi64(_mm256_andnot_si256(hi, lo)), 8);
+    s = _mm256_add_epi64(s, _mm256_slli_epi64(_mm256_popcnt_epi64(_mm256_andnot_si256(lo, hi)), 16));
+    s = _mm256_add_epi64(s, _mm256_slli_epi64(_mm256_popcnt_epi64(_mm256_and_si256(hi, lo)), 24));
+    __m128i t = _mm_add_epi64(_mm256_castsi256_si128(s), _mm256_extracti32x4_epi32(s, 1));
+    return (uint32_t)_mm_cvtsi128_si64(_mm_add_epi64(t, _mm_unpackhi_epi64(t, t)));
+}
+#endif
+
+#define BWT_OCC_INIT(SFX, ATTR, cnt4, cnt4w, fill, cnt1)                                         \
+    ATTR static bwtint_t bwt_occ_##SFX(const bwt_t *bwt, bwtint_t k, ubyte_t c) {                   \
+        bwtint_t n;                                                                                 \
+        uint32_t *p, *end;                                                                          \
+        if (k == bwt->seq_len) {                                                                    \
+            return bwt->L2[c + 1] - bwt->L2[c];                                                     \
+        }                                                                                           \
+        if (k == (bwtint_t)(-1)) {                                                                  \
+            return 0;                                                                               \
+        }                                                                                           \
+        k -= (k >= bwt->primary); /* because $ is not in bwt */                                     \
+        /* retrieve Occ at k/OCC_INTERVAL */                                                        \
+        n = ((bwtint_t *)(p = bwt_occ_intv(bwt, k)))[c];                                            \
+        p += sizeof(bwtint_t); /* jump to the start of the first BWT cell */                        \
+        /* calculate Occ up to the last k/32 */                                                     \
+        end = p + (((k >> 5) - ((k & ~OCC_INTV_MASK) >> 5)) << 1);                                  \
+        for (; p < end; p += 2) {                                                                   \
+            n += cnt1((uint64_t)p[0] << 32 | p[1], c);                                              \
+        }                                                                                           \
+        /* calculate Occ */                                                                         \
+        n += cnt1(((uint64_t)p[0] << 32 | p[1]) & ~((1ull << ((~k & 31) << 1)) - 1), c);            \
+        if (c == 0) {                                                                               \
+            n -= ~k & 31; /* corrected for the masked bits */                                       \
+        }                                                                                           \
+        return n;                                                                                   \
+    }                                                                                               \
+                                                                                                    \
+    ATTR static void bwt_2occ_##SFX(const bwt_t *bwt, bwtint_t k, bwtint_t l, ubyte_t c, bwtint_t *ok, bwtint_t *ol) { \
+        bwtint_t _k, _l;                                                                            \
+        _k = (k >= bwt->primary) ? k - 1 : k;                                                       \
+        _l = (l >= bwt->primary) ? l - 1 : l;                                                       \
+        if (_l / OCC_INTERVAL != _k / OCC_INTERVAL || k == (bwtint_t)(-1) || l == (bwtint_t)(-1)) { \
+            *ok = bwt_occ_##SFX(bwt, k, c);                                                         \
+            *ol = bwt_occ_##SFX(bwt, l, c);                                                         \
+        } else {                                                                                    \
+            bwtint_t m, n, i, j;                                                                    \
+            uint32_t *p;                                                                            \
+            if (k >= bwt->primary) {                                                                \
+                --k;                                                                                \
+            }                                                                                       \
+            if (l >= bwt->primary) {                                                                \
+                --l;                                                                                \
+            }                                                                                       \
+            n = ((bwtint_t *)(p = bwt_occ_intv(bwt, k)))[c];                                        \
+            p += sizeof(bwtint_t);                                                                  \
+            /* calculate *ok */                                                                     \
+            j = k >> 5 << 5;                                                                        \
+            for (i = k / OCC_INTERVAL * OCC_INTERVAL; i < j; i += 32, p += 2) {                     \
+                n += cnt1((uint64_t)p[0] << 32 | p[1], c);                                          \
+            }                                                                                       \
+            m = n;                                                                                  \
+            n += cnt1(((uint64_t)p[0] << 32 | p[1]) & ~((1ull << ((~k & 31) << 1)) - 1), c);        \
+            if (c == 0) {                                                                           \
+                n -= ~k & 31; /* corrected for the masked bits */                                   \
+            }                                                                                       \
+            *ok = n;                                                                                \
+            /* calculate *ol */                                                                     \
+            j = l >> 5 << 5;                                                                        \
+            for (; i < j; i += 32, p += 2) {                                                        \
+                m += cnt1((uint64_t)p[0] << 32 | p[1], c);                                          \
+            }                                                                                       \
+            m += cnt1(((uint64_t)p[0] << 32 | p[1]) & ~((1ull << ((~l & 31) << 1)) - 1), c);        \
+            if (c == 0) {                                                                           \
+                m -= ~l & 31; /* corrected for the masked bits */                                   \
+            }                                                                                       \
+            *ol = m;                                                                                \
+        }                                                                                           \
+    }                                                                                               \
+                                                                                                    \
+    ATTR static void bwt_occ4_##SFX(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4]) {                \
+        bwtint_t x;                                                                                 \
+        uint32_t *p;                                                                                \
+        int n;                                                                                      \
+        if (k == (bwtint_t)(-1)) {                                                                  \
+            memset(cnt, 0, 4 * sizeof(bwtint_t));                                                   \
+            return;                                                                                 \
+        }                                                                                           \
+        k -= (k >= bwt->primary); /* because $ is not in bwt */                                     \
+        p = bwt_occ_intv(bwt, k);                                                                   \
+        memcpy(cnt, p, 4 * sizeof(bwtint_t));                                                      \
+        p += sizeof(bwtint_t); /* sizeof(bwtint_t) = 4*(sizeof(bwtint_t)/sizeof(uint32_t)) */       \
+        n = (k >> 4) - ((k & ~OCC_INTV_MASK) >> 4); /* words before the one containing k */        \
+        x = cnt4(bwt, p, n) + cnt4w(bwt, p[n] & ~((1U << ((~k & 15) << 1)) - 1));                   \
+        x = fill(x, n + 1) - (~k & 15);                                                             \
+        cnt[0] += x & 0xff;                                                                         \
+        cnt[1] += x >> 8 & 0xff;                                                                    \
+        cnt[2] += x >> 16 & 0xff;                                                                   \
+        cnt[3] += x >> 24;                                                                          \
+    }                                                                                               \
+                                                                                                    \
+    ATTR static void bwt_2occ4_##SFX(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4]) { \
+        bwtint_t _k, _l;                                                                            \
+        _k = k - (k >= bwt->primary);                                                               \
+        _l = l - (l >= bwt->primary);                                                               \
+        if (_l >> OCC_INTV_SHIFT != _k >> OCC_INTV_SHIFT || k == (bwtint_t)(-1) || l == (bwtint_t)(-1)) { \
+            bwt_occ4_##SFX(bwt, k, cntk);                                                           \
+            bwt_occ4_##SFX(bwt, l, cntl);                                                           \
+        } else {                                                                                    \
+            bwtint_t x, y;                                                                          \
+            uint32_t *p;                                                                            \
+            int nk, nl;                                                                             \
+            k -= (k >= bwt->primary); /* because $ is not in bwt */                                 \
+            l -= (l >= bwt->primary);                                                               \
+            p = bwt_occ_intv(bwt, k);                                                               \
+            memcpy(cntk, p, 4 * sizeof(bwtint_t));                                                  \
+            p += sizeof(bwtint_t);                                                                  \
+            /* prepare cntk[] */                                                                    \
+            nk = (k >> 4) - ((k & ~OCC_INTV_MASK) >> 4);                                            \
+            nl = (l >> 4) - ((l & ~OCC_INTV_MASK) >> 4);                                            \
+            x = y = cnt4(bwt, p, nk);                                                               \
+            x += cnt4w(bwt, p[nk] & ~((1U << ((~k & 15) << 1)) - 1));                               \
+            x = fill(x, nk + 1) - (~k & 15);                                                        \
+            /* calculate cntl[] and finalize cntk[] */                                              \
+            y += cnt4(bwt, p + nk, nl - nk) + cnt4w(bwt, p[nl] & ~((1U << ((~l & 15) << 1)) - 1));  \
+            y = fill(y, nl + 1) - (~l & 15);                                                        \
+            memcpy(cntl, cntk, 4 * sizeof(bwtint_t));                                               \
+            cntk[0] += x & 0xff;                                                                    \
+            cntk[1] += x >> 8 & 0xff;                                                               \
+            cntk[2] += x >> 16 & 0xff;                                                              \
+            cntk[3] += x >> 24;                                                                     \
+            cntl[0] += y & 0xff;                                                                    \
+            cntl[1] += y >> 8 & 0xff;                                                               \
+            cntl[2] += y >> 16 & 0xff;                                                              \
+            cntl[3] += y >> 24;                                                                     \
+        }                                                                                           \
     }
-    k -= (k >= bwt->primary); // because $ is not in bwt
 
-    // retrieve Occ at k/OCC_INTERVAL
-    n = ((bwtint_t *)(p = bwt_occ_intv(bwt, k)))[c];
-    p += sizeof(bwtint_t); // jump to the start of the first BWT cell
+BWT_OCC_INIT(table, , bwt_cnt4_table, bwt_cnt4w_table, __occ_fill_none, bwt_cnt1_table)
+#ifdef __GNUC__
+// scalar POPCNT is not faster than cnt_table at counting all four bases
+BWT_OCC_INIT(popcnt, __attribute__((target("popcnt"))), bwt_cnt4_table, bwt_cnt4w_table, __occ_fill_none, bwt_cnt1_popcnt)
+BWT_OCC_INIT(vpopcnt, __attribute__((target("popcnt,avx512f,avx512vl,avx512vpopcntdq"))), bwt_cnt4_vpopcnt, bwt_cnt4w_popcnt, __occ_fill_a, bwt_cnt1_popcnt)
+#endif
+
+static struct {
+    bwtint_t (*occ)(const bwt_t *bwt, bwtint_t k, ubyte_t c);
+    void (*occ2)(const bwt_t *bwt, bwtint_t k, bwtint_t l, ubyte_t c, bwtint_t *ok, bwtint_t *ol);
+    void (*occ4)(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4]);
+    void (*occ24)(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4]);
+} bwt_occ_f = {bwt_occ_table, bwt_2occ_table, bwt_occ4_table, bwt_2occ4_table};
 
-    // calculate Occ up to the last k/32
-    end = p + (((k >> 5) - ((k & ~OCC_INTV_MASK) >> 5)) << 1);
-    for (; p < end; p += 2) {
-        n += __occ_aux((uint64_t)
-                           p[0] << 32 | p[1], c);
+int bwt_occ_simd(int level) {
+    int max_level = BWT_OCC_TABLE;
+#ifdef __GNUC__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt")) {
+        max_level = BWT_OCC_POPCNT;
+        if (__builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512vpopcntdq")) {
+            max_level = BWT_OCC_VPOPCNT;
+        }
+    }
+#endif
+    level = level < 0 || level > max_level ? max_level : level;
+    bwt_occ_f.occ = bwt_occ_table, bwt_occ_f.occ2 = bwt_2occ_table;
+    bwt_occ_f.occ4 = bwt_occ4_table, bwt_occ_f.occ24 = bwt_2occ4_table;
+#ifdef __GNUC__
+    if (level == BWT_OCC_POPCNT) {
+        bwt_occ_f.occ = bwt_occ_popcnt, bwt_occ_f.occ2 = bwt_2occ_popcnt;
+        bwt_occ_f.occ4 = bwt_occ4_popcnt, bwt_occ_f.occ24 = bwt_2occ4_popcnt;
+    } else if (level == BWT_OCC_VPOPCNT) {
+        bwt_occ_f.occ = bwt_occ_vpopcnt, bwt_occ_f.occ2 = bwt_2occ_vpopcnt;
+        bwt_occ_f.occ4 = bwt_occ4_vpopcnt, bwt_occ_f.occ24 = bwt_2occ4_vpopcnt;
     }
+#endif
+    return level;
+}
 
-    // calculate Occ
-    n += __occ_aux(((uint64_t)
-                        p[0] << 32 | p[1]) & ~((1ull << ((~k & 31) << 1)) - 1), c);
-    if (c == 0) {
-        n -= ~k & 31;
-    } // corrected for the masked bits
+#ifdef __GNUC__
+// select the kernels before main() and thus before any thread may call them
+__attribute__((constructor)) static void bwt_occ_simd_init(void) {
+    bwt_occ_simd(-1);
+}
+#endif
 
-    return n;
+/**
+ * 通过bwt数据计算Qcc
+ * @param bwt
+ * @param k
+ * @param c
+ * @return Qcc的值
+ */
+bwtint_t bwt_occ(const bwt_t *bwt, bwtint_t k, ubyte_t c) {
+    return bwt_occ_f.occ(bwt, k, c);
 }
 
 // an analogy to bwt_occ() but more efficient, requiring k <= l
 void bwt_2occ(const bwt_t *bwt, bwtint_t k, bwtint_t l, ubyte_t c, bwtint_t *ok, bwtint_t *ol) {
-    bwtint_t _k, _l;
-    _k = (k >= bwt->primary) ? k - 1 : k;
-    _l = (l >= bwt->primary) ? l - 1 : l;
-    if (_l / OCC_INTERVAL != _k / OCC_INTERVAL || k == (bwtint_t)(-1) || l == (bwtint_t)(-1)) {
-        *ok = bwt_occ(bwt, k, c);
-        *ol = bwt_occ(bwt, l, c);
-    } else {
-        bwtint_t m, n, i, j;
-        uint32_t *p;
-        if (k >= bwt->primary) {
-            --k;
-        }
-        if (l >= bwt->primary) {
-            --l;
-        }
-        n = ((bwtint_t *)(p = bwt_occ_intv(bwt, k)))[c];
-        p += sizeof(bwtint_t);
-        // calculate *ok
-        j = k >> 5 << 5;
-        for (i = k / OCC_INTERVAL * OCC_INTERVAL; i < j; i += 32, p += 2) {
-            n += __occ_aux((uint64_t)
-                               p[0] << 32 | p[1], c);
-        }
-        m = n;
-        n += __occ_aux(((uint64_t)
-                            p[0] << 32 | p[1]) & ~((1ull << ((~k & 31) << 1)) - 1), c);
-        if (c == 0) {
-            n -= ~k & 31;
-        } // corrected for the masked bits
-        *ok = n;
-        // calculate *ol
-        j = l >> 5 << 5;
-        for (; i < j; i += 32, p += 2) {
-            m += __occ_aux((uint64_t)
-                               p[0] << 32 | p[1], c);
-        }
-        m += __occ_aux(((uint64_t)
-                            p[0] << 32 | p[1]) & ~((1ull << ((~l & 31) << 1)) - 1), c);
-        if (c == 0) {
-            m -= ~l & 31;
-        } // corrected for the masked bits
-        *ol = m;
-    }
+    bwt_occ_f.occ2(bwt, k, l, c, ok, ol);
 }
 
-#define __occ_aux4(bwt, b)                                            \
-    ((bwt)->cnt_table[(b)&0xff] + (bwt)->cnt_table[(b)>>8&0xff]        \
-     + (bwt)->cnt_table[(b)>>16&0xff] + (bwt)->cnt_table[(b)>>24])
-
 void bwt_occ4(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4]) {
-    bwtint_t x;
-    uint32_t *p, tmp, *end;
-    if (k == (bwtint_t)(-1)) {
-        memset(cnt, 0, 4 * sizeof(bwtint_t));
-        return;
-    }
-    k -= (k >= bwt->primary); // because $ is not in bwt
-    p = bwt_occ_intv(bwt, k);
-    memcpy(cnt, p, 4 * sizeof(bwtint_t));
-    p += sizeof(bwtint_t); // sizeof(bwtint_t) = 4*(sizeof(bwtint_t)/sizeof(uint32_t))
-    end = p + ((k >> 4) - ((k & ~OCC_INTV_MASK) >> 4)); // this is the end point of the following loop
-    for (x = 0; p < end; ++p) {
-        x += __occ_aux4(bwt, *p);
-    }
-    tmp = *p & ~((1U << ((~k & 15) << 1)) - 1);
-    x += __occ_aux4(bwt, tmp) - (~k & 15);
-    cnt[0] += x & 0xff;
-    cnt[1] += x >> 8 & 0xff;
-    cnt[2] += x >> 16 & 0xff;
-    cnt[3] += x >> 24;
+    bwt_occ_f.occ4(bwt, k, cnt);
 }
 
 // an analogy to bwt_occ4() but more efficient, requiring k <= l
 void bwt_2occ4(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4]) {
-    bwtint_t _k, _l;
-    _k = k - (k >= bwt->primary);
-    _l = l - (l >= bwt->primary);
-    if (_l >> OCC_INTV_SHIFT != _k >> OCC_INTV_SHIFT || k == (bwtint_t)(-1) || l == (bwtint_t)(-1)) {
-        bwt_occ4(bwt, k, cntk);
-        bwt_occ4(bwt, l, cntl);
-    } else {
-        bwtint_t x, y;
-        uint32_t *p, tmp, *endk, *endl;
-        k -= (k >= bwt->primary); // because $ is not in bwt
-        l -= (l >= bwt->primary);
-        p = bwt_occ_intv(bwt, k);
-        memcpy(cntk, p, 4 * sizeof(bwtint_t));
-        p += sizeof(bwtint_t); // sizeof(bwtint_t) = 4*(sizeof(bwtint_t)/sizeof(uint32_t))
-        // prepare cntk[]
-        endk = p + ((k >> 4) - ((k & ~OCC_INTV_MASK) >> 4));
-        endl = p + ((l >> 4) - ((l & ~OCC_INTV_MASK) >> 4));
-        for (x = 0; p < endk; ++p) {
-            x += __occ_aux4(bwt, *p);
-        }
-        y = x;
-        tmp = *p & ~((1U << ((~k & 15) << 1)) - 1);
-        x += __occ_aux4(bwt, tmp) - (~k & 15);
-        // calculate cntl[] and finalize cntk[]
-        for (; p < endl; ++p) {
-            y += __occ_aux4(bwt, *p);
-        }
-        tmp = *p & ~((1U << ((~l & 15) << 1)) - 1);
-        y += __occ_aux4(bwt, tmp) - (~l & 15);
-        memcpy(cntl, cntk, 4 * sizeof(bwtint_t));
-        cntk[0] += x & 0xff;
-        cntk[1] += x >> 8 & 0xff;
-        cntk[2] += x >> 16 & 0xff;
-        cntk[3] += x >> 24;
-
-        cntl[0] += y & 0xff;
-        cntl[1] += y >> 8 & 0xff;
-        cntl[2] += y >> 16 & 0xff;
-        cntl[3] += y >> 24;
-    }
+    bwt_occ_f.occ24(bwt, k, l, cntk, cntl);
 }
 
 int bwt_match_exact(const bwt_t *bwt, int len, const ubyte_t *str, bwtint_t *sa_begin, bwtint_t *sa_end) {
@@ -282,7 +573,25 @@ int bwt_match_exact(const bwt_t *bwt, int len, const ubyte_t *str, bwtint_t *sa_
     int i;
     k = 0;
     l = bwt->seq_len;
-    for (i = len - 1; i >= 0; --i) {
+    i = len - 1;
+    if (bwt->kmer_k > 0 && len > 0) { // start from the interval of the last j bases
+        bwtint_t m = 0;
+        bwtintv_t ik;
+        int j = len < bwt->kmer_k ? len : bwt->kmer_k;
+        for (i = len - j; i < len; ++i) {
+            if (str[i] > 3) {
+                return 0;
+            } // no match
+            m = m << 2 | str[i];
+        }
+        bwt_kmer_intv(bwt, j, m, ik);
+        if (ik.x[2] == 0) {
+            return 0;
+        } // no match
+        k = ik.x[0], l = ik.x[0] + ik.x[2] - 1;
+        i = len - j - 1;
+    }
+    for (; i >= 0; --i) {
         ubyte_t c = str[i];
         if (c > 3) {
             return 0;
@@ -351,6 +660,58 @@ void bwt_extend(const bwt_t *bwt, const bwtintv_t *ik, bwtintv_t ok[4], int is_b
     ok[0].x[is_back] = ok[1].x[is_back] + ok[1].x[2];
 }
 
+// prefetch the occurrence blocks to be read by bwt_extend(bwt, ik, ok, is_back)
+void bwt_extend_prefetch(const bwt_t *bwt, const bwtintv_t *ik, int is_back) {
+#ifdef __GNUC__
+    bwtint_t k = ik->x[!is_back] - 1, l = k + ik->x[2];
+    if (k != (bwtint_t)(-1)) {
+        k -= (k >= bwt->primary);
+        __builtin_prefetch(bwt_occ_intv(bwt, k)); // one cache line per block; see BWT_ALIGN
+    }
+    l -= (l >= bwt->primary);
+    if (l >> OCC_INTV_SHIFT != k >> OCC_INTV_SHIFT) {
+        __builtin_prefetch(bwt_occ_intv(bwt, l));
+    }
+#endif
+}
+
+void bwt_gen_kmer(bwt_t *bwt, int k) {
+    bwtint_t m, n;
+    int c, j;
+    xassert(k >= 1 && k <= BWT_KMER_MAX, "k-mer length out of range.");
+    free(bwt->kmer);
+    bwt->kmer_k = k, bwt->kmer_mmap = 0;
+    bwt->kmer = (bwtint_t *)malloc(bwt_kmer_off(k + 1) * sizeof(bwtint_t));
+    for (c = 0; c < 4; ++c) {
+        bwtintv_t ik;
+        bwt_set_intv(bwt, c, ik);
+        memcpy(bwt->kmer + c * 3, ik.x, 3 * sizeof(bwtint_t));
+    }
+    // the j-mer m is extended to the (j+1)-mers m<<2|c in one bwt_extend()
+    for (j = 1; j < k; ++j) {
+        bwtint_t *p = bwt->kmer + bwt_kmer_off(j), *q = bwt->kmer + bwt_kmer_off(j + 1);
+        for (m = 0, n = (bwtint_t)1 << (j << 1); m < n; ++m) {
+            bwtintv_t ik, ok[4];
+            memcpy(ik.x, p + m * 3, 3 * sizeof(bwtint_t));
+            bwt_extend(bwt, &ik, ok, 0);
+            for (c = 0; c < 4; ++c) { // forward extension; ok[] is indexed by the complement
+                memcpy(q + ((m << 2 | c) * 3), ok[3 - c].x, 3 * sizeof(bwtint_t));
+            }
+        }
+    }
+}
+
+void bwt_kmer_prefetch(const bwt_t *bwt, int len, const uint8_t *q) {
+#ifdef __GNUC__
+    bwtint_t m = 0;
+    int j, n = len < bwt->kmer_k ? len : bwt->kmer_k;
+    for (j = 0; j < n && q[j] < 4; ++j) {
+        m = m << 2 | q[j];
+        __builtin_prefetch(bwt->kmer + bwt_kmer_off(j + 1) + m * 3);
+    }
+#endif
+}
+
 /**
  * 将p->a数组反向排列
  * @param p 待处理数据
@@ -380,6 +741,7 @@ static void bwt_reverse_intvs(bwtintv_v *p) {
  */
 int bwt_smem1a(const bwt_t *bwt, int len, const uint8_t *q, int x, int min_intv, uint64_t max_intv, bwtintv_v *mem, bwtintv_v *tmpvec[2]) {
     int i, j;
+    bwtint_t m; // q[x..i] packed, for the k-mer table
     bwtintv_t ik, ok[4]; //ik为输入，ok为输出即A/C/G/T对于的数据
     bwtintv_v a[2], *prev, *curr, *swap;
 
@@ -398,6 +760,10 @@ int bwt_smem1a(const bwt_t *bwt, int len, const uint8_t *q, int x, int min_intv,
 
     bwt_set_intv(bwt, q[x], ik); // the initial interval of a single base
     ik.info = x + 1;
+    m = q[x];
+    if (bwt->kmer_k > 1) {
+        bwt_kmer_prefetch(bwt, len - x, q + x);
+    }
 
     //1. 前向(右)匹配查找，找到最右端无法匹配的碱基索引
     for (i = x + 1, curr->n = 0; i < len; ++i) { // forward search
@@ -406,7 +772,12 @@ int bwt_smem1a(const bwt_t *bwt, int len, const uint8_t *q, int x, int min_intv,
             break;
         } else if (q[i] < 4) { // an A/C/G/T base
             int c = 3 - q[i]; // complement of q[i]
-            bwt_extend(bwt, &ik, ok, 0);
+            if (i - x < bwt->kmer_k) { // q[x..i] is in the k-mer table
+                m = m << 2 | q[i];
+                bwt_kmer_intv(bwt, i - x + 1, m, ok[c]);
+            } else {
+                bwt_extend(bwt, &ik, ok, 0);
+            }
             if (ok[c].x[2] != ik.x[2]) { // change of the interval size
                 kv_push(bwtintv_t, *curr, ik);
                 // the interval size is too small to be extended further
@@ -474,16 +845,26 @@ int bwt_smem1(const bwt_t *bwt, int len, const uint8_t *q, int x, int min_intv,
 }
 
 int bwt_seed_strategy1(const bwt_t *bwt, int len, const uint8_t *q, int x, int min_len, int max_intv, bwtintv_t *mem) {
+    bwtint_t m; // q[x..i] packed, for the k-mer table
     bwtintv_t ik, ok[4];
     memset(mem, 0, sizeof(bwtintv_t));
     if (q[x] > 3) {
         return x + 1;
     }
     bwt_set_intv(bwt, q[x], ik); // the initial interval of a single base
+    m = q[x];
+    if (bwt->kmer_k > 1) {
+        bwt_kmer_prefetch(bwt, len - x, q + x);
+    }
     for (int i = x + 1; i < len; ++i) { // forward search
         if (q[i] < 4) { // an A/C/G/T base
             int c = 3 - q[i]; // complement of q[i]
-            bwt_extend(bwt, &ik, ok, 0);
+            if (i - x < bwt->kmer_k) { // q[x..i] is in the k-mer table
+                m = m << 2 | q[i];
+                bwt_kmer_intv(bwt, i - x + 1, m, ok[c]);
+            } else {
+                bwt_extend(bwt, &ik, ok, 0);
+            }
             if (ok[c].x[2] < max_intv && i - x >= min_len) {
                 *mem = ok[c];
                 mem->info = (uint64_t)
@@ -528,7 +909,17 @@ void bwt_dump_sa(const char *fn, const bwt_t *bwt) {
     err_fwrite(bwt->L2 + 1, sizeof(bwtint_t), 4, fp);
     err_fwrite(&bwt->sa_intv, sizeof(bwtint_t), 1, fp);
     err_fwrite(&bwt->seq_len, sizeof(bwtint_t), 1, fp);
-    err_fwrite(bwt->sa + 1, sizeof(bwtint_t), bwt->n_sa - 1, fp);
+    if (bwt->sa_width == 8) {
+        err_fwrite(bwt->sa + 1, sizeof(bwtint_t), bwt->n_sa - 1, fp);
+    } else { // unpack; the file always has 64-bit samples
+        bwtint_t i, j, buf[0x1000];
+        for (i = 1; i < bwt->n_sa; i += j) {
+            for (j = 0; j < 0x1000 && i + j < bwt->n_sa; ++j) {
+                buf[j] = bwt_sa_sample(bwt, i + j);
+            }
+            err_fwrite(buf, sizeof(bwtint_t), j, fp);
+        }
+    }
     err_fflush(fp);
     err_fclose(fp);
 }
@@ -567,6 +958,75 @@ void bwt_restore_sa(const char *fn, bwt_t *bwt) {
 
     fread_fix(fp, sizeof(bwtint_t) * (bwt->n_sa - 1), bwt->sa + 1);
     err_fclose(fp);
+    bwt->sa_width = 8;
+    bwt_pack_sa(bwt);
+}
+
+#define BWT_FP_STEP 16 // bwt_fingerprint() reads the counts of one occurrence block in 16
+
+/* CRC32 of primary, seq_len, L2 and the occurrence counts of every
+ * BWT_FP_STEP-th block; any two BWTs of the same length and base
+ * composition differ in the counts of some block, and almost surely in
+ * those of sampled blocks, which are 2048 bases apart. */
+static uint32_t bwt_fingerprint(const bwt_t *bwt) {
+    uLong crc = crc32(0L, Z_NULL, 0);
+    bwtint_t k;
+    crc = crc32(crc, (const Bytef *)&bwt->primary, sizeof(bwtint_t));
+    crc = crc32(crc, (const Bytef *)&bwt->seq_len, sizeof(bwtint_t));
+    crc = crc32(crc, (const Bytef *)bwt->L2, 5 * sizeof(bwtint_t));
+    for (k = 0; k <= bwt->seq_len; k += OCC_INTERVAL * BWT_FP_STEP) {
+        crc = crc32(crc, (const Bytef *)bwt_occ_intv(bwt, k), 4 * sizeof(bwtint_t));
+    }
+    return crc;
+}
+
+/* The .kmer file starts with four words: k, primary, seq_len and
+ * bwt_fingerprint() of the BWT it was built from, followed by the table
+ * itself. */
+void bwt_dump_kmer(const char *fn, const bwt_t *bwt) {
+    FILE *fp;
+    bwtint_t hdr[4];
+    hdr[0] = bwt->kmer_k, hdr[1] = bwt->primary, hdr[2] = bwt->seq_len, hdr[3] = bwt_fingerprint(bwt);
+    fp = xopen(fn, "wb");
+    err_fwrite(hdr, sizeof(bwtint_t), 4, fp);
+    err_fwrite(bwt->kmer, sizeof(bwtint_t), bwt_kmer_off(bwt->kmer_k + 1), fp);
+    err_fflush(fp);
+    err_fclose(fp);
+}
+
+int bwt_restore_kmer(const char *fn, bwt_t *bwt) {
+    struct stat st;
+    bwtint_t *hdr;
+    int fd;
+
+    if ((fd = open(fn, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < 4 * (off_t)sizeof(bwtint_t)) {
+        close(fd);
+        return -1;
+    }
+    hdr = (bwtint_t *)mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        return -1;
+    }
+    if (hdr[0] < 1 || hdr[0] > BWT_KMER_MAX || hdr[1] != bwt->primary || hdr[2] != bwt->seq_len
+        || (bwtint_t)st.st_size != (4 + bwt_kmer_off(hdr[0] + 1)) * sizeof(bwtint_t) || hdr[3] != bwt_fingerprint(bwt)) {
+        munmap(hdr, st.st_size);
+        return -2;
+    }
+    bwt->kmer_k = hdr[0], bwt->kmer_mmap = 1;
+    bwt->kmer = hdr + 4;
+    return 0;
+}
+
+uint32_t *bwt_alloc_bwt(bwtint_t bwt_size) {
+    void *p;
+    if (posix_memalign(&p, BWT_ALIGN, bwt_size * 4) != 0) {
+        err_fatal(__func__, "failed to allocate %llu bytes for the BWT", (unsigned long long)bwt_size * 4);
+    }
+    return (uint32_t *)p;
 }
 
 /**
@@ -583,7 +1043,7 @@ bwt_t *bwt_restore_bwt(const char *fn) {
     err_fseek(fp, 0, SEEK_END);
     //设置bwt数据长度并分配内存空间，size: (length - 40)/4
     bwt->bwt_size = (err_ftell(fp) - sizeof(bwtint_t) * 5) >> 2;
-    bwt->bwt = (uint32_t *)calloc(bwt->bwt_size, 4);
+    bwt->bwt = bwt_alloc_bwt(bwt->bwt_size);
     //重置文件句柄到文件头后读取文件内容
     err_fseek(fp, 0, SEEK_SET);
     err_fread_noeof(&bwt->primary, sizeof(bwtint_t), 1, fp);
@@ -607,5 +1067,10 @@ void bwt_destroy(bwt_t *bwt) {
     }
     free(bwt->sa);
     free(bwt->bwt);
+    if (bwt->kmer_mmap) {
+        munmap(bwt->kmer - 4, (4 + bwt_kmer_off(bwt->kmer_k + 1)) * sizeof(bwtint_t));
+    } else {
+        free(bwt->kmer);
+    }
     free(bwt);
 }
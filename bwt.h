@@ -38,6 +38,10 @@
 #define OCC_INTERVAL   (1LL<<OCC_INTV_SHIFT)
 #define OCC_INTV_MASK  (OCC_INTERVAL - 1)
 
+#define BWT_OCC_TABLE   0 // cnt_table lookups
+#define BWT_OCC_POPCNT  1 // 64-bit POPCNT for bwt_occ()/bwt_2occ(); cnt_table for the rest
+#define BWT_OCC_VPOPCNT 2 // in addition, AVX-512 VPOPCNTQ for bwt_occ4()/bwt_2occ4()
+
 #ifndef BWA_UBYTE
 #define BWA_UBYTE
 typedef unsigned char ubyte_t;
@@ -57,6 +61,11 @@ typedef struct {
     int sa_intv; //分组大小，必须为2的n次幂
     bwtint_t n_sa; //sa的长度
     bwtint_t *sa; //后缀数组的数据，即基因字符在原始序列中的位置
+    int sa_width; // bytes per sample in sa; 8 unless packed by bwt_pack_sa()
+    // k-mer lookup table (optional)
+    int kmer_k; // all k-mers of length 1..kmer_k are tabulated; 0 if there is no table
+    int kmer_mmap; // whether kmer is memory-mapped
+    bwtint_t *kmer; // bi-intervals of the j-mers, starting at kmer+bwt_kmer_off(j); see bwt_kmer_intv()
 } bwt_t;
 
 typedef struct {
@@ -83,6 +92,9 @@ typedef struct {
 #define bwt_bwt(b, k) ((b)->bwt[((k)>>7<<4) + sizeof(bwtint_t) + (((k)&0x7f)>>4)])
 #define bwt_occ_intv(b, k) ((b)->bwt + ((k)>>7<<4))
 
+// an occurrence block (4 counts + 128 bases) is exactly 64 bytes; keep bwt_t::bwt aligned so a block never straddles two cache lines
+#define BWT_ALIGN 64
+
 /* retrieve a character from the $-removed BWT string. Note that
  * bwt_t::bwt is not exactly the BWT string and therefore this macro is
  * called bwt_B0 instead of bwt_B */
@@ -95,6 +107,27 @@ typedef struct {
     (ik).info = 0 \
     )
 
+#define BWT_KMER_MAX 13 // the table takes 24*(4^(k+1)-4)/3 bytes
+#define BWT_KMER_DEF 10 // default for `bwa index'
+
+#define BWT_SA_LANES 32
+
+// size of bwt_t::sa in bytes; packed samples are read 8 bytes at a time, hence the padding
+#define bwt_sa_bytes(b) ((b)->n_sa * (b)->sa_width + ((b)->sa_width < 8 ? 8 : 0))
+
+// offset of the 4^j bi-intervals of all j-mers in bwt_t::kmer
+#define bwt_kmer_off(j) ((((bwtint_t)1 << ((j) << 1)) - 4) / 3 * 3)
+
+/* bi-interval of j-mer m, with the first base in the most significant bits;
+ * identical to bwt_set_intv() on the first base followed by forward
+ * bwt_extend() on the rest, except that ik.info is set to 0 */
+#define bwt_kmer_intv(b, j, m, ik) ( \
+    (ik).x[0] = (b)->kmer[bwt_kmer_off(j) + (m) * 3], \
+    (ik).x[1] = (b)->kmer[bwt_kmer_off(j) + (m) * 3 + 1], \
+    (ik).x[2] = (b)->kmer[bwt_kmer_off(j) + (m) * 3 + 2], \
+    (ik).info = 0 \
+    )
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -105,22 +138,94 @@ void bwt_dump_sa(const char *fn, const bwt_t *bwt);
 
 bwt_t *bwt_restore_bwt(const char *fn);
 
+/**
+ * Allocate bwt_t::bwt with BWT_ALIGN-byte alignment; the memory is NOT zeroed
+ * and can be freed with free()
+ */
+uint32_t *bwt_alloc_bwt(bwtint_t bwt_size);
+
 void bwt_restore_sa(const char *fn, bwt_t *bwt);
 
+/**
+ * Build the k-mer lookup table, for all k-mers of length up to $k
+ */
+void bwt_gen_kmer(bwt_t *bwt, int k);
+
+void bwt_dump_kmer(const char *fn, const bwt_t *bwt);
+
+/**
+ * Memory-map the k-mer lookup table
+ *
+ * @return   0 on success; -1 if the file is absent or unreadable; -2 if it
+ *           was built for a different BWT
+ */
+int bwt_restore_kmer(const char *fn, bwt_t *bwt);
+
+/**
+ * Prefetch the k-mer table entries of q[0..j) for j up to min(len,kmer_k)
+ */
+void bwt_kmer_prefetch(const bwt_t *bwt, int len, const uint8_t *q);
+
 void bwt_destroy(bwt_t *bwt);
 
 void bwt_bwtgen(const char *fn_pac, const char *fn_bwt); // from BWT-SW
 void bwt_bwtgen2(const char *fn_pac, const char *fn_bwt, int block_size); // from BWT-SW
+void bwt_bwtgen3(const char *fn_pac, const char *fn_bwt, int block_size, int n_threads);
 void bwt_cal_sa(bwt_t *bwt, int intv);
 
+/**
+ * The same as bwt_cal_sa() but with the LF-mapping cycle cut into pieces
+ * that are walked by $n_threads threads; the samples are identical
+ */
+void bwt_cal_sa2(bwt_t *bwt, int intv, int n_threads);
+
+/**
+ * Compute the SA samples and write them to $fn as bwt_dump_sa() does
+ *
+ * With $max_mem > 0, at most $max_mem bytes of samples are held at a time:
+ * the LF-mapping cycle is walked once per block of samples and each block
+ * is appended to the file. $bwt->sa is not set in that case.
+ */
+void bwt_cal_sa_dump(const char *fn, bwt_t *bwt, int intv, int n_threads, int64_t max_mem);
+
 void bwt_bwtupdate_core(bwt_t *bwt);
 
+/**
+ * Write the BWT interleaved with Occ to $fn, as bwt_bwtupdate_core() and
+ * bwt_dump_bwt() would, without holding the interleaved BWT in memory
+ *
+ * Chunk counts are computed in parallel and prefix-summed; chunks are then
+ * interleaved a few at a time by $n_threads threads and appended to the file.
+ * $bwt is not modified, so $fn may be the file it was restored from.
+ */
+void bwt_bwtupdate_dump(const char *fn, const bwt_t *bwt, int n_threads);
+
 bwtint_t bwt_occ(const bwt_t *bwt, bwtint_t k, ubyte_t c);
 
 void bwt_occ4(const bwt_t *bwt, bwtint_t k, bwtint_t cnt[4]);
 
 bwtint_t bwt_sa(const bwt_t *bwt, bwtint_t k);
 
+/**
+ * Look up the suffix array at n positions
+ *
+ * Equivalent to calling bwt_sa() on each of k[0..n), but the LF-mapping
+ * walks of up to BWT_SA_LANES positions are interleaved, with the next
+ * occurrence block of each walk prefetched, to overlap their cache misses.
+ *
+ * @param k   SA coordinates
+ * @param sa  (out) SA values; may be the same array as $k
+ */
+void bwt_sa_batch(const bwt_t *bwt, int n, const bwtint_t *k, bwtint_t *sa);
+
+/**
+ * Pack the SA samples into the fewest bytes that hold seq_len
+ *
+ * For a human genome, this is 5 bytes instead of 8 per sample.
+ * bwt_restore_sa() calls this; the .sa file keeps 64-bit samples.
+ */
+void bwt_pack_sa(bwt_t *bwt);
+
 // more efficient version of bwt_occ/bwt_occ4 for retrieving two close Occ values
 void bwt_gen_cnt_table(bwt_t *bwt);
 
@@ -128,6 +233,20 @@ void bwt_2occ(const bwt_t *bwt, bwtint_t k, bwtint_t l, ubyte_t c, bwtint_t *ok,
 
 void bwt_2occ4(const bwt_t *bwt, bwtint_t k, bwtint_t l, bwtint_t cntk[4], bwtint_t cntl[4]);
 
+/**
+ * Select how bwt_occ() and friends count bases in an occurrence block
+ *
+ * All methods give identical results. By default, the fastest one supported
+ * by the CPU is selected when the program starts. Not thread-safe: call it
+ * before any thread uses bwt_occ() and friends.
+ *
+ * @param level   one of BWT_OCC_*; negative for the fastest supported
+ *
+ * @return        the level in use, which may be lower than $level if the
+ *                CPU does not support it
+ */
+int bwt_occ_simd(int level);
+
 int bwt_match_exact(const bwt_t *bwt, int len, const ubyte_t *str, bwtint_t *sa_begin, bwtint_t *sa_end);
 
 int bwt_match_exact_alt(const bwt_t *bwt, int len, const ubyte_t *str, bwtint_t *k0, bwtint_t *l0);
@@ -137,6 +256,12 @@ int bwt_match_exact_alt(const bwt_t *bwt, int len, const ubyte_t *str, bwtint_t
  */
 void bwt_extend(const bwt_t *bwt, const bwtintv_t *ik, bwtintv_t ok[4], int is_back);
 
+/**
+ * Prefetch the occurrence blocks that bwt_extend() will read for _ik_, such
+ * that the cache misses of many independent extensions can overlap.
+ */
+void bwt_extend_prefetch(const bwt_t *bwt, const bwtintv_t *ik, int is_back);
+
 /**
  * Given a query _q_, collect potential SMEMs covering position _x_ and store them in _mem_.
  * Return the end of the longest exact match starting from _x_.
@@ -147,6 +272,14 @@ int bwt_smem1a(const bwt_t *bwt, int len, const uint8_t *q, int x, int min_intv,
 
 int bwt_seed_strategy1(const bwt_t *bwt, int len, const uint8_t *q, int x, int min_len, int max_intv, bwtintv_t *mem);
 
+// compute inverse CSA: the row of the suffix one position upstream of the suffix at row k
+static inline bwtint_t bwt_invPsi(const bwt_t *bwt, bwtint_t k) {
+    bwtint_t x = k - (k > bwt->primary);
+    x = bwt_B0(bwt, x);
+    x = bwt->L2[x] + bwt_occ(bwt, k, x);
+    return k == bwt->primary ? 0 : x;
+}
+
 #ifdef __cplusplus
 }
 #endif
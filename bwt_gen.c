@@ -28,6 +28,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <errno.h>
+#include <unistd.h>
 #include "QSufSort.h"
 
 #ifdef USE_MALLOC_WRAPPERS
@@ -98,6 +99,7 @@ typedef struct BWTInc {
     unsigned int *packedText;
     unsigned char *textBuffer;
     unsigned int *packedShift;
+    int numberOfThread;
 } BWTInc;
 
 static bgint_t TextLengthFromBytePacked(bgint_t bytePackedLength, unsigned int bitPerChar, unsigned int lastByteLength) {
@@ -728,10 +730,25 @@ static bgint_t BWTIncGetAbsoluteRank(
     return seqIndexFromStart[firstCharInLastIteration];
 }
 
-static void BWTIncSortKey(bgint_t *__restrict key, bgint_t *__restrict seq, const bgint_t numItem) {
+// Ranges left unsorted by BWTIncSortKeyRange(); they are disjoint and can be sorted concurrently
+typedef struct BWTIncSortRange {
+    int64_t maxSize;                    // ranges of at most this size are deferred
+    int64_t n, m;
+    int64_t *range;                        // [low, high] pairs
+} BWTIncSortRange;
+
+/**
+ * Quicksort key[lowIndex..highIndex] together with seq
+ *
+ * If split is not NULL, ranges no larger than split->maxSize are recorded
+ * instead of being sorted. Sorting each of them later with split==NULL
+ * yields exactly the same arrays as a single serial call.
+ */
+static void BWTIncSortKeyRange(bgint_t *__restrict key, bgint_t *__restrict seq, int64_t lowIndex, int64_t highIndex,
+                               BWTIncSortRange *split) {
 #define EQUAL_KEY_THRESHOLD    4    // Partition for equal key if data array size / the number of data with equal value with pivot < EQUAL_KEY_THRESHOLD
 
-    int64_t lowIndex, highIndex, midIndex;
+    int64_t midIndex;
     int64_t lowPartitionIndex, highPartitionIndex;
     int64_t lowStack[32], highStack[32];
     int stackDepth;
@@ -739,19 +756,30 @@ static void BWTIncSortKey(bgint_t *__restrict key, bgint_t *__restrict seq, cons
     bgint_t tempSeq, tempKey;
     int64_t numberOfEqualKey;
 
-    if (numItem < 2) {
+    if (highIndex <= lowIndex) {
         return;
     }
 
     stackDepth = 0;
 
-    lowIndex = 0;
-    highIndex = numItem - 1;
-
     for (;;) {
 
         for (;;) {
 
+            // Leave the range to the caller
+            if (split && highIndex - lowIndex < split->maxSize) {
+                if (highIndex > lowIndex) {
+                    if (split->n == split->m) {
+                        split->m = split->m ? split->m << 1 : 16;
+                        split->range = (int64_t *) realloc(split->range, split->m * 2 * sizeof(int64_t));
+                    }
+                    split->range[split->n * 2] = lowIndex;
+                    split->range[split->n * 2 + 1] = highIndex;
+                    split->n++;
+                }
+                break;
+            }
+
             // Sort small array of data
             if (highIndex - lowIndex < BWTINC_INSERT_SORT_NUM_ITEM) {     // Insertion sort on smallest arrays
                 for (i = lowIndex + 1; i <= highIndex; i++) {
@@ -908,6 +936,71 @@ static void BWTIncSortKey(bgint_t *__restrict key, bgint_t *__restrict seq, cons
     }
 }
 
+static void BWTIncSortKey(bgint_t *__restrict key, bgint_t *__restrict seq, const bgint_t numItem) {
+    BWTIncSortKeyRange(key, seq, 0, (int64_t) numItem - 1, NULL);
+}
+
+typedef struct {
+    bgint_t *key, *seq;
+    const int64_t *group;                // [low, high] of each group
+    BWTIncSortRange *split;                // one per group
+    int64_t *range;                        // all deferred ranges
+} BWTIncSortWorker;
+
+static void BWTIncSortGroupWorker(void *data, long i, int tid) {
+    BWTIncSortWorker *w = (BWTIncSortWorker *) data;
+    BWTIncSortKeyRange(w->key, w->seq, w->group[i * 2], w->group[i * 2 + 1], &w->split[i]);
+}
+
+static void BWTIncSortRangeWorker(void *data, long i, int tid) {
+    BWTIncSortWorker *w = (BWTIncSortWorker *) data;
+    BWTIncSortKeyRange(w->key, w->seq, w->range[i * 2], w->range[i * 2 + 1], NULL);
+}
+
+/**
+ * Sort several disjoint groups of key/seq with numberOfThread threads
+ *
+ * Each group is first partitioned into small ranges (one thread per
+ * group), and the ranges are then sorted in parallel. The result is
+ * identical to calling BWTIncSortKey() on each group.
+ */
+static void BWTIncSortKeyGroups(bgint_t *key, bgint_t *seq, const int64_t *group, int numberOfGroup,
+                                int64_t numItem, int numberOfThread) {
+    extern void kt_for(int n_threads, void (*func)(void *, long, int), void *data, long n);
+    BWTIncSortWorker w;
+    BWTIncSortRange split[ALPHABET_SIZE + 2];
+    int64_t maxSize, numberOfRange, k;
+    int i;
+
+    if (numberOfThread <= 1) {
+        for (i = 0; i < numberOfGroup; i++) {
+            BWTIncSortKeyRange(key, seq, group[i * 2], group[i * 2 + 1], NULL);
+        }
+        return;
+    }
+
+    // 8 ranges per thread balance the load without too much serial partitioning
+    maxSize = max(numItem / (numberOfThread * 8), 1 << 16);
+    memset(split, 0, sizeof(split));
+    for (i = 0; i < numberOfGroup; i++) {
+        split[i].maxSize = maxSize;
+    }
+    w.key = key, w.seq = seq, w.group = group, w.split = split;
+    kt_for(min(numberOfThread, numberOfGroup), BWTIncSortGroupWorker, &w, numberOfGroup);
+
+    for (i = 0, numberOfRange = 0; i < numberOfGroup; i++) {
+        numberOfRange += split[i].n;
+    }
+    w.range = (int64_t *) malloc((numberOfRange + 1) * 2 * sizeof(int64_t));
+    for (i = 0, k = 0; i < numberOfGroup; i++) {
+        memcpy(w.range + k * 2, split[i].range, split[i].n * 2 * sizeof(int64_t));
+        k += split[i].n;
+        free(split[i].range);
+    }
+    kt_for(numberOfThread, BWTIncSortRangeWorker, &w, numberOfRange);
+    free(w.range);
+}
+
 
 static void BWTIncBuildRelativeRank(
     bgint_t *__restrict sortedRank, bgint_t *__restrict seq,
@@ -1125,15 +1218,125 @@ void BWTClearTrailingBwtCode(BWT *bwt) {
 }
 
 
+// Fill the occValue of the occMajorIndex-th major interval and return its character counts in occMajor
+static void BWTGenerateOccValueMajor(
+    const unsigned int *bwt, unsigned int *__restrict occValue, const bgint_t occMajorIndex,
+    bgint_t *__restrict occMajor, const unsigned int *decodeTable) {
+    const bgint_t numberOfOccIntervalPerMajor = OCC_INTERVAL_MAJOR / OCC_INTERVAL;
+    const unsigned int wordBetweenOccValue = OCC_INTERVAL / CHAR_PER_WORD;
+    unsigned int c;
+    bgint_t i, j;
+    bgint_t occIndex, bwtIndex;
+    bgint_t sum;
+    bgint_t tempOccValue0[ALPHABET_SIZE], tempOccValue1[ALPHABET_SIZE];
+
+    occIndex = (occMajorIndex - 1) * (numberOfOccIntervalPerMajor / 2);
+    bwtIndex = (occMajorIndex - 1) * (OCC_INTERVAL_MAJOR / CHAR_PER_WORD);
+    tempOccValue0[0] = 0;
+    tempOccValue0[1] = 0;
+    tempOccValue0[2] = 0;
+    tempOccValue0[3] = 0;
+
+    for (i = 0; i < numberOfOccIntervalPerMajor / 2; i++) {
+
+        sum = 0;
+        tempOccValue1[0] = tempOccValue0[0];
+        tempOccValue1[1] = tempOccValue0[1];
+        tempOccValue1[2] = tempOccValue0[2];
+        tempOccValue1[3] = tempOccValue0[3];
+
+        for (j = 0; j < wordBetweenOccValue; j++) {
+            c = bwt[bwtIndex];
+            sum += decodeTable[c >> 16];
+            sum += decodeTable[c & 0x0000FFFF];
+            bwtIndex++;
+        }
+        if (!DNA_OCC_SUM_EXCEPTION(sum)) {
+            tempOccValue1[0] += (sum & 0x000000FF);
+            sum >>= 8;
+            tempOccValue1[1] += (sum & 0x000000FF);
+            sum >>= 8;
+            tempOccValue1[2] += (sum & 0x000000FF);
+            sum >>= 8;
+            tempOccValue1[3] += sum;
+        } else {
+            if (sum == 0x00000100) {
+                tempOccValue1[0] += 256;
+            } else if (sum == 0x00010000) {
+                tempOccValue1[1] += 256;
+            } else if (sum == 0x01000000) {
+                tempOccValue1[2] += 256;
+            } else {
+                tempOccValue1[3] += 256;
+            }
+        }
+        occValue[occIndex * 4 + 0] = (tempOccValue0[0] << 16) | tempOccValue1[0];
+        occValue[occIndex * 4 + 1] = (tempOccValue0[1] << 16) | tempOccValue1[1];
+        occValue[occIndex * 4 + 2] = (tempOccValue0[2] << 16) | tempOccValue1[2];
+        occValue[occIndex * 4 + 3] = (tempOccValue0[3] << 16) | tempOccValue1[3];
+        tempOccValue0[0] = tempOccValue1[0];
+        tempOccValue0[1] = tempOccValue1[1];
+        tempOccValue0[2] = tempOccValue1[2];
+        tempOccValue0[3] = tempOccValue1[3];
+        sum = 0;
+
+        occIndex++;
+
+        for (j = 0; j < wordBetweenOccValue; j++) {
+            c = bwt[bwtIndex];
+            sum += decodeTable[c >> 16];
+            sum += decodeTable[c & 0x0000FFFF];
+            bwtIndex++;
+        }
+        if (!DNA_OCC_SUM_EXCEPTION(sum)) {
+            tempOccValue0[0] += (sum & 0x000000FF);
+            sum >>= 8;
+            tempOccValue0[1] += (sum & 0x000000FF);
+            sum >>= 8;
+            tempOccValue0[2] += (sum & 0x000000FF);
+            sum >>= 8;
+            tempOccValue0[3] += sum;
+        } else {
+            if (sum == 0x00000100) {
+                tempOccValue0[0] += 256;
+            } else if (sum == 0x00010000) {
+                tempOccValue0[1] += 256;
+            } else if (sum == 0x01000000) {
+                tempOccValue0[2] += 256;
+            } else {
+                tempOccValue0[3] += 256;
+            }
+        }
+    }
+
+    occMajor[0] = tempOccValue0[0];
+    occMajor[1] = tempOccValue0[1];
+    occMajor[2] = tempOccValue0[2];
+    occMajor[3] = tempOccValue0[3];
+}
+
+typedef struct {
+    const unsigned int *bwt;
+    unsigned int *occValue;
+    bgint_t *occValueMajor;
+    const unsigned int *decodeTable;
+} BWTOccWorker;
+
+static void BWTGenerateOccValueWorker(void *data, long i, int tid) {
+    BWTOccWorker *w = (BWTOccWorker *) data;
+    BWTGenerateOccValueMajor(w->bwt, w->occValue, i + 1, w->occValueMajor + (i + 1) * 4, w->decodeTable);
+}
+
 void BWTGenerateOccValueFromBwt(
     const unsigned int *bwt, unsigned int *__restrict occValue,
     bgint_t *__restrict occValueMajor,
-    const bgint_t textLength, const unsigned int *decodeTable) {
+    const bgint_t textLength, const unsigned int *decodeTable, int numberOfThread) {
+    extern void kt_for(int n_threads, void (*func)(void *, long, int), void *data, long n);
     bgint_t numberOfOccValueMajor, numberOfOccValue;
     unsigned int wordBetweenOccValue;
     bgint_t numberOfOccIntervalPerMajor;
     unsigned int c;
-    bgint_t i, j;
+    bgint_t j;
     bgint_t occMajorIndex;
     bgint_t occIndex, bwtIndex;
     bgint_t sum; // perhaps unsigned is big enough
@@ -1155,92 +1358,25 @@ void BWTGenerateOccValueFromBwt(
     occValueMajor[2] = 0;
     occValueMajor[3] = 0;
 
-    occIndex = 0;
-    bwtIndex = 0;
-    for (occMajorIndex = 1; occMajorIndex < numberOfOccValueMajor; occMajorIndex++) {
-
-        for (i = 0; i < numberOfOccIntervalPerMajor / 2; i++) {
-
-            sum = 0;
-            tempOccValue1[0] = tempOccValue0[0];
-            tempOccValue1[1] = tempOccValue0[1];
-            tempOccValue1[2] = tempOccValue0[2];
-            tempOccValue1[3] = tempOccValue0[3];
-
-            for (j = 0; j < wordBetweenOccValue; j++) {
-                c = bwt[bwtIndex];
-                sum += decodeTable[c >> 16];
-                sum += decodeTable[c & 0x0000FFFF];
-                bwtIndex++;
-            }
-            if (!DNA_OCC_SUM_EXCEPTION(sum)) {
-                tempOccValue1[0] += (sum & 0x000000FF);
-                sum >>= 8;
-                tempOccValue1[1] += (sum & 0x000000FF);
-                sum >>= 8;
-                tempOccValue1[2] += (sum & 0x000000FF);
-                sum >>= 8;
-                tempOccValue1[3] += sum;
-            } else {
-                if (sum == 0x00000100) {
-                    tempOccValue1[0] += 256;
-                } else if (sum == 0x00010000) {
-                    tempOccValue1[1] += 256;
-                } else if (sum == 0x01000000) {
-                    tempOccValue1[2] += 256;
-                } else {
-                    tempOccValue1[3] += 256;
-                }
-            }
-            occValue[occIndex * 4 + 0] = (tempOccValue0[0] << 16) | tempOccValue1[0];
-            occValue[occIndex * 4 + 1] = (tempOccValue0[1] << 16) | tempOccValue1[1];
-            occValue[occIndex * 4 + 2] = (tempOccValue0[2] << 16) | tempOccValue1[2];
-            occValue[occIndex * 4 + 3] = (tempOccValue0[3] << 16) | tempOccValue1[3];
-            tempOccValue0[0] = tempOccValue1[0];
-            tempOccValue0[1] = tempOccValue1[1];
-            tempOccValue0[2] = tempOccValue1[2];
-            tempOccValue0[3] = tempOccValue1[3];
-            sum = 0;
-
-            occIndex++;
-
-            for (j = 0; j < wordBetweenOccValue; j++) {
-                c = bwt[bwtIndex];
-                sum += decodeTable[c >> 16];
-                sum += decodeTable[c & 0x0000FFFF];
-                bwtIndex++;
-            }
-            if (!DNA_OCC_SUM_EXCEPTION(sum)) {
-                tempOccValue0[0] += (sum & 0x000000FF);
-                sum >>= 8;
-                tempOccValue0[1] += (sum & 0x000000FF);
-                sum >>= 8;
-                tempOccValue0[2] += (sum & 0x000000FF);
-                sum >>= 8;
-                tempOccValue0[3] += sum;
-            } else {
-                if (sum == 0x00000100) {
-                    tempOccValue0[0] += 256;
-                } else if (sum == 0x00010000) {
-                    tempOccValue0[1] += 256;
-                } else if (sum == 0x01000000) {
-                    tempOccValue0[2] += 256;
-                } else {
-                    tempOccValue0[3] += 256;
-                }
-            }
+    // Major intervals are independent; occValueMajor first keeps the count of each interval
+    if (numberOfThread > 1 && numberOfOccValueMajor > 2) {
+        BWTOccWorker w;
+        w.bwt = bwt, w.occValue = occValue, w.occValueMajor = occValueMajor, w.decodeTable = decodeTable;
+        kt_for(numberOfThread, BWTGenerateOccValueWorker, &w, numberOfOccValueMajor - 1);
+    } else {
+        for (occMajorIndex = 1; occMajorIndex < numberOfOccValueMajor; occMajorIndex++) {
+            BWTGenerateOccValueMajor(bwt, occValue, occMajorIndex, occValueMajor + occMajorIndex * 4, decodeTable);
         }
-
-        occValueMajor[occMajorIndex * 4 + 0] = occValueMajor[(occMajorIndex - 1) * 4 + 0] + tempOccValue0[0];
-        occValueMajor[occMajorIndex * 4 + 1] = occValueMajor[(occMajorIndex - 1) * 4 + 1] + tempOccValue0[1];
-        occValueMajor[occMajorIndex * 4 + 2] = occValueMajor[(occMajorIndex - 1) * 4 + 2] + tempOccValue0[2];
-        occValueMajor[occMajorIndex * 4 + 3] = occValueMajor[(occMajorIndex - 1) * 4 + 3] + tempOccValue0[3];
-        tempOccValue0[0] = 0;
-        tempOccValue0[1] = 0;
-        tempOccValue0[2] = 0;
-        tempOccValue0[3] = 0;
-
     }
+    for (occMajorIndex = 1; occMajorIndex < numberOfOccValueMajor; occMajorIndex++) {
+        occValueMajor[occMajorIndex * 4 + 0] += occValueMajor[(occMajorIndex - 1) * 4 + 0];
+        occValueMajor[occMajorIndex * 4 + 1] += occValueMajor[(occMajorIndex - 1) * 4 + 1];
+        occValueMajor[occMajorIndex * 4 + 2] += occValueMajor[(occMajorIndex - 1) * 4 + 2];
+        occValueMajor[occMajorIndex * 4 + 3] += occValueMajor[(occMajorIndex - 1) * 4 + 3];
+    }
+
+    occIndex = (numberOfOccValueMajor - 1) * (numberOfOccIntervalPerMajor / 2);
+    bwtIndex = occIndex * 2 * wordBetweenOccValue;
 
     while (occIndex < (numberOfOccValue - 1) / 2) {
         sum = 0;
@@ -1360,6 +1496,8 @@ static void BWTIncConstruct(BWTInc *bwtInc, const bgint_t numChar) {
     bgint_t *relativeRank, *seq, *sortedRank;
     unsigned int *insertBwt, *mergedBwt;
     bgint_t newInverseSa0RelativeRank, oldInverseSa0RelativeRank, newInverseSa0;
+    int64_t group[(ALPHABET_SIZE + 2) * 2];
+    int numberOfGroup;
 
     mergedBwtSizeInWord = BWTResidentSizeInWord(bwtInc->bwt->textLength + numChar);
     mergedOccSizeInWord = BWTOccValueMinorSizeInWord(bwtInc->bwt->textLength + numChar);
@@ -1425,24 +1563,27 @@ static void BWTIncConstruct(BWTInc *bwtInc, const bgint_t numChar) {
             numChar, bwtInc->cumulativeCountInCurrentBuild, bwtInc->firstCharInLastIteration);
 
         // Sort rank by ALPHABET_SIZE + 2 groups (or ALPHABET_SIZE + 1 groups when inverseSa0 sit on the border of a group)
+        numberOfGroup = 0;
         for (i = 0; i < ALPHABET_SIZE; i++) {
             if (bwtInc->cumulativeCountInCurrentBuild[i] > oldInverseSa0RelativeRank ||
                 bwtInc->cumulativeCountInCurrentBuild[i + 1] <= oldInverseSa0RelativeRank) {
-                BWTIncSortKey(sortedRank + bwtInc->cumulativeCountInCurrentBuild[i],
-                    seq + bwtInc->cumulativeCountInCurrentBuild[i],
-                    bwtInc->cumulativeCountInCurrentBuild[i + 1] - bwtInc->cumulativeCountInCurrentBuild[i]);
+                group[numberOfGroup * 2] = bwtInc->cumulativeCountInCurrentBuild[i];
+                group[numberOfGroup * 2 + 1] = bwtInc->cumulativeCountInCurrentBuild[i + 1] - 1;
+                numberOfGroup++;
             } else {
                 if (bwtInc->cumulativeCountInCurrentBuild[i] < oldInverseSa0RelativeRank) {
-                    BWTIncSortKey(sortedRank + bwtInc->cumulativeCountInCurrentBuild[i],
-                        seq + bwtInc->cumulativeCountInCurrentBuild[i],
-                        oldInverseSa0RelativeRank - bwtInc->cumulativeCountInCurrentBuild[i]);
+                    group[numberOfGroup * 2] = bwtInc->cumulativeCountInCurrentBuild[i];
+                    group[numberOfGroup * 2 + 1] = oldInverseSa0RelativeRank - 1;
+                    numberOfGroup++;
                 }
                 if (bwtInc->cumulativeCountInCurrentBuild[i + 1] > oldInverseSa0RelativeRank + 1) {
-                    BWTIncSortKey(sortedRank + oldInverseSa0RelativeRank + 1, seq + oldInverseSa0RelativeRank + 1,
-                        bwtInc->cumulativeCountInCurrentBuild[i + 1] - oldInverseSa0RelativeRank - 1);
+                    group[numberOfGroup * 2] = oldInverseSa0RelativeRank + 1;
+                    group[numberOfGroup * 2 + 1] = bwtInc->cumulativeCountInCurrentBuild[i + 1] - 1;
+                    numberOfGroup++;
                 }
             }
         }
+        BWTIncSortKeyGroups(sortedRank, seq, group, numberOfGroup, numChar, bwtInc->numberOfThread);
 
         // build relative rank; sortedRank is updated for merging to cater for the fact that $ is not encoded in bwt
         // the cumulative freq information is used to make sure that inverseSa0 and suffix beginning with different characters are kept in different unsorted groups)
@@ -1480,7 +1621,7 @@ static void BWTIncConstruct(BWTInc *bwtInc, const bgint_t numChar) {
 
     BWTClearTrailingBwtCode(bwtInc->bwt);
     BWTGenerateOccValueFromBwt(bwtInc->bwt->bwtCode, bwtInc->bwt->occValue, bwtInc->bwt->occValueMajor,
-        bwtInc->bwt->textLength, bwtInc->bwt->decodeTable);
+        bwtInc->bwt->textLength, bwtInc->bwt->decodeTable, bwtInc->numberOfThread);
 
     bwtInc->bwt->inverseSa0 = newInverseSa0;
 
@@ -1503,9 +1644,11 @@ static void BWTIncConstruct(BWTInc *bwtInc, const bgint_t numChar) {
  * @param inputFileName 输入文件名称
  * @param initialMaxBuildSize
  * @param incMaxBuildSize
+ * @param numberOfThread 线程数量
  * @return
  */
-BWTInc *BWTIncConstructFromPacked(const char *inputFileName, bgint_t initialMaxBuildSize, bgint_t incMaxBuildSize) {
+BWTInc *BWTIncConstructFromPacked(const char *inputFileName, bgint_t initialMaxBuildSize, bgint_t incMaxBuildSize,
+                                   int numberOfThread) {
 
     FILE *packedFile;
     bgint_t packedFileLen;
@@ -1541,6 +1684,7 @@ BWTInc *BWTIncConstructFromPacked(const char *inputFileName, bgint_t initialMaxB
     totalTextLength = TextLengthFromBytePacked(packedFileLen, BIT_PER_CHAR, lastByteLength);
 
     bwtInc = BWTIncCreate(totalTextLength, initialMaxBuildSize, incMaxBuildSize);
+    bwtInc->numberOfThread = numberOfThread;
 
     BWTIncSetBuildSizeAndTextAddr(bwtInc);
 
@@ -1660,26 +1804,39 @@ void BWTSaveBwtCodeAndOcc(const BWT *bwt, const char *bwtFileName, const char *o
  * @param fn_pac 输出pac文件名称
  * @param fn_bwt bwt信息
  * @param block_size block限制数据
+ * @param n_threads 线程数量；结果与单线程完全相同
  */
-void bwt_bwtgen2(const char *fn_pac, const char *fn_bwt, int block_size) {
+void bwt_bwtgen3(const char *fn_pac, const char *fn_bwt, int block_size, int n_threads) {
     BWTInc *bwtInc;
-    bwtInc = BWTIncConstructFromPacked(fn_pac, block_size, block_size);
+    bwtInc = BWTIncConstructFromPacked(fn_pac, block_size, block_size, n_threads);
     fprintf(stderr, "[bwt_gen] Finished constructing BWT in %u iterations.\n", bwtInc->numberOfIterationDone);
     BWTSaveBwtCodeAndOcc(bwtInc->bwt, fn_bwt, 0);
     BWTIncFree(bwtInc);
 }
 
+void bwt_bwtgen2(const char *fn_pac, const char *fn_bwt, int block_size) {
+    bwt_bwtgen3(fn_pac, fn_bwt, block_size, 1);
+}
+
 // 从pac文件读取数据后转换为bwt文件，默认block_size
 void bwt_bwtgen(const char *fn_pac, const char *fn_bwt) {
     bwt_bwtgen2(fn_pac, fn_bwt, 10000000);
 }
 
 int bwt_bwtgen_main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: bwtgen <in.pac> <out.bwt>\n");
+    int c, n_threads = 1;
+    while ((c = getopt(argc, argv, "t:")) >= 0) {
+        if (c == 't') {
+            n_threads = atoi(optarg);
+        } else {
+            return 1;
+        }
+    }
+    if (optind + 2 > argc) {
+        fprintf(stderr, "Usage: bwtgen [-t nThreads] <in.pac> <out.bwt>\n");
         return 1;
     }
-    bwt_bwtgen(argv[1], argv[2]);
+    bwt_bwtgen3(argv[optind], argv[optind + 1], 10000000, n_threads);
     return 0;
 }
 
@@ -13,10 +13,6 @@
 #include "utils.h"
 #include "bwa.h"
 
-#ifdef HAVE_PTHREAD
-#include <pthread.h>
-#endif
-
 #ifdef USE_MALLOC_WRAPPERS
 #  include "malloc_wrap.h"
 #endif
@@ -80,67 +76,117 @@ int bwt_cal_width(const bwt_t *bwt, int len, const ubyte_t *str, bwt_width_t *wi
 	return bid;
 }
 
-void bwa_cal_sa_reg_gap(int tid, bwt_t *const bwt, int n_seqs, bwa_seq_t *seqs, const gap_opt_t *opt)
-{
-	int i, j, max_l = 0, max_len;
+typedef struct { // per-thread buffers of the aln workers
 	gap_stack_t *stack;
 	bwt_width_t *w, *seed_w;
-	gap_opt_t local_opt = *opt;
+	ubyte_t *cseq;
+	int max_l;
+} aln_tbuf_t;
+
+typedef struct {
+	bwt_t *bwt;
+	bwa_seq_t *seqs;
+	const gap_opt_t *opt;
+	gap_opt_t local_opt; // max_diff and max_gapo adjusted to the longest read in the batch
+	int keep_seq;
+	aln_tbuf_t *buf;
+} aln_worker_t;
 
-	// initiate priority stack
+static void aln_worker_init(aln_worker_t *w, bwt_t *const bwt, int n_seqs, bwa_seq_t *seqs, const gap_opt_t *opt, int keep_seq, int n_threads)
+{
+	int i, max_len;
+	memset(w, 0, sizeof(aln_worker_t));
+	w->bwt = bwt, w->seqs = seqs, w->opt = opt, w->keep_seq = keep_seq;
+	w->local_opt = *opt;
 	for (i = max_len = 0; i != n_seqs; ++i)
 		if (seqs[i].len > max_len) max_len = seqs[i].len;
-	if (opt->fnr > 0.0) local_opt.max_diff = bwa_cal_maxdiff(max_len, BWA_AVG_ERR, opt->fnr);
-	if (local_opt.max_diff < local_opt.max_gapo) local_opt.max_gapo = local_opt.max_diff;
-	stack = gap_init_stack(local_opt.max_diff, local_opt.max_gapo, local_opt.max_gape, &local_opt);
+	if (opt->fnr > 0.0) w->local_opt.max_diff = bwa_cal_maxdiff(max_len, BWA_AVG_ERR, opt->fnr);
+	if (w->local_opt.max_diff < w->local_opt.max_gapo) w->local_opt.max_gapo = w->local_opt.max_diff;
+	w->buf = (aln_tbuf_t*)calloc(n_threads, sizeof(aln_tbuf_t));
+	for (i = 0; i < n_threads; ++i) {
+		// initiate priority stack
+		w->buf[i].stack = gap_init_stack(w->local_opt.max_diff, w->local_opt.max_gapo, w->local_opt.max_gape, &w->local_opt);
+		w->buf[i].seed_w = (bwt_width_t*)calloc(opt->seed_len+1, sizeof(bwt_width_t));
+	}
+}
+
+static void aln_worker_destroy(aln_worker_t *w, int n_threads)
+{
+	int i;
+	for (i = 0; i < n_threads; ++i) {
+		aln_tbuf_t *b = &w->buf[i];
+		free(b->seed_w); free(b->w); free(b->cseq);
+		gap_destroy_stack(b->stack);
+	}
+	free(w->buf);
+}
+
+static void bwa_cal_sa_reg_gap1(const aln_worker_t *aw, aln_tbuf_t *b, bwa_seq_t *p)
+{
+	const gap_opt_t *opt = aw->opt;
+	gap_opt_t local_opt = aw->local_opt;
+	int j;
+	p->sa = 0; p->type = BWA_TYPE_NO_MATCH; p->c1 = p->c2 = 0; p->n_aln = 0; p->aln = 0;
+	if (b->max_l < p->len) {
+		b->max_l = p->len;
+		b->w = (bwt_width_t*)realloc(b->w, (b->max_l + 1) * sizeof(bwt_width_t));
+		memset(b->w, 0, (b->max_l + 1) * sizeof(bwt_width_t));
+		if (aw->keep_seq) b->cseq = (ubyte_t*)realloc(b->cseq, b->max_l);
+	}
+	bwt_cal_width(aw->bwt, p->len, p->seq, b->w);
+	if (opt->fnr > 0.0) local_opt.max_diff = bwa_cal_maxdiff(p->len, BWA_AVG_ERR, opt->fnr);
+	local_opt.seed_len = opt->seed_len < p->len? opt->seed_len : 0x7fffffff;
+	if (p->len > opt->seed_len)
+		bwt_cal_width(aw->bwt, opt->seed_len, p->seq + (p->len - opt->seed_len), b->seed_w);
+	if (aw->keep_seq) { // align a complemented copy; the read is kept for generating SAM
+		for (j = 0; j < p->len; ++j)
+			b->cseq[j] = p->seq[j] > 3? 4 : 3 - p->seq[j];
+		p->aln = bwt_match_gap(aw->bwt, p->len, b->cseq, b->w, p->len <= opt->seed_len? 0 : b->seed_w, &local_opt, &p->n_aln, b->stack);
+		return;
+	}
+	// core function
+	for (j = 0; j < p->len; ++j) // we need to complement
+		p->seq[j] = p->seq[j] > 3? 4 : 3 - p->seq[j];
+	p->aln = bwt_match_gap(aw->bwt, p->len, p->seq, b->w, p->len <= opt->seed_len? 0 : b->seed_w, &local_opt, &p->n_aln, b->stack);
+	//fprintf(stderr, "mm=%lld,ins=%lld,del=%lld,gapo=%lld\n", p->aln->n_mm, p->aln->n_ins, p->aln->n_del, p->aln->n_gapo);
+	// clean up the unused data in the record
+	free(p->name); free(p->seq); free(p->rseq); free(p->qual);
+	p->name = 0; p->seq = p->rseq = p->qual = 0;
+}
 
-	seed_w = (bwt_width_t*)calloc(opt->seed_len+1, sizeof(bwt_width_t));
-	w = 0;
+void bwa_cal_sa_reg_gap(int tid, bwt_t *const bwt, int n_seqs, bwa_seq_t *seqs, const gap_opt_t *opt)
+{
+	int i;
+	aln_worker_t w;
+	aln_worker_init(&w, bwt, n_seqs, seqs, opt, 0, 1);
 	for (i = 0; i != n_seqs; ++i) {
-		bwa_seq_t *p = seqs + i;
 #ifdef HAVE_PTHREAD
 		if (i % opt->n_threads != tid) continue;
 #endif
-		p->sa = 0; p->type = BWA_TYPE_NO_MATCH; p->c1 = p->c2 = 0; p->n_aln = 0; p->aln = 0;
-		if (max_l < p->len) {
-			max_l = p->len;
-			w = (bwt_width_t*)realloc(w, (max_l + 1) * sizeof(bwt_width_t));
-			memset(w, 0, (max_l + 1) * sizeof(bwt_width_t));
-		}
-		bwt_cal_width(bwt, p->len, p->seq, w);
-		if (opt->fnr > 0.0) local_opt.max_diff = bwa_cal_maxdiff(p->len, BWA_AVG_ERR, opt->fnr);
-		local_opt.seed_len = opt->seed_len < p->len? opt->seed_len : 0x7fffffff;
-		if (p->len > opt->seed_len)
-			bwt_cal_width(bwt, opt->seed_len, p->seq + (p->len - opt->seed_len), seed_w);
-		// core function
-		for (j = 0; j < p->len; ++j) // we need to complement
-			p->seq[j] = p->seq[j] > 3? 4 : 3 - p->seq[j];
-		p->aln = bwt_match_gap(bwt, p->len, p->seq, w, p->len <= opt->seed_len? 0 : seed_w, &local_opt, &p->n_aln, stack);
-		//fprintf(stderr, "mm=%lld,ins=%lld,del=%lld,gapo=%lld\n", p->aln->n_mm, p->aln->n_ins, p->aln->n_del, p->aln->n_gapo);
-		// clean up the unused data in the record
-		free(p->name); free(p->seq); free(p->rseq); free(p->qual);
-		p->name = 0; p->seq = p->rseq = p->qual = 0;
+		bwa_cal_sa_reg_gap1(&w, &w.buf[0], seqs + i);
 	}
-	free(seed_w); free(w);
-	gap_destroy_stack(stack);
+	aln_worker_destroy(&w, 1);
 }
 
-#ifdef HAVE_PTHREAD
-typedef struct {
-	int tid;
-	bwt_t *bwt;
-	int n_seqs;
-	bwa_seq_t *seqs;
-	const gap_opt_t *opt;
-} thread_aux_t;
+static void aln_worker(void *data, long i, int tid)
+{
+	aln_worker_t *w = (aln_worker_t*)data;
+	bwa_cal_sa_reg_gap1(w, &w->buf[tid], w->seqs + i);
+}
 
-static void *worker(void *data)
+void bwa_cal_sa_batch(bwt_t *const bwt, int n_seqs, bwa_seq_t *seqs, const gap_opt_t *opt, int keep_seq)
 {
-	thread_aux_t *d = (thread_aux_t*)data;
-	bwa_cal_sa_reg_gap(d->tid, d->bwt, d->n_seqs, d->seqs, d->opt);
-	return 0;
+	extern void kt_for(int n_threads, void (*func)(void*,long,int), void *data, long n);
+	int n_threads = opt->n_threads > 1? opt->n_threads : 1;
+	aln_worker_t w;
+	aln_worker_init(&w, bwt, n_seqs, seqs, opt, keep_seq, n_threads);
+	if (n_threads == 1) { // no multi-threading at all
+		int i;
+		for (i = 0; i != n_seqs; ++i)
+			bwa_cal_sa_reg_gap1(&w, &w.buf[0], seqs + i);
+	} else kt_for(n_threads, aln_worker, &w, n_seqs); // reads differ a lot in time; kt_for() balances them dynamically
+	aln_worker_destroy(&w, n_threads);
 }
-#endif
 
 bwa_seqio_t *bwa_open_reads(int mode, const char *fn_fa)
 {
@@ -156,75 +202,145 @@ bwa_seqio_t *bwa_open_reads(int mode, const char *fn_fa)
 	return ks;
 }
 
-void bwa_aln_core(const char *prefix, const char *fn_fa, const gap_opt_t *opt)
-{
-	int i, n_seqs;
-	long long tot_seqs = 0;
-	bwa_seq_t *seqs;
+typedef struct {
+	const gap_opt_t *opt;
 	bwa_seqio_t *ks;
-	clock_t t;
 	bwt_t *bwt;
+	long long tot_seqs;
+} aln_aux_t;
+
+typedef struct {
+	int n_seqs;
+	long long tot_seqs; // number of reads up to this batch
+	bwa_seq_t *seqs;
+} aln_data_t;
+
+/**
+ * aln的流水线：step 0读入序列，step 1多线程比对，step 2按顺序写sai
+ */
+static void *aln_process(void *shared, int step, void *_data)
+{
+	aln_aux_t *aux = (aln_aux_t*)shared;
+	aln_data_t *data = (aln_data_t*)_data;
+	int i;
+	if (step == 0) {
+		bwa_seq_t *seqs;
+		int n_seqs;
+		if ((seqs = bwa_read_seq(aux->ks, 0x40000, &n_seqs, aux->opt->mode, aux->opt->trim_qual)) == 0)
+			return 0;
+		data = (aln_data_t*)calloc(1, sizeof(aln_data_t));
+		data->n_seqs = n_seqs, data->seqs = seqs;
+		data->tot_seqs = aux->tot_seqs += n_seqs;
+		return data;
+	} else if (step == 1) {
+		double t = realtime();
+		bwa_cal_sa_batch(aux->bwt, data->n_seqs, data->seqs, aux->opt, 0);
+		fprintf(stderr, "[bwa_aln_core] calculate SA coordinate... %.2f sec\n", realtime() - t);
+		return data;
+	} else if (step == 2) {
+		double t = realtime();
+		for (i = 0; i < data->n_seqs; ++i) {
+			bwa_seq_t *p = data->seqs + i;
+			err_fwrite(&p->n_aln, 4, 1, stdout);
+			if (p->n_aln) err_fwrite(p->aln, sizeof(bwt_aln1_t), p->n_aln, stdout);
+		}
+		fprintf(stderr, "[bwa_aln_core] write to the disk... %.2f sec\n", realtime() - t);
+		bwa_free_read_seq(data->n_seqs, data->seqs);
+		fprintf(stderr, "[bwa_aln_core] %lld sequences have been processed.\n", data->tot_seqs);
+		free(data);
+		return 0;
+	}
+	return 0;
+}
+
+void bwa_aln_core(const char *prefix, const char *fn_fa, const gap_opt_t *opt)
+{
+	extern void kt_pipeline(int n_threads, void *(*func)(void*, int, void*), void *shared_data, int n_steps);
+	aln_aux_t aux;
 
 	// initialization
-	ks = bwa_open_reads(opt->mode, fn_fa);
+	memset(&aux, 0, sizeof(aln_aux_t));
+	aux.opt = opt;
+	aux.ks = bwa_open_reads(opt->mode, fn_fa);
 
 	{ // load BWT
 		char *str = (char*)calloc(strlen(prefix) + 10, 1);
-		strcpy(str, prefix); strcat(str, ".bwt");  bwt = bwt_restore_bwt(str);
+		strcpy(str, prefix); strcat(str, ".bwt");  aux.bwt = bwt_restore_bwt(str);
 		free(str);
 	}
 
-	// core loop
+	// core loop; with more than one thread, reading, aligning and writing of consecutive batches overlap
 	err_fwrite(SAI_MAGIC, 1, 4, stdout);
 	err_fwrite(opt, sizeof(gap_opt_t), 1, stdout);
-	while ((seqs = bwa_read_seq(ks, 0x40000, &n_seqs, opt->mode, opt->trim_qual)) != 0) {
-		tot_seqs += n_seqs;
-		t = clock();
-
-		fprintf(stderr, "[bwa_aln_core] calculate SA coordinate... ");
+	kt_pipeline(opt->n_threads > 1? 2 : 1, aln_process, &aux, 3);
 
-#ifdef HAVE_PTHREAD
-		if (opt->n_threads <= 1) { // no multi-threading at all
-			bwa_cal_sa_reg_gap(0, bwt, n_seqs, seqs, opt);
-		} else {
-			pthread_t *tid;
-			pthread_attr_t attr;
-			thread_aux_t *data;
-			int j;
-			pthread_attr_init(&attr);
-			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-			data = (thread_aux_t*)calloc(opt->n_threads, sizeof(thread_aux_t));
-			tid = (pthread_t*)calloc(opt->n_threads, sizeof(pthread_t));
-			for (j = 0; j < opt->n_threads; ++j) {
-				data[j].tid = j; data[j].bwt = bwt;
-				data[j].n_seqs = n_seqs; data[j].seqs = seqs; data[j].opt = opt;
-				pthread_create(&tid[j], &attr, worker, data + j);
-			}
-			for (j = 0; j < opt->n_threads; ++j) pthread_join(tid[j], 0);
-			free(data); free(tid);
-		}
-#else
-		bwa_cal_sa_reg_gap(0, bwt, n_seqs, seqs, opt);
-#endif
-
-		fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
-
-		t = clock();
-		fprintf(stderr, "[bwa_aln_core] write to the disk... ");
-		for (i = 0; i < n_seqs; ++i) {
-			bwa_seq_t *p = seqs + i;
-			err_fwrite(&p->n_aln, 4, 1, stdout);
-			if (p->n_aln) err_fwrite(p->aln, sizeof(bwt_aln1_t), p->n_aln, stdout);
-		}
-		fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
+	// destroy
+	bwt_destroy(aux.bwt);
+	bwa_seq_close(aux.ks);
+}
 
-		bwa_free_read_seq(n_seqs, seqs);
-		fprintf(stderr, "[bwa_aln_core] %lld sequences have been processed.\n", tot_seqs);
+int bwa_aln_set_opt(gap_opt_t *opt, int c, const char *arg, int *opte)
+{
+	switch (c) {
+	case 'n':
+		if (strstr(arg, ".")) opt->fnr = atof(arg), opt->max_diff = -1;
+		else opt->max_diff = atoi(arg), opt->fnr = -1.0;
+		break;
+	case 'o': opt->max_gapo = atoi(arg); break;
+	case 'e': *opte = atoi(arg); break;
+	case 'M': opt->s_mm = atoi(arg); break;
+	case 'O': opt->s_gapo = atoi(arg); break;
+	case 'E': opt->s_gape = atoi(arg); break;
+	case 'd': opt->max_del_occ = atoi(arg); break;
+	case 'i': opt->indel_end_skip = atoi(arg); break;
+	case 'l': opt->seed_len = atoi(arg); break;
+	case 'k': opt->max_seed_diff = atoi(arg); break;
+	case 'm': opt->max_entries = atoi(arg); break;
+	case 't': opt->n_threads = atoi(arg); break;
+	case 'L': opt->mode |= BWA_MODE_LOGGAP; break;
+	case 'R': opt->max_top2 = atoi(arg); break;
+	case 'q': opt->trim_qual = atoi(arg); break;
+	case 'N': opt->mode |= BWA_MODE_NONSTOP; opt->max_top2 = 0x7fffffff; break;
+	case 'f': xreopen(arg, "wb", stdout); break;
+	case 'b': opt->mode |= BWA_MODE_BAM; break;
+	case '0': opt->mode |= BWA_MODE_BAM_SE; break;
+	case '1': opt->mode |= BWA_MODE_BAM_READ1; break;
+	case '2': opt->mode |= BWA_MODE_BAM_READ2; break;
+	case 'I': opt->mode |= BWA_MODE_IL13; break;
+	case 'Y': opt->mode |= BWA_MODE_CFY; break;
+	case 'B': opt->mode |= atoi(arg) << 24; break;
+	default: return 0;
 	}
+	return 1;
+}
 
-	// destroy
-	bwt_destroy(bwt);
-	bwa_seq_close(ks);
+void bwa_aln_print_opts(const gap_opt_t *opt)
+{
+	fprintf(stderr, "Options: -n NUM    max #diff (int) or missing prob under %.2f err rate (float) [%.2f]\n",
+			BWA_AVG_ERR, opt->fnr);
+	fprintf(stderr, "         -o INT    maximum number or fraction of gap opens [%d]\n", opt->max_gapo);
+	fprintf(stderr, "         -e INT    maximum number of gap extensions, -1 for disabling long gaps [-1]\n");
+	fprintf(stderr, "         -i INT    do not put an indel within INT bp towards the ends [%d]\n", opt->indel_end_skip);
+	fprintf(stderr, "         -d INT    maximum occurrences for extending a long deletion [%d]\n", opt->max_del_occ);
+	fprintf(stderr, "         -l INT    seed length [%d]\n", opt->seed_len);
+	fprintf(stderr, "         -k INT    maximum differences in the seed [%d]\n", opt->max_seed_diff);
+	fprintf(stderr, "         -m INT    maximum entries in the queue [%d]\n", opt->max_entries);
+	fprintf(stderr, "         -t INT    number of threads [%d]\n", opt->n_threads);
+	fprintf(stderr, "         -M INT    mismatch penalty [%d]\n", opt->s_mm);
+	fprintf(stderr, "         -O INT    gap open penalty [%d]\n", opt->s_gapo);
+	fprintf(stderr, "         -E INT    gap extension penalty [%d]\n", opt->s_gape);
+	fprintf(stderr, "         -R INT    stop searching when there are >INT equally best hits [%d]\n", opt->max_top2);
+	fprintf(stderr, "         -q INT    quality threshold for read trimming down to %dbp [%d]\n", BWA_MIN_RDLEN, opt->trim_qual);
+	fprintf(stderr, "         -f FILE   file to write output to instead of stdout\n");
+	fprintf(stderr, "         -B INT    length of barcode\n");
+	fprintf(stderr, "         -L        log-scaled gap penalty for long deletions\n");
+	fprintf(stderr, "         -N        non-iterative mode: search for all n-difference hits (slooow)\n");
+	fprintf(stderr, "         -I        the input is in the Illumina 1.3+ FASTQ-like format\n");
+	fprintf(stderr, "         -b        the input read file is in the BAM format\n");
+	fprintf(stderr, "         -0        use single-end reads only (effective with -b)\n");
+	fprintf(stderr, "         -1        use the 1st read in a pair (effective with -b)\n");
+	fprintf(stderr, "         -2        use the 2nd read in a pair (effective with -b)\n");
+	fprintf(stderr, "         -Y        filter Casava-filtered sequences\n");
 }
 
 int bwa_aln(int argc, char *argv[])
@@ -234,37 +350,8 @@ int bwa_aln(int argc, char *argv[])
 	char *prefix;
 
 	opt = gap_init_opt();
-	while ((c = getopt(argc, argv, "n:o:e:i:d:l:k:LR:m:t:NM:O:E:q:f:b012IYB:")) >= 0) {
-		switch (c) {
-		case 'n':
-			if (strstr(optarg, ".")) opt->fnr = atof(optarg), opt->max_diff = -1;
-			else opt->max_diff = atoi(optarg), opt->fnr = -1.0;
-			break;
-		case 'o': opt->max_gapo = atoi(optarg); break;
-		case 'e': opte = atoi(optarg); break;
-		case 'M': opt->s_mm = atoi(optarg); break;
-		case 'O': opt->s_gapo = atoi(optarg); break;
-		case 'E': opt->s_gape = atoi(optarg); break;
-		case 'd': opt->max_del_occ = atoi(optarg); break;
-		case 'i': opt->indel_end_skip = atoi(optarg); break;
-		case 'l': opt->seed_len = atoi(optarg); break;
-		case 'k': opt->max_seed_diff = atoi(optarg); break;
-		case 'm': opt->max_entries = atoi(optarg); break;
-		case 't': opt->n_threads = atoi(optarg); break;
-		case 'L': opt->mode |= BWA_MODE_LOGGAP; break;
-		case 'R': opt->max_top2 = atoi(optarg); break;
-		case 'q': opt->trim_qual = atoi(optarg); break;
-		case 'N': opt->mode |= BWA_MODE_NONSTOP; opt->max_top2 = 0x7fffffff; break;
-		case 'f': xreopen(optarg, "wb", stdout); break;
-		case 'b': opt->mode |= BWA_MODE_BAM; break;
-		case '0': opt->mode |= BWA_MODE_BAM_SE; break;
-		case '1': opt->mode |= BWA_MODE_BAM_READ1; break;
-		case '2': opt->mode |= BWA_MODE_BAM_READ2; break;
-		case 'I': opt->mode |= BWA_MODE_IL13; break;
-		case 'Y': opt->mode |= BWA_MODE_CFY; break;
-		case 'B': opt->mode |= atoi(optarg) << 24; break;
-		default: return 1;
-		}
+	while ((c = getopt(argc, argv, BWA_ALN_OPTS)) >= 0) {
+		if (!bwa_aln_set_opt(opt, c, optarg, &opte)) return 1;
 	}
 	if (opte > 0) {
 		opt->max_gape = opte;
@@ -274,31 +361,7 @@ int bwa_aln(int argc, char *argv[])
 	if (optind + 2 > argc) {
 		fprintf(stderr, "\n");
 		fprintf(stderr, "Usage:   bwa aln [options] <prefix> <in.fq>\n\n");
-		fprintf(stderr, "Options: -n NUM    max #diff (int) or missing prob under %.2f err rate (float) [%.2f]\n",
-				BWA_AVG_ERR, opt->fnr);
-		fprintf(stderr, "         -o INT    maximum number or fraction of gap opens [%d]\n", opt->max_gapo);
-		fprintf(stderr, "         -e INT    maximum number of gap extensions, -1 for disabling long gaps [-1]\n");
-		fprintf(stderr, "         -i INT    do not put an indel within INT bp towards the ends [%d]\n", opt->indel_end_skip);
-		fprintf(stderr, "         -d INT    maximum occurrences for extending a long deletion [%d]\n", opt->max_del_occ);
-		fprintf(stderr, "         -l INT    seed length [%d]\n", opt->seed_len);
-		fprintf(stderr, "         -k INT    maximum differences in the seed [%d]\n", opt->max_seed_diff);
-		fprintf(stderr, "         -m INT    maximum entries in the queue [%d]\n", opt->max_entries);
-		fprintf(stderr, "         -t INT    number of threads [%d]\n", opt->n_threads);
-		fprintf(stderr, "         -M INT    mismatch penalty [%d]\n", opt->s_mm);
-		fprintf(stderr, "         -O INT    gap open penalty [%d]\n", opt->s_gapo);
-		fprintf(stderr, "         -E INT    gap extension penalty [%d]\n", opt->s_gape);
-		fprintf(stderr, "         -R INT    stop searching when there are >INT equally best hits [%d]\n", opt->max_top2);
-		fprintf(stderr, "         -q INT    quality threshold for read trimming down to %dbp [%d]\n", BWA_MIN_RDLEN, opt->trim_qual);
-        fprintf(stderr, "         -f FILE   file to write output to instead of stdout\n");
-		fprintf(stderr, "         -B INT    length of barcode\n");
-		fprintf(stderr, "         -L        log-scaled gap penalty for long deletions\n");
-		fprintf(stderr, "         -N        non-iterative mode: search for all n-difference hits (slooow)\n");
-		fprintf(stderr, "         -I        the input is in the Illumina 1.3+ FASTQ-like format\n");
-		fprintf(stderr, "         -b        the input read file is in the BAM format\n");
-		fprintf(stderr, "         -0        use single-end reads only (effective with -b)\n");
-		fprintf(stderr, "         -1        use the 1st read in a pair (effective with -b)\n");
-		fprintf(stderr, "         -2        use the 2nd read in a pair (effective with -b)\n");
-		fprintf(stderr, "         -Y        filter Casava-filtered sequences\n");
+		bwa_aln_print_opts(opt);
 		fprintf(stderr, "\n");
 		return 1;
 	}
@@ -102,6 +102,8 @@ typedef struct {
 #define BWA_MODE_BAM_READ2  0x100
 #define BWA_MODE_IL13       0x200
 
+#define BWA_ALN_OPTS "n:o:e:i:d:l:k:LR:m:t:NM:O:E:q:f:b012IYB:" // getopt string of bwa aln
+
 typedef struct {
 	int s_mm, s_gapo, s_gape;
 	int mode; // bit 24-31 are the barcode length
@@ -122,6 +124,7 @@ typedef struct {
 	int n_multi, N_multi;
 	int type, is_sw, is_preload;
 	double ap_prior;
+	int n_threads;
 } pe_opt_t;
 
 struct __bwa_seqio_t;
@@ -133,6 +136,8 @@ extern "C" {
 
 	gap_opt_t *gap_init_opt();
 	void bwa_aln_core(const char *prefix, const char *fn_fa, const gap_opt_t *opt);
+	int bwa_aln_set_opt(gap_opt_t *opt, int c, const char *arg, int *opte);
+	void bwa_aln_print_opts(const gap_opt_t *opt);
 
 	bwa_seqio_t *bwa_seq_open(const char *fn);
 	bwa_seqio_t *bwa_bam_open(const char *fn, int which);
@@ -143,6 +148,12 @@ extern "C" {
 
 	int bwa_cal_maxdiff(int l, double err, double thres);
 	void bwa_cal_sa_reg_gap(int tid, bwt_t *const bwt, int n_seqs, bwa_seq_t *seqs, const gap_opt_t *opt);
+	/**
+	 * Find SA intervals of all reads with opt->n_threads threads. Unlike
+	 * bwa_cal_sa_reg_gap(), which frees the sequences afterwards, the reads
+	 * are left untouched if keep_seq is true.
+	 */
+	void bwa_cal_sa_batch(bwt_t *const bwt, int n_seqs, bwa_seq_t *seqs, const gap_opt_t *opt, int keep_seq);
 
 	void bwa_cs2nt_core(bwa_seq_t *p, bwtint_t l_pac, ubyte_t *pac);
 
@@ -28,10 +28,23 @@ gap_stack_t *gap_init_stack(int max_mm, int max_gapo, int max_gape, const gap_op
 	return gap_init_stack2(aln_score(max_mm+1, max_gapo+1, max_gape+1, opt));
 }
 
+static inline void gap_free_block(gap_stack_t *stack, gap_stack1_t *q)
+{
+	gap_block_t *b = q->top;
+	q->top = b->prev;
+	b->prev = stack->free_blocks;
+	stack->free_blocks = b;
+}
+
 void gap_destroy_stack(gap_stack_t *stack)
 {
 	int i;
-	for (i = 0; i != stack->n_stacks; ++i) free(stack->stacks[i].stack);
+	gap_block_t *b, *p;
+	for (i = 0; i != stack->n_stacks; ++i)
+		for (b = stack->stacks[i].top; b; b = p)
+			p = b->prev, free(b);
+	for (b = stack->free_blocks; b; b = p)
+		p = b->prev, free(b);
 	free(stack->stacks);
 	free(stack);
 }
@@ -39,8 +52,11 @@ void gap_destroy_stack(gap_stack_t *stack)
 static void gap_reset_stack(gap_stack_t *stack)
 {
 	int i;
-	for (i = 0; i != stack->n_stacks; ++i)
-		stack->stacks[i].n_entries = 0;
+	for (i = 0; i != stack->n_stacks; ++i) {
+		gap_stack1_t *q = stack->stacks + i;
+		while (q->top) gap_free_block(stack, q);
+		q->n_entries = 0;
+	}
 	stack->best = stack->n_stacks;
 	stack->n_entries = 0;
 }
@@ -49,20 +65,24 @@ static inline void gap_push(gap_stack_t *stack, int i, bwtint_t k, bwtint_t l, i
 							int state, int is_diff, const gap_opt_t *opt)
 {
 	int score;
-	gap_entry_t *p;
+	gap_entry_t *p, x;
 	gap_stack1_t *q;
 	score = aln_score(n_mm, n_gapo, n_gape, opt);
 	q = stack->stacks + score;
-	if (q->n_entries == q->m_entries) {
-		q->m_entries = q->m_entries? q->m_entries<<1 : 4;
-		q->stack = (gap_entry_t*)realloc(q->stack, sizeof(gap_entry_t) * q->m_entries);
+	if ((q->n_entries & ((1<<GAP_BLOCK_SHIFT) - 1)) == 0 && (q->n_entries || q->top == 0)) { // the top block is full; take a new one
+		gap_block_t *b = stack->free_blocks;
+		if (b) stack->free_blocks = b->prev;
+		else b = (gap_block_t*)malloc(sizeof(gap_block_t));
+		b->prev = q->top;
+		q->top = b;
 	}
-	p = q->stack + q->n_entries;
-	p->info = (uint32_t)score<<21 | i; p->k = k; p->l = l;
-	p->n_mm = n_mm; p->n_gapo = n_gapo; p->n_gape = n_gape;
-	p->n_ins = n_ins; p->n_del = n_del;
-	p->state = state; 
-	p->last_diff_pos = is_diff? i : 0;
+	p = q->top->a + (q->n_entries & ((1<<GAP_BLOCK_SHIFT) - 1));
+	x.info = (uint32_t)score<<21 | i; x.k = k; x.l = l;
+	x.n_mm = n_mm; x.n_gapo = n_gapo; x.n_gape = n_gape;
+	x.n_ins = n_ins; x.n_del = n_del;
+	x.state = state; x.n_seed_mm = 0;
+	x.last_diff_pos = is_diff? i : 0;
+	*p = x; // all fields set, so that the entry is written in one go
 	++(q->n_entries);
 	++(stack->n_entries);
 	if (stack->best > score) stack->best = score;
@@ -71,12 +91,13 @@ static inline void gap_push(gap_stack_t *stack, int i, bwtint_t k, bwtint_t l, i
 static inline void gap_pop(gap_stack_t *stack, gap_entry_t *e)
 {
 	gap_stack1_t *q;
+	int i;
 	q = stack->stacks + stack->best;
-	*e = q->stack[q->n_entries - 1];
-	--(q->n_entries);
+	i = --(q->n_entries) & ((1<<GAP_BLOCK_SHIFT) - 1);
+	*e = q->top->a[i];
+	if (i == 0 && q->n_entries) gap_free_block(stack, q); // the top block is empty; the bottom one is kept till gap_reset_stack()
 	--(stack->n_entries);
 	if (q->n_entries == 0 && stack->n_entries) { // reset best
-		int i;
 		for (i = stack->best + 1; i < stack->n_stacks; ++i)
 			if (stack->stacks[i].n_entries != 0) break;
 		stack->best = i;
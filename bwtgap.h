@@ -4,7 +4,7 @@
 #include "bwt.h"
 #include "bwtaln.h"
 
-typedef struct { // recursion stack
+typedef struct { // recursion stack; 32 bytes
 	uint32_t info; // score<<21 | i
 	uint32_t n_mm:8, n_gapo:8, n_gape:8, state:2, n_seed_mm:6;
 	uint32_t n_ins:16, n_del:16;
@@ -12,14 +12,22 @@ typedef struct { // recursion stack
 	bwtint_t k, l; // (k,l) is the SA region of [i,n-1]
 } gap_entry_t;
 
-typedef struct {
-	int n_entries, m_entries;
-	gap_entry_t *stack;
+#define GAP_BLOCK_SHIFT 7 // 128 entries, or 4KB, per block
+
+typedef struct gap_block_s {
+	gap_entry_t a[1<<GAP_BLOCK_SHIFT]; // first, so that entries are aligned as malloc() returns
+	struct gap_block_s *prev; // the block below in the same bucket, or the next free block
+} gap_block_t;
+
+typedef struct { // entries of one score, kept in a chain of blocks
+	int n_entries;
+	gap_block_t *top;
 } gap_stack1_t;
 
 typedef struct {
 	int n_stacks, best, n_entries;
 	gap_stack1_t *stacks;
+	gap_block_t *free_blocks; // blocks are recycled between buckets and reads; only freed with the stack
 } gap_stack_t;
 
 #ifdef __cplusplus
@@ -27,6 +27,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <getopt.h>
 #include <unistd.h>
 #include <time.h>
 #include <zlib.h>
@@ -36,6 +38,9 @@
 #include "utils.h"
 #include "rle.h"
 #include "rope.h"
+#include "ksort.h"
+#include "kvec.h"
+#include "QSufSort.h"
 
 #ifdef _DIVBWT
 #include "divsufsort.h"
@@ -138,7 +143,8 @@ bwt_t *bwt_pac2bwt(const char *fn_pac, int use_is) {
         rope_destroy(r);
     }
     // 为bwt分配内存空间并计算获得bwt
-    bwt->bwt = (uint32_t *)calloc(bwt->bwt_size, 4);
+    bwt->bwt = bwt_alloc_bwt(bwt->bwt_size);
+    memset(bwt->bwt, 0, bwt->bwt_size * 4);
     //把 seq 中的每256个转换成一个16*16的矩阵，并压缩为bwt的值
     for (i = 0; i < bwt->seq_len; ++i) {
         // buf[i] << ((15 - (i & 15)) << 1) 即：Burrows Wheeler Transform转换算法中的左移操作
@@ -174,6 +180,14 @@ int bwa_pac2bwt(int argc, char *argv[]) {
 
 #define bwt_B00(b, k) ((b)->bwt[(k)>>4]>>((~(k)&0xf)<<1)&3)
 
+/**
+ * BWT 与 Occ 表在内存中的字节数，即 bwt_bwtupdate_core() 之后 bwt_size * 4
+ * @param seq_len 序列长度（含正反链）
+ */
+static int64_t bwt_occ_bytes(int64_t seq_len) {
+    return (((seq_len + 15) >> 4) + ((seq_len + OCC_INTERVAL - 1) / OCC_INTERVAL + 1) * (int64_t)sizeof(bwtint_t)) * 4;
+}
+
 /**
  * 更新bwt数据中的bwt表
  * @param bwt bwt数据指针
@@ -184,7 +198,7 @@ void bwt_bwtupdate_core(bwt_t *bwt) {
 
     n_occ = (bwt->seq_len + OCC_INTERVAL - 1) / OCC_INTERVAL + 1;
     bwt->bwt_size += n_occ * sizeof(bwtint_t); // the new size
-    buf = (uint32_t *)calloc(bwt->bwt_size, 4); // will be the new bwt
+    buf = bwt_alloc_bwt(bwt->bwt_size); // will be the new bwt; every word is written below
     c[0] = c[1] = c[2] = c[3] = 0;
     for (i = k = 0; i < bwt->seq_len; ++i) {
         if (i % OCC_INTERVAL == 0) {
@@ -204,16 +218,141 @@ void bwt_bwtupdate_core(bwt_t *bwt) {
     bwt->bwt = buf;
 }
 
+#define BWT_UPDATE_CHUNK (OCC_INTERVAL << 15) // characters per chunk in bwt_bwtupdate_dump()
+
+// count the nucleotides at [0,n) of 2-bit packed words p; n <= OCC_INTERVAL
+static inline void bwt_cnt_block(const bwt_t *bwt, const uint32_t *p, int n, bwtint_t c[4]) {
+    int i;
+    uint32_t x = 0;
+    for (i = 0; i < n >> 4; ++i) { // at most 128 per byte lane
+        x += bwt->cnt_table[p[i] & 0xff] + bwt->cnt_table[p[i] >> 8 & 0xff]
+             + bwt->cnt_table[p[i] >> 16 & 0xff] + bwt->cnt_table[p[i] >> 24];
+    }
+    c[0] += x & 0xff, c[1] += x >> 8 & 0xff, c[2] += x >> 16 & 0xff, c[3] += x >> 24;
+    for (i <<= 4; i < n; ++i) {
+        ++c[p[i >> 4] >> ((~i & 0xf) << 1) & 3];
+    }
+}
+
+typedef struct {
+    const bwt_t *bwt;
+    bwtint_t (*cnt)[4]; // cnt[i]: counts before the i-th chunk
+    bwtint_t r0;        // the first chunk of the current round
+    uint32_t *buf;
+} bwtupdate_aux_t;
+
+static void bwtupdate_cnt_worker(void *data, long i, int tid) {
+    bwtupdate_aux_t *a = (bwtupdate_aux_t *)data;
+    const bwt_t *bwt = a->bwt;
+    bwtint_t j, end = (i + 1) * BWT_UPDATE_CHUNK < bwt->seq_len ? (i + 1) * BWT_UPDATE_CHUNK : bwt->seq_len;
+    memset(a->cnt[i + 1], 0, sizeof(bwtint_t) * 4);
+    for (j = i * BWT_UPDATE_CHUNK; j < end; j += OCC_INTERVAL) {
+        bwt_cnt_block(bwt, bwt->bwt + j / 16, end - j < OCC_INTERVAL ? end - j : OCC_INTERVAL, a->cnt[i + 1]);
+    }
+}
+
+static void bwtupdate_fill_worker(void *data, long i, int tid) {
+    bwtupdate_aux_t *a = (bwtupdate_aux_t *)data;
+    const bwt_t *bwt = a->bwt;
+    bwtint_t j, c[4], x = a->r0 + i, end = (x + 1) * BWT_UPDATE_CHUNK < bwt->seq_len ? (x + 1) * BWT_UPDATE_CHUNK : bwt->seq_len;
+    uint32_t *p = a->buf + i * (BWT_UPDATE_CHUNK / OCC_INTERVAL) * (OCC_INTERVAL / 16 + sizeof(bwtint_t));
+    memcpy(c, a->cnt[x], sizeof(bwtint_t) * 4);
+    for (j = x * BWT_UPDATE_CHUNK; j < end; j += OCC_INTERVAL) {
+        int n = end - j < OCC_INTERVAL ? end - j : OCC_INTERVAL;
+        memcpy(p, c, sizeof(bwtint_t) * 4);
+        p += sizeof(bwtint_t);
+        memcpy(p, bwt->bwt + j / 16, (n + 15) / 16 * 4);
+        p += (n + 15) / 16;
+        bwt_cnt_block(bwt, bwt->bwt + j / 16, n, c);
+    }
+}
+
+void bwt_bwtupdate_dump(const char *fn, const bwt_t *bwt, int n_threads) {
+    extern void kt_for(int n_threads, void (*func)(void *, long, int), void *data, long n);
+    bwtupdate_aux_t a;
+    bwtint_t i, n_chunk, n_round, size = 0;
+    FILE *fp;
+
+    n_chunk = (bwt->seq_len + BWT_UPDATE_CHUNK - 1) / BWT_UPDATE_CHUNK;
+    n_threads = n_threads > 1 ? n_threads : 1;
+    a.bwt = bwt;
+    a.cnt = calloc(n_chunk + 1, sizeof(bwtint_t) * 4);
+    kt_for(n_threads, bwtupdate_cnt_worker, &a, n_chunk);
+    for (i = 1; i <= n_chunk; ++i) { // prefix sum over chunks
+        a.cnt[i][0] += a.cnt[i - 1][0], a.cnt[i][1] += a.cnt[i - 1][1];
+        a.cnt[i][2] += a.cnt[i - 1][2], a.cnt[i][3] += a.cnt[i - 1][3];
+    }
+
+    fp = xopen(fn, "wb");
+    err_fwrite(&bwt->primary, sizeof(bwtint_t), 1, fp);
+    err_fwrite(bwt->L2 + 1, sizeof(bwtint_t), 4, fp);
+    n_round = n_threads * 2;
+    a.buf = malloc(n_round * (BWT_UPDATE_CHUNK / OCC_INTERVAL) * (OCC_INTERVAL / 16 + sizeof(bwtint_t)) * 4);
+    for (a.r0 = 0; a.r0 < n_chunk; a.r0 += n_round) {
+        bwtint_t n = a.r0 + n_round < n_chunk ? n_round : n_chunk - a.r0, end, l;
+        kt_for(n_threads, bwtupdate_fill_worker, &a, n);
+        end = (a.r0 + n) * BWT_UPDATE_CHUNK < bwt->seq_len ? (a.r0 + n) * BWT_UPDATE_CHUNK : bwt->seq_len;
+        l = (end - a.r0 * BWT_UPDATE_CHUNK + OCC_INTERVAL - 1) / OCC_INTERVAL * sizeof(bwtint_t)
+            + (end + 15) / 16 - a.r0 * BWT_UPDATE_CHUNK / 16; // only the last chunk may be partial
+        err_fwrite(a.buf, 4, l, fp);
+        size += l;
+    }
+    err_fwrite(a.cnt[n_chunk], sizeof(bwtint_t), 4, fp); // the last element
+    size += sizeof(bwtint_t);
+    err_fflush(fp);
+    err_fclose(fp);
+    xassert(size == bwt->bwt_size + ((bwt->seq_len + OCC_INTERVAL - 1) / OCC_INTERVAL + 1) * sizeof(bwtint_t),
+            "inconsistent bwt_size");
+    free(a.buf);
+    free(a.cnt);
+}
+
+// remove the image of the index whose file $fn ends with $ext, as it would shadow the rewritten files
+static void bwa_idx_drop_img(const char *fn, const char *ext) {
+    int l = strlen(fn), l_ext = strlen(ext);
+    char *str;
+    if (l < l_ext || strcmp(fn + l - l_ext, ext) != 0) {
+        return;
+    }
+    str = calloc(l - l_ext + 5, 1);
+    memcpy(str, fn, l - l_ext);
+    strcpy(str + l - l_ext, ".img");
+    if (access(str, F_OK) == 0 && unlink(str) == 0 && bwa_verbose >= 2) {
+        fprintf(stderr, "[W::%s] removed the outdated %s; run `bwa idx2img' to rebuild it\n", __func__, str);
+    }
+    free(str);
+}
+
+// remove <prefix>.kmer, which does not match a rebuilt BWT; `bwa index' writes a new one unless -k 0
+static void bwa_idx_drop_kmer(const char *prefix) {
+    char *str = calloc(strlen(prefix) + 6, 1);
+    strcat(strcpy(str, prefix), ".kmer");
+    if (access(str, F_OK) == 0 && unlink(str) == 0 && bwa_verbose >= 3) {
+        fprintf(stderr, "[M::%s] removed the outdated %s\n", __func__, str);
+    }
+    free(str);
+}
+
 int bwa_bwtupdate(int argc, char *argv[]) // the "bwtupdate" command
 {
     bwt_t *bwt;
-    if (argc != 2) {
-        fprintf(stderr, "Usage: bwa bwtupdate <the.bwt>\n");
+    int c, n_threads = 1;
+    while ((c = getopt(argc, argv, "t:")) >= 0) {
+        switch (c) {
+            case 't':
+                n_threads = atoi(optarg);
+                break;
+            default:
+                return 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        fprintf(stderr, "Usage: bwa bwtupdate [-t nThreads] <the.bwt>\n");
         return 1;
     }
-    bwt = bwt_restore_bwt(argv[1]);
-    bwt_bwtupdate_core(bwt);
-    bwt_dump_bwt(argv[1], bwt);
+    bwa_idx_drop_img(argv[optind], ".bwt");
+    bwt = bwt_restore_bwt(argv[optind]);
+    bwt_bwtupdate_dump(argv[optind], bwt, n_threads);
     bwt_destroy(bwt);
     return 0;
 }
@@ -221,27 +360,77 @@ int bwa_bwtupdate(int argc, char *argv[]) // the "bwtupdate" command
 int bwa_bwt2sa(int argc, char *argv[]) // the "bwt2sa" command
 {
     bwt_t *bwt;
-    int c, sa_intv = 32;
-    while ((c = getopt(argc, argv, "i:")) >= 0) {
+    int c, sa_intv = 32, n_threads = 1;
+    while ((c = getopt(argc, argv, "i:t:")) >= 0) {
         switch (c) {
             case 'i':
                 sa_intv = atoi(optarg);
                 break;
+            case 't':
+                n_threads = atoi(optarg);
+                break;
             default:
                 return 1;
         }
     }
     if (optind + 2 > argc) {
-        fprintf(stderr, "Usage: bwa bwt2sa [-i %d] <in.bwt> <out.sa>\n", sa_intv);
+        fprintf(stderr, "Usage: bwa bwt2sa [-i %d] [-t nThreads] <in.bwt> <out.sa>\n", sa_intv);
         return 1;
     }
+    bwa_idx_drop_img(argv[optind + 1], ".sa");
     bwt = bwt_restore_bwt(argv[optind]);
-    bwt_cal_sa(bwt, sa_intv);
+    bwt_cal_sa2(bwt, sa_intv, n_threads);
     bwt_dump_sa(argv[optind + 1], bwt);
     bwt_destroy(bwt);
     return 0;
 }
 
+int bwa_idx2img(int argc, char *argv[]) // the "idx2img" command
+{
+    bwaidx_t *idx;
+    char *prefix, *fn;
+    int c, to_check = 0, ret = 0;
+    while ((c = getopt(argc, argv, "c")) >= 0) {
+        switch (c) {
+            case 'c':
+                to_check = 1;
+                break;
+            default:
+                return 1;
+        }
+    }
+    if (optind + 1 > argc) {
+        fprintf(stderr, "Usage: bwa idx2img [-c] <idxbase>\n\n");
+        fprintf(stderr, "Options: -c       verify the checksums of an existing image\n\n");
+        return 1;
+    }
+    if ((prefix = bwa_idx_infer_prefix(argv[optind])) == 0) {
+        fprintf(stderr, "[E::%s] fail to locate the index files\n", __func__);
+        return 1;
+    }
+    fn = calloc(strlen(prefix) + 5, 1);
+    strcat(strcpy(fn, prefix), ".img");
+    if (to_check) {
+        if ((idx = bwa_idx_load_mmap(fn, BWA_MMAP_VERIFY)) == 0) {
+            fprintf(stderr, "[E::%s] %s failed the check\n", __func__, fn);
+            ret = 1;
+        } else if (bwa_verbose >= 3) {
+            fprintf(stderr, "[M::%s] %s is intact\n", __func__, fn);
+        }
+    } else if ((idx = bwa_idx_load_from_disk(prefix, BWA_IDX_ALL)) != 0) {
+        bwa_idx_dump_img(fn, idx);
+        if (bwa_verbose >= 3) {
+            fprintf(stderr, "[M::%s] wrote %ld bytes to %s\n", __func__, (long)idx->l_mem, fn);
+        }
+    } else {
+        ret = 1;
+    }
+    bwa_idx_destroy(idx);
+    free(fn);
+    free(prefix);
+    return ret;
+}
+
 // the "index" command
 /**
  * bwa index命令的主函数，将参考序列转化为多个中间数据文件（包括：bwt/pac/sa/ann/amb）
@@ -249,12 +438,48 @@ int bwa_bwt2sa(int argc, char *argv[]) // the "bwt2sa" command
  * @param argv 参数内容
  * @return
  */
+/**
+ * 构建k-mer查找表<prefix>.kmer
+ * @param prefix 索引文件名前缀
+ * @param k k-mer的最大长度；参考序列较短时会被调小
+ */
+static void bwa_idx_build_kmer(const char *prefix, int k) {
+    bwt_t *bwt;
+    char *str;
+    clock_t t = clock();
+
+    str = (char *)calloc(strlen(prefix) + 10, 1);
+    strcat(strcpy(str, prefix), ".bwt");
+    bwt = bwt_restore_bwt(str);
+    while (k > 1 && (bwtint_t)1 << (k << 1) > bwt->seq_len >> 6) { // keep the table smaller than the BWT
+        --k;
+    }
+    if (bwa_verbose >= 3) {
+        fprintf(stderr, "[bwa_index] Construct the %d-mer lookup table... ", k);
+    }
+    bwt_gen_kmer(bwt, k);
+    strcat(strcpy(str, prefix), ".kmer");
+    bwt_dump_kmer(str, bwt);
+    bwt_destroy(bwt);
+    free(str);
+    if (bwa_verbose >= 3) {
+        fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
+    }
+}
+
 int bwa_index(int argc, char *argv[]) {
     //block_size 默认10M
-    int c, algo_type = BWTALGO_AUTO, is_64 = 0, block_size = 10000000;
+    int c, algo_type = BWTALGO_AUTO, is_64 = 0, block_size = 10000000, kmer_k = BWT_KMER_DEF, sa_intv = 32;
+    int n_threads = 1, shift;
+    int64_t max_mem = 0;
     char *prefix = 0, *str;
-    while ((c = getopt(argc, argv, "6a:p:b:")) >= 0) {
+    char *fn_append = 0;
+    static struct option lopts[] = {{"append", required_argument, 0, 'A'}, {0, 0, 0, 0}};
+    while ((c = getopt_long(argc, argv, "6a:p:b:k:s:t:m:", lopts, 0)) >= 0) {
         switch (c) {
+            case 'A':
+                fn_append = optarg;
+                break;
             case 'a': // if -a is not set, algo_type will be determined later
                 if (strcmp(optarg, "rb2") == 0) {
                     algo_type = BWTALGO_RB2;
@@ -272,6 +497,43 @@ int bwa_index(int argc, char *argv[]) {
             case '6':
                 is_64 = 1;
                 break;
+            case 'k':
+                kmer_k = atoi(optarg);
+                if (kmer_k < 0 || kmer_k > BWT_KMER_MAX) {
+                    err_fatal(__func__, "-k must be between 0 and %d.", BWT_KMER_MAX);
+                }
+                break;
+            case 's':
+                sa_intv = atoi(optarg);
+                if (sa_intv <= 0 || (sa_intv & (sa_intv - 1))) {
+                    err_fatal(__func__, "-s must be a power of 2.");
+                }
+                break;
+            case 't':
+                n_threads = atoi(optarg);
+                if (n_threads < 1) {
+                    n_threads = 1;
+                }
+                break;
+            case 'm':
+                errno = 0;
+                max_mem = strtoll(optarg, &str, 10);
+                if (*str == 'G' || *str == 'g') {
+                    shift = 30, ++str;
+                } else if (*str == 'M' || *str == 'm') {
+                    shift = 20, ++str;
+                } else if (*str == 'K' || *str == 'k') {
+                    shift = 10, ++str;
+                } else {
+                    shift = 0;
+                }
+                if (errno || str == optarg || *str || max_mem < 0 || max_mem > INT64_MAX >> shift) {
+                    fprintf(stderr, "[E::%s] invalid memory budget '%s'; expect INT with an optional K/M/G suffix\n",
+                            __func__, optarg);
+                    return 1;
+                }
+                max_mem <<= shift;
+                break;
             case 'b':
                 block_size = strtol(optarg, &str, 10);
                 if (*str == 'G' || *str == 'g') {
@@ -287,14 +549,21 @@ int bwa_index(int argc, char *argv[]) {
         }
     }
 
-    if (optind + 1 > argc) {
+    if (optind + 1 > argc && !(fn_append && prefix)) {
         fprintf(stderr, "\n");
-        fprintf(stderr, "Usage:   bwa index [options] <in.fasta>\n\n");
+        fprintf(stderr, "Usage:   bwa index [options] <in.fasta>\n");
+        fprintf(stderr, "         bwa index [options] --append <new.fasta> <idxbase>\n\n");
         fprintf(stderr, "Options: -a STR    BWT construction algorithm: bwtsw, is or rb2 [auto]\n");
         fprintf(stderr, "         -p STR    prefix of the index [same as fasta name]\n");
         fprintf(stderr, "         -b INT    block size for the bwtsw algorithm (effective with -a bwtsw) [%d]\n",
             block_size);
         fprintf(stderr, "         -6        index files named as <in.fasta>.64.* instead of <in.fasta>.* \n");
+        fprintf(stderr, "         -k INT    tabulate SA intervals of k-mers up to INT bp (0 to disable) [%d]\n", kmer_k);
+        fprintf(stderr, "         -s INT    sample every INT-th suffix array entry, a power of 2; smaller is faster\n");
+        fprintf(stderr, "                   but takes more memory [%d]\n", sa_intv);
+        fprintf(stderr, "         -t INT    number of threads for SA sampling and for BWT construction with -a bwtsw [%d]\n", n_threads);
+        fprintf(stderr, "         -m INT    memory budget in bytes; K/M/G suffix allowed; 0 for no limit [0]\n");
+        fprintf(stderr, "         --append FILE  insert the sequences in FILE into the existing index <idxbase> or -p\n");
         fprintf(stderr, "\n");
         fprintf(stderr, "Warning: `-a bwtsw' does not work for short genomes, while `-a is' and\n");
         fprintf(stderr, "         `-a div' do not work not for long genomes.\n\n");
@@ -307,7 +576,14 @@ int bwa_index(int argc, char *argv[]) {
             strcat(prefix, ".64");
         }
     }
-    bwa_idx_build(argv[optind], prefix, algo_type, block_size);
+    if (fn_append) {
+        bwa_idx_append(fn_append, prefix, n_threads);
+    } else {
+        bwa_idx_build3(argv[optind], prefix, algo_type, block_size, sa_intv, n_threads, max_mem);
+    }
+    if (kmer_k > 0) {
+        bwa_idx_build_kmer(prefix, kmer_k);
+    }
     free(prefix);
     return 0;
 }
@@ -321,6 +597,15 @@ int bwa_index(int argc, char *argv[]) {
  * @return
  */
 int bwa_idx_build(const char *fa, const char *prefix, int algo_type, int block_size) {
+    return bwa_idx_build2(fa, prefix, algo_type, block_size, 32, 1);
+}
+
+int bwa_idx_build2(const char *fa, const char *prefix, int algo_type, int block_size, int sa_intv, int n_threads) {
+    return bwa_idx_build3(fa, prefix, algo_type, block_size, sa_intv, n_threads, 0);
+}
+
+int bwa_idx_build3(const char *fa, const char *prefix, int algo_type, int block_size, int sa_intv, int n_threads,
+                   int64_t max_mem) {
 
     char *str, *str2, *str3; //str输出pac的文件名，str3输出bwt的文件名
     clock_t t;
@@ -329,6 +614,8 @@ int bwa_idx_build(const char *fa, const char *prefix, int algo_type, int block_s
     str = (char *)calloc(strlen(prefix) + 10, 1);
     str2 = (char *)calloc(strlen(prefix) + 10, 1);
     str3 = (char *)calloc(strlen(prefix) + 10, 1);
+    bwa_idx_drop_img(prefix, "");
+    bwa_idx_drop_kmer(prefix);
 
     { // nucleotide indexing
         gzFile fp = xzopen(fa, "r");
@@ -347,6 +634,32 @@ int bwa_idx_build(const char *fa, const char *prefix, int algo_type, int block_s
     // 根据pac的长度选择BWT算法：1-RB2，2-BWT-SW，3-IS
     if (algo_type == 0) {
         algo_type = l_pac > 50000000 ? 2 : 3;
+        if (max_mem > 0 && algo_type == 3 && l_pac * 5 > max_mem && l_pac > 20000000) {
+            algo_type = 2; // IS takes 5 bytes per base
+        }
+    }
+    if (max_mem > 0) { // fit each step into the memory budget; l_pac counts both strands here
+        int64_t n = l_pac, fixed = n / 4 + n / 32 + n / 2048 + (8 << 20), b;
+        b = bwt_occ_bytes(n) + (5 << 20); // the SA step below needs at least this; fail before building the BWT
+        if (max_mem < b) {
+            err_fatal(__func__, "memory budget too small; -m %lldM is required to sample the SA",
+                      (long long)(b >> 20) + 1);
+        }
+        if (algo_type == 2) { // bwtsw: resident BWT and Occ, and ~4.8 bytes per character of the block
+            b = (max_mem - fixed) / 5;
+            if (b < 1000000) {
+                err_fatal(__func__, "memory budget too small; -m %lldM is required for this reference",
+                          (long long)((fixed + 5000000) >> 20) + 1);
+            }
+            block_size = b < block_size ? b : block_size;
+            if (bwa_verbose >= 3) {
+                fprintf(stderr, "[bwa_index] Memory budget %lldM: BWT block size %d\n", (long long)(max_mem >> 20),
+                        block_size);
+            }
+        } else if (n * 5 > max_mem && bwa_verbose >= 2) {
+            fprintf(stderr, "[W::%s] `-a %s' needs about %lldM and may exceed the memory budget\n", __func__,
+                    algo_type == 3 ? "is" : "rb2", (long long)(n * 5 >> 20));
+        }
     }
     {
         strcpy(str, prefix);
@@ -358,7 +671,7 @@ int bwa_idx_build(const char *fa, const char *prefix, int algo_type, int block_s
             fprintf(stderr, "[bwa_index] Construct BWT for the packed sequence...\n");
         }
         if (algo_type == 2) {
-            bwt_bwtgen2(str, str2, block_size);
+            bwt_bwtgen3(str, str2, block_size, n_threads);
         } else if (algo_type == 1 || algo_type == 3) {
             bwt_t *bwt;
             bwt = bwt_pac2bwt(str, algo_type == 3);
@@ -378,8 +691,7 @@ int bwa_idx_build(const char *fa, const char *prefix, int algo_type, int block_s
             fprintf(stderr, "[bwa_index] Update BWT... ");
         }
         bwt = bwt_restore_bwt(str);
-        bwt_bwtupdate_core(bwt);
-        bwt_dump_bwt(str, bwt);
+        bwt_bwtupdate_dump(str, bwt, n_threads);
         bwt_destroy(bwt);
         if (bwa_verbose >= 3) {
             fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
@@ -408,8 +720,15 @@ int bwa_idx_build(const char *fa, const char *prefix, int algo_type, int block_s
             fprintf(stderr, "[bwa_index] Construct SA from BWT and Occ... ");
         }
         bwt = bwt_restore_bwt(str);
-        bwt_cal_sa(bwt, 32);
-        bwt_dump_sa(str3, bwt);
+        if (max_mem > 0) { // what is left after the BWT and Occ holds the SA samples
+            int64_t m = max_mem - (int64_t)bwt->bwt_size * 4 - (4 << 20); // >= 1M, checked before the BWT was built
+            if (bwa_verbose >= 3 && (bwt->seq_len / sa_intv + 1) * 8 > m) {
+                fprintf(stderr, "in %lld passes... ", (long long)(((bwt->seq_len / sa_intv + 1) * 8 + m - 1) / m));
+            }
+            bwt_cal_sa_dump(str3, bwt, sa_intv, n_threads, m);
+        } else {
+            bwt_cal_sa_dump(str3, bwt, sa_intv, n_threads, 0);
+        }
         bwt_destroy(bwt);
         if (bwa_verbose >= 3) {
             fprintf(stderr, "%.2f sec\n", (float)(clock() - t) / CLOCKS_PER_SEC);
@@ -420,3 +739,326 @@ int bwa_idx_build(const char *fa, const char *prefix, int algo_type, int block_s
     free(str);
     return 0;
 }
+
+/*
+ * Appending sequences to an existing index
+ *
+ * The text indexed by the BWT is T = A B, where A is the forward strand and B = rc(A)$. Appending the forward
+ * strand F of the new sequences turns it into T' = A X B with X = F rc(F). Suffixes of B are unchanged, and so is
+ * the relative order of the suffixes starting in A[0, p-L) as long as A[p-L, p) occurs only once in T': any
+ * comparison involving one of them is decided before reaching X. The remaining "dirty" suffixes, those starting in
+ * A[p-L, p) or X, are ranked among the unchanged ones with a backward search over the old BWT, sorted with
+ * QSufSort and merged into the old BWT in one pass.
+ */
+
+typedef struct {
+    uint64_t key, i;
+} append_key_t;
+
+#define append_key_lt(a, b) ((a).key < (b).key)
+KSORT_INIT(append_key, append_key_t, append_key_lt)
+KSORT_INIT_GENERIC(uint64_t)
+
+// T' with only the last w bases of A in memory
+typedef struct {
+    int64_t p, lx, w; // |A|, |X| and the number of bases of A kept
+    uint8_t *a, *x;   // a: A[p-w, p); x: X
+} append_text_t;
+
+static inline int append_char(const append_text_t *t, int64_t pos) {
+    if (pos < t->p) {
+        return t->a[pos - (t->p - t->w)];
+    } else if (pos < t->p + t->lx) {
+        return t->x[pos - t->p];
+    }
+    return 3 - t->a[t->w - 1 - (pos - t->p - t->lx)]; // B is the reverse complement of A
+}
+
+// bases [beg, end) of the forward strand in the .pac
+static uint8_t *append_fetch(FILE *fp, int64_t beg, int64_t end) {
+    int64_t i, b0 = beg >> 2, b1 = (end + 3) >> 2;
+    uint8_t *buf = malloc(b1 - b0), *s = malloc(end - beg);
+    err_fseek(fp, b0, SEEK_SET);
+    err_fread_noeof(buf, 1, b1 - b0, fp);
+    for (i = beg; i < end; ++i) {
+        s[i - beg] = buf[(i >> 2) - b0] >> ((~i & 3) << 1) & 3;
+    }
+    free(buf);
+    return s;
+}
+
+// append a character to the BWT being merged; c < 0 stands for $
+static inline void append_put(bwt_t *bwt, bwtint_t *row, bwtint_t *k, int c) {
+    if (c < 0) {
+        bwt->primary = *row;
+    } else {
+        bwt->bwt[*k >> 4] |= (uint32_t)c << ((~*k & 15) << 1);
+        ++*k;
+    }
+    ++*row;
+}
+
+/**
+ * 从SA采样中找到位置pos处后缀所在的行：取pos下游最近的采样，再用LF映射回退
+ * @param fn sa文件名
+ * @param bwt 与sa对应的bwt
+ * @param pos 后缀在序列上的位置
+ * @param sa_intv (out) SA采样间隔
+ * @return pos处后缀所在的行
+ */
+static bwtint_t append_find_row(const char *fn, const bwt_t *bwt, bwtint_t pos, int *sa_intv) {
+    bwtint_t hdr[7], buf[0x10000], i, j, n_sa, best = bwt->seq_len, row = 0; // row 0 is the suffix at seq_len
+    FILE *fp;
+
+    fp = xopen(fn, "rb");
+    err_fread_noeof(hdr, sizeof(bwtint_t), 7, fp);
+    xassert(hdr[0] == bwt->primary && hdr[6] == bwt->seq_len, "SA-BWT inconsistency.");
+    *sa_intv = hdr[5];
+    n_sa = (bwt->seq_len + hdr[5]) / hdr[5];
+    for (i = 1; i < n_sa && best - pos > 0x10000; i += j) { // stop at a sample close enough
+        bwtint_t n = n_sa - i < 0x10000 ? n_sa - i : 0x10000;
+        err_fread_noeof(buf, sizeof(bwtint_t), n, fp);
+        for (j = 0; j < n; ++j) {
+            if (buf[j] >= pos && buf[j] < best) {
+                best = buf[j], row = (i + j) * hdr[5];
+            }
+        }
+    }
+    err_fclose(fp);
+    for (; best > pos; --best) {
+        row = bwt_invPsi(bwt, row);
+    }
+    return row;
+}
+
+static void append_rename(const char *tmp, const char *prefix, const char *ext) {
+    char *src, *dst;
+    src = calloc(strlen(tmp) + 10, 1);
+    dst = calloc(strlen(prefix) + 10, 1);
+    strcat(strcpy(src, tmp), ext);
+    strcat(strcpy(dst, prefix), ext);
+    if (rename(src, dst) != 0) {
+        err_fatal(__func__, "fail to rename %s to %s: %s", src, dst, strerror(errno));
+    }
+    free(src);
+    free(dst);
+}
+
+int bwa_idx_append(const char *fa, const char *prefix, int n_threads) {
+    char *tmp, *str;
+    append_text_t t;
+    bwt_t *bwt, *nb;
+    bwtint_t n, rowp, k, l, x, row, n_clean, *lo, *od, cnt[4];
+    int64_t p, m, L, d, i, j, l_pac, *ord;
+    kvec_t(int64_t) occ = {0, 0, 0};
+    append_key_t *key;
+    qsint_t *V, *I;
+    FILE *fp_pac;
+    int c, sa_intv, scanned = 0;
+    clock_t t0;
+
+    tmp = (char *)calloc(strlen(prefix) + 20, 1);
+    str = (char *)calloc(strlen(prefix) + 20, 1);
+    strcat(strcpy(tmp, prefix), ".append"); // the new index is written next to the old one and renamed at the end
+
+    { // pack the new sequences after the old ones
+        gzFile fp = xzopen(fa, "r");
+        t0 = clock();
+        if (bwa_verbose >= 3) {
+            fprintf(stderr, "[bwa_index] Pack FASTA... ");
+        }
+        l_pac = bns_fasta2bntseq_append(fp, prefix, tmp);
+        if (bwa_verbose >= 3) {
+            fprintf(stderr, "%.2f sec\n", (float)(clock() - t0) / CLOCKS_PER_SEC);
+        }
+        err_gzclose(fp);
+    }
+
+    t0 = clock();
+    if (bwa_verbose >= 3) {
+        fprintf(stderr, "[bwa_index] Insert the new sequences into the BWT... ");
+    }
+    bwt = bwt_restore_bwt(strcat(strcpy(str, prefix), ".bwt"));
+    n = bwt->seq_len, p = n >> 1;
+    xassert(l_pac >= p && (bwtint_t)p * 2 == n, "BWT-PAC inconsistency.");
+    if (l_pac == p) {
+        err_fatal(__func__, "no sequences in %s.", fa);
+    }
+    memset(&t, 0, sizeof(append_text_t));
+    t.p = p, t.lx = (l_pac - p) * 2;
+    fp_pac = xopen(strcat(strcpy(str, tmp), ".pac"), "rb");
+    t.x = append_fetch(fp_pac, p, l_pac);
+    t.x = realloc(t.x, t.lx);
+    memset(cnt, 0, sizeof(cnt));
+    for (i = 0; i < t.lx >> 1; ++i) {
+        t.x[t.lx - 1 - i] = 3 - t.x[i];
+        ++cnt[t.x[i]], ++cnt[3 - t.x[i]];
+    }
+    rowp = append_find_row(strcat(strcpy(str, prefix), ".sa"), bwt, p, &sa_intv);
+
+    // find L; occ keeps the occurrences of A[p-L, p) starting in [p-L+1, p+|X|), i.e. overlapping X
+    k = 0, l = n; // SA interval of the empty string
+    for (L = 1; L <= p; ++L) {
+        if (L + 1 > t.w && t.w < p) { // keep one more base for the BWT of the suffix at p-L
+            free(t.a);
+            t.w = t.w * 2 > 256 ? t.w * 2 : 256;
+            t.w = t.w < p ? t.w : p;
+            t.a = append_fetch(fp_pac, p - t.w, p);
+        }
+        c = append_char(&t, p - L);
+        k = bwt->L2[c] + bwt_occ(bwt, k - 1, c) + 1;
+        l = bwt->L2[c] + bwt_occ(bwt, l, c);
+        if (k < l) { // also elsewhere in A or B
+            continue;
+        }
+        if (!scanned) { // the first L unique in T; scan X for it
+            for (d = p - L + 1; d < p + t.lx; ++d) {
+                for (i = 0; i < L && append_char(&t, d + i) == append_char(&t, p - L + i); ++i);
+                if (i == L) {
+                    kv_push(int64_t, occ, d);
+                }
+            }
+            scanned = 1;
+        } else { // extend the occurrences of A[p-L+1, p) by c
+            for (i = j = 0; i < occ.n; ++i) {
+                if (append_char(&t, occ.a[i] - 1) == c) {
+                    occ.a[j++] = occ.a[i] - 1;
+                }
+            }
+            occ.n = j;
+            if (append_char(&t, p + t.lx - 1) == c) { // also the one at the start of B
+                for (i = 0; i < L - 1 && append_char(&t, p + t.lx + i) == append_char(&t, p - L + 1 + i); ++i);
+                if (i == L - 1) {
+                    kv_push(int64_t, occ, p + t.lx - 1);
+                }
+            }
+        }
+        if (occ.n == 0) {
+            break;
+        }
+    }
+    L = L < p ? L : p;
+    m = L + t.lx;
+    kv_destroy(occ);
+    err_fclose(fp_pac);
+
+    // rank the dirty suffixes among the unchanged ones
+    lo = (bwtint_t *)malloc(m * sizeof(bwtint_t));
+    od = (bwtint_t *)malloc(L * sizeof(bwtint_t));
+    for (d = m - 1, x = rowp; d >= 0; --d) {
+        c = append_char(&t, p - L + d);
+        lo[d] = x = bwt->L2[c] + bwt_occ(bwt, x - 1, c) + 1; // the number of old suffixes smaller than T'[p-L+d..]
+    }
+    for (i = 0, x = rowp; i < L; ++i) { // rows of the old suffixes starting in A[p-L, p), which are gone in T'
+        od[i] = x = bwt_invPsi(bwt, x);
+    }
+    ks_introsort(uint64_t, L, od);
+    key = (append_key_t *)malloc((m + 1) * sizeof(append_key_t));
+    for (d = 0; d <= m; ++d) {
+        bwtint_t r = d < m ? lo[d] : rowp, lo_i = 0, hi_i = L;
+        while (lo_i < hi_i) { // the number of gone rows before r
+            bwtint_t mid = (lo_i + hi_i) >> 1;
+            if (od[mid] < r) {
+                lo_i = mid + 1;
+            } else {
+                hi_i = mid;
+            }
+        }
+        r -= lo_i;
+        if (d < m) {
+            lo[d] = r;
+        }
+        // the suffix at p+|X| (the start of B) is unchanged and is larger than the dirty suffixes of the same rank
+        key[d].key = r << 3 | (d < m ? append_char(&t, p - L + d) : 7);
+        key[d].i = d;
+    }
+    ks_introsort(append_key, m + 1, key);
+    V = (qsint_t *)malloc((m + 2) * sizeof(qsint_t));
+    I = (qsint_t *)malloc((m + 2) * sizeof(qsint_t));
+    for (d = 0, j = 0; d <= m; ++d) {
+        j += d > 0 && key[d].key != key[d - 1].key;
+        V[key[d].i] = j;
+    }
+    free(key);
+    QSufSortSuffixSort(V, I, m + 1, j, 0, 0);
+    free(I);
+    ord = (int64_t *)malloc((m + 1) * sizeof(int64_t));
+    for (d = 0; d <= m; ++d) {
+        ord[V[d] - 1] = d;
+    }
+    free(V);
+
+    // merge
+    nb = (bwt_t *)calloc(1, sizeof(bwt_t));
+    nb->seq_len = n + t.lx;
+    nb->bwt_size = (nb->seq_len + 15) >> 4;
+    nb->bwt = bwt_alloc_bwt(nb->bwt_size);
+    memset(nb->bwt, 0, nb->bwt_size * 4);
+    for (c = 0, x = 0; c < 4; ++c) {
+        nb->L2[c] = bwt->L2[c] + x;
+        x += cnt[c];
+    }
+    nb->L2[4] = nb->seq_len;
+    for (x = 0, i = j = 0, row = k = n_clean = 0; x <= n + 1; ++x) {
+        for (; j <= m && (ord[j] == m || lo[ord[j]] <= n_clean); ++j) {
+            if ((d = ord[j]) < m) {
+                append_put(nb, &row, &k, p - L + d == 0 ? -1 : append_char(&t, p - L + d - 1));
+            }
+        }
+        if (x == n + 1) {
+            break;
+        }
+        if (i < L && od[i] == x) {
+            ++i;
+            continue;
+        }
+        if (x == bwt->primary) {
+            c = -1;
+        } else if (x == rowp) {
+            c = t.x[t.lx - 1];
+        } else {
+            c = bwt_B0(bwt, x - (x > bwt->primary));
+        }
+        append_put(nb, &row, &k, c);
+        ++n_clean;
+    }
+    xassert(j == m + 1 && row == nb->seq_len + 1 && k == nb->seq_len, "failed to merge the BWT.");
+    bwt_gen_cnt_table(nb);
+    bwt_destroy(bwt);
+    free(ord), free(od), free(lo), free(t.a), free(t.x);
+    if (bwa_verbose >= 3) {
+        fprintf(stderr, "%lld suffixes re-sorted; %.2f sec\n", (long long)m, (float)(clock() - t0) / CLOCKS_PER_SEC);
+    }
+
+    t0 = clock();
+    if (bwa_verbose >= 3) {
+        fprintf(stderr, "[bwa_index] Update BWT... ");
+    }
+    bwt_bwtupdate_dump(strcat(strcpy(str, tmp), ".bwt"), nb, n_threads);
+    bwt_destroy(nb);
+    if (bwa_verbose >= 3) {
+        fprintf(stderr, "%.2f sec\n", (float)(clock() - t0) / CLOCKS_PER_SEC);
+    }
+
+    t0 = clock();
+    if (bwa_verbose >= 3) {
+        fprintf(stderr, "[bwa_index] Construct SA from BWT and Occ... ");
+    }
+    bwt = bwt_restore_bwt(str);
+    bwt_cal_sa_dump(strcat(strcpy(str, tmp), ".sa"), bwt, sa_intv, n_threads, 0);
+    bwt_destroy(bwt);
+    if (bwa_verbose >= 3) {
+        fprintf(stderr, "%.2f sec\n", (float)(clock() - t0) / CLOCKS_PER_SEC);
+    }
+
+    append_rename(tmp, prefix, ".pac");
+    append_rename(tmp, prefix, ".ann");
+    append_rename(tmp, prefix, ".amb");
+    append_rename(tmp, prefix, ".bwt");
+    append_rename(tmp, prefix, ".sa");
+    bwa_idx_drop_img(prefix, "");
+    bwa_idx_drop_kmer(prefix);
+    free(str);
+    free(tmp);
+    return 0;
+}
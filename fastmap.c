@@ -32,11 +32,13 @@
 #include <limits.h>
 #include <ctype.h>
 #include <math.h>
+#include <pthread.h>
 #include "bwa.h"
 #include "bwamem.h"
 #include "kvec.h"
 #include "utils.h"
 #include "bntseq.h"
+#include "ksw.h"
 #include "kseq.h"
 
 KSEQ_DECLARE(gzFile)
@@ -47,21 +49,36 @@ void *kopen(const char *fn, int *_fd);
 
 int kclose(void *a);
 
-void kt_pipeline(int n_threads, void *(*func)(void *, int, void *), void *shared_data, int n_steps);
+void kt_pipeline2(int n_threads, void *(*func)(void *, int, void *), void *shared_data, int n_steps, int unordered);
+
+/* Batches in flight: one being read, the others being aligned or written.
+ * Their parallel steps are queued on the same kt_forpool, so threads done
+ * with the tail of one batch's step go on with the next batch's step; this
+ * costs up to one more batch of memory than two batches in flight. */
+#define MEM_N_BATCHES 3
 
 typedef struct {
-    kseq_t *ks, *ks2;
+    bseq_file_t *fp, *fp2;
     mem_opt_t *opt;
     mem_pestat_t *pes0;
     int64_t n_processed;
     int copy_comment, actual_chunk_size; //实际block大小，默认10M
     bwaidx_t *idx;
+    mem_tpool_t *tp; // -t threads, created once and shared by the batches in flight
+    // -e: insert sizes inferred from the first batch and used for the rest
+    int pes_once, pes_ready, pes_ok;
+    mem_pestat_t pes_est[4];
+    mem_bamw_t *bw; // -l: BGZF-compressed BAM output
+    pthread_mutex_t pes_lock;
+    pthread_cond_t pes_cv;
 } ktp_aux_t;
 
 typedef struct {
     ktp_aux_t *aux;
     int n_seqs;
+    int64_t n_processed; // number of reads before this batch
     bseq1_t *seqs;
+    char *mem[2]; // the strings of seqs[] point into these
 } ktp_data_t;
 
 /**
@@ -78,17 +95,13 @@ static void *process(void *shared, int step, void *_data) {
     if (step == 0) {
         //step 1: 读取待比对基因序列数据，最多支持两个压缩文件
         ktp_data_t *ret = calloc(1, sizeof(ktp_data_t));
-        ret->seqs = bseq_read(aux->actual_chunk_size, &ret->n_seqs, aux->ks, aux->ks2);
+        ret->seqs = bseq_read3(aux->actual_chunk_size, &ret->n_seqs, aux->fp, aux->fp2, aux->copy_comment, ret->mem);
         if (ret->seqs == 0) {
             free(ret);
             return 0;
         }
-        if (!aux->copy_comment) {
-            for (int i = 0; i < ret->n_seqs; ++i) {
-                free(ret->seqs[i].comment);
-                ret->seqs[i].comment = 0;
-            }
-        }
+        ret->n_processed = aux->n_processed;
+        aux->n_processed += ret->n_seqs;
         int64_t size = 0;
         for (int i = 0; i < ret->n_seqs; ++i) {
             size += ret->seqs[i].l_seq;
@@ -101,6 +114,19 @@ static void *process(void *shared, int step, void *_data) {
         //step 2: 执行序列数据的匹配查找
         const mem_opt_t *opt = aux->opt;
         const bwaidx_t *idx = aux->idx;
+        const mem_pestat_t *pes0 = aux->pes0;
+        mem_pestat_t *pes_out = 0;
+        int is_first = aux->pes_once && !aux->pes0 && (opt->flag & MEM_F_PE) && data->n_processed == 0;
+        if (is_first) {
+            pes_out = aux->pes_est;
+        } else if (aux->pes_once && !aux->pes0 && (opt->flag & MEM_F_PE)) { // wait for the first batch
+            pthread_mutex_lock(&aux->pes_lock);
+            while (!aux->pes_ready) {
+                pthread_cond_wait(&aux->pes_cv, &aux->pes_lock);
+            }
+            pthread_mutex_unlock(&aux->pes_lock);
+            pes0 = aux->pes_ok ? aux->pes_est : 0;
+        }
         if (opt->flag & MEM_F_SMARTPE) {
             bseq1_t *sep[2];
             int n_sep[2];
@@ -112,15 +138,18 @@ static void *process(void *shared, int step, void *_data) {
             }
             if (n_sep[0]) {
                 tmp_opt.flag &= ~MEM_F_PE;
-                mem_process_seqs(&tmp_opt, idx->bwt, idx->bns, idx->pac, aux->n_processed, n_sep[0], sep[0], 0);
+                mem_process_seqs2(&tmp_opt, idx->bwt, idx->bns, idx->pac, data->n_processed, n_sep[0], sep[0], 0, 0, aux->tp);
                 for (int i = 0; i < n_sep[0]; ++i) {
                     data->seqs[sep[0][i].id].sam = sep[0][i].sam;
                 }
             }
             if (n_sep[1]) {
                 tmp_opt.flag |= MEM_F_PE;
-                mem_process_seqs(&tmp_opt, idx->bwt, idx->bns, idx->pac, aux->n_processed + n_sep[0],
-                    n_sep[1], sep[1], aux->pes0);
+                mem_process_seqs2(&tmp_opt, idx->bwt, idx->bns, idx->pac, data->n_processed + n_sep[0],
+                    n_sep[1], sep[1], pes0, pes_out, aux->tp);
+                if (is_first) {
+                    aux->pes_ok = 1;
+                }
                 for (int i = 0; i < n_sep[1]; ++i) {
                     data->seqs[sep[1][i].id].sam = sep[1][i].sam;
                 }
@@ -128,22 +157,35 @@ static void *process(void *shared, int step, void *_data) {
             free(sep[0]);
             free(sep[1]);
         } else {
-            mem_process_seqs(opt, idx->bwt, idx->bns, idx->pac, aux->n_processed, data->n_seqs, data->seqs, aux->pes0);
+            mem_process_seqs2(opt, idx->bwt, idx->bns, idx->pac, data->n_processed, data->n_seqs, data->seqs, pes0, pes_out, aux->tp);
+            if (is_first) {
+                aux->pes_ok = 1;
+            }
+        }
+        if (is_first) {
+            if (bwa_verbose >= 3) {
+                fprintf(stderr, "[M::%s] %s\n", __func__, aux->pes_ok ? "the insert size distribution of this batch is used for the rest"
+                    : "no pairs in the first batch; inferring insert sizes for each batch");
+            }
+            pthread_mutex_lock(&aux->pes_lock);
+            aux->pes_ready = 1;
+            pthread_cond_broadcast(&aux->pes_cv);
+            pthread_mutex_unlock(&aux->pes_lock);
         }
-        aux->n_processed += data->n_seqs;
         return data;
     } else if (step == 2) {
         //step 2: 输出比对结果(sam)，并释放内存指针
+        if (aux->bw) {
+            mem_bamw_write(aux->bw, data->n_seqs, data->seqs, aux->tp);
+        }
         for (int i = 0; i < data->n_seqs; ++i) {
-            if (data->seqs[i].sam) {
+            if (data->seqs[i].sam && aux->bw == 0) {
                 err_fputs(data->seqs[i].sam, stdout);
             }
-            free(data->seqs[i].name);
-            free(data->seqs[i].comment);
-            free(data->seqs[i].seq);
-            free(data->seqs[i].qual);
             free(data->seqs[i].sam);
         }
+        free(data->mem[0]);
+        free(data->mem[1]);
         free(data->seqs);
         free(data);
         return 0;
@@ -190,9 +232,8 @@ static void update_a(mem_opt_t *opt, const mem_opt_t *opt0) {
 int main_mem(int argc, char *argv[]) {
 
     mem_opt_t *opt, opt0;
-    int fd, fd2, i, c, ignore_alt = 0, no_mt_io = 0;
+    int fd, fd2, i, c, ignore_alt = 0, no_mt_io = 0, pin = 0, bam_level = -1;
     int fixed_chunk_size = -1;
-    gzFile fp, fp2 = 0;
     char *p, *rg_line = 0, *hdr_line = 0;
     const char *mode = 0;
     void *ko = 0, *ko2 = 0;
@@ -208,7 +249,7 @@ int main_mem(int argc, char *argv[]) {
     aux.opt = opt = mem_opt_init();
     memset(&opt0, 0, sizeof(mem_opt_t));
     while ((c = getopt(argc, argv,
-        "51qpaMCSPVYjuk:c:v:s:r:t:R:A:B:O:E:U:w:L:d:T:Q:D:m:I:N:o:f:W:x:G:h:y:K:X:H:F:")) >= 0) {
+        "51qpaMCSPVYjubezk:c:l:v:s:r:t:R:A:B:O:E:U:w:L:d:T:Q:D:m:I:N:o:f:W:x:G:h:y:K:X:H:F:")) >= 0) {
         if (c == 'k') {
             opt->min_seed_len = atoi(optarg), opt0.min_seed_len = 1;
         } else if (c == '1') {
@@ -247,6 +288,8 @@ int main_mem(int argc, char *argv[]) {
             opt->flag |= MEM_F_KEEP_SUPP_MAPQ;
         } else if (c == 'u') {
             opt->flag |= MEM_F_XB;
+        } else if (c == 'z') {
+            opt->flag |= MEM_F_BATCHEXT;
         } else if (c == 'c') {
             opt->max_occ = atoi(optarg), opt0.max_occ = 1;
         } else if (c == 'd') {
@@ -255,6 +298,12 @@ int main_mem(int argc, char *argv[]) {
             bwa_verbose = atoi(optarg);
         } else if (c == 'j') {
             ignore_alt = 1;
+        } else if (c == 'b') {
+            pin = 1;
+        } else if (c == 'e') {
+            aux.pes_once = 1;
+        } else if (c == 'l') {
+            bam_level = atoi(optarg), opt->flag |= MEM_F_BAM;
         } else if (c == 'r') {
             opt->split_factor = atof(optarg), opt0.split_factor = 1.;
         } else if (c == 'D') {
@@ -372,6 +421,7 @@ int main_mem(int argc, char *argv[]) {
         fprintf(stderr, "Usage: bwa mem [options] <idxbase> <in1.fq> [in2.fq]\n\n");
         fprintf(stderr, "Algorithm options:\n\n");
         fprintf(stderr, "       -t INT        number of threads [%d]\n", opt->n_threads);
+        fprintf(stderr, "       -b            pin threads to CPUs, filling one NUMA node after another\n");
         fprintf(stderr, "       -k INT        minimum seed length [%d]\n", opt->min_seed_len);
         fprintf(stderr, "       -w INT        band width for banded alignment [%d]\n", opt->w);
         fprintf(stderr, "       -d INT        off-diagonal X-dropoff [%d]\n", opt->zdrop);
@@ -389,6 +439,7 @@ int main_mem(int argc, char *argv[]) {
             opt->max_matesw);
         fprintf(stderr, "       -S            skip mate rescue\n");
         fprintf(stderr, "       -P            skip pairing; mate rescue performed unless -S also in use\n");
+        fprintf(stderr, "       -z            batch SMEM finding, seed extension and mate rescue across reads (same output)\n");
         fprintf(stderr, "\nScoring options:\n\n");
         fprintf(stderr,
             "       -A INT        score for a sequence match, which scales options -TdBOELU unless overridden [%d]\n",
@@ -414,6 +465,7 @@ int main_mem(int argc, char *argv[]) {
         fprintf(stderr,
             "       -H STR/FILE   insert STR to header if it starts with @; or insert lines in FILE [null]\n");
         fprintf(stderr, "       -o FILE       sam file to output results to [stdout]\n");
+        fprintf(stderr, "       -l INT        output BGZF-compressed BAM at zlib level INT (0-9) instead of SAM\n");
         fprintf(stderr,
             "       -j            treat ALT contigs as part of the primary assembly (i.e. ignore <idxbase>.alt file)\n");
         fprintf(stderr,
@@ -439,6 +491,8 @@ int main_mem(int argc, char *argv[]) {
         fprintf(stderr,
             "                     (4 sigma from the mean if absent) and min of the insert size distribution.\n");
         fprintf(stderr, "                     FR orientation only. [inferred]\n");
+        fprintf(stderr, "       -e            infer the insert size distribution from the first batch only and reuse it,\n");
+        fprintf(stderr, "                     so that pairs are finalized without waiting for the whole batch\n");
         fprintf(stderr, "\n");
         fprintf(stderr, "Note: Please read the man page for detailed description of the command line and options.\n");
         fprintf(stderr, "\n");
@@ -543,8 +597,7 @@ int main_mem(int argc, char *argv[]) {
         }
         return 1;
     }
-    fp = gzdopen(fd, "r");
-    aux.ks = kseq_init(fp);
+    aux.fp = bseq_open(fd, opt->n_threads);
     if (optind + 2 < argc) {
         if (opt->flag & MEM_F_PE) {
             if (bwa_verbose >= 2) {
@@ -559,24 +612,36 @@ int main_mem(int argc, char *argv[]) {
                 }
                 return 1;
             }
-            fp2 = gzdopen(fd2, "r");
-            aux.ks2 = kseq_init(fp2);
+            aux.fp2 = bseq_open(fd2, opt->n_threads);
             opt->flag |= MEM_F_PE;
         }
     }
-    bwa_print_sam_hdr(aux.idx->bns, hdr_line);
+    if (opt->flag & MEM_F_BAM) {
+        p = bwa_format_sam_hdr(aux.idx->bns, hdr_line);
+        aux.bw = mem_bamw_init(stdout, bam_level, aux.idx->bns, p);
+        free(p);
+    } else {
+        bwa_print_sam_hdr(aux.idx->bns, hdr_line);
+    }
     aux.actual_chunk_size = fixed_chunk_size > 0 ? fixed_chunk_size : opt->chunk_size * opt->n_threads;
-    //默认启动两个线程工作
-    kt_pipeline(no_mt_io ? 1 : 2, process, &aux, 3);
+    //读入和输出按顺序执行，比对(step 1)可以同时处理多批数据
+    pthread_mutex_init(&aux.pes_lock, 0);
+    pthread_cond_init(&aux.pes_cv, 0);
+    aux.tp = mem_tpool_init(opt->n_threads, pin);
+    kt_pipeline2(no_mt_io ? 1 : MEM_N_BATCHES, process, &aux, 3, 1 << 1);
+    mem_tpool_destroy(aux.tp);
+    if (aux.bw) {
+        mem_bamw_close(aux.bw);
+    }
+    pthread_cond_destroy(&aux.pes_cv);
+    pthread_mutex_destroy(&aux.pes_lock);
     free(hdr_line);
     free(opt);
     bwa_idx_destroy(aux.idx);
-    kseq_destroy(aux.ks);
-    err_gzclose(fp);
+    bseq_close(aux.fp);
     kclose(ko);
-    if (aux.ks2) {
-        kseq_destroy(aux.ks2);
-        err_gzclose(fp2);
+    if (aux.fp2) {
+        bseq_close(aux.fp2);
         kclose(ko2);
     }
     return 0;
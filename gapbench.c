@@ -0,0 +1,204 @@
+/* gapbench: per-read latency and peak memory of bwt_match_gap(), the core of `bwa aln'.
+
+   gapbench sim <idx.base> > reads.fq
+     samples reads from the reference and puts errors in them; -r is the
+     per-base error rate, of which -g are 1bp insertions or deletions and the
+     rest mismatches. Reads across an N or a contig boundary are resampled.
+
+   gapbench run [aln options] <idx.base> <reads.fq>
+     aligns the first batch of reads, as `bwa aln' would, -x times with
+     bwa_cal_sa_batch() and reports the best round. It also reports the peak
+     RSS of the process and how much of it was added by the alignment, mostly
+     the gap stacks, as well as a checksum of the SA intervals, which must not
+     change with the implementation.
+
+   Build with `make gapbench'. Only public APIs of libbwa.a are used, so the
+   same file builds against older trees for a before/after comparison, e.g.
+
+     ./gapbench sim -c 20000 -s 100 -r 0.04 ref.fa > e4.fq
+     ./gapbench run -n 0.04 -e 3 -l 1000 ref.fa e4.fq
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "bwa.h"
+#include "bntseq.h"
+#include "bwtaln.h"
+#include "utils.h"
+
+#ifdef USE_MALLOC_WRAPPERS
+#  include "malloc_wrap.h"
+#endif
+
+static uint64_t splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static inline double drand_sm(uint64_t *x) { return (splitmix64(x) >> 11) * (1.0 / 9007199254740992.0); }
+
+static long peak_rss_kb(void)
+{
+	struct rusage r;
+	getrusage(RUSAGE_SELF, &r);
+	return r.ru_maxrss; // in kilobytes on Linux
+}
+
+static int gapbench_sim(int argc, char *argv[])
+{
+	int c, i, j, n_reads = 20000, len = 100, rid;
+	double err = 0.04, indel = 0.1;
+	uint64_t seed = 11;
+	bwaidx_t *idx;
+	char *seq, *qual;
+
+	while ((c = getopt(argc, argv, "c:s:r:g:S:")) >= 0) {
+		if (c == 'c') n_reads = atoi(optarg);
+		else if (c == 's') len = atoi(optarg);
+		else if (c == 'r') err = atof(optarg);
+		else if (c == 'g') indel = atof(optarg);
+		else if (c == 'S') seed = strtoull(optarg, 0, 10);
+		else return 1;
+	}
+	if (optind + 1 > argc || n_reads < 1 || len < 1 || err < 0.0 || err > 1.0 || indel < 0.0 || indel > 1.0) {
+		fprintf(stderr, "\nUsage:   gapbench sim [options] <idx.base>\n\n");
+		fprintf(stderr, "Options: -c INT    number of reads [%d]\n", n_reads);
+		fprintf(stderr, "         -s INT    read length [%d]\n", len);
+		fprintf(stderr, "         -r FLOAT  per-base error rate [%.2f]\n", err);
+		fprintf(stderr, "         -g FLOAT  fraction of errors that are 1bp indels [%.2f]\n", indel);
+		fprintf(stderr, "         -S INT    random seed [%llu]\n\n", (unsigned long long)seed);
+		return 1;
+	}
+	if ((idx = bwa_idx_load(argv[optind], BWA_IDX_BNS|BWA_IDX_PAC)) == 0) return 1;
+	if (idx->bns->l_pac < 2 * len) {
+		fprintf(stderr, "[E::%s] the reference is shorter than two reads\n", __func__);
+		bwa_idx_destroy(idx);
+		return 1;
+	}
+	seq = (char*)malloc(len + 1); qual = (char*)malloc(len + 1);
+	memset(qual, 'I', len); qual[len] = 0; seq[len] = 0;
+	for (i = 0; i < n_reads; ++i) {
+		int64_t pos, k;
+		int is_rev, n_err = 0, n_try = 0;
+		do { // a deletion consumes one more reference base, so there are at most 2*len of them
+			if (++n_try > 1000000) err_fatal(__func__, "no %dbp window free of N within a contig", 2 * len);
+			pos = splitmix64(&seed) % (idx->bns->l_pac - 2 * len + 1);
+		} while (bns_cnt_ambi(idx->bns, pos, 2 * len, &rid) > 0 || bns_pos2rid(idx->bns, pos + 2 * len - 1) != rid);
+		for (j = 0, k = pos; j < len; ++j) {
+			int b = bns_pac(idx->pac, k);
+			if (drand_sm(&seed) < err) {
+				++n_err;
+				if (drand_sm(&seed) < indel) {
+					if (splitmix64(&seed) & 1) { // insertion: a random base not from the reference
+						seq[j] = "ACGT"[splitmix64(&seed) & 3];
+						continue;
+					}
+					++k, b = bns_pac(idx->pac, k); // deletion: skip one reference base
+				} else b = (b + 1 + splitmix64(&seed) % 3) & 3; // mismatch
+			}
+			seq[j] = "ACGT"[b];
+			++k;
+		}
+		is_rev = splitmix64(&seed) & 1;
+		if (is_rev) { // reverse complement
+			for (j = 0; j < len>>1; ++j) {
+				char t = seq[j];
+				seq[j] = seq[len - 1 - j]; seq[len - 1 - j] = t;
+			}
+			for (j = 0; j < len; ++j)
+				seq[j] = "TGCA"[nst_nt4_table[(int)seq[j]]];
+		}
+		printf("@r%d_%s_%lld_%c_%d\n%s\n+\n%s\n", i + 1, idx->bns->anns[rid].name,
+			   (long long)(pos - idx->bns->anns[rid].offset + 1), "+-"[is_rev], n_err, seq, qual);
+	}
+	free(seq); free(qual);
+	bwa_idx_destroy(idx);
+	return 0;
+}
+
+static int gapbench_run(int argc, char *argv[])
+{
+	extern bwa_seqio_t *bwa_open_reads(int mode, const char *fn_fa);
+	int c, i, r, n_seqs, n_rounds = 3, opte = -1;
+	long rss0;
+	double best = 1e30;
+	uint64_t sum = 0;
+	gap_opt_t *opt;
+	char *prefix, *str;
+	bwt_t *bwt;
+	bwa_seqio_t *ks;
+	bwa_seq_t *seqs;
+
+	opt = gap_init_opt();
+	while ((c = getopt(argc, argv, "x:" BWA_ALN_OPTS)) >= 0) {
+		if (c == 'x') n_rounds = atoi(optarg);
+		else if (!bwa_aln_set_opt(opt, c, optarg, &opte)) return 1;
+	}
+	if (opte > 0) {
+		opt->max_gape = opte;
+		opt->mode &= ~BWA_MODE_GAPE;
+	}
+	if (optind + 2 > argc || n_rounds < 1) {
+		fprintf(stderr, "\nUsage:   gapbench run [options] <idx.base> <reads.fq>\n\n");
+		fprintf(stderr, "Options: -x INT    number of rounds; the best one is reported [%d]\n", n_rounds);
+		fprintf(stderr, "         all other options are those of `bwa aln'\n\n");
+		free(opt);
+		return 1;
+	}
+	if ((prefix = bwa_idx_infer_prefix(argv[optind])) == 0) {
+		fprintf(stderr, "[%s] fail to locate the index\n", __func__);
+		free(opt);
+		return 1;
+	}
+	str = (char*)calloc(strlen(prefix) + 10, 1);
+	strcpy(str, prefix); strcat(str, ".bwt"); bwt = bwt_restore_bwt(str);
+	free(str);
+	ks = bwa_open_reads(opt->mode, argv[optind+1]);
+	if ((seqs = bwa_read_seq(ks, 0x40000, &n_seqs, opt->mode, opt->trim_qual)) == 0) {
+		fprintf(stderr, "[E::%s] no reads in %s\n", __func__, argv[optind+1]);
+		return 1;
+	}
+	bwa_seq_close(ks);
+
+	rss0 = peak_rss_kb();
+	for (r = 0; r < n_rounds; ++r) {
+		double t = realtime();
+		bwa_cal_sa_batch(bwt, n_seqs, seqs, opt, 1);
+		t = realtime() - t;
+		best = best < t? best : t;
+		for (i = 0, sum = 0; i < n_seqs; ++i) {
+			bwa_seq_t *p = seqs + i;
+			int j;
+			for (j = 0; j < p->n_aln; ++j)
+				sum = sum * 131 + (p->aln[j].k ^ p->aln[j].l << 32) + p->aln[j].score;
+			sum = sum * 131 + p->n_aln;
+			free(p->aln); p->aln = 0;
+		}
+		fprintf(stderr, "[M::%s] round %d: %.3f sec\n", __func__, r + 1, t);
+	}
+	printf("reads\t%d\n", n_seqs);
+	printf("best_us_per_read\t%.1f\n", best * 1e6 / n_seqs);
+	printf("peak_rss_mb\t%.1f\n", peak_rss_kb() / 1024.0);
+	printf("aln_rss_mb\t%.1f\n", (peak_rss_kb() - rss0) / 1024.0);
+	printf("checksum\t%016llx\n", (unsigned long long)sum);
+
+	bwa_free_read_seq(n_seqs, seqs);
+	bwt_destroy(bwt);
+	free(prefix); free(opt);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1 && strcmp(argv[1], "sim") == 0) return gapbench_sim(argc - 1, argv + 1);
+	if (argc > 1 && strcmp(argv[1], "run") == 0) return gapbench_run(argc - 1, argv + 1);
+	fprintf(stderr, "\nUsage:   gapbench <command> [options]\n\n");
+	fprintf(stderr, "Command: sim       simulate reads with many mismatches and 1bp indels\n");
+	fprintf(stderr, "         run       time bwt_match_gap() on the reads, as `bwa aln' would\n\n");
+	return 1;
+}
@@ -25,6 +25,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include <emmintrin.h>
 #include "ksw.h"
@@ -460,7 +461,7 @@ typedef struct {
  * @param _max_off 取得最大得分时在query和reference上位置差的 最大值
  * @return best semi-local alignment score
  */
-int ksw_extend2(int qlen, const uint8_t * query, int tlen, const uint8_t * target, int m, const int8_t * mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int * _qle, int * _tle, int * _gtle, int * _gscore, int * _max_off) {
+static int ksw_extend2_scalar(int qlen, const uint8_t * query, int tlen, const uint8_t * target, int m, const int8_t * mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int * _qle, int * _tle, int * _gtle, int * _gscore, int * _max_off) {
     eh_t * eh; // score array
     int8_t * qp; // query profile
     int i, j, k, oe_del = o_del + e_del, oe_ins = o_ins + e_ins, beg, end, max, max_i, max_j, max_ins, max_del, max_ie, gscore, max_off;
@@ -596,6 +597,981 @@ int ksw_extend2(int qlen, const uint8_t * query, int tlen, const uint8_t * targe
     return max;
 }
 
+/*******************************
+ *** Vectorized SW extension ***
+ *******************************/
+
+/* The vectorized kernels below compute exactly the same recurrence as
+ * ksw_extend2_scalar(), row by row, with the band, the Z-dropoff and the
+ * stale cells outside the band all handled in the same way, so that the
+ * results are bit-identical. Cells on a row are processed W at a time in
+ * 32-bit lanes. H and E do not depend on other cells on the same row; F
+ * only depends on M = H(i-1,j-1)+S(i,j) on the same row:
+ *
+ *   F(i,j+1) = max{F(i,j)-e_ins, M(i,j)-oe_ins, 0}
+ *
+ * which is a max-plus prefix scan and is computed in log2(W) steps plus a
+ * carry from the previous block. */
+
+#define KSW_EXT_PAD 16 // the widest vector has 16 lanes; loads may read up to 15 cells beyond the band
+
+static int ksw_simd_level = KSW_SIMD_NONE; // set by ksw_extend_simd_init()
+
+typedef void (*ksw_ext_row_f)(int beg, int end, int32_t * H, int32_t * E, const int32_t * q, int oe_del, int e_del, int oe_ins, int e_ins, int * h1, int * m, int * mj);
+
+// reduce per-lane maxima to the row max and the last column where the max is achieved
+static inline void ksw_ext_reduce(int n, const int32_t * vmax, const int32_t * vidx, int * _m, int * _mj) {
+    int k, m = 0, mj = -1;
+    for (k = 0; k < n; ++k) {
+        if (vmax[k] > m || (vmax[k] == m && vidx[k] > mj)) {
+            m = vmax[k], mj = vidx[k];
+        }
+    }
+    *_m = m, *_mj = mj;
+}
+
+#ifdef __GNUC__
+#include <immintrin.h>
+
+__attribute__((target("sse4.1")))
+static void ksw_ext_row_sse41(int beg, int end, int32_t * H, int32_t * E, const int32_t * q, int oe_del, int e_del, int oe_ins, int e_ins, int * _h1, int * _m, int * _mj) {
+    int j0, f = 0, h1 = *_h1;
+    int32_t tmp[2][4];
+    __m128i zero = _mm_setzero_si128(), lane = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i v_oe_del = _mm_set1_epi32(oe_del), v_e_del = _mm_set1_epi32(e_del), v_oe_ins = _mm_set1_epi32(oe_ins);
+    __m128i v_e_ins1 = _mm_set1_epi32(e_ins), v_e_ins2 = _mm_set1_epi32(e_ins * 2);
+    __m128i dec = _mm_setr_epi32(e_ins, e_ins * 2, e_ins * 3, e_ins * 4);
+    __m128i vmax = zero, vidx = _mm_set1_epi32(-1);
+    for (j0 = beg; j0 < end; j0 += 4) {
+        __m128i h, e, M, x, fv, hs, jv;
+        h = _mm_loadu_si128((__m128i *)(H + j0)); // H(i-1,j-1)
+        e = _mm_loadu_si128((__m128i *)(E + j0)); // E(i,j)
+        M = _mm_add_epi32(h, _mm_loadu_si128((__m128i *)(q + j0)));
+        M = _mm_andnot_si128(_mm_cmpeq_epi32(h, zero), M); // M = H(i-1,j-1)? H(i-1,j-1)+S(i,j) : 0
+        // F: prefix scan; after this x[t] = F(i,j0+t+1)
+        x = _mm_max_epi32(_mm_sub_epi32(M, v_oe_ins), zero);
+        x = _mm_max_epi32(x, _mm_sub_epi32(_mm_slli_si128(x, 4), v_e_ins1));
+        x = _mm_max_epi32(x, _mm_sub_epi32(_mm_slli_si128(x, 8), v_e_ins2));
+        x = _mm_max_epi32(x, _mm_sub_epi32(_mm_set1_epi32(f), dec));
+        fv = _mm_alignr_epi8(x, _mm_set1_epi32(f), 12); // F(i,j)
+        f = _mm_extract_epi32(x, 3);
+        h = _mm_max_epi32(_mm_max_epi32(M, e), fv); // H(i,j)
+        e = _mm_max_epi32(_mm_sub_epi32(e, v_e_del), _mm_max_epi32(_mm_sub_epi32(M, v_oe_del), zero)); // E(i+1,j)
+        hs = _mm_alignr_epi8(h, _mm_set1_epi32(h1), 12); // H(i,j-1) for the next row
+        jv = _mm_add_epi32(_mm_set1_epi32(j0), lane);
+        if (end - j0 >= 4) {
+            _mm_storeu_si128((__m128i *)(H + j0), hs);
+            _mm_storeu_si128((__m128i *)(E + j0), e);
+            h1 = _mm_extract_epi32(h, 3);
+        } else { // the last partial block; don't touch cells beyond the band
+            int k, n = end - j0;
+            _mm_storeu_si128((__m128i *)tmp[0], hs);
+            _mm_storeu_si128((__m128i *)tmp[1], e);
+            for (k = 0; k < n; ++k) {
+                H[j0 + k] = tmp[0][k], E[j0 + k] = tmp[1][k];
+            }
+            _mm_storeu_si128((__m128i *)tmp[0], h);
+            h1 = tmp[0][n - 1];
+            h = _mm_blendv_epi8(_mm_set1_epi32(-1), h, _mm_cmpgt_epi32(_mm_set1_epi32(n), lane));
+        }
+        vidx = _mm_blendv_epi8(jv, vidx, _mm_cmpgt_epi32(vmax, h));
+        vmax = _mm_max_epi32(vmax, h);
+    }
+    _mm_storeu_si128((__m128i *)tmp[0], vmax);
+    _mm_storeu_si128((__m128i *)tmp[1], vidx);
+    ksw_ext_reduce(4, tmp[0], tmp[1], _m, _mj);
+    *_h1 = h1;
+}
+
+// shift 32-bit lanes towards the higher end by s<4 lanes, filling with zeros
+#define __sl_epi32_avx2(x, s) _mm256_alignr_epi8((x), _mm256_permute2x128_si256((x), (x), 0x08), 16 - ((s) << 2))
+
+__attribute__((target("avx2")))
+static void ksw_ext_row_avx2(int beg, int end, int32_t * H, int32_t * E, const int32_t * q, int oe_del, int e_del, int oe_ins, int e_ins, int * _h1, int * _m, int * _mj) {
+    int j0, f = 0, h1 = *_h1;
+    int32_t tmp[2][8];
+    __m256i zero = _mm256_setzero_si256(), lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i v_oe_del = _mm256_set1_epi32(oe_del), v_e_del = _mm256_set1_epi32(e_del), v_oe_ins = _mm256_set1_epi32(oe_ins);
+    __m256i v_e_ins1 = _mm256_set1_epi32(e_ins), v_e_ins2 = _mm256_set1_epi32(e_ins * 2), v_e_ins4 = _mm256_set1_epi32(e_ins * 4);
+    __m256i dec = _mm256_mullo_epi32(_mm256_add_epi32(lane, _mm256_set1_epi32(1)), v_e_ins1);
+    __m256i vmax = zero, vidx = _mm256_set1_epi32(-1);
+    for (j0 = beg; j0 < end; j0 += 8) {
+        __m256i h, e, M, x, fv, hs, jv;
+        h = _mm256_loadu_si256((__m256i *)(H + j0));
+        e = _mm256_loadu_si256((__m256i *)(E + j0));
+        M = _mm256_add_epi32(h, _mm256_loadu_si256((__m256i *)(q + j0)));
+        M = _mm256_andnot_si256(_mm256_cmpeq_epi32(h, zero), M);
+        x = _mm256_max_epi32(_mm256_sub_epi32(M, v_oe_ins), zero);
+        x = _mm256_max_epi32(x, _mm256_sub_epi32(__sl_epi32_avx2(x, 1), v_e_ins1));
+        x = _mm256_max_epi32(x, _mm256_sub_epi32(__sl_epi32_avx2(x, 2), v_e_ins2));
+        x = _mm256_max_epi32(x, _mm256_sub_epi32(_mm256_permute2x128_si256(x, x, 0x08), v_e_ins4));
+        x = _mm256_max_epi32(x, _mm256_sub_epi32(_mm256_set1_epi32(f), dec));
+        fv = _mm256_blend_epi32(__sl_epi32_avx2(x, 1), _mm256_set1_epi32(f), 0x01);
+        f = _mm256_extract_epi32(x, 7);
+        h = _mm256_max_epi32(_mm256_max_epi32(M, e), fv);
+        e = _mm256_max_epi32(_mm256_sub_epi32(e, v_e_del), _mm256_max_epi32(_mm256_sub_epi32(M, v_oe_del), zero));
+        hs = _mm256_blend_epi32(__sl_epi32_avx2(h, 1), _mm256_set1_epi32(h1), 0x01);
+        jv = _mm256_add_epi32(_mm256_set1_epi32(j0), lane);
+        if (end - j0 >= 8) {
+            _mm256_storeu_si256((__m256i *)(H + j0), hs);
+            _mm256_storeu_si256((__m256i *)(E + j0), e);
+            h1 = _mm256_extract_epi32(h, 7);
+        } else {
+            int k, n = end - j0;
+            _mm256_storeu_si256((__m256i *)tmp[0], hs);
+            _mm256_storeu_si256((__m256i *)tmp[1], e);
+            for (k = 0; k < n; ++k) {
+                H[j0 + k] = tmp[0][k], E[j0 + k] = tmp[1][k];
+            }
+            _mm256_storeu_si256((__m256i *)tmp[0], h);
+            h1 = tmp[0][n - 1];
+            h = _mm256_blendv_epi8(_mm256_set1_epi32(-1), h, _mm256_cmpgt_epi32(_mm256_set1_epi32(n), lane));
+        }
+        vidx = _mm256_blendv_epi8(jv, vidx, _mm256_cmpgt_epi32(vmax, h));
+        vmax = _mm256_max_epi32(vmax, h);
+    }
+    _mm256_storeu_si256((__m256i *)tmp[0], vmax);
+    _mm256_storeu_si256((__m256i *)tmp[1], vidx);
+    ksw_ext_reduce(8, tmp[0], tmp[1], _m, _mj);
+    *_h1 = h1;
+}
+
+__attribute__((target("avx512f")))
+static void ksw_ext_row_avx512(int beg, int end, int32_t * H, int32_t * E, const int32_t * q, int oe_del, int e_del, int oe_ins, int e_ins, int * _h1, int * _m, int * _mj) {
+    int j0, f = 0, h1 = *_h1;
+    int32_t tmp[2][16];
+    __m512i zero = _mm512_setzero_si512(), lane = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512i v_oe_del = _mm512_set1_epi32(oe_del), v_e_del = _mm512_set1_epi32(e_del), v_oe_ins = _mm512_set1_epi32(oe_ins);
+    __m512i v_e_ins1 = _mm512_set1_epi32(e_ins), v_e_ins2 = _mm512_set1_epi32(e_ins * 2);
+    __m512i v_e_ins4 = _mm512_set1_epi32(e_ins * 4), v_e_ins8 = _mm512_set1_epi32(e_ins * 8);
+    __m512i dec = _mm512_mullo_epi32(_mm512_add_epi32(lane, _mm512_set1_epi32(1)), v_e_ins1);
+    __m512i vmax = zero, vidx = _mm512_set1_epi32(-1);
+    for (j0 = beg; j0 < end; j0 += 16) {
+        __m512i h, e, M, x, fv, hs, jv;
+        __mmask16 valid = end - j0 >= 16 ? 0xffff : (1U << (end - j0)) - 1;
+        h = _mm512_loadu_si512(H + j0);
+        e = _mm512_loadu_si512(E + j0);
+        M = _mm512_add_epi32(h, _mm512_loadu_si512(q + j0));
+        M = _mm512_maskz_mov_epi32(_mm512_cmpneq_epi32_mask(h, zero), M);
+        x = _mm512_max_epi32(_mm512_sub_epi32(M, v_oe_ins), zero);
+        x = _mm512_max_epi32(x, _mm512_sub_epi32(_mm512_alignr_epi32(x, zero, 15), v_e_ins1));
+        x = _mm512_max_epi32(x, _mm512_sub_epi32(_mm512_alignr_epi32(x, zero, 14), v_e_ins2));
+        x = _mm512_max_epi32(x, _mm512_sub_epi32(_mm512_alignr_epi32(x, zero, 12), v_e_ins4));
+        x = _mm512_max_epi32(x, _mm512_sub_epi32(_mm512_alignr_epi32(x, zero, 8), v_e_ins8));
+        x = _mm512_max_epi32(x, _mm512_sub_epi32(_mm512_set1_epi32(f), dec));
+        fv = _mm512_alignr_epi32(x, _mm512_set1_epi32(f), 15);
+        f = _mm_extract_epi32(_mm512_extracti32x4_epi32(x, 3), 3);
+        h = _mm512_max_epi32(_mm512_max_epi32(M, e), fv);
+        e = _mm512_max_epi32(_mm512_sub_epi32(e, v_e_del), _mm512_max_epi32(_mm512_sub_epi32(M, v_oe_del), zero));
+        hs = _mm512_alignr_epi32(h, _mm512_set1_epi32(h1), 15);
+        jv = _mm512_add_epi32(_mm512_set1_epi32(j0), lane);
+        _mm512_mask_storeu_epi32(H + j0, valid, hs); // masked stores don't touch cells beyond the band
+        _mm512_mask_storeu_epi32(E + j0, valid, e);
+        _mm512_storeu_si512(tmp[0], h);
+        h1 = tmp[0][end - j0 >= 16 ? 15 : end - j0 - 1];
+        h = _mm512_mask_blend_epi32(valid, _mm512_set1_epi32(-1), h);
+        vidx = _mm512_mask_blend_epi32(_mm512_cmpgt_epi32_mask(vmax, h), jv, vidx);
+        vmax = _mm512_max_epi32(vmax, h);
+    }
+    _mm512_storeu_si512(tmp[0], vmax);
+    _mm512_storeu_si512(tmp[1], vidx);
+    ksw_ext_reduce(16, tmp[0], tmp[1], _m, _mj);
+    *_h1 = h1;
+}
+#endif
+
+/**
+ * The same as ksw_extend2_scalar(), except that H and E are kept in
+ * separate arrays and each row is computed by the vectorized kernel $row.
+ */
+static int ksw_extend2_vec(ksw_ext_row_f row, int qlen, const uint8_t * query, int tlen, const uint8_t * target, int m, const int8_t * mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int * _qle, int * _tle, int * _gtle, int * _gscore, int * _max_off) {
+    int32_t * H, * E, * qp; // score arrays and the query profile
+    int i, j, k, oe_del = o_del + e_del, oe_ins = o_ins + e_ins, beg, end, max, max_i, max_j, max_ins, max_del, max_ie, gscore, max_off;
+    assert(h0 > 0);
+    // allocate memory; padded as the kernels may read beyond the band
+    qp = malloc((qlen * m + KSW_EXT_PAD) * 4);
+    H = calloc(qlen + 1 + KSW_EXT_PAD, 4);
+    E = calloc(qlen + 1 + KSW_EXT_PAD, 4);
+    // generate the query profile
+    for (k = i = 0; k < m; ++k) {
+        const int8_t * p = &mat[k * m];
+        for (j = 0; j < qlen; ++j) {
+            qp[i++] = p[query[j]];
+        }
+    }
+    // fill the first row
+    H[0] = h0;
+    H[1] = h0 > oe_ins ? h0 - oe_ins : 0;
+    for (j = 2; j <= qlen && H[j - 1] > e_ins; ++j) {
+        H[j] = H[j - 1] - e_ins;
+    }
+    // adjust $w if it is too large
+    k = m * m;
+    for (i = 0, max = 0; i < k; ++i) { // get the max score
+        max = max > mat[i] ? max : mat[i];
+    }
+    max_ins = (int)((double)(qlen * max + end_bonus - o_ins) / e_ins + 1.);
+    max_ins = max_ins > 1 ? max_ins : 1;
+    w = w < max_ins ? w : max_ins;
+    max_del = (int)((double)(qlen * max + end_bonus - o_del) / e_del + 1.);
+    max_del = max_del > 1 ? max_del : 1;
+    w = w < max_del ? w : max_del;
+    // DP loop
+    max = h0, max_i = max_j = -1;
+    max_ie = -1, gscore = -1;
+    max_off = 0;
+    beg = 0, end = qlen;
+    for (i = 0; LIKELY(i < tlen); ++i) {
+        int h1, m = 0, mj = -1;
+        // apply the band and the constraint (if provided)
+        if (beg < i - w) {
+            beg = i - w;
+        }
+        if (end > i + w + 1) {
+            end = i + w + 1;
+        }
+        if (end > qlen) {
+            end = qlen;
+        }
+        // compute the first column
+        if (beg == 0) {
+            h1 = h0 - (o_del + e_del * (i + 1));
+            if (h1 < 0) {
+                h1 = 0;
+            }
+        } else {
+            h1 = 0;
+        }
+        if (beg < end) {
+            row(beg, end, H, E, &qp[target[i] * qlen], oe_del, e_del, oe_ins, e_ins, &h1, &m, &mj);
+        }
+        H[end] = h1;
+        E[end] = 0;
+        if ((beg < end ? end : beg) == qlen) { // the scalar loop variable $j ends at max(beg,end)
+            max_ie = gscore > h1 ? max_ie : i;
+            gscore = gscore > h1 ? gscore : h1;
+        }
+        if (m == 0) {
+            break;
+        }
+        if (m > max) {
+            max = m, max_i = i, max_j = mj;
+            max_off = max_off > abs(mj - i) ? max_off : abs(mj - i);
+        } else if (zdrop > 0) {
+            if (i - max_i > mj - max_j) {
+                if (max - m - ((i - max_i) - (mj - max_j)) * e_del > zdrop) {
+                    break;
+                }
+            } else {
+                if (max - m - ((mj - max_j) - (i - max_i)) * e_ins > zdrop) {
+                    break;
+                }
+            }
+        }
+        // update beg and end for the next round
+        for (j = beg; LIKELY(j < end) && H[j] == 0 && E[j] == 0; ++j) {
+        }
+        beg = j;
+        for (j = end; LIKELY(j >= beg) && H[j] == 0 && E[j] == 0; --j) {
+        }
+        end = j + 2 < qlen ? j + 2 : qlen;
+    }
+    free(H);
+    free(E);
+    free(qp);
+    if (_qle) {
+        *_qle = max_j + 1;
+    }
+    if (_tle) {
+        *_tle = max_i + 1;
+    }
+    if (_gtle) {
+        *_gtle = max_ie + 1;
+    }
+    if (_gscore) {
+        *_gscore = gscore;
+    }
+    if (_max_off) {
+        *_max_off = max_off;
+    }
+    return max;
+}
+
+int ksw_extend_simd(int level) {
+    int max_level = 0;
+#ifdef __GNUC__
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        max_level = KSW_SIMD_AVX512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        max_level = KSW_SIMD_AVX2;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        max_level = KSW_SIMD_SSE41;
+    }
+#endif
+    ksw_simd_level = level < 0 || level > max_level ? max_level : level;
+    return ksw_simd_level;
+}
+
+#ifdef __GNUC__
+// select the kernel before main() and thus before any thread may call it
+__attribute__((constructor)) static void ksw_extend_simd_init(void) {
+    ksw_extend_simd(-1);
+}
+#endif
+
+int ksw_extend2(int qlen, const uint8_t * query, int tlen, const uint8_t * target, int m, const int8_t * mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int * _qle, int * _tle, int * _gtle, int * _gscore, int * _max_off) {
+    ksw_ext_row_f row = 0;
+#ifdef __GNUC__
+    if (ksw_simd_level == KSW_SIMD_AVX512) {
+        row = ksw_ext_row_avx512;
+    } else if (ksw_simd_level == KSW_SIMD_AVX2) {
+        row = ksw_ext_row_avx2;
+    } else if (ksw_simd_level == KSW_SIMD_SSE41) {
+        row = ksw_ext_row_sse41;
+    }
+#endif
+    if (row == 0) {
+        return ksw_extend2_scalar(qlen, query, tlen, target, m, mat, o_del, e_del, o_ins, e_ins, w, end_bonus, zdrop, h0, _qle, _tle, _gtle, _gscore, _max_off);
+    }
+    return ksw_extend2_vec(row, qlen, query, tlen, target, m, mat, o_del, e_del, o_ins, e_ins, w, end_bonus, zdrop, h0, _qle, _tle, _gtle, _gscore, _max_off);
+}
+
+/*****************************
+ *** Batched SW extension ***
+ *****************************/
+
+/* ksw_extend2_batch() runs KSW_LANES extensions side by side, one in each
+ * 32-bit lane. Unlike the kernels above, which split a row of a single
+ * extension into blocks, a lane carries a whole extension, so F is a plain
+ * recurrence along the row and there is no prefix scan. Each lane has its
+ * own band [beg,end) on the current row; cells outside of it are masked out
+ * and left untouched as in ksw_extend2_scalar(). Jobs are sorted by length
+ * such that lanes in a group have similar bands and finish at similar rows.
+ * The matrices are interleaved: cell j of lane l is at [j*KSW_LANES+l]. */
+
+#define KSW_LANES 16
+
+typedef void (*ksw_ext_lanes_f)(int jb, int je, const int32_t * rb, const int32_t * re, const int32_t * T, int32_t * H, int32_t * E, const int32_t * Q, const int32_t * mat32, int oe_del, int e_del, int oe_ins, int e_ins, int32_t * h1, int32_t * m, int32_t * mj);
+
+typedef struct {
+    int beg, end, w, max, max_i, max_j, max_ie, gscore, max_off, done;
+} ksw_lane_t;
+
+#ifdef __GNUC__
+__attribute__((target("avx2")))
+static void ksw_ext_lanes_avx2(int jb, int je, const int32_t * rb, const int32_t * re, const int32_t * T, int32_t * H, int32_t * E, const int32_t * Q, const int32_t * mat32, int oe_del, int e_del, int oe_ins, int e_ins, int32_t * _h1, int32_t * _m, int32_t * _mj) {
+    int j, k;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i v_oe_del = _mm256_set1_epi32(oe_del), v_e_del = _mm256_set1_epi32(e_del), v_oe_ins = _mm256_set1_epi32(oe_ins), v_e_ins = _mm256_set1_epi32(e_ins);
+    __m256i vrb[2], vre[2], vT[2], h1[2], m[2], mj[2], f[2];
+    for (k = 0; k < 2; ++k) { // two 8-lane halves
+        vrb[k] = _mm256_loadu_si256((__m256i *)(rb + k * 8));
+        vre[k] = _mm256_loadu_si256((__m256i *)(re + k * 8));
+        vT[k] = _mm256_loadu_si256((__m256i *)(T + k * 8));
+        h1[k] = _mm256_loadu_si256((__m256i *)(_h1 + k * 8));
+        m[k] = _mm256_loadu_si256((__m256i *)(_m + k * 8));
+        mj[k] = _mm256_loadu_si256((__m256i *)(_mj + k * 8));
+        f[k] = zero;
+    }
+    for (j = jb; j < je; ++j) {
+        __m256i vj = _mm256_set1_epi32(j);
+        for (k = 0; k < 2; ++k) {
+            int32_t * pH = H + j * KSW_LANES + k * 8, * pE = E + j * KSW_LANES + k * 8;
+            __m256i in, M, e, h, S, t;
+            in = _mm256_andnot_si256(_mm256_cmpgt_epi32(vrb[k], vj), _mm256_cmpgt_epi32(vre[k], vj)); // beg <= j < end
+            M = _mm256_loadu_si256((__m256i *)pH); // H(i-1,j-1)
+            e = _mm256_loadu_si256((__m256i *)pE); // E(i,j)
+            _mm256_maskstore_epi32(pH, in, h1[k]); // H(i,j-1) for the next row
+            S = _mm256_i32gather_epi32(mat32, _mm256_add_epi32(vT[k], _mm256_loadu_si256((__m256i *)(Q + j * KSW_LANES + k * 8))), 4);
+            M = _mm256_andnot_si256(_mm256_cmpeq_epi32(M, zero), _mm256_add_epi32(M, S));
+            h = _mm256_max_epi32(_mm256_max_epi32(M, e), f[k]); // H(i,j)
+            h1[k] = _mm256_blendv_epi8(h1[k], h, in);
+            mj[k] = _mm256_blendv_epi8(mj[k], vj, _mm256_andnot_si256(_mm256_cmpgt_epi32(m[k], h), in));
+            m[k] = _mm256_blendv_epi8(m[k], _mm256_max_epi32(m[k], h), in);
+            t = _mm256_max_epi32(_mm256_sub_epi32(M, v_oe_del), zero);
+            e = _mm256_max_epi32(_mm256_sub_epi32(e, v_e_del), t); // E(i+1,j)
+            _mm256_maskstore_epi32(pE, in, e);
+            t = _mm256_max_epi32(_mm256_sub_epi32(M, v_oe_ins), zero);
+            f[k] = _mm256_blendv_epi8(f[k], _mm256_max_epi32(_mm256_sub_epi32(f[k], v_e_ins), t), in); // F(i,j+1)
+        }
+    }
+    for (k = 0; k < 2; ++k) {
+        _mm256_storeu_si256((__m256i *)(_h1 + k * 8), h1[k]);
+        _mm256_storeu_si256((__m256i *)(_m + k * 8), m[k]);
+        _mm256_storeu_si256((__m256i *)(_mj + k * 8), mj[k]);
+    }
+}
+
+__attribute__((target("avx512f")))
+static void ksw_ext_lanes_avx512(int jb, int je, const int32_t * rb, const int32_t * re, const int32_t * T, int32_t * H, int32_t * E, const int32_t * Q, const int32_t * mat32, int oe_del, int e_del, int oe_ins, int e_ins, int32_t * _h1, int32_t * _m, int32_t * _mj) {
+    int j;
+    __m512i zero = _mm512_setzero_si512();
+    __m512i v_oe_del = _mm512_set1_epi32(oe_del), v_e_del = _mm512_set1_epi32(e_del), v_oe_ins = _mm512_set1_epi32(oe_ins), v_e_ins = _mm512_set1_epi32(e_ins);
+    __m512i vrb = _mm512_loadu_si512(rb), vre = _mm512_loadu_si512(re), vT = _mm512_loadu_si512(T);
+    __m512i mat_lo = _mm512_loadu_si512(mat32), mat_hi = _mm512_loadu_si512(mat32 + 16);
+    __m512i h1 = _mm512_loadu_si512(_h1), m = _mm512_loadu_si512(_m), mj = _mm512_loadu_si512(_mj), f = zero;
+    for (j = jb; j < je; ++j) {
+        int32_t * pH = H + j * KSW_LANES, * pE = E + j * KSW_LANES;
+        __m512i vj = _mm512_set1_epi32(j), M, e, h, S, t;
+        __mmask16 in = _mm512_cmple_epi32_mask(vrb, vj) & _mm512_cmpgt_epi32_mask(vre, vj);
+        M = _mm512_loadu_si512(pH);
+        e = _mm512_loadu_si512(pE);
+        _mm512_mask_storeu_epi32(pH, in, h1);
+        S = _mm512_permutex2var_epi32(mat_lo, _mm512_add_epi32(vT, _mm512_loadu_si512(Q + j * KSW_LANES)), mat_hi);
+        M = _mm512_maskz_add_epi32(_mm512_test_epi32_mask(M, M), M, S);
+        h = _mm512_max_epi32(_mm512_max_epi32(M, e), f);
+        h1 = _mm512_mask_mov_epi32(h1, in, h);
+        mj = _mm512_mask_mov_epi32(mj, in & _mm512_cmpge_epi32_mask(h, m), vj);
+        m = _mm512_mask_max_epi32(m, in, m, h);
+        t = _mm512_max_epi32(_mm512_sub_epi32(M, v_oe_del), zero);
+        e = _mm512_max_epi32(_mm512_sub_epi32(e, v_e_del), t);
+        _mm512_mask_storeu_epi32(pE, in, e);
+        t = _mm512_max_epi32(_mm512_sub_epi32(M, v_oe_ins), zero);
+        f = _mm512_mask_max_epi32(f, in, _mm512_sub_epi32(f, v_e_ins), t);
+    }
+    _mm512_storeu_si512(_h1, h1);
+    _mm512_storeu_si512(_m, m);
+    _mm512_storeu_si512(_mj, mj);
+}
+#endif
+
+static inline void ksw_lane_finish(const ksw_lane_t * s, ksw_extjob_t * p) {
+    p->score = s->max;
+    p->qle = s->max_j + 1;
+    p->tle = s->max_i + 1;
+    p->gtle = s->max_ie + 1;
+    p->gscore = s->gscore;
+    p->max_off = s->max_off;
+}
+
+/**
+ * Run up to KSW_LANES jobs in lanes; per lane, the driver does exactly what
+ * ksw_extend2_vec() does for one extension.
+ */
+static void ksw_extend2_lanes(ksw_ext_lanes_f lanes, int n, ksw_extjob_t ** jobs, int m, const int32_t * mat32, int max_sc, int o_del, int e_del, int o_ins, int e_ins, int zdrop) {
+    int32_t rb[KSW_LANES], re[KSW_LANES], T[KSW_LANES], h1[KSW_LANES], vm[KSW_LANES], vmj[KSW_LANES];
+    int32_t * H, * E, * Q;
+    ksw_lane_t st[KSW_LANES], * s;
+    int i, j, l, qmax, n_active, oe_del = o_del + e_del, oe_ins = o_ins + e_ins, max_ins, max_del;
+    for (l = 0, qmax = 0; l < n; ++l) {
+        qmax = qmax > jobs[l]->qlen ? qmax : jobs[l]->qlen;
+    }
+    H = calloc((qmax + 1) * KSW_LANES, 4);
+    E = calloc((qmax + 1) * KSW_LANES, 4);
+    Q = calloc((qmax + 1) * KSW_LANES, 4); // residues beyond $qlen are 0 such that lookups stay in mat32[]
+    for (l = 0; l < KSW_LANES; ++l) {
+        st[l].done = 1;
+    }
+    for (l = 0; l < n; ++l) {
+        ksw_extjob_t * p = jobs[l];
+        assert(p->h0 > 0);
+        s = &st[l];
+        for (j = 0; j < p->qlen; ++j) {
+            Q[j * KSW_LANES + l] = p->query[j];
+        }
+        // fill the first row
+        H[l] = p->h0;
+        H[KSW_LANES + l] = p->h0 > oe_ins ? p->h0 - oe_ins : 0;
+        for (j = 2; j <= p->qlen && H[(j - 1) * KSW_LANES + l] > e_ins; ++j) {
+            H[j * KSW_LANES + l] = H[(j - 1) * KSW_LANES + l] - e_ins;
+        }
+        // adjust $w if it is too large
+        max_ins = (int)((double)(p->qlen * max_sc + p->end_bonus - o_ins) / e_ins + 1.);
+        max_ins = max_ins > 1 ? max_ins : 1;
+        s->w = p->w < max_ins ? p->w : max_ins;
+        max_del = (int)((double)(p->qlen * max_sc + p->end_bonus - o_del) / e_del + 1.);
+        max_del = max_del > 1 ? max_del : 1;
+        s->w = s->w < max_del ? s->w : max_del;
+        s->max = p->h0, s->max_i = s->max_j = -1;
+        s->max_ie = -1, s->gscore = -1;
+        s->max_off = 0;
+        s->beg = 0, s->end = p->qlen;
+        s->done = 0;
+    }
+    // DP loop
+    for (i = 0, n_active = n; n_active > 0; ++i) {
+        int jb = qmax, je = 0;
+        for (l = 0; l < KSW_LANES; ++l) {
+            ksw_extjob_t * p;
+            s = &st[l];
+            rb[l] = re[l] = T[l] = h1[l] = vm[l] = 0, vmj[l] = -1;
+            if (s->done) {
+                continue;
+            }
+            p = jobs[l];
+            if (i >= p->tlen) {
+                ksw_lane_finish(s, p);
+                s->done = 1, --n_active;
+                continue;
+            }
+            // apply the band and the constraint (if provided)
+            if (s->beg < i - s->w) {
+                s->beg = i - s->w;
+            }
+            if (s->end > i + s->w + 1) {
+                s->end = i + s->w + 1;
+            }
+            if (s->end > p->qlen) {
+                s->end = p->qlen;
+            }
+            // compute the first column
+            if (s->beg == 0) {
+                h1[l] = p->h0 - (o_del + e_del * (i + 1));
+                if (h1[l] < 0) {
+                    h1[l] = 0;
+                }
+            }
+            if (s->beg < s->end) {
+                rb[l] = s->beg, re[l] = s->end;
+                jb = jb < s->beg ? jb : s->beg;
+                je = je > s->end ? je : s->end;
+            }
+            T[l] = p->target[i] * m;
+        }
+        if (jb < je) {
+            lanes(jb, je, rb, re, T, H, E, Q, mat32, oe_del, e_del, oe_ins, e_ins, h1, vm, vmj);
+        }
+        for (l = 0; l < KSW_LANES; ++l) {
+            ksw_extjob_t * p;
+            int32_t * h = H + l, * e = E + l;
+            int mj = vmj[l];
+            s = &st[l];
+            if (s->done) {
+                continue;
+            }
+            p = jobs[l];
+            h[s->end * KSW_LANES] = h1[l];
+            e[s->end * KSW_LANES] = 0;
+            if ((s->beg < s->end ? s->end : s->beg) == p->qlen) {
+                s->max_ie = s->gscore > h1[l] ? s->max_ie : i;
+                s->gscore = s->gscore > h1[l] ? s->gscore : h1[l];
+            }
+            if (vm[l] == 0) {
+                ksw_lane_finish(s, p);
+                s->done = 1, --n_active;
+                continue;
+            }
+            if (vm[l] > s->max) {
+                s->max = vm[l], s->max_i = i, s->max_j = mj;
+                s->max_off = s->max_off > abs(mj - i) ? s->max_off : abs(mj - i);
+            } else if (zdrop > 0) {
+                int dropped;
+                if (i - s->max_i > mj - s->max_j) {
+                    dropped = s->max - vm[l] - ((i - s->max_i) - (mj - s->max_j)) * e_del > zdrop;
+                } else {
+                    dropped = s->max - vm[l] - ((mj - s->max_j) - (i - s->max_i)) * e_ins > zdrop;
+                }
+                if (dropped) {
+                    ksw_lane_finish(s, p);
+                    s->done = 1, --n_active;
+                    continue;
+                }
+            }
+            // update beg and end for the next round
+            for (j = s->beg; LIKELY(j < s->end) && h[j * KSW_LANES] == 0 && e[j * KSW_LANES] == 0; ++j) {
+            }
+            s->beg = j;
+            for (j = s->end; LIKELY(j >= s->beg) && h[j * KSW_LANES] == 0 && e[j * KSW_LANES] == 0; --j) {
+            }
+            s->end = j + 2 < p->qlen ? j + 2 : p->qlen;
+        }
+    }
+    free(H);
+    free(E);
+    free(Q);
+}
+
+static int ksw_extjob_cmp(const void * a, const void * b) {
+    const ksw_extjob_t * p = *(ksw_extjob_t * const *)a, * q = *(ksw_extjob_t * const *)b;
+    if (p->qlen != q->qlen) {
+        return p->qlen < q->qlen ? -1 : 1;
+    }
+    return p->tlen < q->tlen ? -1 : p->tlen > q->tlen ? 1 : 0;
+}
+
+void ksw_extend2_batch(int n, ksw_extjob_t * jobs, int m, const int8_t * mat, int o_del, int e_del, int o_ins, int e_ins, int zdrop) {
+    ksw_ext_lanes_f lanes = 0;
+    ksw_extjob_t ** srt;
+    int32_t mat32[32];
+    int i, max_sc;
+#ifdef __GNUC__
+    if (ksw_simd_level == KSW_SIMD_AVX512) {
+        lanes = ksw_ext_lanes_avx512;
+    } else if (ksw_simd_level == KSW_SIMD_AVX2) {
+        lanes = ksw_ext_lanes_avx2;
+    }
+#endif
+    if (lanes == 0 || m * m > 32) { // one at a time
+        for (i = 0; i < n; ++i) {
+            ksw_extjob_t * p = &jobs[i];
+            p->score = ksw_extend2(p->qlen, p->query, p->tlen, p->target, m, mat, o_del, e_del, o_ins, e_ins, p->w, p->end_bonus, zdrop, p->h0, &p->qle, &p->tle, &p->gtle, &p->gscore, &p->max_off);
+        }
+        return;
+    }
+    for (i = 0, max_sc = 0; i < 32; ++i) {
+        mat32[i] = i < m * m ? mat[i] : 0;
+        max_sc = max_sc > mat32[i] ? max_sc : mat32[i];
+    }
+    srt = malloc(n * sizeof(ksw_extjob_t *));
+    for (i = 0; i < n; ++i) {
+        srt[i] = &jobs[i];
+    }
+    qsort(srt, n, sizeof(ksw_extjob_t *), ksw_extjob_cmp);
+    for (i = 0; i < n; i += KSW_LANES) {
+        ksw_extend2_lanes(lanes, n - i < KSW_LANES ? n - i : KSW_LANES, &srt[i], m, mat32, max_sc, o_del, e_del, o_ins, e_ins, zdrop);
+    }
+    free(srt);
+}
+
+/*******************************
+ *** Batched local alignment ***
+ *******************************/
+
+/* ksw_align2_batch() runs many alignments side by side, one in each 8-bit or
+ * 16-bit lane, where ksw_u8() and ksw_i16() split a single query across the
+ * lanes. To give identical results, a lane follows the striped layout the job
+ * would have had with p values per __m128i: the query is padded with residues
+ * scoring 0 to a multiple of p, and E(i+1,j) is computed from H(i,j) before
+ * the lazy-F loop, i.e. with F restarting from 0 at each of the p segments of
+ * the query. The lazy-F loop then brings H(i,j) to its exact value, which a
+ * lane gets from a second, unsegmented F. The lazy-F loop may stop too early
+ * if o_ins==0, in which case the jobs are run by ksw_align2() one by one. A
+ * lane takes the next job as soon as its current one is finished. As for the
+ * batched extension, cell j of lane l is at [j*w+l] for w lanes. */
+
+#define KSW_ALN_MAXW 64 // number of lanes of the widest kernel
+
+typedef void (*ksw_aln_lanes_f)(int xe, const int16_t * T, const int16_t * L, void * H, void * E, const void * Q, const int8_t * tab, int shift, int oe_del, int e_del, int oe_ins, int e_ins, int16_t * rmax, int16_t * rarg);
+
+typedef struct {
+    const uint8_t * query, * target;
+    int qlen, tlen, qrev, trev; // the first qrev+1 (trev+1) residues are read backwards; -1 for none
+    int p, minsc, endsc;
+    kswr_t r;
+} ksw_alnpass_t;
+
+typedef struct {
+    ksw_alnpass_t * p;
+    int i, ql, slen, gmax, te, qe, n_b, m_b;
+    int thres; // min(minsc,gmax+1): imax below this changes nothing
+    uint64_t * b;
+} ksw_alnlane_t;
+
+#ifdef __GNUC__
+// 64 lanes with the arithmetic of ksw_u8(); requires $xe<=256
+__attribute__((target("avx512bw,avx512vbmi")))
+static void ksw_aln_lanes_u8(int xe, const int16_t * T, const int16_t * L, void * _H, void * _E, const void * _Q, const int8_t * tab, int shift, int oe_del, int e_del, int oe_ins, int e_ins, int16_t * _rmax, int16_t * _rarg) {
+    uint8_t * H = (uint8_t *)_H, * E = (uint8_t *)_E;
+    const uint8_t * Q = (const uint8_t *)_Q;
+    int x;
+    __m512i zero = _mm512_setzero_si512(), v_shift = _mm512_set1_epi8(shift);
+    __m512i v_oe_del = _mm512_set1_epi8(oe_del), v_e_del = _mm512_set1_epi8(e_del), v_oe_ins = _mm512_set1_epi8(oe_ins), v_e_ins = _mm512_set1_epi8(e_ins);
+    __m512i vtab = _mm512_add_epi8(_mm512_loadu_si512(tab), v_shift);
+    __m512i vT = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtepi16_epi8(_mm512_loadu_si512(T))), _mm512_cvtepi16_epi8(_mm512_loadu_si512(T + 32)), 1);
+    __m512i vL = _mm512_inserti64x4(_mm512_castsi256_si512(_mm512_cvtepi16_epi8(_mm512_loadu_si512(L))), _mm512_cvtepi16_epi8(_mm512_loadu_si512(L + 32)), 1);
+    __m512i diag = zero, floc = zero, f = zero, hl = zero, rmax = zero, rarg = zero;
+    vL = _mm512_sub_epi8(vL, _mm512_set1_epi8(1)); // the last cell; 256 fits in this way
+    for (x = 0; x < xe; ++x) {
+        uint8_t * pH = H + x * 64, * pE = E + x * 64;
+        __m512i vx = _mm512_set1_epi8(x), q, S, h, e, t;
+        __mmask64 mk;
+        q = _mm512_loadu_si512(Q + x * 64);
+        S = _mm512_permutexvar_epi8(_mm512_add_epi8(vT, q), vtab); // only the lower 6 bits of the index are used
+        floc = _mm512_mask_mov_epi8(floc, _mm512_movepi8_mask(q), zero); // a new segment
+        t = _mm512_loadu_si512(pH); // H(i-1,j)
+        e = _mm512_loadu_si512(pE); // E(i,j)
+        h = _mm512_subs_epu8(_mm512_adds_epu8(diag, S), v_shift);
+        h = _mm512_max_epu8(_mm512_max_epu8(h, e), floc); // H(i,j) before lazy-F
+        e = _mm512_max_epu8(_mm512_subs_epu8(e, v_e_del), _mm512_subs_epu8(h, v_oe_del)); // E(i+1,j)
+        _mm512_storeu_si512(pE, e);
+        floc = _mm512_max_epu8(_mm512_subs_epu8(floc, v_e_ins), _mm512_subs_epu8(h, v_oe_ins)); // F within the segment
+        f = _mm512_max_epu8(_mm512_subs_epu8(f, v_e_ins), _mm512_subs_epu8(hl, v_oe_ins)); // F(i,j)
+        h = _mm512_max_epu8(h, f); // H(i,j)
+        _mm512_storeu_si512(pH, h);
+        hl = h, diag = t;
+        mk = _mm512_cmpgt_epu8_mask(h, rmax) & _mm512_cmple_epu8_mask(vx, vL);
+        rmax = _mm512_mask_mov_epi8(rmax, mk, h);
+        rarg = _mm512_mask_mov_epi8(rarg, mk, vx);
+    }
+    _mm512_storeu_si512(_rmax, _mm512_cvtepu8_epi16(_mm512_castsi512_si256(rmax)));
+    _mm512_storeu_si512(_rmax + 32, _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(rmax, 1)));
+    _mm512_storeu_si512(_rarg, _mm512_cvtepu8_epi16(_mm512_castsi512_si256(rarg)));
+    _mm512_storeu_si512(_rarg + 32, _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(rarg, 1)));
+}
+
+// 32 lanes with the arithmetic of ksw_i16()
+__attribute__((target("avx512bw")))
+static void ksw_aln_lanes_i16(int xe, const int16_t * T, const int16_t * L, void * _H, void * _E, const void * _Q, const int8_t * tab, int shift, int oe_del, int e_del, int oe_ins, int e_ins, int16_t * _rmax, int16_t * _rarg) {
+    int16_t * H = (int16_t *)_H, * E = (int16_t *)_E;
+    const int16_t * Q = (const int16_t *)_Q;
+    int x;
+    __m512i zero = _mm512_setzero_si512();
+    __m512i v_oe_del = _mm512_set1_epi16(oe_del), v_e_del = _mm512_set1_epi16(e_del), v_oe_ins = _mm512_set1_epi16(oe_ins), v_e_ins = _mm512_set1_epi16(e_ins);
+    __m512i vtab = _mm512_cvtepi8_epi16(_mm256_loadu_si256((__m256i *)tab));
+    __m512i vT = _mm512_loadu_si512(T), vL = _mm512_loadu_si512(L);
+    __m512i diag = zero, floc = zero, f = zero, hl = zero, rmax = zero, rarg = zero;
+    for (x = 0; x < xe; ++x) {
+        int16_t * pH = H + x * 32, * pE = E + x * 32;
+        __m512i vx = _mm512_set1_epi16(x), q, S, h, e, t;
+        __mmask32 mk;
+        q = _mm512_loadu_si512(Q + x * 32);
+        S = _mm512_permutexvar_epi16(_mm512_add_epi16(vT, q), vtab); // only the lower 5 bits of the index are used
+        floc = _mm512_mask_mov_epi16(floc, _mm512_movepi16_mask(q), zero);
+        t = _mm512_loadu_si512(pH);
+        e = _mm512_loadu_si512(pE);
+        h = _mm512_max_epi16(_mm512_max_epi16(_mm512_adds_epi16(diag, S), e), floc);
+        e = _mm512_max_epi16(_mm512_subs_epu16(e, v_e_del), _mm512_subs_epu16(h, v_oe_del));
+        _mm512_storeu_si512(pE, e);
+        floc = _mm512_max_epi16(_mm512_subs_epu16(floc, v_e_ins), _mm512_subs_epu16(h, v_oe_ins));
+        f = _mm512_max_epi16(_mm512_subs_epu16(f, v_e_ins), _mm512_subs_epu16(hl, v_oe_ins));
+        h = _mm512_max_epi16(h, f);
+        _mm512_storeu_si512(pH, h);
+        hl = h, diag = t;
+        mk = _mm512_cmpgt_epi16_mask(h, rmax) & _mm512_cmpgt_epi16_mask(vL, vx);
+        rmax = _mm512_mask_mov_epi16(rmax, mk, h);
+        rarg = _mm512_mask_mov_epi16(rarg, mk, vx);
+    }
+    _mm512_storeu_si512(_rmax, rmax);
+    _mm512_storeu_si512(_rarg, rarg);
+}
+#endif
+
+static void ksw_aln_load(ksw_alnlane_t * s, ksw_alnpass_t * p, int w, int size, int l, int m, void * H, void * E, void * Q) {
+    int x, k, c;
+    s->p = p;
+    s->i = 0, s->gmax = 0, s->te = -1, s->qe = 0, s->n_b = 0;
+    s->thres = p->minsc < 1 ? p->minsc : 1;
+    s->slen = (p->qlen + p->p - 1) / p->p;
+    s->ql = s->slen * p->p;
+    for (x = k = 0; x < s->ql; ++x, ++k) { // residue $m pads the query; the highest bit flags the start of a segment
+        c = x >= p->qlen ? m : x <= p->qrev ? p->query[p->qrev - x] : p->query[x];
+        k = k == s->slen ? 0 : k;
+        if (size == 1) {
+            ((uint8_t *)Q)[x * w + l] = c | (k == 0 ? 0x80 : 0);
+            ((uint8_t *)H)[x * w + l] = ((uint8_t *)E)[x * w + l] = 0;
+        } else {
+            ((int16_t *)Q)[x * w + l] = c | (k == 0 ? 0x8000 : 0);
+            ((int16_t *)H)[x * w + l] = ((int16_t *)E)[x * w + l] = 0;
+        }
+    }
+}
+
+// the epilogue of ksw_u8() and ksw_i16()
+static void ksw_aln_finish(const ksw_alnlane_t * s, int max_sc) {
+    kswr_t * r = &s->p->r;
+    int i;
+    *r = g_defr;
+    r->score = s->gmax, r->te = s->te, r->qe = s->qe;
+    if (s->n_b) {
+        int w = (r->score + max_sc - 1) / max_sc, low = s->te - w, high = s->te + w;
+        for (i = 0; i < s->n_b; ++i) {
+            int e = (int32_t)s->b[i];
+            if ((e < low || e > high) && (int)(s->b[i] >> 32) > r->score2) {
+                r->score2 = s->b[i] >> 32, r->te2 = e;
+            }
+        }
+    }
+}
+
+static void ksw_align2_lanes(ksw_aln_lanes_f lanes, int w, int size, int n, ksw_alnpass_t ** ps, int m, const int8_t * tab, int shift, int max_sc, int o_del, int e_del, int o_ins, int e_ins) {
+    int16_t T[KSW_ALN_MAXW], L[KSW_ALN_MAXW], rmax[KSW_ALN_MAXW], rarg[KSW_ALN_MAXW];
+    void * H, * E, * Q;
+    ksw_alnlane_t st[KSW_ALN_MAXW], * s;
+    int i, l, next, xmax, xe;
+    if (n == 0) {
+        return;
+    }
+    for (i = 0, xmax = 0; i < n; ++i) {
+        int ql = (ps[i]->qlen + ps[i]->p - 1) / ps[i]->p * ps[i]->p;
+        xmax = xmax > ql ? xmax : ql;
+    }
+    H = malloc(xmax * w * size);
+    E = malloc(xmax * w * size);
+    Q = malloc(xmax * w * size);
+    memset(st, 0, sizeof(st));
+    for (l = next = 0, xe = -1; l < w; ++l) {
+        s = &st[l];
+        s->i = 0;
+        do { // skip jobs with an empty target
+            if (s->p) {
+                ksw_aln_finish(s, max_sc);
+            }
+            s->p = next < n ? ps[next++] : 0;
+            if (s->p) {
+                ksw_aln_load(s, s->p, w, size, l, m, H, E, Q);
+            }
+        } while (s->p && s->p->tlen == 0);
+    }
+    for (;;) {
+        if (xe < 0) { // the lanes have changed
+            for (l = 0, xe = 0; l < w; ++l) {
+                L[l] = st[l].p ? st[l].ql : 0;
+                xe = xe > L[l] ? xe : L[l];
+            }
+        }
+        if (xe == 0) {
+            break;
+        }
+        for (l = 0; l < w; ++l) {
+            const ksw_alnpass_t * p = st[l].p;
+            i = st[l].i;
+            T[l] = p ? (i <= p->trev ? p->target[p->trev - i] : p->target[i]) * (m + 1) : 0;
+        }
+        lanes(xe, T, L, H, E, Q, tab, shift, o_del + e_del, e_del, o_ins + e_ins, e_ins, rmax, rarg);
+        for (l = 0; l < w; ++l) {
+            int imax = rmax[l];
+            s = &st[l];
+            if (s->p == 0) {
+                continue;
+            }
+            if (imax >= s->thres) {
+                if (imax >= s->p->minsc) { // the b array of ksw_u8()
+                    if (s->n_b == 0 || (int32_t)s->b[s->n_b - 1] + 1 != s->i) {
+                        if (s->n_b == s->m_b) {
+                            s->m_b = s->m_b ? s->m_b << 1 : 8;
+                            s->b = (uint64_t *)realloc(s->b, 8 * s->m_b);
+                        }
+                        s->b[s->n_b++] = (uint64_t)imax << 32 | s->i;
+                    } else if ((int)(s->b[s->n_b - 1] >> 32) < imax) {
+                        s->b[s->n_b - 1] = (uint64_t)imax << 32 | s->i;
+                    }
+                }
+                if (imax > s->gmax) {
+                    s->gmax = imax, s->te = s->i, s->qe = rarg[l];
+                    s->thres = s->p->minsc < s->gmax + 1 ? s->p->minsc : s->gmax + 1;
+                    if (s->gmax >= s->p->endsc) {
+                        s->i = s->p->tlen - 1;
+                    }
+                }
+            }
+            if (++s->i == s->p->tlen) { // finished; take the next job
+                do {
+                    ksw_aln_finish(s, max_sc);
+                    s->p = next < n ? ps[next++] : 0;
+                    if (s->p) {
+                        ksw_aln_load(s, s->p, w, size, l, m, H, E, Q);
+                    }
+                } while (s->p && s->p->tlen == 0);
+                xe = -1;
+            }
+        }
+    }
+    for (l = 0; l < w; ++l) {
+        free(st[l].b);
+    }
+    free(H);
+    free(E);
+    free(Q);
+}
+
+static int ksw_alnpass_cmp(const void * a, const void * b) {
+    const ksw_alnpass_t * p = *(ksw_alnpass_t * const *)a, * q = *(ksw_alnpass_t * const *)b;
+    int lp = (p->qlen + p->p - 1) / p->p * p->p, lq = (q->qlen + q->p - 1) / q->p * q->p;
+    int tp = p->trev >= 0 ? p->trev : p->tlen, tq = q->trev >= 0 ? q->trev : q->tlen; // the reverse pass stops before trev
+    if (p->p != q->p) {
+        return p->p > q->p ? -1 : 1;
+    }
+    if (lp != lq) {
+        return lp < lq ? -1 : 1;
+    }
+    return tp < tq ? -1 : tp > tq ? 1 : 0;
+}
+
+// run passes sorted by ksw_alnpass_cmp(); those with p==16 come first
+static void ksw_align2_passes(ksw_aln_lanes_f u8, ksw_aln_lanes_f i16, int n, ksw_alnpass_t ** ps, int m, const int8_t * tab, int shift, int max_sc, int o_del, int e_del, int o_ins, int e_ins) {
+    int n8;
+    qsort(ps, n, sizeof(ksw_alnpass_t *), ksw_alnpass_cmp);
+    for (n8 = 0; n8 < n && ps[n8]->p == 16; ++n8) {
+    }
+    ksw_align2_lanes(u8, 64, 1, n8, ps, m, tab, shift, max_sc, o_del, e_del, o_ins, e_ins);
+    ksw_align2_lanes(i16, 32, 2, n - n8, ps + n8, m, tab, shift, max_sc, o_del, e_del, o_ins, e_ins);
+}
+
+void ksw_align2_batch(int n, ksw_alnjob_t * jobs, int m, const int8_t * mat, int o_del, int e_del, int o_ins, int e_ins) {
+    ksw_aln_lanes_f u8 = 0, i16 = 0;
+    ksw_alnpass_t * ps, ** srt;
+    uint8_t * qbuf = 0, * tbuf = 0;
+    int8_t tab[64];
+    int i, k, max_sc, min_sc, shift, m_qbuf = 0, m_tbuf = 0;
+#ifdef __GNUC__
+    if (ksw_simd_level == KSW_SIMD_AVX512 && __builtin_cpu_supports("avx512bw")) { // narrower kernels are not faster than ksw_u8()
+        i16 = ksw_aln_lanes_i16;
+        if (__builtin_cpu_supports("avx512vbmi")) {
+            u8 = ksw_aln_lanes_u8;
+        }
+    }
+#endif
+    for (i = 0, max_sc = 0, min_sc = 127; i < m * m; ++i) { // as in ksw_qinit()
+        max_sc = max_sc > mat[i] ? max_sc : mat[i];
+        min_sc = min_sc < mat[i] ? min_sc : mat[i];
+    }
+    shift = (uint8_t)(256 - min_sc);
+    memset(tab, 0, 64);
+    for (i = 0; i < m * (m + 1) && m <= 5; ++i) { // residue $m pads the query
+        tab[i] = i % (m + 1) < m ? mat[i / (m + 1) * m + i % (m + 1)] : 0;
+    }
+    ps = malloc(n * sizeof(ksw_alnpass_t));
+    srt = malloc(n * sizeof(ksw_alnpass_t *));
+    for (i = k = 0; i < n; ++i) {
+        ksw_alnjob_t * p = &jobs[i];
+        ksw_alnpass_t * q = &ps[i];
+        int xtra = p->xtra;
+        q->query = p->query, q->target = p->target;
+        q->qlen = p->qlen, q->tlen = p->tlen;
+        q->qrev = q->trev = -1;
+        q->p = (xtra & KSW_XBYTE) ? 16 : 8;
+        q->minsc = (xtra & KSW_XSUBO) ? xtra & 0xffff : 0x10000;
+        q->endsc = (xtra & KSW_XSTOP) ? xtra & 0xffff : 0x10000;
+        if (m <= 5 && o_ins > 0 && max_sc > 0 && p->qlen > 0) { // no saturation in either kernel
+            if ((xtra & KSW_XBYTE) ? u8 && p->qlen * max_sc + shift < 255 : i16 && p->qlen * max_sc < 0x7fff - 16) {
+                srt[k++] = q;
+                continue;
+            }
+        }
+        // ksw_align2() reverses the sequences in place; work on copies as they may be shared by jobs
+        q->p = 0;
+        if (p->qlen > m_qbuf) {
+            m_qbuf = p->qlen;
+            qbuf = realloc(qbuf, m_qbuf);
+        }
+        if (p->tlen > m_tbuf) {
+            m_tbuf = p->tlen;
+            tbuf = realloc(tbuf, m_tbuf);
+        }
+        memcpy(qbuf, p->query, p->qlen);
+        memcpy(tbuf, p->target, p->tlen);
+        p->r = ksw_align2(p->qlen, qbuf, p->tlen, tbuf, m, mat, o_del, e_del, o_ins, e_ins, xtra, 0);
+    }
+    free(qbuf);
+    free(tbuf);
+    ksw_align2_passes(u8, i16, k, srt, m, tab, shift, max_sc, o_del, e_del, o_ins, e_ins);
+    for (i = k = 0; i < n; ++i) { // the start positions, as in ksw_align2()
+        ksw_alnjob_t * p = &jobs[i];
+        ksw_alnpass_t * q = &ps[i];
+        if (q->p == 0) {
+            continue;
+        }
+        p->r = q->r;
+        if ((p->xtra & KSW_XSTART) == 0 || ((p->xtra & KSW_XSUBO) && p->r.score < (p->xtra & 0xffff))) {
+            q->p = 0;
+            continue;
+        }
+        q->qlen = p->r.qe + 1, q->qrev = p->r.qe, q->trev = p->r.te;
+        q->minsc = 0x10000, q->endsc = p->r.score;
+        srt[k++] = q;
+    }
+    ksw_align2_passes(u8, i16, k, srt, m, tab, shift, max_sc, o_del, e_del, o_ins, e_ins);
+    for (i = 0; i < n; ++i) {
+        kswr_t * r = &jobs[i].r;
+        if (ps[i].p && r->score == ps[i].r.score) {
+            r->tb = r->te - ps[i].r.te, r->qb = r->qe - ps[i].r.qe;
+        }
+    }
+    free(srt);
+    free(ps);
+}
+
 /**
  * 该函数为存计算，可以考虑改为使用GPU加速执行
  * @param qlen 待匹配段碱基的query长度
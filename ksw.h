@@ -8,9 +8,21 @@
 #define KSW_XSUBO  0x40000
 #define KSW_XSTART 0x80000
 
+#define KSW_SIMD_NONE   0
+#define KSW_SIMD_SSE41  1
+#define KSW_SIMD_AVX2   2
+#define KSW_SIMD_AVX512 3
+
 struct _kswq_t;
 typedef struct _kswq_t kswq_t;
 
+typedef struct {
+	int qlen, tlen;
+	const uint8_t *query, *target;
+	int w, end_bonus, h0;
+	int score, qle, tle, gtle, gscore, max_off; // output; see ksw_extend2()
+} ksw_extjob_t;
+
 typedef struct {
 	int score; // best score
 	int te, qe; // target end and query end
@@ -18,6 +30,13 @@ typedef struct {
 	int tb, qb; // target start and query start
 } kswr_t;
 
+typedef struct {
+	int qlen, tlen;
+	const uint8_t *query, *target;
+	int xtra;
+	kswr_t r; // output; see ksw_align2()
+} ksw_alnjob_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -107,6 +126,46 @@ extern "C" {
 	int ksw_extend(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off);
 	int ksw_extend2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off);
 
+	/**
+	 * Select the kernel used by ksw_extend() and ksw_extend2()
+	 *
+	 * All kernels give identical results. By default, the widest one
+	 * supported by the CPU is selected when the program starts. Not
+	 * thread-safe: call it before any thread uses the kernels.
+	 *
+	 * @param level   one of KSW_SIMD_*; negative for the widest supported
+	 *
+	 * @return        the level in use, which may be lower than $level if
+	 *                the CPU does not support it
+	 */
+	int ksw_extend_simd(int level);
+
+	/**
+	 * Run a batch of independent extensions
+	 *
+	 * The results are identical to calling ksw_extend2() on each job, but
+	 * jobs are sorted by length and extended side by side in SIMD lanes.
+	 * Inputs of each job are $qlen, $query, $tlen, $target, $w, $end_bonus
+	 * and $h0; the rest of the fields are set on return.
+	 *
+	 * @param n       number of jobs
+	 * @param jobs    array of jobs
+	 */
+	void ksw_extend2_batch(int n, ksw_extjob_t *jobs, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int zdrop);
+
+	/**
+	 * Run a batch of independent local alignments
+	 *
+	 * The results are identical to calling ksw_align2() on each job without
+	 * a query profile, but jobs are aligned side by side in SIMD lanes. Inputs
+	 * of each job are $qlen, $query, $tlen, $target and $xtra; $r is set on
+	 * return. The sequences are not modified and may be shared by jobs.
+	 *
+	 * @param n       number of jobs
+	 * @param jobs    array of jobs
+	 */
+	void ksw_align2_batch(int n, ksw_alnjob_t *jobs, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,3 +1,8 @@
+#ifdef __linux__
+#define _GNU_SOURCE // for pthread_setaffinity_np()
+#include <sched.h>
+#include <stdio.h>
+#endif
 #include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -36,8 +41,7 @@ static inline long steal_work(kt_for_t *t) {
     return k >= t->n ? -1 : k;
 }
 
-static void *ktf_worker(void *data) {
-    ktf_worker_t *w = (ktf_worker_t *)data;
+static void ktf_run(ktf_worker_t *w) {
     long i;
     for (;;) {
         i = __sync_fetch_and_add(&w->i, w->t->n_threads);
@@ -49,6 +53,11 @@ static void *ktf_worker(void *data) {
     while ((i = steal_work(w->t)) >= 0) {
         w->t->func(w->t->data, i, w - w->t->w);
     }
+}
+
+static void *ktf_worker(void *data) {
+    ktf_worker_t *w = (ktf_worker_t *)data;
+    ktf_run(w);
     pthread_exit(0);
 }
 
@@ -70,6 +79,212 @@ void kt_for(int n_threads, void (*func)(void *, long, int), void *data, long n)
     }
 }
 
+/****************
+ * kt_forpool() *
+ ****************/
+
+/* The same as kt_for(), but the threads are created once and wait for jobs
+ * in between. Several callers may submit jobs at the same time; the jobs are
+ * queued and a thread that finds no index left to take in a job, its own or
+ * stolen, moves on to the next job in the queue. */
+typedef struct kto_job_t {
+    kt_for_t t;
+    int n_users, drained; // threads working on the job; whether all indices have been taken
+    struct kto_job_t *next;
+} kto_job_t;
+
+struct kt_forpool_t;
+
+typedef struct {
+    struct kt_forpool_t *fp;
+    int i;
+} kto_worker_t;
+
+typedef struct kt_forpool_t {
+    int n_threads, stop;
+    kto_job_t *head, *tail; // queued jobs, oldest first
+    kto_worker_t *w;
+    pthread_t *tid;
+    pthread_mutex_t mutex;
+    pthread_cond_t cv_m, cv_s; // cv_m: a job may be finished; cv_s: a job is submitted or the pool is stopped
+} kt_forpool_t;
+
+static void *kto_worker(void *data) {
+    kto_worker_t *w = (kto_worker_t *)data;
+    kt_forpool_t *fp = w->fp;
+    pthread_mutex_lock(&fp->mutex);
+    for (;;) {
+        kto_job_t *j;
+        for (j = fp->head; j && j->drained; j = j->next) {
+        }
+        if (j == 0) {
+            if (fp->stop) {
+                break;
+            }
+            pthread_cond_wait(&fp->cv_s, &fp->mutex);
+            continue;
+        }
+        ++j->n_users;
+        pthread_mutex_unlock(&fp->mutex);
+
+        ktf_run(&j->t.w[w->i]); // returns when no index is left to take
+
+        pthread_mutex_lock(&fp->mutex);
+        j->drained = 1;
+        if (--j->n_users == 0) {
+            pthread_cond_broadcast(&fp->cv_m);
+        }
+    }
+    pthread_mutex_unlock(&fp->mutex);
+    pthread_exit(0);
+}
+
+#ifdef __linux__
+// CPUs this process may run on, node by node, so that threads next to each other share a NUMA node
+static int kt_cpu_list(int **_cpus) {
+    cpu_set_t set;
+    int c, node, n = 0, *cpus;
+    char fn[64], line[4096];
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &set) != 0) {
+        return 0;
+    }
+    cpus = (int *)malloc(CPU_SETSIZE * sizeof(int));
+    for (node = 0;; ++node) {
+        FILE *fp;
+        char *p;
+        sprintf(fn, "/sys/devices/system/node/node%d/cpulist", node);
+        if ((fp = fopen(fn, "r")) == 0) {
+            break;
+        }
+        for (p = fgets(line, sizeof(line), fp); p && *p >= '0' && *p <= '9';) { // e.g. "0-15,32-47"
+            long a, b;
+            a = b = strtol(p, &p, 10);
+            if (*p == '-') {
+                b = strtol(p + 1, &p, 10);
+            }
+            for (; a <= b && a < CPU_SETSIZE; ++a) {
+                if (CPU_ISSET(a, &set)) {
+                    cpus[n++] = a, CPU_CLR(a, &set);
+                }
+            }
+            p += *p == ',';
+        }
+        fclose(fp);
+    }
+    for (c = 0; c < CPU_SETSIZE; ++c) { // no sysfs, or CPUs not listed under any node
+        if (CPU_ISSET(c, &set)) {
+            cpus[n++] = c;
+        }
+    }
+    *_cpus = cpus;
+    return n;
+}
+#endif
+
+/**
+ * 创建常驻线程池，供kt_forpool()反复使用
+ * @param n_threads 线程数量
+ * @param pin 非0时将第i个线程绑定到第i个CPU(按NUMA节点排序)；仅Linux支持
+ * @return 线程池
+ */
+void *kt_forpool_init(int n_threads, int pin) {
+    kt_forpool_t *fp;
+    int i;
+    if (n_threads < 1) {
+        n_threads = 1;
+    }
+    fp = (kt_forpool_t *)calloc(1, sizeof(kt_forpool_t));
+    fp->n_threads = n_threads;
+    fp->tid = (pthread_t *)calloc(n_threads, sizeof(pthread_t));
+    fp->w = (kto_worker_t *)calloc(n_threads, sizeof(kto_worker_t));
+    pthread_mutex_init(&fp->mutex, 0);
+    pthread_cond_init(&fp->cv_m, 0);
+    pthread_cond_init(&fp->cv_s, 0);
+    for (i = 0; i < n_threads; ++i) {
+        fp->w[i].fp = fp, fp->w[i].i = i;
+        pthread_create(&fp->tid[i], 0, kto_worker, &fp->w[i]);
+    }
+#ifdef __linux__
+    if (pin) {
+        int *cpus = 0, n_cpus = kt_cpu_list(&cpus);
+        for (i = 0; i < n_threads && n_cpus > 0; ++i) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i % n_cpus], &set);
+            pthread_setaffinity_np(fp->tid[i], sizeof(cpu_set_t), &set);
+        }
+        free(cpus);
+    }
+#endif
+    return fp;
+}
+
+void kt_forpool_destroy(void *_fp) {
+    kt_forpool_t *fp = (kt_forpool_t *)_fp;
+    int i;
+    if (fp == 0) {
+        return;
+    }
+    pthread_mutex_lock(&fp->mutex);
+    fp->stop = 1;
+    pthread_cond_broadcast(&fp->cv_s);
+    pthread_mutex_unlock(&fp->mutex);
+    for (i = 0; i < fp->n_threads; ++i) {
+        pthread_join(fp->tid[i], 0);
+    }
+    pthread_mutex_destroy(&fp->mutex);
+    pthread_cond_destroy(&fp->cv_m);
+    pthread_cond_destroy(&fp->cv_s);
+    free(fp->w);
+    free(fp->tid);
+    free(fp);
+}
+
+/**
+ * 与kt_for()相同，但由线程池中的线程执行；可由多个线程同时调用，任务排队，
+ * 线程取完一个任务的所有i后即转向下一个任务；本任务的所有i完成后返回
+ * @param _fp kt_forpool_init()创建的线程池
+ * @param func 对每个i调用func(data, i, tid)，tid小于线程数量
+ * @param data 任务数据
+ * @param n 任务数量
+ */
+void kt_forpool(void *_fp, void (*func)(void *, long, int), void *data, long n) {
+    kt_forpool_t *fp = (kt_forpool_t *)_fp;
+    kto_job_t j, *q, *prev;
+    int i;
+    if (n <= 0) {
+        return;
+    }
+    j.t.func = func, j.t.data = data, j.t.n = n, j.t.n_threads = fp->n_threads;
+    j.t.w = (ktf_worker_t *)alloca(fp->n_threads * sizeof(ktf_worker_t));
+    for (i = 0; i < fp->n_threads; ++i) {
+        j.t.w[i].t = &j.t, j.t.w[i].i = i;
+    }
+    j.n_users = j.drained = 0, j.next = 0;
+    pthread_mutex_lock(&fp->mutex);
+    if (fp->tail) {
+        fp->tail->next = &j;
+    } else {
+        fp->head = &j;
+    }
+    fp->tail = &j;
+    pthread_cond_broadcast(&fp->cv_s);
+    while (!j.drained || j.n_users > 0) { // all indices taken and their func() returned
+        pthread_cond_wait(&fp->cv_m, &fp->mutex);
+    }
+    for (q = fp->head, prev = 0; q != &j; prev = q, q = q->next) { // unlink the job
+    }
+    if (prev) {
+        prev->next = j.next;
+    } else {
+        fp->head = j.next;
+    }
+    if (fp->tail == &j) {
+        fp->tail = prev;
+    }
+    pthread_mutex_unlock(&fp->mutex);
+}
+
 /*****************
  * kt_pipeline() *
  *****************/
@@ -91,6 +306,7 @@ typedef struct ktp_t {
 
     int64_t index;
     int n_workers, n_steps;
+    int unordered; //可以由多个线程同时、乱序执行的步骤(bit mask)
     ktp_worker_t *workers; //线程work指针
     pthread_mutex_t mutex; //线程中的互斥锁
     pthread_cond_t cv; //线程中的条件变量
@@ -107,11 +323,13 @@ static void *ktp_worker(void *data) {
             int i;
             // test whether another worker is doing the same step
             for (i = 0; i < p->n_workers; ++i) {
+                const ktp_worker_t *q = &p->workers[i];
                 // ignore itself
-                if (w == &p->workers[i]) {
+                if (w == q) {
                     continue;
                 }
-                if (p->workers[i].step <= w->step && p->workers[i].index < w->index) {
+                // an unordered step may run alongside the same step of earlier data
+                if (q->index < w->index && (q->step < w->step || (q->step == w->step && !(p->unordered >> w->step & 1)))) {
                     break;
                 }
             }
@@ -139,12 +357,17 @@ static void *ktp_worker(void *data) {
 
 /**
  * 线程控制管理，启动工作线程
- * @param n_threads 线程数量
+ *
+ * 每个线程依次处理一块数据的所有步骤，因此最多有n_threads块数据同时在流水线中。
+ * 默认每个步骤按数据的读入顺序、一次只由一个线程执行；unordered中标记的步骤
+ * 可以由多个线程对不同的数据块同时执行。
+ * @param n_threads 线程数量，即同时处理的数据块数
  * @param func 线程执行函数
  * @param shared_data 线程共享数据
  * @param n_steps 需要执行的步数
+ * @param unordered 可以并发执行的步骤，第i位对应第i步；第0步和最后一步通常不应设置
  */
-void kt_pipeline(int n_threads, void *(*func)(void *, int, void *), void *shared_data, int n_steps) {
+void kt_pipeline2(int n_threads, void *(*func)(void *, int, void *), void *shared_data, int n_steps, int unordered) {
     ktp_t aux;
     int i;
 
@@ -153,6 +376,7 @@ void kt_pipeline(int n_threads, void *(*func)(void *, int, void *), void *shared
     }
     aux.n_workers = n_threads;
     aux.n_steps = n_steps;
+    aux.unordered = unordered;
     aux.func = func; //work function
     aux.shared = shared_data;
     aux.index = 0;
@@ -182,3 +406,7 @@ void kt_pipeline(int n_threads, void *(*func)(void *, int, void *), void *shared
     pthread_mutex_destroy(&aux.mutex);
     pthread_cond_destroy(&aux.cv);
 }
+
+void kt_pipeline(int n_threads, void *(*func)(void *, int, void *), void *shared_data, int n_steps) {
+    kt_pipeline2(n_threads, func, shared_data, n_steps, 0);
+}
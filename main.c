@@ -41,6 +41,8 @@ int bwa_bwtupdate(int argc, char *argv[]);
 
 int bwa_bwt2sa(int argc, char *argv[]);
 
+int bwa_idx2img(int argc, char *argv[]);
+
 int bwa_index(int argc, char *argv[]);
 
 int bwt_bwtgen_main(int argc, char *argv[]);
@@ -51,6 +53,10 @@ int bwa_sai2sam_se(int argc, char *argv[]);
 
 int bwa_sai2sam_pe(int argc, char *argv[]);
 
+int bwa_alnse(int argc, char *argv[]);
+
+int bwa_alnpe(int argc, char *argv[]);
+
 int bwa_bwtsw2(int argc, char *argv[]);
 
 int main_fastmap(int argc, char *argv[]);
@@ -80,6 +86,8 @@ static int usage() {
     fprintf(stderr, "         aln           gapped/ungapped alignment\n");
     fprintf(stderr, "         samse         generate alignment (single ended)\n");
     fprintf(stderr, "         sampe         generate alignment (paired ended)\n");
+    fprintf(stderr, "         alnse         aln+samse without intermediate .sai files\n");
+    fprintf(stderr, "         alnpe         aln+sampe without intermediate .sai files\n");
     fprintf(stderr, "         bwasw         BWA-SW for long queries (DEPRECATED)\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "         shm           manage indices in shared memory\n");
@@ -88,6 +96,7 @@ static int usage() {
     fprintf(stderr, "         pac2bwtgen    alternative algorithm for generating BWT\n");
     fprintf(stderr, "         bwtupdate     update .bwt to the new format\n");
     fprintf(stderr, "         bwt2sa        generate SA from BWT and Occ\n");
+    fprintf(stderr, "         idx2img       pack the index into a memory-mappable image\n");
     fprintf(stderr, "\n");
     fprintf(stderr,
         "Note: To use BWA, you need to first index the genome with `bwa index'.\n"
@@ -127,6 +136,8 @@ int main(int argc, char *argv[]) {
         ret = bwa_bwtupdate(argc - 1, argv + 1);
     } else if (strcmp(argv[1], "bwt2sa") == 0) {
         ret = bwa_bwt2sa(argc - 1, argv + 1);
+    } else if (strcmp(argv[1], "idx2img") == 0) {
+        ret = bwa_idx2img(argc - 1, argv + 1);
     } else if (strcmp(argv[1], "index") == 0) {
         ret = bwa_index(argc - 1, argv + 1);
     } else if (strcmp(argv[1], "aln") == 0) {
@@ -135,6 +146,10 @@ int main(int argc, char *argv[]) {
         ret = bwa_sai2sam_se(argc - 1, argv + 1);
     } else if (strcmp(argv[1], "sampe") == 0) {
         ret = bwa_sai2sam_pe(argc - 1, argv + 1);
+    } else if (strcmp(argv[1], "alnse") == 0) {
+        ret = bwa_alnse(argc - 1, argv + 1);
+    } else if (strcmp(argv[1], "alnpe") == 0) {
+        ret = bwa_alnpe(argc - 1, argv + 1);
     } else if (strcmp(argv[1], "bwtsw2") == 0) {
         ret = bwa_bwtsw2(argc - 1, argv + 1);
     } else if (strcmp(argv[1], "dbwtsw") == 0) {
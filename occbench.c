@@ -0,0 +1,150 @@
+/**
+ * occbench: check that every bwt_occ_simd() level gives the same Occ values,
+ * and time bwt_occ(), bwt_2occ(), bwt_occ4() and bwt_2occ4() at each level.
+ *
+ * Build with `make occbench'; run as `./occbench [-n INT] [-s INT] <idx.base>'.
+ * The exit status is non-zero if any level disagrees with BWT_OCC_TABLE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bwt.h"
+#include "utils.h"
+
+#define N_LEVELS 3
+
+static const char *level_name[N_LEVELS] = {"table", "popcnt", "vpopcnt"};
+
+typedef struct {
+    bwtint_t occ, ok, ol, cnt[4], cntk[4], cntl[4];
+} occ_res_t;
+
+static uint64_t splitmix64(uint64_t *x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Query positions: random k with l within a few blocks of k, as in a backward search,
+ * plus both ends of the BWT and every offset of the first two occurrence blocks
+ */
+static void gen_queries(const bwt_t *bwt, int n, uint64_t seed, bwtint_t *k, bwtint_t *l, ubyte_t *c) {
+    int i, m = 0;
+    for (i = 0; i < 2 * OCC_INTERVAL && i <= bwt->seq_len && m < n; ++i, ++m) {
+        k[m] = i, l[m] = i, c[m] = i & 3;
+    }
+    if (m < n) {
+        k[m] = (bwtint_t)-1, l[m] = bwt->seq_len, c[m] = 0, ++m;
+    }
+    if (m < n) {
+        k[m] = bwt->seq_len, l[m] = bwt->seq_len, c[m] = 3, ++m;
+    }
+    for (; m < n; ++m) {
+        uint64_t r = splitmix64(&seed);
+        k[m] = r % (bwt->seq_len + 1);
+        l[m] = k[m] + (r >> 40) % (4 * OCC_INTERVAL);
+        l[m] = l[m] > bwt->seq_len ? bwt->seq_len : l[m];
+        c[m] = r >> 62;
+    }
+}
+
+static void run_level(const bwt_t *bwt, int n, const bwtint_t *k, const bwtint_t *l, const ubyte_t *c, occ_res_t *res,
+                      double t[4]) {
+    int i;
+    double t0;
+    t0 = realtime();
+    for (i = 0; i < n; ++i) {
+        res[i].occ = bwt_occ(bwt, k[i], c[i]);
+    }
+    t[0] = realtime() - t0, t0 = realtime();
+    for (i = 0; i < n; ++i) {
+        bwt_2occ(bwt, k[i], l[i], c[i], &res[i].ok, &res[i].ol);
+    }
+    t[1] = realtime() - t0, t0 = realtime();
+    for (i = 0; i < n; ++i) {
+        bwt_occ4(bwt, k[i], res[i].cnt);
+    }
+    t[2] = realtime() - t0, t0 = realtime();
+    for (i = 0; i < n; ++i) {
+        bwt_2occ4(bwt, k[i], l[i], res[i].cntk, res[i].cntl);
+    }
+    t[3] = realtime() - t0;
+}
+
+int main(int argc, char *argv[]) {
+    int c, i, lv, n = 10000000, n_diff = 0;
+    uint64_t seed = 11;
+    char *fn;
+    bwt_t *bwt;
+    bwtint_t *k, *l;
+    ubyte_t *cc;
+    occ_res_t *ref, *res;
+    double t[4];
+
+    while ((c = getopt(argc, argv, "n:s:")) >= 0) {
+        if (c == 'n') {
+            n = atoi(optarg);
+        } else if (c == 's') {
+            seed = strtoull(optarg, 0, 10);
+        } else {
+            return 1;
+        }
+    }
+    if (optind + 1 > argc || n < 1) {
+        fprintf(stderr, "Usage: occbench [-n INT] [-s INT] <idx.base>\n");
+        fprintf(stderr, "Options: -n INT    number of queries [10000000]\n");
+        fprintf(stderr, "         -s INT    random seed [11]\n");
+        return 1;
+    }
+    fn = malloc(strlen(argv[optind]) + 5);
+    strcat(strcpy(fn, argv[optind]), ".bwt");
+    bwt = bwt_restore_bwt(fn);
+    free(fn);
+
+    k = malloc(n * sizeof(bwtint_t));
+    l = malloc(n * sizeof(bwtint_t));
+    cc = malloc(n);
+    ref = malloc(n * sizeof(occ_res_t));
+    res = malloc(n * sizeof(occ_res_t));
+    gen_queries(bwt, n, seed, k, l, cc);
+
+    run_level(bwt, n, k, l, cc, ref, t); // warm up the caches so that the first level timed is not penalised
+    printf("level\tbwt_occ\tbwt_2occ\tbwt_occ4\tbwt_2occ4\t(ns per query)\n");
+    for (lv = 0; lv < N_LEVELS; ++lv) {
+        if (bwt_occ_simd(lv) != lv) {
+            printf("%s\tnot supported by this CPU\n", level_name[lv]);
+            continue;
+        }
+        run_level(bwt, n, k, l, cc, lv == 0 ? ref : res, t);
+        printf("%s\t%.2f\t%.2f\t%.2f\t%.2f\n", level_name[lv], t[0] * 1e9 / n, t[1] * 1e9 / n, t[2] * 1e9 / n,
+               t[3] * 1e9 / n);
+        if (lv == 0) {
+            continue;
+        }
+        for (i = 0; i < n; ++i) {
+            if (memcmp(&ref[i], &res[i], sizeof(occ_res_t)) != 0) {
+                if (n_diff++ < 10) {
+                    fprintf(stderr, "[E::%s] %s differs from table at k=%lld l=%lld c=%d\n", __func__, level_name[lv],
+                            (long long)k[i], (long long)l[i], cc[i]);
+                }
+            }
+        }
+    }
+    bwt_occ_simd(-1);
+    if (n_diff) {
+        fprintf(stderr, "[E::%s] %d queries differ\n", __func__, n_diff);
+    } else {
+        fprintf(stderr, "[M::%s] all supported levels agree on %d queries\n", __func__, n);
+    }
+
+    free(res);
+    free(ref);
+    free(cc);
+    free(l);
+    free(k);
+    bwt_destroy(bwt);
+    return n_diff ? 1 : 0;
+}